@@ -0,0 +1,274 @@
+/*
+http_conn内存布局基准测试：原布局 对比 冷热分离布局
+    在大量连接对象上模拟epoll按随机顺序交付的keep-alive请求 每个请求:
+        读入请求(写读缓冲区 更新m_read_idx) -> 逐行解析(m_checked_idx/m_start_line/m_check_state)
+        -> 生成响应头(写写缓冲区) -> 更新发送进度 -> init()为下一个请求复位
+    原布局:     热字段与2KB读缓冲区、1KB写缓冲区、200字节路径和struct stat交错 init()清零约3.2KB
+    冷热分离:   热字段集中在对象开头的两个缓存行 缓冲区在对象外 init()只复位字段
+    用perf_event_open统计用户态的LLC未命中数(内核不允许时只输出耗时)
+用法: ./layout_bench [connections requests]
+*/
+#include<linux/perf_event.h>
+#include<sys/syscall.h>
+#include<sys/ioctl.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
+#include<netinet/in.h>
+#include<unistd.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+
+static const int READ_BUFFER_SIZE = 2048;
+static const int WRITE_BUFFER_SIZE = 1024;
+static const int FILENAME_LEN = 200;
+
+static const char request[] =
+    "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: keep-alive\r\nAccept-Encoding: gzip\r\n\r\n";
+static const char header[] =
+    "HTTP/1.1 200 OK\r\nETag: \"6ad6427b-ed9\"\r\nContent-Length: 3801\r\n"
+    "Date: Mon, 19 Oct 2026 16:26:55 GMT\r\nConnection: keep-alive\r\n\r\n";
+
+/*原来的http_conn成员顺序*/
+struct old_conn{
+    int m_sockfd;
+    struct sockaddr_in m_address;
+    char m_read_buf[READ_BUFFER_SIZE];
+    int m_read_idx;
+    int m_checked_idx;
+    int m_start_line;
+    char m_write_buf[WRITE_BUFFER_SIZE];
+    int m_write_idx;
+    int m_check_state;
+    int m_method;
+    char m_real_file[FILENAME_LEN];
+    char* m_url;
+    char* m_version;
+    char* m_host;
+    int m_content_length;
+    bool m_linger;
+    char* m_file_address;
+    struct stat m_file_stat;
+    struct iovec m_iv[2];
+    int m_iv_count;
+    off_t m_bytes_to_send;
+    off_t m_bytes_have_send;
+
+    void init()
+    {
+        m_check_state = 0;
+        m_linger = false;
+        m_method = 0;
+        m_url = m_version = m_host = 0;
+        m_content_length = 0;
+        m_start_line = m_checked_idx = m_read_idx = m_write_idx = 0;
+        m_file_address = 0;
+        m_iv_count = 0;
+        m_bytes_to_send = m_bytes_have_send = 0;
+        memset(m_read_buf, '\0', READ_BUFFER_SIZE);
+        memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
+        memset(m_real_file, '\0', FILENAME_LEN);
+    }
+};
+
+/*冷热分离后的http_conn成员顺序(省略了与本测试无关的缓存项指针等)*/
+struct new_conn{
+    alignas(64) int m_sockfd;
+    int m_check_state;
+    int m_read_idx;
+    int m_checked_idx;
+    int m_start_line;
+    int m_write_idx;
+    int m_method;
+    bool m_linger;
+    bool m_use_sendfile;
+    bool m_waiting;
+    bool m_vary;
+    char* m_read_buf;
+    char* m_write_buf;
+    char* m_real_file;
+    int m_iv_idx;
+    int m_iv_count;
+
+    off_t m_bytes_to_send;
+    off_t m_bytes_have_send;
+    off_t m_file_offset;
+    int m_file_fd;
+    time_t m_last_progress;
+    new_conn* m_wait_prev;
+    new_conn* m_wait_next;
+    struct iovec m_iv[3];
+
+    size_t m_real_len;
+    char* m_url;
+    char* m_version;
+    char* m_host;
+    int m_content_length;
+    char* m_file_address;
+    struct sockaddr_in m_address;
+
+    void init()
+    {
+        m_check_state = 0;
+        m_linger = false;
+        m_method = 0;
+        m_url = m_version = m_host = 0;
+        m_content_length = 0;
+        m_start_line = m_checked_idx = m_read_idx = m_write_idx = 0;
+        m_file_address = 0;
+        m_iv_count = m_iv_idx = 0;
+        m_bytes_to_send = m_bytes_have_send = 0;
+        m_real_len = 0;
+    }
+};
+
+/*两种布局共用的请求处理过程*/
+template<typename C>
+static uint64_t serve(C* c)
+{
+    /*read_once*/
+    memcpy(c->m_read_buf + c->m_read_idx, request, sizeof(request) - 1);
+    c->m_read_idx += sizeof(request) - 1;
+    /*parse_line 逐行解析*/
+    uint64_t sum = 0;
+    for(; c->m_checked_idx < c->m_read_idx; ++c->m_checked_idx)
+    {
+        if(c->m_read_buf[c->m_checked_idx] == '\n')
+        {
+            sum += c->m_checked_idx - c->m_start_line;
+            c->m_start_line = c->m_checked_idx + 1;
+            c->m_check_state++;
+        }
+    }
+    c->m_url = c->m_read_buf + 4;
+    c->m_linger = true;
+    /*process_write*/
+    memcpy(c->m_write_buf, header, sizeof(header) - 1);
+    c->m_write_idx = sizeof(header) - 1;
+    c->m_iv[0].iov_base = c->m_write_buf;
+    c->m_iv[0].iov_len = c->m_write_idx;
+    c->m_iv_count = 1;
+    c->m_bytes_to_send = c->m_write_idx;
+    /*write*/
+    c->m_bytes_have_send = c->m_bytes_to_send;
+    sum += c->m_sockfd + c->m_bytes_have_send;
+    c->init();
+    return sum;
+}
+
+static int perf_open()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template<typename C>
+static void run(const char* name, C* conns, int n, const uint32_t* order, long requests, int perf_fd)
+{
+    uint64_t sum = 0;
+    /*预热一轮 使每个连接对象都被访问过*/
+    for(int i = 0; i < n; ++i)
+    {
+        sum += serve(&conns[i]);
+    }
+    long long misses = -1;
+    if(perf_fd >= 0)
+    {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = now();
+    for(long i = 0; i < requests; ++i)
+    {
+        sum += serve(&conns[order[i % n]]);
+    }
+    double elapsed = now() - start;
+    if(perf_fd >= 0)
+    {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perf_fd, &misses, sizeof(misses)) != sizeof(misses))
+        {
+            misses = -1;
+        }
+    }
+    if(misses >= 0)
+    {
+        printf("%-10s %8zu %12.1f %14.3f   (%lu)\n", name, sizeof(C), elapsed * 1e9 / requests,
+                (double)misses / requests, (unsigned long)(sum & 1));
+    }
+    else
+    {
+        printf("%-10s %8zu %12.1f %14s   (%lu)\n", name, sizeof(C), elapsed * 1e9 / requests, "n/a",
+                (unsigned long)(sum & 1));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 20000;
+    long requests = argc > 2 ? atol(argv[2]) : 2000000;
+
+    /*epoll交付就绪连接的顺序与内存位置无关 用随机排列模拟*/
+    uint32_t* order = new uint32_t[n];
+    for(int i = 0; i < n; ++i)
+    {
+        order[i] = i;
+    }
+    srand(1);
+    for(int i = n - 1; i > 0; --i)
+    {
+        int j = rand() % (i + 1);
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    old_conn* olds = new old_conn[n];
+    new_conn* news = new new_conn[n];
+    char* buffers = new char[(size_t)n * (READ_BUFFER_SIZE + WRITE_BUFFER_SIZE + FILENAME_LEN)];
+    for(int i = 0; i < n; ++i)
+    {
+        memset(&olds[i], 0, sizeof(old_conn));
+        memset(&news[i], 0, sizeof(new_conn));
+        olds[i].m_sockfd = news[i].m_sockfd = i;
+        news[i].m_read_buf = buffers + (size_t)i * (READ_BUFFER_SIZE + WRITE_BUFFER_SIZE + FILENAME_LEN);
+        news[i].m_write_buf = news[i].m_read_buf + READ_BUFFER_SIZE;
+        news[i].m_real_file = news[i].m_write_buf + WRITE_BUFFER_SIZE;
+    }
+
+    int perf_fd = perf_open();
+    if(perf_fd < 0)
+    {
+        printf("perf_event_open failed, LLC misses not available\n");
+    }
+    printf("%d connections, %ld requests\n", n, requests);
+    printf("%-10s %8s %12s %14s\n", "layout", "sizeof", "ns/req", "LLC-miss/req");
+    run("old", olds, n, order, requests, perf_fd);
+    run("hot/cold", news, n, order, requests, perf_fd);
+
+    if(perf_fd >= 0)
+    {
+        close(perf_fd);
+    }
+    delete [] buffers;
+    delete [] news;
+    delete [] olds;
+    delete [] order;
+    return 0;
+}
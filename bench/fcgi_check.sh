@@ -0,0 +1,197 @@
+#!/bin/bash
+#
+# FastCGI检查：server把/fcgi/交给测试应用fcgi_responder 比较取回的内容
+#     顺序取回多MB的响应 以及0字节到3MB的请求体经STDIN原样返回(带与不带Content-Length两种转发)
+#     多个并发请求: 应用声明支持多路复用时应在同一连接上交错进行(应用统计的max_inflight大于1)
+#         之后以single模式重启应用 同样的并发请求每条连接只进行一个
+#     应用在响应中途关闭连接: 客户收到部分响应后连接被关闭 同一连接上的其他请求不挂起 之后的请求重新连接后正常
+#     每次请求限时FCGI_TIMEOUT秒
+# 用法: bench/fcgi_check.sh
+#
+# 环境变量: FCGI_PORT(默认9395) FCGI_APP_PORT(默认9396) FCGI_FETCHES(默认20) FCGI_TIMEOUT(默认10)
+
+set -u
+
+cd "$(dirname "$0")/.."
+
+port=${FCGI_PORT:-9395}
+app_port=${FCGI_APP_PORT:-9396}
+fetches=${FCGI_FETCHES:-20}
+timeout=${FCGI_TIMEOUT:-10}
+
+if [ ! -x ./server ] || [ ! -x ./fcgi_responder ]; then
+    echo "fcgi-check: build server and fcgi_responder first (make && make fcgi_responder)" >&2
+    exit 2
+fi
+
+fixture=$(mktemp -d)
+server_pid=
+app_pid=
+cleanup()
+{
+    for pid in $server_pid $app_pid; do
+        kill "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+    done
+    rm -rf "$fixture"
+}
+trap cleanup EXIT
+
+wait_port()
+{
+    for i in $(seq 50); do
+        if (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+start_app()
+{
+    if [ -n "$app_pid" ]; then
+        kill "$app_pid" 2>/dev/null
+        wait "$app_pid" 2>/dev/null
+    fi
+    ./fcgi_responder "$app_port" "$1" >> "$fixture/app.log" 2>&1 &
+    app_pid=$!
+    wait_port "$app_port"
+}
+
+# 第i个字节为'a' + i % 26的n字节
+pattern()
+{
+    yes abcdefghijklmnopqrstuvwxyz | tr -d '\n' | head -c "$1"
+}
+
+failed=0
+fail()
+{
+    echo "fcgi-check: $*" >&2
+    failed=$((failed + 1))
+}
+
+# fetch 名字 路径 [请求体文件]: 取回到$fixture/名字.out 输出"状态码 curl退出码"
+fetch()
+{
+    local data=()
+    if [ -n "${3:-}" ]; then
+        data=(--data-binary @"$3")
+    fi
+    local code
+    code=$(curl -s -o "$fixture/$1.out" -w '%{http_code}' --max-time "$timeout" "${data[@]}" "http://127.0.0.1:$port$2")
+    echo "$code $?"
+}
+
+expect()
+{
+    local result
+    result=$(fetch "$1" "$2" "${4:-}")
+    if [ "$result" != "200 0" ] || ! cmp -s "$fixture/$1.out" "$3"; then
+        fail "$2: got '$result' or different content"
+    fi
+}
+
+if ! start_app mpx; then
+    echo "fcgi-check: fcgi_responder failed to start" >&2
+    exit 2
+fi
+./server --doc_root="$fixture" --fastcgi_routes=/fcgi/=127.0.0.1:"$app_port" 127.0.0.1 "$port" > "$fixture/server.log" 2>&1 &
+server_pid=$!
+if ! wait_port "$port"; then
+    echo "fcgi-check: server failed to start" >&2
+    cat "$fixture/server.log" >&2
+    exit 2
+fi
+
+pattern 3145728 > "$fixture/3m"
+for i in $(seq "$fetches"); do
+    expect seq /fcgi/bytes/3145728 "$fixture/3m"
+done
+echo "sequential: $fetches x 3MB done"
+
+for n in 0 1 8191 8192 100000 3145728; do
+    pattern "$n" > "$fixture/body$n"
+    expect echo$n /fcgi/echo "$fixture/body$n" "$fixture/body$n"
+    expect length$n /fcgi/echo-length "$fixture/body$n" "$fixture/body$n"
+done
+echo "request bodies: 0B to 3MB echoed"
+
+# expect在子shell中运行 失败信息写到stderr 计数由退出码带回
+expect_sub()
+{
+    local before=$failed
+    expect "$@"
+    [ "$failed" -eq "$before" ]
+}
+
+# 并发请求: 一半取回1MB 一半回显200KB的请求体
+concurrent()
+{
+    local pids=()
+    pattern 1048576 > "$fixture/1m"
+    pattern 204800 > "$fixture/200k"
+    for i in $(seq 8); do
+        expect_sub par$i /fcgi/bytes/1048576 "$fixture/1m" &
+        pids+=($!)
+        expect_sub parecho$i /fcgi/echo "$fixture/200k" "$fixture/200k" &
+        pids+=($!)
+    done
+    for pid in "${pids[@]}"; do
+        wait "$pid" || failed=$((failed + 1))
+    done
+}
+
+max_inflight()
+{
+    fetch stats /fcgi/stats > /dev/null
+    awk '{ print $2 }' "$fixture/stats.out"
+}
+
+concurrent
+inflight=$(max_inflight)
+if [ "${inflight:-0}" -le 1 ]; then
+    fail "multiplexing: at most ${inflight:-0} request in flight on one connection"
+fi
+echo "multiplexed: 16 concurrent requests, up to $inflight on one connection"
+
+start_app single
+concurrent
+inflight=$(max_inflight)
+if [ "${inflight:-0}" -ne 1 ]; then
+    fail "single: ${inflight:-0} requests in flight on one connection"
+fi
+echo "single: 16 concurrent requests, one per connection"
+
+# 应用在响应中途关闭连接 客户收到部分响应(curl退出码18)
+start_app mpx
+result=$(fetch die /fcgi/die/2097152)
+size=$(stat -c %s "$fixture/die.out")
+if [ "${result#* }" != 18 ] || [ "$size" -ge 2097152 ]; then
+    fail "die: got '$result' with $size bytes, expected a truncated response"
+fi
+# 与其他进行中的请求同在一条连接上时 它们各自以502或关闭结束 不等到超时
+pids=()
+for i in $(seq 4); do
+    fetch dieside$i /fcgi/bytes/1048576 > "$fixture/dieside$i.result" &
+    pids+=($!)
+done
+fetch diemid /fcgi/die/2097152 > "$fixture/diemid.result" &
+pids+=($!)
+for pid in "${pids[@]}"; do
+    wait "$pid"
+done
+for f in "$fixture"/dieside*.result "$fixture/diemid.result"; do
+    if [ "$(cut -d' ' -f2 "$f")" = 28 ]; then
+        fail "die: a request on the same connection timed out"
+    fi
+done
+expect after /fcgi/bytes/3145728 "$fixture/3m"
+echo "app dying mid-response: client closed, next request reconnects"
+
+if [ "$failed" -gt 0 ]; then
+    echo "fcgi-check: $failed checks failed" >&2
+    exit 1
+fi
+echo "fcgi-check: passed"
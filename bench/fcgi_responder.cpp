@@ -0,0 +1,364 @@
+/*
+FastCGI检查用的测试应用 只依赖POSIX 每个连接一个线程:
+    回答FCGI_GET_VALUES 默认声明支持多路复用(FCGI_MPXS_CONNS=1) 第二个参数为single时声明不支持
+    同一连接上的多个请求交错处理: 每读完一批记录 就给每个已收齐请求体的请求各发一段(8KB)STDOUT 轮流直到发完
+    请求路径(REQUEST_URI)的最后几段决定响应:
+        .../bytes/N         N字节 带Content-Length
+        .../echo            原样返回请求体 不带Content-Length(服务器按chunked转发)
+        .../echo-length     原样返回请求体 带Content-Length
+        .../die/N           声明N字节 发出一半后直接关闭连接 模拟应用在响应中途崩溃
+        .../stats           各连接上同时进行的请求数的最大值 "max_inflight N"
+    消息体的第i个字节为'a' + i % 26
+用法: ./fcgi_responder port [mpx|single]
+*/
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<pthread.h>
+#include<signal.h>
+#include<poll.h>
+#include<unistd.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<atomic>
+#include<string>
+#include<map>
+
+enum{
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_GET_VALUES = 9,
+    FCGI_GET_VALUES_RESULT = 10
+};
+
+static const int CHUNK = 8192;
+
+static bool multiplex = true;
+static std::atomic<int> max_inflight(0);
+
+struct request{
+    bool keep_conn;
+    std::string params;
+    std::string uri;
+    std::string body;
+    bool ready;             /*请求体已收齐 正在发送响应*/
+    std::string out;        /*CGI响应头 + 消息体*/
+    size_t out_off;
+    size_t die_at;          /*发到这里时关闭连接 0表示不关闭*/
+};
+
+static bool send_all(int fd, const char* p, size_t n)
+{
+    while(n > 0)
+    {
+        ssize_t ret = send(fd, p, n, MSG_NOSIGNAL);
+        if(ret <= 0)
+        {
+            return false;
+        }
+        p += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+static bool send_record(int fd, int type, int id, const char* data, int len)
+{
+    unsigned char head[8] = {1, (unsigned char)type, (unsigned char)(id >> 8), (unsigned char)id,
+            (unsigned char)(len >> 8), (unsigned char)len, 0, 0};
+    return send_all(fd, (const char*)head, 8) && send_all(fd, data, len);
+}
+
+/*名值对的长度: 小于128时1字节 否则4字节且最高位为1*/
+static bool read_length(const std::string& s, size_t& pos, size_t& len)
+{
+    if(pos >= s.size())
+    {
+        return false;
+    }
+    unsigned char c = s[pos];
+    if(c < 128)
+    {
+        len = c;
+        pos += 1;
+        return true;
+    }
+    if(pos + 4 > s.size())
+    {
+        return false;
+    }
+    len = ((c & 0x7f) << 24) | ((unsigned char)s[pos + 1] << 16) | ((unsigned char)s[pos + 2] << 8) | (unsigned char)s[pos + 3];
+    pos += 4;
+    return true;
+}
+
+static std::map<std::string, std::string> parse_pairs(const std::string& s)
+{
+    std::map<std::string, std::string> pairs;
+    size_t pos = 0, name_len, value_len;
+    while(read_length(s, pos, name_len) && read_length(s, pos, value_len) && pos + name_len + value_len <= s.size())
+    {
+        pairs[s.substr(pos, name_len)] = s.substr(pos + name_len, value_len);
+        pos += name_len + value_len;
+    }
+    return pairs;
+}
+
+static void append_pair(std::string& out, const char* name, const char* value)
+{
+    out += (char)strlen(name);
+    out += (char)strlen(value);
+    out += name;
+    out += value;
+}
+
+static void pattern(std::string& out, long n)
+{
+    for(long i = 0; i < n; ++i)
+    {
+        out += (char)('a' + i % 26);
+    }
+}
+
+/*请求体收齐后按路径生成响应*/
+static void build_response(request& r)
+{
+    std::string path = r.uri.substr(0, r.uri.find('?'));
+    size_t slash = path.rfind('/');
+    std::string last = path.substr(slash + 1);
+    std::string dir = path.substr(0, slash);
+    std::string kind = dir.substr(dir.rfind('/') + 1);
+    char head[256];
+    if(last == "echo" || last == "echo-length")
+    {
+        if(last == "echo")
+        {
+            snprintf(head, sizeof(head), "Content-Type: application/octet-stream\r\n\r\n");
+        }
+        else
+        {
+            snprintf(head, sizeof(head), "Content-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n", r.body.size());
+        }
+        r.out = head + r.body;
+    }
+    else if(last == "stats")
+    {
+        snprintf(head, sizeof(head), "Content-Type: text/plain\r\n\r\nmax_inflight %d\n", max_inflight.load());
+        r.out = head;
+    }
+    else if(kind == "bytes" || kind == "die")
+    {
+        long n = atol(last.c_str());
+        snprintf(head, sizeof(head), "Content-Type: application/octet-stream\r\nContent-Length: %ld\r\n\r\n", n);
+        r.out = head;
+        pattern(r.out, n);
+        if(kind == "die")
+        {
+            r.die_at = strlen(head) + n / 2;
+        }
+    }
+    else
+    {
+        r.out = "Status: 404 Not Found\r\nContent-Type: text/plain\r\n\r\nnot found\n";
+    }
+    r.ready = true;
+}
+
+/*处理一条完整的记录 返回false时关闭连接*/
+static bool on_record(int fd, std::map<int, request>& reqs, int type, int id, const std::string& data)
+{
+    switch(type)
+    {
+        case FCGI_GET_VALUES:
+        {
+            std::string out;
+            append_pair(out, "FCGI_MPXS_CONNS", multiplex ? "1" : "0");
+            append_pair(out, "FCGI_MAX_REQS", "32");
+            return send_record(fd, FCGI_GET_VALUES_RESULT, 0, out.data(), out.size());
+        }
+        case FCGI_BEGIN_REQUEST:
+        {
+            request& r = reqs[id];
+            r.keep_conn = data.size() >= 3 && (data[2] & 1);
+            r.ready = false;
+            r.out_off = 0;
+            r.die_at = 0;
+            int n = reqs.size();
+            int seen = max_inflight.load();
+            while(n > seen && !max_inflight.compare_exchange_weak(seen, n))
+            {}
+            return true;
+        }
+        case FCGI_ABORT_REQUEST:
+        {
+            bool keep = reqs[id].keep_conn;
+            reqs.erase(id);
+            char end[8] = {0};
+            return send_record(fd, FCGI_END_REQUEST, id, end, 8) && keep;
+        }
+        case FCGI_PARAMS:
+        {
+            request& r = reqs[id];
+            if(!data.empty())
+            {
+                r.params += data;
+                return true;
+            }
+            std::map<std::string, std::string> params = parse_pairs(r.params);
+            r.uri = params["REQUEST_URI"];
+            return true;
+        }
+        case FCGI_STDIN:
+        {
+            request& r = reqs[id];
+            if(!data.empty())
+            {
+                r.body += data;
+            }
+            else
+            {
+                build_response(r);
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+/*给每个已收齐请求体的请求各发一段 返回false时关闭连接*/
+static bool respond_round(int fd, std::map<int, request>& reqs)
+{
+    for(std::map<int, request>::iterator it = reqs.begin(); it != reqs.end(); )
+    {
+        request& r = it->second;
+        if(!r.ready)
+        {
+            ++it;
+            continue;
+        }
+        size_t n = r.out.size() - r.out_off < (size_t)CHUNK ? r.out.size() - r.out_off : CHUNK;
+        if(r.die_at && r.out_off + n >= r.die_at)
+        {
+            send_record(fd, FCGI_STDOUT, it->first, r.out.data() + r.out_off, r.die_at - r.out_off);
+            return false;
+        }
+        if(n > 0 && !send_record(fd, FCGI_STDOUT, it->first, r.out.data() + r.out_off, n))
+        {
+            return false;
+        }
+        r.out_off += n;
+        if(r.out_off < r.out.size())
+        {
+            ++it;
+            continue;
+        }
+        char end[8] = {0};
+        if(!send_record(fd, FCGI_STDOUT, it->first, NULL, 0) || !send_record(fd, FCGI_END_REQUEST, it->first, end, 8))
+        {
+            return false;
+        }
+        bool keep = r.keep_conn;
+        reqs.erase(it++);
+        if(!keep)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void* serve(void* arg)
+{
+    int fd = (int)(long)arg;
+    std::map<int, request> reqs;
+    std::string in;
+    char buf[65536];
+    while(true)
+    {
+        bool pending = false;
+        for(std::map<int, request>::iterator it = reqs.begin(); it != reqs.end(); ++it)
+        {
+            pending = pending || it->second.ready;
+        }
+        struct pollfd p = {fd, POLLIN, 0};
+        if(poll(&p, 1, pending ? 0 : -1) > 0)
+        {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if(n <= 0)
+            {
+                break;
+            }
+            in.append(buf, n);
+            size_t pos = 0;
+            bool ok = true;
+            while(ok && in.size() - pos >= 8)
+            {
+                const unsigned char* h = (const unsigned char*)in.data() + pos;
+                size_t len = (h[4] << 8) | h[5];
+                size_t total = 8 + len + h[6];
+                if(in.size() - pos < total)
+                {
+                    break;
+                }
+                ok = on_record(fd, reqs, h[1], (h[2] << 8) | h[3], in.substr(pos + 8, len));
+                pos += total;
+            }
+            in.erase(0, pos);
+            if(!ok)
+            {
+                break;
+            }
+        }
+        if(!respond_round(fd, reqs))
+        {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s port [mpx|single]\n", argv[0]);
+        return 1;
+    }
+    multiplex = argc < 3 || strcmp(argv[2], "single") != 0;
+    signal(SIGPIPE, SIG_IGN);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(argv[1]));
+    if(bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenfd, 128) < 0)
+    {
+        perror("fcgi_responder");
+        return 1;
+    }
+    while(true)
+    {
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd < 0)
+        {
+            continue;
+        }
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, serve, (void*)(long)fd) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
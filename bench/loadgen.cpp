@@ -0,0 +1,778 @@
+/*
+HTTP负载生成器：多线程 每个线程一个epoll 管理自己的一组连接
+    闭环模式(默认):   每个连接保持pipeline个请求在途 收到一个响应立即发送下一个请求
+    开环模式(-r):     按固定总速率为每个连接排定请求的计划发送时间 与响应何时返回无关
+                      延迟从计划发送时间开始计算 连接上在途请求已满时 请求推迟发送但计划时间不变
+                      避免协调遗漏(coordinated omission)掩盖服务器的停顿
+    -k 0 关闭keep-alive 每个请求使用新连接(延迟包含建立连接) 此时pipeline固定为1
+    URL按权重随机选择
+结果(吞吐量 HDR延迟分位 错误计数)以JSON写到标准输出 可读的摘要写到标准错误
+    公平性: 各连接的平均延迟的最小值、最大值和变异系数 以及各连接完成请求数的Jain公平指数(1为完全均等)
+    服务器让某些连接长时间独占事件循环时 其他连接的平均延迟明显偏高 变异系数变大
+用法: ./loadgen -p port [-h host] [-c connections] [-t threads] [-d seconds] [-r rate]
+                [-k 0|1] [-P pipeline] [-u [weight:]url]...
+     host的写法与server的监听地址相同 可以是IPv6地址[::1]或Unix域socket(unix:/path、unix:@name 此时不需要-p)
+*/
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<sys/timerfd.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<arpa/inet.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdint.h>
+#include<time.h>
+#include<math.h>
+#include<string>
+#include<vector>
+
+#include"../metrics/hdr_histogram.h"
+#include"../net/listener.h"
+
+static const int MAX_PIPELINE = 64;
+static const int HEADER_MAX = 8192;
+static const int READ_CHUNK = 64 * 1024;
+/*keep-alive模式下开始计时前等待连接建立的最长时间(秒)*/
+static const int CONNECT_TIMEOUT = 5;
+
+struct options{
+    const char* host;
+    int port;
+    int connections;
+    int threads;
+    double duration;
+    double rate;        /*总请求速率 0为闭环模式*/
+    bool keepalive;
+    int pipeline;
+};
+
+struct url_choice{
+    std::string request;    /*预先生成的完整请求*/
+    std::string url;
+    int weight;
+};
+
+static options opt = {"127.0.0.1", 0, 16, 2, 10.0, 0.0, true, 1};
+static std::vector<url_choice> urls;
+static int total_weight = 0;
+static listen_addr server_addr;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*线程内的统计 结束后由主线程合并*/
+struct thread_stats{
+    hdr_histogram latency;
+    uint64_t completed;
+    uint64_t bytes;
+    uint64_t connect_errors;
+    uint64_t io_errors;
+    uint64_t parse_errors;
+    uint64_t non_2xx;
+    uint64_t unfinished;
+    thread_stats() : completed(0), bytes(0), connect_errors(0), io_errors(0), parse_errors(0), non_2xx(0), unfinished(0) {}
+};
+
+struct worker;
+
+struct connection{
+    int fd;
+    bool connected;
+    /*在途请求的开始时间(开环模式下为计划发送时间) 环形数组*/
+    uint64_t starts[MAX_PIPELINE];
+    int head;
+    int count;
+    /*待发送的数据*/
+    std::string out;
+    size_t out_off;
+    /*响应解析状态*/
+    char header[HEADER_MAX];
+    int header_len;
+    bool in_body;
+    long body_left;
+    int status;
+    bool server_close;
+    /*开环模式下一个请求的计划发送时间*/
+    uint64_t next_due;
+    uint32_t rng;
+    /*该连接(-k 0时为同一位置上依次建立的连接)完成的请求数和延迟之和 用于公平性统计*/
+    uint64_t done;
+    uint64_t latency_sum;
+};
+
+struct worker{
+    pthread_t tid;
+    int id;
+    int epollfd;
+    int timerfd;            /*开环模式下在最早的计划时间唤醒 事件的data.ptr为空*/
+    std::vector<connection*> conns;
+    thread_stats* stats;
+    uint64_t interval;      /*开环模式下每个连接两个请求之间的计划间隔*/
+    uint64_t end_time;
+    uint64_t elapsed;       /*实际计时的时长 不含建立连接*/
+};
+
+static uint32_t next_rand(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static const url_choice& pick_url(connection* c)
+{
+    if(urls.size() == 1)
+    {
+        return urls[0];
+    }
+    int r = next_rand(&c->rng) % total_weight;
+    for(size_t i = 0; i < urls.size(); ++i)
+    {
+        r -= urls[i].weight;
+        if(r < 0)
+        {
+            return urls[i];
+        }
+    }
+    return urls.back();
+}
+
+static void reset_parser(connection* c)
+{
+    c->header_len = 0;
+    c->in_body = false;
+    c->body_left = 0;
+    c->status = 0;
+    c->server_close = false;
+}
+
+static bool open_connection(worker* w, connection* c)
+{
+    c->fd = socket(server_addr.family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c->fd < 0)
+    {
+        return false;
+    }
+    if(server_addr.is_inet())
+    {
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    c->connected = false;
+    c->head = 0;
+    c->count = 0;
+    c->out.clear();
+    c->out_off = 0;
+    reset_parser(c);
+    /*Unix域socket的监听队列满时connect返回EAGAIN 按连接错误处理*/
+    if(connect(c->fd, (struct sockaddr*)&server_addr.addr, server_addr.len) < 0 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return true;
+}
+
+static void close_connection(worker* w, connection* c)
+{
+    if(c->fd >= 0)
+    {
+        epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/*尽量发送缓冲的请求 返回false表示连接出错*/
+static bool flush(connection* c)
+{
+    while(c->connected && c->out_off < c->out.size())
+    {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            return errno == EAGAIN;
+        }
+        c->out_off += n;
+    }
+    if(c->out_off == c->out.size())
+    {
+        c->out.clear();
+        c->out_off = 0;
+    }
+    return true;
+}
+
+/*排入一个开始时间为start的请求*/
+static void queue_request(connection* c, uint64_t start)
+{
+    c->starts[(c->head + c->count) % MAX_PIPELINE] = start;
+    c->count++;
+    c->out += pick_url(c).request;
+}
+
+/*补足在途请求 闭环模式下开始时间为当前时间 开环模式下为计划时间*/
+static void fill(worker* w, connection* c, uint64_t now)
+{
+    if(!opt.keepalive && c->fd < 0)
+    {
+        if(now >= w->end_time || (opt.rate > 0 && c->next_due > now))
+        {
+            return;
+        }
+        if(!open_connection(w, c))
+        {
+            w->stats->connect_errors++;
+            return;
+        }
+    }
+    while(c->count < opt.pipeline && now < w->end_time)
+    {
+        if(opt.rate > 0)
+        {
+            if(c->next_due > now)
+            {
+                break;
+            }
+            queue_request(c, c->next_due);
+            c->next_due += w->interval;
+        }
+        else
+        {
+            queue_request(c, now);
+        }
+    }
+}
+
+/*一个响应接收完毕*/
+static void complete(worker* w, connection* c, uint64_t now)
+{
+    uint64_t start = c->starts[c->head];
+    c->head = (c->head + 1) % MAX_PIPELINE;
+    c->count--;
+    w->stats->latency.record(now - start);
+    w->stats->completed++;
+    c->done++;
+    c->latency_sum += now - start;
+    if(c->status < 200 || c->status >= 300)
+    {
+        w->stats->non_2xx++;
+    }
+}
+
+/*
+解析收到的数据 可能包含多个流水线响应
+响应一定带Content-Length 头部超过HEADER_MAX视为解析错误 返回false表示需要关闭连接
+*/
+static bool consume(worker* w, connection* c, const char* data, size_t len, uint64_t now)
+{
+    while(len > 0)
+    {
+        if(c->in_body)
+        {
+            size_t n = (size_t)c->body_left < len ? c->body_left : len;
+            c->body_left -= n;
+            data += n;
+            len -= n;
+        }
+        else
+        {
+            size_t n = len;
+            if(c->header_len + n > (size_t)HEADER_MAX - 1)
+            {
+                n = HEADER_MAX - 1 - c->header_len;
+            }
+            int old_len = c->header_len;
+            memcpy(c->header + c->header_len, data, n);
+            c->header_len += n;
+            c->header[c->header_len] = '\0';
+            /*从上次的末尾向前回退3字节 以找到跨越两次读取的空行*/
+            char* end = strstr(c->header + (old_len > 3 ? old_len - 3 : 0), "\r\n\r\n");
+            if(!end)
+            {
+                if(c->header_len >= HEADER_MAX - 1)
+                {
+                    w->stats->parse_errors++;
+                    return false;
+                }
+                return true;
+            }
+            size_t used = end + 4 - c->header - old_len;
+            data += used;
+            len -= used;
+            *end = '\0';
+            if(sscanf(c->header, "HTTP/1.%*d %d", &c->status) != 1)
+            {
+                w->stats->parse_errors++;
+                return false;
+            }
+            const char* cl = strcasestr(c->header, "\r\nContent-Length:");
+            if(!cl)
+            {
+                w->stats->parse_errors++;
+                return false;
+            }
+            c->body_left = atol(cl + 17);
+            c->server_close = strcasestr(c->header, "\r\nConnection: close") != NULL;
+            c->in_body = true;
+            c->header_len = 0;
+        }
+        if(c->in_body && c->body_left == 0)
+        {
+            bool server_close = c->server_close;
+            complete(w, c, now);
+            reset_parser(c);
+            if(server_close || !opt.keepalive)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void handle_event(worker* w, connection* c, uint32_t events)
+{
+    uint64_t now = now_ns();
+    if(!c->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0)
+        {
+            w->stats->connect_errors++;
+            /*连接失败的请求不计入延迟*/
+            c->count = 0;
+            close_connection(w, c);
+            return;
+        }
+        c->connected = true;
+    }
+    if(events & EPOLLIN)
+    {
+        static __thread char buf[READ_CHUNK];
+        while(true)
+        {
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if(n > 0)
+            {
+                w->stats->bytes += n;
+                if(!consume(w, c, buf, n, now))
+                {
+                    /*服务器关闭连接时仍在途的请求记为未完成*/
+                    w->stats->unfinished += c->count;
+                    c->count = 0;
+                    close_connection(w, c);
+                    break;
+                }
+                continue;
+            }
+            if(n == 0 || errno != EAGAIN)
+            {
+                if(c->count > 0)
+                {
+                    w->stats->io_errors++;
+                }
+                c->count = 0;
+                close_connection(w, c);
+            }
+            break;
+        }
+    }
+    if(c->fd < 0)
+    {
+        /*keep-alive下被关闭的连接重新建立*/
+        if(opt.keepalive)
+        {
+            if(now < w->end_time && !open_connection(w, c))
+            {
+                w->stats->connect_errors++;
+            }
+        }
+    }
+    if(c->fd >= 0 || !opt.keepalive)
+    {
+        fill(w, c, now);
+        if(c->fd >= 0 && !flush(c))
+        {
+            w->stats->io_errors++;
+            c->count = 0;
+            close_connection(w, c);
+        }
+    }
+}
+
+/*
+keep-alive模式下先建立全部连接再开始计时
+服务器的监听队列很短时 一次发起大量连接会有SYN被丢弃 重传的1秒会被计入开头几个请求的延迟
+*/
+static void connect_all(worker* w)
+{
+    size_t pending = 0;
+    for(size_t i = 0; i < w->conns.size(); ++i)
+    {
+        if(open_connection(w, w->conns[i]))
+        {
+            ++pending;
+        }
+        else
+        {
+            w->stats->connect_errors++;
+        }
+    }
+    uint64_t deadline = now_ns() + CONNECT_TIMEOUT * 1000000000ULL;
+    struct epoll_event events[256];
+    while(pending > 0 && now_ns() < deadline)
+    {
+        int n = epoll_wait(w->epollfd, events, 256, 100);
+        for(int i = 0; i < n; ++i)
+        {
+            connection* c = static_cast<connection*>(events[i].data.ptr);
+            if(c->connected || c->fd < 0)
+            {
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if(err != 0)
+            {
+                w->stats->connect_errors++;
+                close_connection(w, c);
+            }
+            else
+            {
+                c->connected = true;
+            }
+            --pending;
+        }
+    }
+}
+
+static void* run_worker(void* arg)
+{
+    worker* w = static_cast<worker*>(arg);
+    w->epollfd = epoll_create1(0);
+    if(opt.keepalive)
+    {
+        connect_all(w);
+    }
+    uint64_t start = now_ns();
+    w->end_time = start + (uint64_t)(opt.duration * 1e9);
+    w->elapsed = 0;
+    for(size_t i = 0; i < w->conns.size(); ++i)
+    {
+        connection* c = w->conns[i];
+        /*开环模式下各连接的计划时间均匀错开*/
+        c->next_due = start + (opt.rate > 0 ? w->interval * i / w->conns.size() : 0);
+        fill(w, c, start);
+        if(c->fd >= 0 && !flush(c))
+        {
+            w->stats->io_errors++;
+            c->count = 0;
+            close_connection(w, c);
+        }
+    }
+
+    /*
+    开环模式下用timerfd睡到最早的计划时间
+    epoll_wait的超时只精确到毫秒 不足1毫秒时若改为忙等 单核上会抢占其他发压线程的时间片 使它们的请求迟发
+    */
+    w->timerfd = -1;
+    if(opt.rate > 0)
+    {
+        w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->timerfd, &ev);
+    }
+    uint64_t armed = 0;
+    struct epoll_event events[256];
+    while(true)
+    {
+        uint64_t now = now_ns();
+        if(now >= w->end_time)
+        {
+            w->elapsed = now - start;
+            break;
+        }
+        int timeout = 100;
+        if(opt.rate > 0)
+        {
+            uint64_t earliest = w->end_time;
+            for(size_t i = 0; i < w->conns.size(); ++i)
+            {
+                connection* c = w->conns[i];
+                if(c->count < opt.pipeline && c->next_due < earliest)
+                {
+                    earliest = c->next_due;
+                }
+            }
+            if(earliest <= now)
+            {
+                timeout = 0;
+            }
+            else if(earliest != armed)
+            {
+                struct itimerspec its;
+                memset(&its, 0, sizeof(its));
+                its.it_value.tv_sec = earliest / 1000000000ULL;
+                its.it_value.tv_nsec = earliest % 1000000000ULL;
+                timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+                armed = earliest;
+            }
+        }
+        int n = epoll_wait(w->epollfd, events, 256, timeout);
+        for(int i = 0; i < n; ++i)
+        {
+            if(!events[i].data.ptr)
+            {
+                uint64_t expirations;
+                ssize_t ret = read(w->timerfd, &expirations, sizeof(expirations));
+                (void)ret;
+                armed = 0;
+                continue;
+            }
+            handle_event(w, static_cast<connection*>(events[i].data.ptr), events[i].events);
+        }
+        if(opt.rate > 0 || !opt.keepalive)
+        {
+            now = now_ns();
+            for(size_t i = 0; i < w->conns.size(); ++i)
+            {
+                connection* c = w->conns[i];
+                if(c->count < opt.pipeline && (c->next_due <= now || c->fd < 0))
+                {
+                    fill(w, c, now);
+                    if(c->fd >= 0 && !flush(c))
+                    {
+                        w->stats->io_errors++;
+                        c->count = 0;
+                        close_connection(w, c);
+                    }
+                }
+            }
+        }
+    }
+    for(size_t i = 0; i < w->conns.size(); ++i)
+    {
+        w->stats->unfinished += w->conns[i]->count;
+        close_connection(w, w->conns[i]);
+    }
+    if(w->timerfd != -1)
+    {
+        close(w->timerfd);
+    }
+    close(w->epollfd);
+    return NULL;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s -p port [-h host] [-c connections] [-t threads] [-d seconds] [-r rate]\n"
+            "          [-k 0|1] [-P pipeline] [-u [weight:]url]...\n", prog);
+    exit(1);
+}
+
+static void add_url(const char* arg)
+{
+    url_choice u;
+    u.weight = 1;
+    const char* colon = strchr(arg, ':');
+    if(arg[0] != '/' && colon)
+    {
+        u.weight = atoi(arg);
+        arg = colon + 1;
+    }
+    if(arg[0] != '/' || u.weight <= 0)
+    {
+        fprintf(stderr, "bad url: %s\n", arg);
+        exit(1);
+    }
+    u.url = arg;
+    urls.push_back(u);
+    total_weight += u.weight;
+}
+
+int main(int argc, char* argv[])
+{
+    int ch;
+    while((ch = getopt(argc, argv, "h:p:c:t:d:r:k:P:u:")) != -1)
+    {
+        switch(ch)
+        {
+            case 'h': opt.host = optarg; break;
+            case 'p': opt.port = atoi(optarg); break;
+            case 'c': opt.connections = atoi(optarg); break;
+            case 't': opt.threads = atoi(optarg); break;
+            case 'd': opt.duration = atof(optarg); break;
+            case 'r': opt.rate = atof(optarg); break;
+            case 'k': opt.keepalive = atoi(optarg) != 0; break;
+            case 'P': opt.pipeline = atoi(optarg); break;
+            case 'u': add_url(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    bool unix_host = strncmp(opt.host, "unix:", 5) == 0;
+    if((opt.port <= 0 && !unix_host) || opt.connections <= 0 || opt.threads <= 0 || opt.duration <= 0
+            || opt.pipeline <= 0 || opt.pipeline > MAX_PIPELINE)
+    {
+        usage(argv[0]);
+    }
+    if(!opt.keepalive)
+    {
+        opt.pipeline = 1;
+    }
+    if(opt.threads > opt.connections)
+    {
+        opt.threads = opt.connections;
+    }
+    if(urls.empty())
+    {
+        add_url("/index.html");
+    }
+    if(!server_addr.parse(opt.host, opt.port))
+    {
+        fprintf(stderr, "bad host: %s\n", opt.host);
+        return 1;
+    }
+    for(size_t i = 0; i < urls.size(); ++i)
+    {
+        char req[1024];
+        if(unix_host)
+        {
+            snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+                    urls[i].url.c_str(), opt.keepalive ? "keep-alive" : "close");
+        }
+        else
+        {
+            snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n\r\n",
+                    urls[i].url.c_str(), opt.host, opt.port, opt.keepalive ? "keep-alive" : "close");
+        }
+        urls[i].request = req;
+    }
+
+    std::vector<worker*> workers;
+    for(int i = 0; i < opt.threads; ++i)
+    {
+        worker* w = new worker;
+        w->id = i;
+        w->stats = new thread_stats;
+        int n = opt.connections / opt.threads + (i < opt.connections % opt.threads ? 1 : 0);
+        for(int j = 0; j < n; ++j)
+        {
+            connection* c = new connection;
+            c->fd = -1;
+            c->count = 0;
+            c->head = 0;
+            c->rng = 2463534242u + i * 7919 + j * 104729;
+            c->done = 0;
+            c->latency_sum = 0;
+            w->conns.push_back(c);
+        }
+        /*每个连接分担rate/connections的速率*/
+        w->interval = opt.rate > 0 ? (uint64_t)(1e9 * opt.connections / opt.rate) : 0;
+        workers.push_back(w);
+    }
+    for(size_t i = 0; i < workers.size(); ++i)
+    {
+        pthread_create(&workers[i]->tid, NULL, run_worker, workers[i]);
+    }
+    thread_stats total;
+    uint64_t elapsed_ns = 0;
+    for(size_t i = 0; i < workers.size(); ++i)
+    {
+        pthread_join(workers[i]->tid, NULL);
+        if(workers[i]->elapsed > elapsed_ns)
+        {
+            elapsed_ns = workers[i]->elapsed;
+        }
+        thread_stats* s = workers[i]->stats;
+        total.latency.merge(s->latency);
+        total.completed += s->completed;
+        total.bytes += s->bytes;
+        total.connect_errors += s->connect_errors;
+        total.io_errors += s->io_errors;
+        total.parse_errors += s->parse_errors;
+        total.non_2xx += s->non_2xx;
+        total.unfinished += s->unfinished;
+    }
+    double elapsed = elapsed_ns / 1e9;
+
+    /*各连接平均延迟的分布 和完成请求数的Jain指数 (sum x)^2 / (n * sum x^2)*/
+    double conn_min = 0, conn_max = 0, conn_sum = 0, conn_sq = 0, done_sum = 0, done_sq = 0;
+    int measured = 0;
+    for(size_t i = 0; i < workers.size(); ++i)
+    {
+        for(size_t j = 0; j < workers[i]->conns.size(); ++j)
+        {
+            const connection* c = workers[i]->conns[j];
+            done_sum += c->done;
+            done_sq += (double)c->done * c->done;
+            if(!c->done)
+            {
+                continue;
+            }
+            double m = (double)c->latency_sum / c->done / 1e3;
+            if(!measured || m < conn_min)
+            {
+                conn_min = m;
+            }
+            if(!measured || m > conn_max)
+            {
+                conn_max = m;
+            }
+            conn_sum += m;
+            conn_sq += m * m;
+            ++measured;
+        }
+    }
+    double conn_mean = measured ? conn_sum / measured : 0;
+    double conn_var = measured ? conn_sq / measured - conn_mean * conn_mean : 0;
+    double conn_cv = conn_mean > 0 && conn_var > 0 ? sqrt(conn_var) / conn_mean : 0;
+    double jain = done_sq > 0 ? done_sum * done_sum / (opt.connections * done_sq) : 0;
+
+    const hdr_histogram& h = total.latency;
+    double mean = h.count() ? (double)h.sum() / h.count() / 1e3 : 0;
+    printf("{\"mode\":\"%s\",\"connections\":%d,\"threads\":%d,\"duration_s\":%.3f,\"keepalive\":%s,"
+            "\"pipeline\":%d,\"target_rate\":%.1f,\"urls\":%zu,"
+            "\"requests\":%llu,\"throughput_rps\":%.1f,\"bytes_per_s\":%.1f,"
+            "\"errors\":{\"connect\":%llu,\"io\":%llu,\"parse\":%llu,\"non_2xx\":%llu,\"unfinished\":%llu},"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+            "\"fairness\":{\"conn_mean_us_min\":%.1f,\"conn_mean_us_max\":%.1f,\"conn_mean_cv\":%.3f,\"jain_index\":%.3f}}\n",
+            opt.rate > 0 ? "open" : "closed", opt.connections, opt.threads, elapsed, opt.keepalive ? "true" : "false",
+            opt.pipeline, opt.rate, urls.size(),
+            (unsigned long long)total.completed, total.completed / elapsed, total.bytes / elapsed,
+            (unsigned long long)total.connect_errors, (unsigned long long)total.io_errors,
+            (unsigned long long)total.parse_errors, (unsigned long long)total.non_2xx,
+            (unsigned long long)total.unfinished,
+            mean, h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3,
+            h.percentile(0.999) / 1e3, h.percentile(1.0) / 1e3,
+            conn_min, conn_max, conn_cv, jain);
+    fprintf(stderr, "%llu requests in %.2fs, %.0f req/s, %.2f MB/s, p50 %.0fus p99 %.0fus p999 %.0fus, "
+            "per-connection mean %.0f-%.0fus (cv %.2f), jain %.3f\n",
+            (unsigned long long)total.completed, elapsed, total.completed / elapsed, total.bytes / elapsed / 1e6,
+            h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3,
+            conn_min, conn_max, conn_cv, jain);
+    return 0;
+}
@@ -0,0 +1,188 @@
+#!/bin/bash
+#
+# 性能回归检查：在回环地址上启动server 用loadgen跑一组固定场景 与基线文件比较
+#     doc_root为临时生成的测试目录(小/中/大文件) 通过环境变量DOC_ROOT传给server
+#     每个场景运行PERF_RUNS次(默认3) 吞吐量和p99取中位数 另记录场景结束时server的RSS、每请求系统调用数
+#     吞吐量低于基线 或RSS、系统调用数高于基线 超过容差(PERF_TOLERANCE 默认0.25)时失败
+#     p99受调度影响波动大 单独使用容差PERF_P99_TOLERANCE(默认1.0 即不超过基线的两倍)
+#     并且只有比基线多出PERF_P99_SLACK_US(默认5000)微秒以上才算回归
+#     系统调用数优先取server /metrics中的syscalls计数 没有时取/proc/<pid>/io的syscr+syscw
+#     (后者只统计read/write类调用 recv/send/epoll_ctl不在其中)
+# 用法: bench/perf_check.sh [baseline_file]           比较
+#       bench/perf_check.sh --update [baseline_file]  用本次结果重写基线
+#
+# 环境变量: PERF_PORT(默认9380) PERF_ADMIN_PORT(默认9381) PERF_DURATION(每次运行的秒数 默认2)
+#           PERF_RUNS(默认3) PERF_TOLERANCE(默认0.25) PERF_P99_TOLERANCE(默认1.0) PERF_P99_SLACK_US(默认5000)
+
+set -u
+
+cd "$(dirname "$0")/.."
+
+update=0
+if [ "${1:-}" = "--update" ]; then
+    update=1
+    shift
+fi
+baseline=${1:-bench/perf_baseline.txt}
+port=${PERF_PORT:-9380}
+admin_port=${PERF_ADMIN_PORT:-9381}
+duration=${PERF_DURATION:-2}
+runs=${PERF_RUNS:-3}
+tolerance=${PERF_TOLERANCE:-0.25}
+p99_tolerance=${PERF_P99_TOLERANCE:-1.0}
+p99_slack=${PERF_P99_SLACK_US:-5000}
+
+if [ ! -x ./server ] || [ ! -x ./loadgen ]; then
+    echo "perf-check: build server and loadgen first (make && make bench)" >&2
+    exit 2
+fi
+
+fixture=$(mktemp -d)
+result=$(mktemp)
+server_pid=
+cleanup()
+{
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null
+        wait "$server_pid" 2>/dev/null
+    fi
+    rm -rf "$fixture" "$result"
+}
+trap cleanup EXIT
+
+# 测试目录: 128字节 16KB 2MB三种文件 以及不存在的路径(404)
+head -c 128 /dev/zero | tr '\0' 'a' > "$fixture/tiny.html"
+head -c 16384 /dev/zero | tr '\0' 'b' > "$fixture/small.html"
+head -c 2097152 /dev/urandom > "$fixture/large.bin"
+cp "$fixture/tiny.html" "$fixture/index.html"
+
+DOC_ROOT="$fixture" ./server 127.0.0.1 "$port" 1048576 "$admin_port" > "$fixture/server.log" 2>&1 &
+server_pid=$!
+for i in $(seq 50); do
+    if (exec 3<>/dev/tcp/127.0.0.1/"$port") 2>/dev/null; then
+        break
+    fi
+    sleep 0.1
+done
+if ! kill -0 "$server_pid" 2>/dev/null; then
+    echo "perf-check: server failed to start" >&2
+    cat "$fixture/server.log" >&2
+    exit 2
+fi
+
+# 从管理端口抓取syscalls计数 server不提供时返回空
+scrape_syscalls()
+{
+    local line
+    exec 3<>/dev/tcp/127.0.0.1/"$admin_port" || return
+    printf 'GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n' >&3
+    line=$(grep -m1 '^tws_syscalls_total ' <&3)
+    exec 3<&-
+    echo "${line##* }"
+}
+
+syscall_count()
+{
+    local n
+    n=$(scrape_syscalls 2>/dev/null)
+    if [ -z "$n" ]; then
+        n=$(awk '/^syscr|^syscw/ {s += $2} END {print s}' /proc/"$server_pid"/io)
+    fi
+    echo "$n"
+}
+
+json_field()
+{
+    echo "$1" | sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p"
+}
+
+median()
+{
+    printf '%s\n' "$@" | sort -g | awk '{v[NR] = $1} END {print v[int((NR + 1) / 2)]}'
+}
+
+# 场景名 loadgen参数
+run_scenario()
+{
+    local name=$1
+    shift
+    # 预热 使文件缓存和内容缓存就绪
+    ./loadgen -h 127.0.0.1 -p "$port" -d 0.5 "$@" > /dev/null 2>&1
+    local before after out run
+    local requests total=0 errors
+    local rps_runs=() p99_runs=()
+    before=$(syscall_count)
+    for run in $(seq "$runs"); do
+        out=$(./loadgen -h 127.0.0.1 -p "$port" -d "$duration" "$@" 2>/dev/null)
+        requests=$(json_field "$out" requests)
+        errors=$(echo "$out" | sed -n 's/.*"connect":\([0-9]*\),"io":\([0-9]*\),"parse":\([0-9]*\).*/\1 \2 \3/p' | awk '{print $1 + $2 + $3}')
+        if [ -z "$requests" ] || [ "$requests" = 0 ]; then
+            echo "perf-check: scenario $name produced no responses" >&2
+            exit 1
+        fi
+        if [ "$errors" != 0 ]; then
+            echo "perf-check: scenario $name had $errors connection errors" >&2
+            exit 1
+        fi
+        total=$((total + requests))
+        rps_runs+=("$(json_field "$out" throughput_rps)")
+        p99_runs+=("$(json_field "$out" p99)")
+    done
+    after=$(syscall_count)
+    local rps p99 rss syscalls
+    rps=$(median "${rps_runs[@]}")
+    p99=$(median "${p99_runs[@]}")
+    rss=$(awk '/^VmRSS/ {print $2}' /proc/"$server_pid"/status)
+    syscalls=$(awk -v a="$before" -v b="$after" -v n="$total" 'BEGIN {printf "%.2f", (b - a) / n}')
+    printf '%-18s %10s %10s %10s %8s\n' "$name" "$rps" "$p99" "$rss" "$syscalls" | tee -a "$result"
+}
+
+printf '%-18s %10s %10s %10s %8s\n' "# scenario" "rps" "p99_us" "rss_kb" "sys/req"
+run_scenario tiny_keepalive   -c 32 -t 2 -u /tiny.html
+run_scenario small_keepalive  -c 32 -t 2 -u /small.html
+run_scenario large_keepalive  -c 8  -t 2 -u /large.bin
+run_scenario notfound         -c 32 -t 2 -u /missing.html
+run_scenario tiny_close       -c 16 -t 2 -k 0 -u /tiny.html
+run_scenario pipelined        -c 16 -t 2 -P 8 -u /tiny.html
+run_scenario mixed_open       -c 32 -t 2 -r 5000 -u 6:/tiny.html -u 3:/small.html -u 1:/missing.html
+
+if [ $update = 1 ]; then
+    {
+        echo "# perf-check baseline: scenario throughput_rps p99_us rss_kb syscalls_per_req"
+        echo "# regenerate with: make perf-baseline"
+        cat "$result"
+    } > "$baseline"
+    echo "perf-check: baseline written to $baseline"
+    exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+    echo "perf-check: no baseline at $baseline (make perf-baseline)" >&2
+    exit 2
+fi
+
+# 吞吐量越高越好 其余越低越好
+awk -v tol="$tolerance" -v p99_tol="$p99_tolerance" -v p99_slack="$p99_slack" '
+    NR == FNR {
+        if ($1 !~ /^#/) { rps[$1] = $2; p99[$1] = $3; rss[$1] = $4; sys[$1] = $5 }
+        next
+    }
+    function check(name, metric, base, now, higher_is_better, tol, slack) {
+        if (base == "" || base == 0) return
+        if (higher_is_better ? now < base * (1 - tol) : now > base * (1 + tol) && now - base > slack) {
+            printf "REGRESSION %-18s %-9s baseline %s now %s\n", name, metric, base, now
+            failed = 1
+        }
+    }
+    {
+        if (!($1 in rps)) { printf "perf-check: %s missing from baseline\n", $1; next }
+        check($1, "rps", rps[$1], $2, 1, tol, 0)
+        check($1, "p99_us", p99[$1], $3, 0, p99_tol, p99_slack)
+        check($1, "rss_kb", rss[$1], $4, 0, tol, 0)
+        check($1, "sys/req", sys[$1], $5, 0, tol, 0)
+    }
+    END {
+        if (failed) exit 1
+        printf "perf-check: no regressions beyond %d%% (p99 %d%%)\n", tol * 100, p99_tol * 100
+    }
+' "$baseline" "$result"
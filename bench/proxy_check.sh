@@ -0,0 +1,144 @@
+#!/bin/bash
+#
+# 反向代理检查：server把/api/转发给替身上游stub_upstream 逐个取回多MB的消息体并逐字节比较
+#     上游的四种定界方式(HTTP/1.0 Content-Length后关闭、保持连接的Content-Length、chunked、以关闭结束)各取PROXY_FETCHES次
+#     每次取回限时PROXY_TIMEOUT秒 超时、状态码不是200或内容不一致都算失败
+#     请求一个接一个发出 上游连接在前一个请求结束后被回收或复用 覆盖连接对象和描述符的复用
+#     0字节到PROXY_BYTES字节的POST请求体经上游原样返回(超过读缓冲区的部分边读边转发)
+#     X-Forwarded-For: 没有时新增 客户已带时追加客户地址
+#     上游在响应后关闭空闲连接: 之后的GET重发、POST换新连接 都应成功
+#     上游收到POST后不响应就关闭连接: 返回502 上游只收到一次(不重发)
+# 用法: bench/proxy_check.sh
+#
+# 环境变量: PROXY_PORT(默认9390) PROXY_UPSTREAM_PORT(默认9391) PROXY_FETCHES(默认50)
+#           PROXY_BYTES(默认3145728) PROXY_TIMEOUT(默认10)
+
+set -u
+
+cd "$(dirname "$0")/.."
+
+port=${PROXY_PORT:-9390}
+upstream_port=${PROXY_UPSTREAM_PORT:-9391}
+fetches=${PROXY_FETCHES:-50}
+bytes=${PROXY_BYTES:-3145728}
+timeout=${PROXY_TIMEOUT:-10}
+
+if [ ! -x ./server ] || [ ! -x ./stub_upstream ]; then
+    echo "proxy-check: build server and stub_upstream first (make && make stub_upstream)" >&2
+    exit 2
+fi
+
+fixture=$(mktemp -d)
+server_pid=
+upstream_pid=
+cleanup()
+{
+    for pid in $server_pid $upstream_pid; do
+        kill "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+    done
+    rm -rf "$fixture"
+}
+trap cleanup EXIT
+
+wait_port()
+{
+    for i in $(seq 50); do
+        if (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+./stub_upstream "$upstream_port" > "$fixture/upstream.log" 2>&1 &
+upstream_pid=$!
+./server --doc_root="$fixture" --proxy_routes=/api/=127.0.0.1:"$upstream_port" 127.0.0.1 "$port" > "$fixture/server.log" 2>&1 &
+server_pid=$!
+if ! wait_port "$upstream_port" || ! wait_port "$port"; then
+    echo "proxy-check: server or stub_upstream failed to start" >&2
+    cat "$fixture/server.log" "$fixture/upstream.log" >&2
+    exit 2
+fi
+
+# 期望的消息体: 第i个字节为'a' + i % 26
+yes abcdefghijklmnopqrstuvwxyz | tr -d '\n' | head -c "$bytes" > "$fixture/expected"
+
+failed=0
+for mode in close length chunked eof; do
+    bad=0
+    slowest=0
+    for i in $(seq "$fetches"); do
+        out=$(curl -s -o "$fixture/body" -w '%{http_code} %{time_total}' --max-time "$timeout" \
+                "http://127.0.0.1:$port/api/$mode/$bytes")
+        code=${out% *}
+        elapsed=${out#* }
+        if [ "$code" != 200 ] || ! cmp -s "$fixture/body" "$fixture/expected"; then
+            echo "proxy-check: $mode fetch $i failed: status $code after ${elapsed}s" >&2
+            bad=$((bad + 1))
+        fi
+        slowest=$(awk -v a="$slowest" -v b="$elapsed" 'BEGIN { print (b > a) ? b : a }')
+    done
+    printf '%-8s %d/%d ok, slowest %ss\n' "$mode" $((fetches - bad)) "$fetches" "$slowest"
+    failed=$((failed + bad))
+done
+
+fail()
+{
+    echo "proxy-check: $*" >&2
+    failed=$((failed + 1))
+}
+
+# request 路径 [curl参数...]: 响应写到$fixture/body 输出状态码
+request()
+{
+    local path=$1
+    shift
+    curl -s -o "$fixture/body" -w '%{http_code}' --max-time "$timeout" "$@" "http://127.0.0.1:$port/api/$path"
+}
+
+for n in 0 1000 8000 100000 "$bytes"; do
+    head -c "$n" /dev/urandom > "$fixture/request"
+    code=$(request echo --data-binary @"$fixture/request" -H 'Content-Type: application/octet-stream')
+    if [ "$code" != 200 ] || ! cmp -s "$fixture/body" "$fixture/request"; then
+        fail "POST body of $n bytes: status $code or different echo"
+    fi
+done
+echo "request bodies: 0B to ${bytes}B echoed"
+
+request xff > /dev/null
+if [ "$(cat "$fixture/body")" != 127.0.0.1 ]; then
+    fail "X-Forwarded-For: got '$(cat "$fixture/body")'"
+fi
+request xff -H 'X-Forwarded-For: 10.0.0.1' > /dev/null
+if [ "$(cat "$fixture/body")" != "10.0.0.1, 127.0.0.1" ]; then
+    fail "X-Forwarded-For with a client value: got '$(cat "$fixture/body")'"
+fi
+echo "X-Forwarded-For: added and appended"
+
+for method in GET POST; do
+    request drop/10 > /dev/null
+    sleep 0.2
+    if [ "$method" = GET ]; then
+        code=$(request length/10)
+    else
+        code=$(request echo --data-binary x)
+    fi
+    if [ "$code" != 200 ]; then
+        fail "$method on a connection closed by the upstream: status $code"
+    fi
+done
+request length/10 > /dev/null
+code=$(request vanish --data-binary x)
+request count > /dev/null
+if [ "$code" != 502 ] || [ "$(cat "$fixture/body")" != 1 ]; then
+    fail "POST lost after it was sent: status $code, upstream saw it $(cat "$fixture/body") times"
+fi
+echo "stale connections: GET retried, POST not re-sent"
+
+if [ "$failed" -gt 0 ]; then
+    echo "proxy-check: $failed checks failed" >&2
+    exit 1
+fi
+echo "proxy-check: passed"
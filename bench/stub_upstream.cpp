@@ -0,0 +1,296 @@
+/*
+反向代理检查用的替身上游 只依赖POSIX 每个连接一个线程 阻塞地读请求、写响应
+    请求路径的最后一段是消息体的字节数 倒数第二段决定响应的定界方式:
+        .../length/N    HTTP/1.1 Content-Length 保持连接
+        .../close/N     HTTP/1.0 Content-Length 发完关闭连接(与python3 -m http.server相同)
+        .../chunked/N   HTTP/1.1 chunked 保持连接
+        .../eof/N       没有长度 以关闭连接结束
+        .../drop/N      同length 但发完后关闭连接 模拟空闲连接被上游关闭
+    消息体的第i个字节为'a' + i % 26 检查脚本据此比较收到的内容
+    其他路径:
+        .../echo        原样返回请求体(按Content-Length读取) 保持连接
+        .../xff         返回请求中X-Forwarded-For的值
+        .../vanish      读完请求后不响应 直接关闭连接 模拟上游执行了请求后连接断开
+        .../count       vanish请求的累计次数
+用法: ./stub_upstream port
+*/
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<pthread.h>
+#include<signal.h>
+#include<unistd.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<atomic>
+#include<string>
+
+enum MODE{
+    MODE_LENGTH = 0,
+    MODE_CLOSE,
+    MODE_CHUNKED,
+    MODE_EOF,
+    MODE_DROP
+};
+
+static std::atomic<int> vanished(0);
+
+static bool send_all(int fd, const char* p, size_t n)
+{
+    while(n > 0)
+    {
+        ssize_t ret = send(fd, p, n, MSG_NOSIGNAL);
+        if(ret <= 0)
+        {
+            return false;
+        }
+        p += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+static char pattern[65536 + 26];
+
+/*按64KB一段发送消息体 chunked时每段一个块*/
+static bool send_body(int fd, long len, bool chunked)
+{
+    for(long off = 0; off < len; )
+    {
+        long n = len - off < 65536 ? len - off : 65536;
+        char size[32];
+        if(chunked && !send_all(fd, size, snprintf(size, sizeof(size), "%lx\r\n", n)))
+        {
+            return false;
+        }
+        if(!send_all(fd, pattern + off % 26, n) || (chunked && !send_all(fd, "\r\n", 2)))
+        {
+            return false;
+        }
+        off += n;
+    }
+    return !chunked || send_all(fd, "0\r\n\r\n", 5);
+}
+
+/*请求头中name字段的值(去掉前导空白) 没有时返回空串*/
+static std::string header(const char* request, const char* name)
+{
+    size_t n = strlen(name);
+    for(const char* line = strstr(request, "\r\n"); line; line = strstr(line + 2, "\r\n"))
+    {
+        if(strncasecmp(line + 2, name, n) == 0)
+        {
+            const char* value = line + 2 + n;
+            value += strspn(value, " \t");
+            const char* end = strstr(value, "\r\n");
+            return end ? std::string(value, end) : std::string(value);
+        }
+    }
+    return std::string();
+}
+
+static bool send_text(int fd, const std::string& body)
+{
+    char head[128];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", body.size());
+    return send_all(fd, head, head_len) && send_all(fd, body.data(), body.size());
+}
+
+/*
+读完请求体 buf[0, *len)是请求头之后已读入的数据 用掉的部分从buf中移走
+echo时原样发回 先发响应头
+*/
+static bool read_body(int fd, char* buf, int size, int* len, long body, bool echo)
+{
+    if(echo)
+    {
+        char head[128];
+        int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %ld\r\n\r\n", body);
+        if(!send_all(fd, head, head_len))
+        {
+            return false;
+        }
+    }
+    while(body > 0)
+    {
+        if(*len == 0)
+        {
+            ssize_t n = recv(fd, buf, size, 0);
+            if(n <= 0)
+            {
+                return false;
+            }
+            *len = n;
+        }
+        int take = *len < body ? *len : (int)body;
+        if(echo && !send_all(fd, buf, take))
+        {
+            return false;
+        }
+        memmove(buf, buf + take, *len - take);
+        *len -= take;
+        body -= take;
+    }
+    return true;
+}
+
+/*处理一个请求 请求体已读完 返回连接是否继续保持*/
+static bool respond(int fd, const char* request)
+{
+    char path[1024];
+    if(sscanf(request, "%*s %1023s", path) != 1)
+    {
+        return false;
+    }
+    char* last = strrchr(path, '/');
+    if(last && strcmp(last, "/xff") == 0)
+    {
+        return send_text(fd, header(request, "X-Forwarded-For:"));
+    }
+    if(last && strcmp(last, "/vanish") == 0)
+    {
+        ++vanished;
+        return false;
+    }
+    if(last && strcmp(last, "/count") == 0)
+    {
+        char count[32];
+        snprintf(count, sizeof(count), "%d", vanished.load());
+        return send_text(fd, count);
+    }
+    long len = last ? atol(last + 1) : 0;
+    MODE mode = MODE_LENGTH;
+    if(last)
+    {
+        *last = '\0';
+        char* kind = strrchr(path, '/');
+        kind = kind ? kind + 1 : path;
+        if(strcmp(kind, "close") == 0)
+        {
+            mode = MODE_CLOSE;
+        }
+        else if(strcmp(kind, "chunked") == 0)
+        {
+            mode = MODE_CHUNKED;
+        }
+        else if(strcmp(kind, "eof") == 0)
+        {
+            mode = MODE_EOF;
+        }
+        else if(strcmp(kind, "drop") == 0)
+        {
+            mode = MODE_DROP;
+        }
+    }
+    char head[256];
+    int head_len;
+    switch(mode)
+    {
+        case MODE_CLOSE:
+            head_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %ld\r\n\r\n", len);
+            break;
+        case MODE_CHUNKED:
+            head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n\r\n");
+            break;
+        case MODE_EOF:
+            head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nConnection: close\r\n\r\n");
+            break;
+        default:
+            head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %ld\r\n\r\n", len);
+            break;
+    }
+    if(!send_all(fd, head, head_len) || !send_body(fd, len, mode == MODE_CHUNKED))
+    {
+        return false;
+    }
+    return mode == MODE_LENGTH || mode == MODE_CHUNKED;
+}
+
+/*读入完整的请求头后读请求体(echo时边读边发回) 再处理请求*/
+static void* serve(void* arg)
+{
+    int fd = (int)(long)arg;
+    char buf[8192];
+    int len = 0;
+    while(true)
+    {
+        char* end = (char*)memmem(buf, len, "\r\n\r\n", 4);
+        if(end)
+        {
+            *end = '\0';
+            char request[sizeof(buf)];
+            memcpy(request, buf, end + 1 - buf);
+            int used = end + 4 - buf;
+            memmove(buf, buf + used, len - used);
+            len -= used;
+            long body = atol(header(request, "Content-Length:").c_str());
+            char path[1024];
+            bool echo = sscanf(request, "%*s %1023s", path) == 1 && strlen(path) >= 5 && strcmp(path + strlen(path) - 5, "/echo") == 0;
+            if(!read_body(fd, buf, sizeof(buf), &len, body, echo))
+            {
+                break;
+            }
+            if(!echo && !respond(fd, request))
+            {
+                break;
+            }
+            continue;
+        }
+        if(len == (int)sizeof(buf))
+        {
+            break;
+        }
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - len, 0);
+        if(n <= 0)
+        {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s port\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for(size_t i = 0; i < sizeof(pattern); ++i)
+    {
+        pattern[i] = 'a' + i % 26;
+    }
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(argv[1]));
+    if(bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenfd, 128) < 0)
+    {
+        perror("stub_upstream");
+        return 1;
+    }
+    while(true)
+    {
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd < 0)
+        {
+            continue;
+        }
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, serve, (void*)(long)fd) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
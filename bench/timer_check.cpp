@@ -0,0 +1,272 @@
+/*
+定时器检查: timer_slab的节点复用、嵌入连接对象的定时器、三种定时器的增删和到期顺序
+三个定时器头文件各自定义了client_data 不能放在同一个编译单元中 按宏选择其中一个编译:
+    g++ -DTIMER_LIST bench/timer_check.cpp -o timer_check
+    TIMER_LIST / TIMER_WHEEL / TIMER_HEAP
+定时器本身的调试输出在标准输出 检查结果输出到标准错误 有失败时退出码为1
+*/
+#include<cstdio>
+#include<cstring>
+#include<set>
+#include<vector>
+
+#if defined(TIMER_LIST)
+#include"../timer/list_timer.h"
+typedef util_timer timer_type;
+static const char* kind = "list";
+#elif defined(TIMER_WHEEL)
+#include"../timer/time_wheel_timer.h"
+typedef tw_timer timer_type;
+static const char* kind = "wheel";
+#elif defined(TIMER_HEAP)
+#include"../timer/time_heap_timer.h"
+typedef heap_timer timer_type;
+static const char* kind = "heap";
+#else
+#error "define TIMER_LIST, TIMER_WHEEL or TIMER_HEAP"
+#endif
+
+static int failed = 0;
+
+#define CHECK(cond, ...) do{ \
+    if(!(cond)){ \
+        fprintf(stderr, "timer-check(%s): line %d: ", kind, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        ++failed; \
+    } \
+}while(0)
+
+static const int CLIENTS = 8;
+static client_data clients[CLIENTS];
+/*到期的顺序 记录client_data的sockfd*/
+static std::vector<int> fired;
+
+static void on_expire(client_data* data)
+{
+    fired.push_back(data->sockfd);
+}
+
+static void init_timer(timer_type* timer, int client)
+{
+    timer->cb_func = on_expire;
+    timer->user_data = &clients[client];
+}
+
+/*空闲链表后进先出 回收的节点被下一次分配取回 超过一块的分配会申请新块*/
+static void check_slab()
+{
+    const int n = timer_slab<timer_type>::SLAB_NODES * 3 + 5;
+    std::vector<timer_type*> nodes;
+    std::set<timer_type*> distinct;
+    for(int i = 0; i < n; ++i)
+    {
+        timer_type* t = timer_slab<timer_type>::alloc();
+        CHECK(t != nullptr, "alloc %d failed", i);
+        nodes.push_back(t);
+        distinct.insert(t);
+    }
+    CHECK((int)distinct.size() == n, "slab handed out %d distinct nodes for %d allocations", (int)distinct.size(), n);
+    for(int i = 0; i < n; ++i)
+    {
+        timer_slab<timer_type>::free(nodes[i]);
+    }
+    /*全部回收后再分配同样多的节点 应完全来自空闲链表*/
+    for(int i = n - 1; i >= 0; --i)
+    {
+        timer_type* t = timer_slab<timer_type>::alloc();
+        CHECK(t == nodes[i], "node %d not reused from the free list", i);
+    }
+    for(int i = 0; i < n; ++i)
+    {
+        timer_slab<timer_type>::free(nodes[i]);
+    }
+}
+
+#if defined(TIMER_LIST)
+
+/*升序链表: 中间插入(曾缺少break)、嵌入节点的删除和再次加入、到期回收slab节点*/
+static void check_timers()
+{
+    time_t now = time(NULL);
+    util_timer embedded[3];
+    sort_timer_lst lst;
+    /*先后插入10 30 20 第三个落在链表中间*/
+    const int order[3] = {1, 3, 2};
+    for(int i = 0; i < 3; ++i)
+    {
+        init_timer(&embedded[i], order[i]);
+        embedded[i].expire = now - 100 + order[i] * 10;
+        lst.add_timer(&embedded[i]);
+    }
+    util_timer* pooled = util_timer::create();
+    CHECK(pooled && pooled->pooled, "create() did not return a slab node");
+    init_timer(pooled, 4);
+    pooled->expire = now - 100 + 25;
+    lst.add_timer(pooled);
+    /*删除嵌入的节点 重新设置超时后再次加入*/
+    lst.del_timer(&embedded[0]);
+    CHECK(!embedded[0].prev && !embedded[0].next, "deleted embedded timer still linked");
+    embedded[0].expire = now - 100 + 40;
+    lst.add_timer(&embedded[0]);
+    /*延长超时 移到链表尾部*/
+    embedded[2].expire = now - 100 + 50;
+    lst.adjust_timer(&embedded[2]);
+    /*一个还没有到期的节点*/
+    util_timer later;
+    init_timer(&later, 5);
+    later.expire = now + 100;
+    lst.add_timer(&later);
+
+    lst.tick();
+    CHECK(fired == std::vector<int>({4, 3, 1, 2}), "list fired in the wrong order (%d timers)", (int)fired.size());
+    CHECK(!embedded[1].prev && !embedded[1].next, "expired embedded timer still linked");
+    /*到期的slab节点已回收 下一次create取回同一个节点*/
+    util_timer* again = util_timer::create();
+    CHECK(again == pooled, "expired slab timer was not returned to the free list");
+    timer_slab<util_timer>::free(again);
+    lst.del_timer(&later);
+}
+
+#elif defined(TIMER_WHEEL)
+
+/*时间轮: 嵌入节点不分配 slab节点到期和删除后回收 多圈的定时器在对应的圈数后到期*/
+static void check_timers()
+{
+    time_wheel wheel;
+    tw_timer embedded[3];
+    for(int i = 0; i < 3; ++i)
+    {
+        init_timer(&embedded[i], i + 1);
+    }
+    CHECK(wheel.add_timer(&embedded[0], 1) == &embedded[0], "embedded timer not added");
+    CHECK(!embedded[0].pooled, "embedded timer marked as pooled");
+    wheel.add_timer(&embedded[1], 3);
+    wheel.add_timer(&embedded[2], 60 + 2);
+    tw_timer* pooled = wheel.add_timer(5);
+    CHECK(pooled && pooled->pooled, "add_timer(timeout) did not return a slab node");
+    init_timer(pooled, 4);
+    tw_timer* removed = wheel.add_timer(2);
+    init_timer(removed, 6);
+    wheel.del_timer(removed);
+    /*删除的slab节点已回收 下一次分配取回同一个节点*/
+    tw_timer* reused = wheel.add_timer(10);
+    CHECK(reused == removed, "deleted slab timer was not returned to the free list");
+    init_timer(reused, 7);
+    /*删除后再次加入嵌入的节点*/
+    wheel.del_timer(&embedded[1]);
+    CHECK(!embedded[1].prev && !embedded[1].next, "deleted embedded timer still linked");
+    wheel.add_timer(&embedded[1], 4);
+
+    /*加入时当前槽为0 超时t秒的定时器在第t+1次tick时到期*/
+    std::vector<int> at_tick[70];
+    for(int i = 1; i <= 64; ++i)
+    {
+        size_t before = fired.size();
+        wheel.tick();
+        at_tick[i].assign(fired.begin() + before, fired.end());
+    }
+    CHECK(at_tick[2] == std::vector<int>{1}, "1s timer did not expire at tick 2");
+    CHECK(at_tick[5] == std::vector<int>{2}, "re-added embedded timer did not expire at tick 5");
+    CHECK(at_tick[6] == std::vector<int>{4}, "5s slab timer did not expire at tick 6");
+    CHECK(at_tick[11] == std::vector<int>{7}, "10s slab timer did not expire at tick 11");
+    CHECK(at_tick[63] == std::vector<int>{3}, "62s timer did not expire one rotation later");
+    CHECK(fired.size() == 5, "wheel fired %d timers, expected 5", (int)fired.size());
+    /*到期的嵌入节点可以再次加入*/
+    CHECK(wheel.add_timer(&embedded[0], 1) == &embedded[0], "expired embedded timer could not be re-added");
+    wheel.del_timer(&embedded[0]);
+}
+
+#elif defined(TIMER_HEAP)
+
+static time_heap* heap_for_readd = nullptr;
+static heap_timer readd_timer;
+
+/*回调中重新加入自己的嵌入定时器 tick先取出堆顶再执行回调*/
+static void on_expire_readd(client_data* data)
+{
+    fired.push_back(data->sockfd);
+    if(data->sockfd == 5)
+    {
+        readd_timer.expire = time(NULL) + 100;
+        heap_for_readd->add_timer(&readd_timer);
+    }
+}
+
+/*时间堆: 嵌入节点按下标立即删除、回调中重新加入、slab节点延迟删除后回收*/
+static void check_timers()
+{
+    time_t now = time(NULL);
+    time_heap heap(2);
+    heap_for_readd = &heap;
+    heap_timer embedded[3];
+    const int expire[3] = {30, 10, 20};
+    for(int i = 0; i < 3; ++i)
+    {
+        init_timer(&embedded[i], i + 1);
+        embedded[i].expire = now - 100 + expire[i];
+        heap.add_timer(&embedded[i]);
+        CHECK(embedded[i].index >= 0, "embedded timer %d has no heap index", i);
+    }
+    heap_timer* pooled = heap_timer::create(-100 + 15);
+    CHECK(pooled && pooled->pooled, "create() did not return a slab node");
+    init_timer(pooled, 4);
+    heap.add_timer(pooled);
+    init_timer(&readd_timer, 5);
+    readd_timer.cb_func = on_expire_readd;
+    readd_timer.expire = now - 100 + 25;
+    heap.add_timer(&readd_timer);
+    heap_timer* lazy = heap_timer::create(-100 + 5);
+    init_timer(lazy, 6);
+    heap.add_timer(lazy);
+    heap_timer later;
+    init_timer(&later, 7);
+    later.expire = now + 100;
+    heap.add_timer(&later);
+
+    /*嵌入节点立即从堆中取出 可以马上再次加入 slab节点只清空回调*/
+    heap.del_timer(&embedded[0]);
+    CHECK(embedded[0].index == -1, "deleted embedded timer still in the heap");
+    embedded[0].cb_func = on_expire;
+    embedded[0].expire = now - 100 + 40;
+    heap.add_timer(&embedded[0]);
+    heap.del_timer(lazy);
+
+    heap.tick();
+    CHECK(fired == std::vector<int>({2, 4, 3, 5, 1}), "heap fired in the wrong order (%d timers)", (int)fired.size());
+    CHECK(embedded[1].index == -1, "expired embedded timer still has a heap index");
+    CHECK(readd_timer.index >= 0, "timer re-added from its callback is not in the heap");
+    CHECK(later.index >= 0, "timer not yet due left the heap");
+    /*延迟删除和到期的slab节点都已回收*/
+    std::set<heap_timer*> reused;
+    reused.insert(heap_timer::create(0));
+    reused.insert(heap_timer::create(0));
+    CHECK(reused.count(pooled) && reused.count(lazy), "expired or deleted slab timers were not returned to the free list");
+    for(std::set<heap_timer*>::iterator it = reused.begin(); it != reused.end(); ++it)
+    {
+        timer_slab<heap_timer>::free(*it);
+    }
+    heap.del_timer(&readd_timer);
+    heap.del_timer(&later);
+    CHECK(heap.empty(), "heap not empty after deleting the embedded timers");
+}
+
+#endif
+
+int main()
+{
+    for(int i = 0; i < CLIENTS; ++i)
+    {
+        memset(&clients[i], 0, sizeof(clients[i]));
+        clients[i].sockfd = i;
+    }
+    check_slab();
+    check_timers();
+    if(failed)
+    {
+        fprintf(stderr, "timer-check(%s): %d checks failed\n", kind, failed);
+        return 1;
+    }
+    fprintf(stderr, "timer-check(%s): passed\n", kind);
+    return 0;
+}
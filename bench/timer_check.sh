@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# 定时器检查
+#     timer_check_list/wheel/heap: timer_slab的节点复用 嵌入的定时器节点 三种定时器的增删和到期顺序
+#     server的空闲超时: idle_timeout秒没有请求的连接被关闭 期间一直有请求的keep-alive连接不受影响
+#         空闲连接应在idle_timeout + 2秒内收到FIN /metrics中的tws_idle_timeouts_total为1
+# 用法: bench/timer_check.sh
+#
+# 环境变量: TIMER_PORT(默认9398) TIMER_ADMIN_PORT(默认9399) TIMER_IDLE(默认2)
+
+set -u
+
+cd "$(dirname "$0")/.."
+
+port=${TIMER_PORT:-9398}
+admin_port=${TIMER_ADMIN_PORT:-9399}
+idle=${TIMER_IDLE:-2}
+
+for bin in server timer_check_list timer_check_wheel timer_check_heap; do
+    if [ ! -x ./$bin ]; then
+        echo "timer-check: build $bin first (make timer-check)" >&2
+        exit 2
+    fi
+done
+
+failed=0
+fail()
+{
+    echo "timer-check: $1" >&2
+    failed=$((failed + 1))
+}
+
+# 定时器自身的调试输出不关心
+for kind in list wheel heap; do
+    if ! ./timer_check_$kind > /dev/null; then
+        fail "$kind timer checks failed"
+    fi
+done
+
+fixture=$(mktemp -d)
+server_pid=
+cleanup()
+{
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null
+        wait "$server_pid" 2>/dev/null
+    fi
+    rm -rf "$fixture"
+}
+trap cleanup EXIT
+
+wait_port()
+{
+    for i in $(seq 50); do
+        if (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+echo hello > "$fixture/index.html"
+./server --doc_root="$fixture" --idle_timeout="$idle" --admin_port="$admin_port" 127.0.0.1 "$port" > "$fixture/server.log" 2>&1 &
+server_pid=$!
+if ! wait_port "$port" || ! wait_port "$admin_port"; then
+    echo "timer-check: server failed to start" >&2
+    cat "$fixture/server.log" >&2
+    exit 2
+fi
+
+request='GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n'
+
+# 3号描述符上的连接不发请求 4号描述符上的连接每秒一个请求 持续超过idle_timeout
+exec 3<>/dev/tcp/127.0.0.1/"$port"
+exec 4<>/dev/tcp/127.0.0.1/"$port"
+start=$SECONDS
+for i in $(seq $((idle + 2))); do
+    printf "$request" >&4
+    sleep 1
+done
+# 空闲连接已经或即将被关闭 cat读到EOF后退出 超时说明连接没有关闭
+if ! timeout 3 cat <&3 > /dev/null; then
+    fail "idle connection still open after $((SECONDS - start))s with idle_timeout=$idle"
+fi
+exec 3<&-
+printf "$request" >&4
+answered=$(timeout 2 cat <&4 | grep -c '^HTTP/1.1 200')
+exec 4<&-
+if [ "$answered" != $((idle + 3)) ]; then
+    fail "busy keep-alive connection answered $answered of $((idle + 3)) requests"
+fi
+
+timeouts=$(curl -s "http://127.0.0.1:$admin_port/metrics" | awk '$1 == "tws_idle_timeouts_total" { print $2 }')
+if [ "$timeouts" != 1 ]; then
+    fail "tws_idle_timeouts_total is '$timeouts', expected 1"
+fi
+echo "idle_timeout=$idle: idle connection closed, busy connection kept"
+
+if [ "$failed" -gt 0 ]; then
+    echo "timer-check: $failed checks failed" >&2
+    exit 1
+fi
+echo "timer-check: passed"
@@ -0,0 +1,232 @@
+/*
+静态文件发送方式基准测试：mmap+writev 对比 sendfile
+    在回环TCP连接上模拟http_conn对一个文件请求的完整发送过程
+    mmap模式:     stat + open + mmap + close + writev(响应头, 映射区) + munmap
+    sendfile模式: stat + open + send(响应头, MSG_MORE) + sendfile + close
+    对端由一个线程不断recv丢弃数据
+用法: ./transmit_bench [small_iters medium_iters huge_iters]
+*/
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<sys/uio.h>
+#include<sys/sendfile.h>
+#include<sys/resource.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+
+static const char* header = "HTTP/1.1 200 OK\r\nContent-Length: 0000000000\r\nConnection: keep-alive\r\n\r\n";
+
+/*对端线程 持续读取并丢弃收到的数据 直到连接关闭*/
+static void* drain(void* arg)
+{
+    int fd = *(int*)arg;
+    static char buf[256 * 1024];
+    while(recv(fd, buf, sizeof(buf), 0) > 0)
+    {}
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_sys()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static bool send_mmap(int sockfd, const char* path)
+{
+    struct stat st;
+    if(stat(path, &st) < 0)
+    {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    char* addr = (char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED)
+    {
+        return false;
+    }
+    struct iovec iv[2];
+    iv[0].iov_base = (void*)header;
+    iv[0].iov_len = strlen(header);
+    iv[1].iov_base = addr;
+    iv[1].iov_len = st.st_size;
+    int idx = 0;
+    while(idx < 2)
+    {
+        ssize_t n = writev(sockfd, iv + idx, 2 - idx);
+        if(n < 0)
+        {
+            munmap(addr, st.st_size);
+            return false;
+        }
+        while(idx < 2 && (size_t)n >= iv[idx].iov_len)
+        {
+            n -= iv[idx].iov_len;
+            ++idx;
+        }
+        if(idx < 2)
+        {
+            iv[idx].iov_base = (char*)iv[idx].iov_base + n;
+            iv[idx].iov_len -= n;
+        }
+    }
+    munmap(addr, st.st_size);
+    return true;
+}
+
+static bool send_file(int sockfd, const char* path)
+{
+    struct stat st;
+    if(stat(path, &st) < 0)
+    {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return false;
+    }
+    size_t len = strlen(header);
+    size_t sent = 0;
+    while(sent < len)
+    {
+        ssize_t n = send(sockfd, header + sent, len - sent, MSG_MORE);
+        if(n < 0)
+        {
+            close(fd);
+            return false;
+        }
+        sent += n;
+    }
+    off_t offset = 0;
+    while(offset < st.st_size)
+    {
+        if(sendfile(sockfd, fd, &offset, st.st_size - offset) <= 0)
+        {
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+/*生成指定大小的测试文件*/
+static void make_file(const char* path, long size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, size) < 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    char buf[4096];
+    memset(buf, 'x', sizeof(buf));
+    for(long off = 0; off < size; off += sizeof(buf))
+    {
+        long n = (size - off) < (long)sizeof(buf) ? (size - off) : (long)sizeof(buf);
+        if(pwrite(fd, buf, n, off) != n)
+        {
+            perror(path);
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+static void run(int sockfd, const char* name, const char* path, long size, int iters, bool use_sendfile)
+{
+    /*预热页缓存*/
+    use_sendfile ? send_file(sockfd, path) : send_mmap(sockfd, path);
+    double sys0 = cpu_sys();
+    double t0 = now();
+    for(int i = 0; i < iters; ++i)
+    {
+        bool ok = use_sendfile ? send_file(sockfd, path) : send_mmap(sockfd, path);
+        if(!ok)
+        {
+            perror(name);
+            exit(1);
+        }
+    }
+    double elapsed = now() - t0;
+    double sys = cpu_sys() - sys0;
+    printf("%-8s %-9s %10ld %8d %12.0f %10.1f %10.2f\n", name, use_sendfile ? "sendfile" : "mmap",
+            size, iters, iters / elapsed, (double)size * iters / elapsed / (1 << 20), sys * 1e6 / iters);
+}
+
+int main(int argc, char* argv[])
+{
+    int iters[3] = {20000, 2000, 20};
+    for(int i = 0; i < 3 && i + 1 < argc; ++i)
+    {
+        iters[i] = atoi(argv[i + 1]);
+    }
+
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(address);
+    if(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listenfd, 1) < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    getsockname(listenfd, (struct sockaddr*)&address, &addrlen);
+    int sockfd = socket(PF_INET, SOCK_STREAM, 0);
+    if(connect(sockfd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        perror("connect");
+        return 1;
+    }
+    int peerfd = accept(listenfd, NULL, NULL);
+    pthread_t tid;
+    pthread_create(&tid, NULL, drain, &peerfd);
+
+    char dir[] = "/tmp/transmit_benchXXXXXX";
+    if(!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    const char* names[3] = {"small", "medium", "huge"};
+    long sizes[3] = {4 * 1024, 256 * 1024, 64L * 1024 * 1024};
+    char paths[3][64];
+
+    printf("%-8s %-9s %10s %8s %12s %10s %10s\n", "file", "mode", "bytes", "iters", "req/s", "MB/s", "sys_us/req");
+    for(int i = 0; i < 3; ++i)
+    {
+        snprintf(paths[i], sizeof(paths[i]), "%s/%s", dir, names[i]);
+        make_file(paths[i], sizes[i]);
+        run(sockfd, names[i], paths[i], sizes[i], iters[i], false);
+        run(sockfd, names[i], paths[i], sizes[i], iters[i], true);
+        unlink(paths[i]);
+    }
+    rmdir(dir);
+
+    close(sockfd);
+    pthread_join(tid, NULL);
+    close(peerfd);
+    close(listenfd);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef _CACHEKEY_H_
+#define _CACHEKEY_H_
+
+#include<stddef.h>
+#include<stdint.h>
+#include<cstring>
+#include<string>
+
+/*
+缓存表的键：路径字节的视图 加上区分同一路径不同版本的tag
+    查找时指向调用者的内存(m_real_file或请求arena) 不构造std::string 不分配内存
+    存入表中时指向缓存项自己保存的路径
+*/
+struct cache_key{
+    const char* data;
+    size_t len;
+    uint64_t tag;
+
+    cache_key(const char* d, size_t l, uint64_t t = 0) : data(d), len(l), tag(t) {}
+    explicit cache_key(const std::string& s, uint64_t t = 0) : data(s.data()), len(s.size()), tag(t) {}
+};
+
+/*FNV-1a*/
+struct cache_key_hash{
+    size_t operator()(const cache_key& key) const
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for(size_t i = 0; i < key.len; ++i)
+        {
+            h ^= (unsigned char)key.data[i];
+            h *= 1099511628211ULL;
+        }
+        h ^= key.tag;
+        h *= 1099511628211ULL;
+        return h;
+    }
+};
+
+struct cache_key_equal{
+    bool operator()(const cache_key& a, const cache_key& b) const
+    {
+        return a.len == b.len && a.tag == b.tag && memcmp(a.data, b.data, a.len) == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include"compress_cache.h"
+#include"../metrics/metrics.h"
+
+#include<unistd.h>
+#include<stdio.h>
+#include<cstring>
+#include<cstdlib>
+#include<vector>
+#include<zlib.h>
+
+/*小于该大小的文件压缩收益抵不上Content-Encoding等额外头部*/
+static const long MIN_COMPRESS_SIZE = 256;
+
+static const char* compressible_types[] = {
+    ".html", ".htm", ".css", ".js", ".mjs", ".json", ".txt", ".xml", ".svg", ".csv", ".md", ".map", nullptr
+};
+
+bool compress_cache::compressible(const char* path)
+{
+    const char* ext = strrchr(path, '.');
+    if(!ext || strchr(ext, '/'))
+    {
+        return false;
+    }
+    for(int i = 0; compressible_types[i]; ++i)
+    {
+        if(strcasecmp(ext, compressible_types[i]) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+compress_cache::compress_cache(long max_bytes, long max_file_size)
+: m_max_bytes(max_bytes), m_max_file_size(max_file_size), m_bytes(0), m_head(nullptr), m_tail(nullptr)
+{
+}
+
+compress_cache::~compress_cache()
+{
+    while(m_head)
+    {
+        compress_entry* entry = m_head;
+        m_head = entry->next;
+        destroy_entry(entry);
+    }
+}
+
+void compress_cache::lru_unlink(compress_entry* entry)
+{
+    if(entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        m_head = entry->next;
+    }
+    if(entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        m_tail = entry->prev;
+    }
+    entry->prev = nullptr;
+    entry->next = nullptr;
+}
+
+void compress_cache::lru_push_front(compress_entry* entry)
+{
+    entry->prev = nullptr;
+    entry->next = m_head;
+    if(m_head)
+    {
+        m_head->prev = entry;
+    }
+    m_head = entry;
+    if(!m_tail)
+    {
+        m_tail = entry;
+    }
+}
+
+void compress_cache::destroy_entry(compress_entry* entry)
+{
+    free(entry->data);
+    delete entry;
+}
+
+/*在锁外执行gzip压缩 结果没有小于原文件的90%时视为不值得压缩*/
+compress_entry* compress_cache::compress(const file_entry* file, uint64_t tag)
+{
+    size_t size = file->st.st_size;
+    const char* src = file->address;
+    char* buf = nullptr;
+    if(!src)
+    {
+        buf = (char*)malloc(size);
+        if(!buf)
+        {
+            return nullptr;
+        }
+        size_t done = 0;
+        while(done < size)
+        {
+            ssize_t n = pread(file->fd, buf + done, size - done, done);
+            if(n <= 0)
+            {
+                free(buf);
+                return nullptr;
+            }
+            done += n;
+        }
+        src = buf;
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    /*windowBits加16表示输出gzip格式*/
+    if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(buf);
+        return nullptr;
+    }
+    size_t bound = deflateBound(&zs, size);
+    char* out = (char*)malloc(bound);
+    int ret = Z_STREAM_ERROR;
+    if(out)
+    {
+        zs.next_in = (Bytef*)src;
+        zs.avail_in = size;
+        zs.next_out = (Bytef*)out;
+        zs.avail_out = bound;
+        ret = deflate(&zs, Z_FINISH);
+    }
+    size_t len = zs.total_out;
+    deflateEnd(&zs);
+    free(buf);
+
+    compress_entry* entry = new compress_entry;
+    entry->path = file->path;
+    entry->tag = tag;
+    entry->data = nullptr;
+    entry->len = 0;
+    if(ret == Z_STREAM_END && len < size / 10 * 9)
+    {
+        entry->data = (char*)realloc(out, len);
+        entry->len = len;
+    }
+    else
+    {
+        free(out);
+    }
+    /*在原ETag的引号内追加编码后缀*/
+    snprintf(entry->etag, sizeof(entry->etag), "%.*s-gzip\"", (int)strlen(file->etag) - 1, file->etag);
+    entry->refcount = 0;
+    entry->cached = false;
+    entry->prev = nullptr;
+    entry->next = nullptr;
+    return entry;
+}
+
+compress_entry* compress_cache::acquire(const file_entry* file)
+{
+    if(m_max_bytes <= 0 || file->st.st_size < MIN_COMPRESS_SIZE || file->st.st_size > m_max_file_size)
+    {
+        return nullptr;
+    }
+    uint64_t tag = (uint64_t)file->st.st_mtim.tv_sec * 1000000000ULL + file->st.st_mtim.tv_nsec;
+    cache_key key(file->path, tag);
+
+    m_mutex.lock();
+    std::unordered_map<cache_key, compress_entry*, cache_key_hash, cache_key_equal>::iterator it = m_table.find(key);
+    if(it != m_table.end())
+    {
+        compress_entry* hit = it->second;
+        lru_unlink(hit);
+        lru_push_front(hit);
+        if(!hit->data)
+        {
+            m_mutex.unlock();
+            metrics::add(COMPRESS_CACHE_HITS);
+            return nullptr;
+        }
+        hit->refcount++;
+        m_mutex.unlock();
+        metrics::add(COMPRESS_CACHE_HITS);
+        return hit;
+    }
+    m_mutex.unlock();
+    metrics::add(COMPRESS_CACHE_MISSES);
+
+    compress_entry* fresh = compress(file, tag);
+    if(!fresh)
+    {
+        return nullptr;
+    }
+    long cost = fresh->len + fresh->path.size() + sizeof(compress_entry);
+
+    std::vector<compress_entry*> victims;
+    m_mutex.lock();
+    it = m_table.find(key);
+    if(it != m_table.end())
+    {
+        /*其他线程已经完成了同一个文件的压缩*/
+        destroy_entry(fresh);
+        fresh = it->second;
+        if(!fresh->data)
+        {
+            m_mutex.unlock();
+            return nullptr;
+        }
+        fresh->refcount++;
+        m_mutex.unlock();
+        return fresh;
+    }
+    if(cost > m_max_bytes)
+    {
+        m_mutex.unlock();
+        if(!fresh->data)
+        {
+            destroy_entry(fresh);
+            return nullptr;
+        }
+        fresh->refcount = 1;
+        return fresh;
+    }
+    fresh->cached = true;
+    fresh->refcount = 1;    /*缓存表持有的引用*/
+    m_table[cache_key(fresh->path, fresh->tag)] = fresh;
+    lru_push_front(fresh);
+    m_bytes += cost;
+    evict(fresh, victims);
+    compress_entry* result = nullptr;
+    if(fresh->data)
+    {
+        fresh->refcount++;
+        result = fresh;
+    }
+    m_mutex.unlock();
+
+    for(size_t i = 0; i < victims.size(); ++i)
+    {
+        destroy_entry(victims[i]);
+    }
+    return result;
+}
+
+void compress_cache::evict(compress_entry* keep, std::vector<compress_entry*>& victims)
+{
+    while(m_bytes > m_max_bytes && m_tail && m_tail != keep)
+    {
+        compress_entry* victim = m_tail;
+        lru_unlink(victim);
+        m_table.erase(cache_key(victim->path, victim->tag));
+        m_bytes -= victim->len + victim->path.size() + sizeof(compress_entry);
+        victim->cached = false;
+        if(--victim->refcount == 0)
+        {
+            victims.push_back(victim);
+        }
+    }
+}
+
+void compress_cache::resize(long max_bytes)
+{
+    std::vector<compress_entry*> victims;
+    m_mutex.lock();
+    m_max_bytes = max_bytes < 0 ? 0 : max_bytes;
+    evict(nullptr, victims);
+    m_mutex.unlock();
+    for(size_t i = 0; i < victims.size(); ++i)
+    {
+        destroy_entry(victims[i]);
+    }
+}
+
+void compress_cache::release(compress_entry* entry)
+{
+    if(!entry)
+    {
+        return;
+    }
+    m_mutex.lock();
+    bool dead = (--entry->refcount == 0);
+    m_mutex.unlock();
+    if(dead)
+    {
+        destroy_entry(entry);
+    }
+}
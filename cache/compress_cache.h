@@ -0,0 +1,71 @@
+#ifndef _COMPRESSCACHE_H_
+#define _COMPRESSCACHE_H_
+
+#include<sys/types.h>
+#include<string>
+#include<unordered_map>
+#include<vector>
+#include<atomic>
+
+#include"../lock/myLock.h"
+#include"file_cache.h"
+#include"cache_key.h"
+
+/*
+压缩结果缓存项：键为(路径, mtime, 编码) 目前只有gzip一种编码 tag即为纳秒精度的mtime
+    文件被修改后mtime变化 旧的缓存项不会再被命中 由LRU自然淘汰
+    压缩后没有明显变小的文件也记录一个data为nullptr的缓存项 避免反复尝试压缩
+*/
+struct compress_entry{
+    std::string path;
+    uint64_t tag;
+    char* data;     /*压缩后的内容*/
+    size_t len;
+    char etag[64];  /*与未压缩版本区分的ETag*/
+    int refcount;   /*由缓存的互斥锁保护*/
+    bool cached;
+    compress_entry* prev;
+    compress_entry* next;
+};
+
+/*
+在线gzip压缩结果的缓存：
+    没有.gz/.br预压缩文件的文本类资源只压缩一次 之后直接发送内存中的压缩结果
+    按占用字节数限制容量 超出时按LRU淘汰
+*/
+class compress_cache{
+public:
+    /*max_bytes为0时禁用在线压缩 超过max_file_size字节的文件不压缩*/
+    compress_cache(long max_bytes, long max_file_size);
+    ~compress_cache();
+
+    /*获取file的gzip压缩结果并增加引用计数 不值得压缩或压缩失败时返回nullptr*/
+    compress_entry* acquire(const file_entry* file);
+    void release(compress_entry* entry);
+
+    /*运行中调整容量 超出的压缩结果立即按LRU淘汰 为0时停止在线压缩*/
+    void resize(long max_bytes);
+
+    /*根据扩展名判断是否为值得压缩的文本类资源*/
+    static bool compressible(const char* path);
+
+private:
+    compress_entry* compress(const file_entry* file, uint64_t tag);
+    void lru_unlink(compress_entry* entry);
+    void lru_push_front(compress_entry* entry);
+    void destroy_entry(compress_entry* entry);
+    /*需持有m_mutex 淘汰LRU尾部直到不超过容量 keep不淘汰 引用计数归零的放入victims*/
+    void evict(compress_entry* keep, std::vector<compress_entry*>& victims);
+
+private:
+    /*重新加载配置时由主线程修改*/
+    std::atomic<long> m_max_bytes;
+    long m_max_file_size;
+    long m_bytes;
+    myMutex m_mutex;
+    std::unordered_map<cache_key, compress_entry*, cache_key_hash, cache_key_equal> m_table;
+    compress_entry* m_head;
+    compress_entry* m_tail;
+};
+
+#endif
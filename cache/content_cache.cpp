@@ -0,0 +1,384 @@
+#include"content_cache.h"
+#include"../metrics/metrics.h"
+
+#include<unistd.h>
+#include<stdio.h>
+#include<cstring>
+#include<sys/mman.h>
+
+content_cache::content_cache(long max_bytes, long max_body)
+: m_max_bytes(max_bytes), m_max_body(max_body), m_arena_bytes(0), m_generation(0), m_samples(0)
+{
+    for(int i = 0; i < CLASS_NUMBER; ++i)
+    {
+        m_classes[i].free_list = nullptr;
+        m_classes[i].head = nullptr;
+        m_classes[i].tail = nullptr;
+    }
+    m_sketch = new uint8_t[SKETCH_DEPTH * SKETCH_WIDTH];
+    memset(m_sketch, 0, SKETCH_DEPTH * SKETCH_WIDTH);
+}
+
+content_cache::~content_cache()
+{
+    for(int i = 0; i < CLASS_NUMBER; ++i)
+    {
+        while(m_classes[i].head)
+        {
+            content_entry* entry = m_classes[i].head;
+            m_classes[i].head = entry->next;
+            delete entry;
+        }
+    }
+    for(size_t i = 0; i < m_chunks.size(); ++i)
+    {
+        munmap(m_chunks[i], CHUNK_SIZE);
+    }
+    delete [] m_sketch;
+}
+
+int content_cache::class_of(size_t len) const
+{
+    for(int i = 0; i < CLASS_NUMBER; ++i)
+    {
+        if(len <= ((size_t)1 << (MIN_CLASS_SHIFT + i)))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*从系统申请一个2MB块 切分为cls类别的slot*/
+bool content_cache::grow(int cls)
+{
+    if(m_arena_bytes + CHUNK_SIZE > m_max_bytes)
+    {
+        return false;
+    }
+    char* chunk = (char*)mmap(0, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(chunk == MAP_FAILED)
+    {
+        /*没有预留的大页 申请两倍大小后裁剪出2MB对齐的部分 交给透明大页*/
+        char* raw = (char*)mmap(0, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(raw == MAP_FAILED)
+        {
+            return false;
+        }
+        chunk = (char*)(((uintptr_t)raw + CHUNK_SIZE - 1) & ~(uintptr_t)(CHUNK_SIZE - 1));
+        if(chunk > raw)
+        {
+            munmap(raw, chunk - raw);
+        }
+        munmap(chunk + CHUNK_SIZE, raw + CHUNK_SIZE - chunk);
+        madvise(chunk, CHUNK_SIZE, MADV_HUGEPAGE);
+    }
+    /*常驻内存 超出RLIMIT_MEMLOCK时失败也不影响使用*/
+    mlock(chunk, CHUNK_SIZE);
+    m_chunks.push_back(chunk);
+    m_arena_bytes += CHUNK_SIZE;
+
+    size_t size = (size_t)1 << (MIN_CLASS_SHIFT + cls);
+    for(size_t offset = 0; offset + size <= (size_t)CHUNK_SIZE; offset += size)
+    {
+        free_slot(cls, chunk + offset);
+    }
+    return true;
+}
+
+char* content_cache::alloc_slot(int cls)
+{
+    slab_class& c = m_classes[cls];
+    if(!c.free_list && !grow(cls))
+    {
+        return nullptr;
+    }
+    char* slot = c.free_list;
+    memcpy(&c.free_list, slot, sizeof(char*));
+    return slot;
+}
+
+void content_cache::free_slot(int cls, char* slot)
+{
+    slab_class& c = m_classes[cls];
+    memcpy(slot, &c.free_list, sizeof(char*));
+    c.free_list = slot;
+}
+
+void content_cache::lru_unlink(content_entry* entry)
+{
+    slab_class& c = m_classes[entry->cls];
+    if(entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        c.head = entry->next;
+    }
+    if(entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        c.tail = entry->prev;
+    }
+    entry->prev = nullptr;
+    entry->next = nullptr;
+}
+
+void content_cache::lru_push_front(content_entry* entry)
+{
+    slab_class& c = m_classes[entry->cls];
+    entry->prev = nullptr;
+    entry->next = c.head;
+    if(c.head)
+    {
+        c.head->prev = entry;
+    }
+    c.head = entry;
+    if(!c.tail)
+    {
+        c.tail = entry;
+    }
+}
+
+/*将entry移出缓存表 返回true表示已没有连接在发送它*/
+bool content_cache::detach(content_entry* entry)
+{
+    m_table.erase(cache_key(entry->path, entry->variant));
+    lru_unlink(entry);
+    entry->cached = false;
+    return --entry->refcount == 0;
+}
+
+void content_cache::destroy_entry(content_entry* entry)
+{
+    free_slot(entry->cls, entry->data);
+    delete entry;
+}
+
+static inline uint32_t sketch_index(size_t hash, int row, int width)
+{
+    uint64_t x = hash + (uint64_t)(row + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x & (width - 1);
+}
+
+/*Count-Min Sketch估计的近期访问次数 取各行计数器的最小值*/
+int content_cache::frequency(const cache_key& key) const
+{
+    size_t hash = cache_key_hash()(key);
+    int freq = 255;
+    for(int i = 0; i < SKETCH_DEPTH; ++i)
+    {
+        int count = m_sketch[i * SKETCH_WIDTH + sketch_index(hash, i, SKETCH_WIDTH)];
+        if(count < freq)
+        {
+            freq = count;
+        }
+    }
+    return freq;
+}
+
+/*记录一次访问 计数器饱和于15 每记录10倍宽度次访问后全部减半 使频率反映近期热度*/
+void content_cache::record(const cache_key& key)
+{
+    size_t hash = cache_key_hash()(key);
+    for(int i = 0; i < SKETCH_DEPTH; ++i)
+    {
+        uint8_t& count = m_sketch[i * SKETCH_WIDTH + sketch_index(hash, i, SKETCH_WIDTH)];
+        if(count < 15)
+        {
+            count++;
+        }
+    }
+    if(++m_samples >= SKETCH_WIDTH * 10)
+    {
+        for(int i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; ++i)
+        {
+            m_sketch[i] >>= 1;
+        }
+        m_samples = 0;
+    }
+}
+
+content_entry* content_cache::lookup(const char* path, size_t path_len, int variant, uint64_t* generation)
+{
+    if(m_max_bytes <= 0)
+    {
+        return nullptr;
+    }
+    cache_key key(path, path_len, variant);
+    m_mutex.lock();
+    record(key);
+    *generation = m_generation;
+    content_entry* hit = nullptr;
+    std::unordered_map<cache_key, content_entry*, cache_key_hash, cache_key_equal>::iterator it = m_table.find(key);
+    if(it != m_table.end())
+    {
+        hit = it->second;
+        lru_unlink(hit);
+        lru_push_front(hit);
+        hit->refcount++;
+    }
+    m_mutex.unlock();
+    metrics::add(hit ? CONTENT_CACHE_HITS : CONTENT_CACHE_MISSES);
+    return hit;
+}
+
+void content_cache::admit(const char* path, size_t path_len, int variant, uint64_t generation, const char* head, int head_len,
+        const char* body, int fd, size_t body_len, const char* etag)
+{
+    if(m_max_bytes <= 0 || (long)body_len > m_max_body)
+    {
+        return;
+    }
+    size_t len = head_len + 2 + body_len;
+    int cls = class_of(len);
+    if(cls < 0)
+    {
+        return;
+    }
+    cache_key key(path, path_len, variant);
+
+    m_mutex.lock();
+    int freq = frequency(key);
+    if(generation != m_generation || m_table.count(key) || freq < ADMIT_MIN)
+    {
+        m_mutex.unlock();
+        return;
+    }
+    char* slot = alloc_slot(cls);
+    if(!slot)
+    {
+        /*TinyLFU: 候选者比该类别中最久未使用的缓存项更热时才替换它*/
+        content_entry* victim = m_classes[cls].tail;
+        if(!victim || frequency(cache_key(victim->path, victim->variant)) >= freq)
+        {
+            m_mutex.unlock();
+            return;
+        }
+        if(detach(victim))
+        {
+            destroy_entry(victim);
+        }
+        slot = alloc_slot(cls);
+        if(!slot)
+        {
+            m_mutex.unlock();
+            return;
+        }
+    }
+    m_mutex.unlock();
+
+    /*在锁外填充响应字节*/
+    memcpy(slot, head, head_len);
+    memcpy(slot + head_len, "\r\n", 2);
+    char* dst = slot + head_len + 2;
+    if(body)
+    {
+        memcpy(dst, body, body_len);
+    }
+    else
+    {
+        size_t done = 0;
+        while(done < body_len)
+        {
+            ssize_t n = pread(fd, dst + done, body_len - done, done);
+            if(n <= 0)
+            {
+                m_mutex.lock();
+                free_slot(cls, slot);
+                m_mutex.unlock();
+                return;
+            }
+            done += n;
+        }
+    }
+
+    content_entry* entry = new content_entry;
+    entry->path.assign(path, path_len);
+    entry->variant = variant;
+    entry->data = slot;
+    entry->head_len = head_len;
+    entry->len = len;
+    snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+    entry->cls = cls;
+    entry->refcount = 1;    /*缓存表持有的引用*/
+    entry->cached = true;
+    entry->prev = nullptr;
+    entry->next = nullptr;
+
+    m_mutex.lock();
+    /*填充期间文件发生了变化或其他线程已准入同一内容*/
+    if(generation != m_generation || m_table.count(key))
+    {
+        destroy_entry(entry);
+        m_mutex.unlock();
+        return;
+    }
+    m_table[cache_key(entry->path, entry->variant)] = entry;
+    lru_push_front(entry);
+    m_mutex.unlock();
+}
+
+void content_cache::release(content_entry* entry)
+{
+    if(!entry)
+    {
+        return;
+    }
+    m_mutex.lock();
+    if(--entry->refcount == 0)
+    {
+        destroy_entry(entry);
+    }
+    m_mutex.unlock();
+}
+
+void content_cache::invalidate(const std::string& path)
+{
+    m_mutex.lock();
+    m_generation++;
+    if(path.empty())
+    {
+        for(int i = 0; i < CLASS_NUMBER; ++i)
+        {
+            while(m_classes[i].head)
+            {
+                content_entry* entry = m_classes[i].head;
+                if(detach(entry))
+                {
+                    destroy_entry(entry);
+                }
+            }
+        }
+    }
+    else
+    {
+        for(int variant = 0; variant < VARIANT_NUMBER; ++variant)
+        {
+            std::unordered_map<cache_key, content_entry*, cache_key_hash, cache_key_equal>::iterator it
+                    = m_table.find(cache_key(path, variant));
+            if(it == m_table.end())
+            {
+                continue;
+            }
+            content_entry* entry = it->second;
+            if(detach(entry))
+            {
+                destroy_entry(entry);
+            }
+        }
+    }
+    m_mutex.unlock();
+}
+
+void content_cache::invalidate_hook(const std::string& path, void* arg)
+{
+    static_cast<content_cache*>(arg)->invalidate(path);
+}
@@ -0,0 +1,108 @@
+#ifndef _CONTENTCACHE_H_
+#define _CONTENTCACHE_H_
+
+#include<sys/types.h>
+#include<stdint.h>
+#include<string>
+#include<unordered_map>
+#include<vector>
+#include<atomic>
+
+#include"../lock/myLock.h"
+#include"cache_key.h"
+
+/*
+内存内容缓存项：小文件的完整响应字节
+    data = 响应头(状态行...Content-Length) + 空行 + 消息体 连续存放在大页arena中
+    Date和Connection头部随时间和连接变化 发送时插入在响应头和空行之间 一次writev发出
+*/
+struct content_entry{
+    std::string path;   /*键为(path, variant) variant为客户端可接受的编码*/
+    int variant;
+    char* data;
+    int head_len;       /*data中空行之前的部分*/
+    size_t len;         /*data的总长度*/
+    char etag[64];
+    int cls;            /*所属的slab大小类别*/
+    int refcount;       /*由缓存的互斥锁保护*/
+    bool cached;
+    content_entry* prev;    /*同一大小类别内的LRU链表*/
+    content_entry* next;
+};
+
+/*
+小文件内存内容缓存：
+    arena按2MB大页分配(MAP_HUGETLB 失败时退回透明大页) 并尽量mlock常驻内存
+    每个2MB块切分为同一大小类别的slot 各类别有自己的空闲链表和LRU链表(slab分配)
+    准入采用TinyLFU: Count-Min Sketch记录近期访问频率 周期性减半老化
+        有空闲slot时访问次数达到ADMIT_MIN才准入
+        需要淘汰时只有候选者频率高于被淘汰者才准入 避免一次性访问冲掉热点
+    文件变化由file_cache的inotify通知 每次失效都推进m_generation 拒绝失效前读取的内容准入
+*/
+class content_cache{
+public:
+    /*max_bytes为0时禁用 消息体超过max_body字节的文件不缓存*/
+    content_cache(long max_bytes, long max_body);
+    ~content_cache();
+
+    /*查找(path, variant)对应的完整响应 命中时增加引用计数 同时记录一次访问*/
+    content_entry* lookup(const char* path, size_t path_len, int variant, uint64_t* generation);
+    /*尝试准入 generation为lookup时得到的值; body为nullptr时从fd读取消息体*/
+    void admit(const char* path, size_t path_len, int variant, uint64_t generation, const char* head, int head_len,
+            const char* body, int fd, size_t body_len, const char* etag);
+    void release(content_entry* entry);
+
+    /*使path的所有编码版本失效 path为空时全部失效*/
+    void invalidate(const std::string& path);
+    /*供file_cache调用的失效通知*/
+    static void invalidate_hook(const std::string& path, void* arg);
+
+    long max_body() const { return m_max_body; }
+    /*运行中调整arena的上限 只影响之后arena的增长 已分配的2MB块不归还 为0时停止查找和准入*/
+    void resize(long max_bytes) { m_max_bytes = max_bytes < 0 ? 0 : max_bytes; }
+
+private:
+    /*slab大小类别: 1KB 2KB ... 128KB*/
+    static const int MIN_CLASS_SHIFT = 10;
+    static const int CLASS_NUMBER = 8;
+    static const long CHUNK_SIZE = 2 * 1024 * 1024;
+    /*Count-Min Sketch*/
+    static const int SKETCH_DEPTH = 4;
+    static const int SKETCH_WIDTH = 1 << 14;
+    static const int ADMIT_MIN = 2;
+    /*variant的取值个数 即http_conn::m_accept_encoding的取值个数*/
+    static const int VARIANT_NUMBER = 4;
+
+    struct slab_class{
+        char* free_list;        /*空闲slot链表 slot的前8字节存放下一个空闲slot*/
+        content_entry* head;    /*LRU链表头 最近使用*/
+        content_entry* tail;
+    };
+
+    int class_of(size_t len) const;
+    char* alloc_slot(int cls);
+    void free_slot(int cls, char* slot);
+    bool grow(int cls);
+    /*以下函数需持有m_mutex*/
+    void lru_unlink(content_entry* entry);
+    void lru_push_front(content_entry* entry);
+    bool detach(content_entry* entry);
+    void destroy_entry(content_entry* entry);
+    int frequency(const cache_key& key) const;
+    void record(const cache_key& key);
+
+private:
+    /*重新加载配置时由主线程修改*/
+    std::atomic<long> m_max_bytes;
+    long m_max_body;
+    long m_arena_bytes;     /*已分配的arena字节数*/
+    uint64_t m_generation;
+    myMutex m_mutex;
+    std::unordered_map<cache_key, content_entry*, cache_key_hash, cache_key_equal> m_table;
+    slab_class m_classes[CLASS_NUMBER];
+    std::vector<char*> m_chunks;
+    uint8_t* m_sketch;      /*SKETCH_DEPTH行 每行SKETCH_WIDTH个计数器*/
+    int m_samples;          /*自上次老化以来记录的访问次数*/
+};
+
+#endif
@@ -0,0 +1,546 @@
+#include"file_cache.h"
+#include"compress_cache.h"
+#include"../metrics/metrics.h"
+
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<time.h>
+#include<stdio.h>
+#include<cstring>
+#include<sys/mman.h>
+#include<sys/inotify.h>
+#include<vector>
+
+/*引起缓存项失效的inotify事件*/
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM
+                                    | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+/*只缓存规范路径 否则同一个文件会以不同的键出现 inotify事件无法对应到缓存项*/
+static bool canonical(const char* path)
+{
+    return strstr(path, "//") == nullptr && strstr(path, "/./") == nullptr && strstr(path, "/../") == nullptr;
+}
+
+file_cache::file_cache(const char* root, int max_entries, long max_bytes, long map_limit)
+: m_map_limit(map_limit), m_generation(0), m_hook(nullptr), m_hook_arg(nullptr), m_inotify_fd(-1)
+{
+    m_enabled = max_entries > 0 && max_bytes > 0;
+    m_shard_entries = (max_entries + SHARD_NUMBER - 1) / SHARD_NUMBER;
+    m_shard_bytes = (max_bytes + SHARD_NUMBER - 1) / SHARD_NUMBER;
+    for(int i = 0; i < SHARD_NUMBER; ++i)
+    {
+        m_shards[i].head = nullptr;
+        m_shards[i].tail = nullptr;
+        m_shards[i].entries = 0;
+        m_shards[i].bytes = 0;
+    }
+    if(m_enabled)
+    {
+        m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        /*没有inotify就无法得知文件变化 此时宁可不缓存*/
+        if(m_inotify_fd < 0)
+        {
+            printf("inotify_init1 failed, file cache disabled\n");
+            m_enabled = false;
+        }
+        else
+        {
+            watch_dir(std::string(root) + "/");
+        }
+    }
+}
+
+file_cache::~file_cache()
+{
+    clear();
+    if(m_inotify_fd != -1)
+    {
+        close(m_inotify_fd);
+    }
+}
+
+/*path存在不旧于原文件的预压缩文件path+suffix*/
+static bool has_sidecar(const char* path, const char* suffix, const struct stat& origin)
+{
+    std::string sidecar = std::string(path) + suffix;
+    struct stat st;
+    metrics::add(SYSCALLS);
+    return stat(sidecar.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)
+            && st.st_mtime >= origin.st_mtime;
+}
+
+static bool is_sidecar(const char* name)
+{
+    size_t len = strlen(name);
+    return len > 3 && (strcmp(name + len - 3, ".gz") == 0 || strcmp(name + len - 3, ".br") == 0);
+}
+
+/*缓存未命中时打开文件 生成缓存项*/
+file_entry* file_cache::open_entry(const char* path, FC_STATUS* status)
+{
+    struct stat st;
+    metrics::add(SYSCALLS);
+    if(stat(path, &st) < 0)
+    {
+        *status = FC_NO_FILE;
+        return nullptr;
+    }
+    if(!(st.st_mode & S_IROTH))
+    {
+        *status = FC_FORBIDDEN;
+        return nullptr;
+    }
+    if(S_ISDIR(st.st_mode))
+    {
+        *status = FC_IS_DIR;
+        return nullptr;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    metrics::add(SYSCALLS);
+    if(fd < 0)
+    {
+        *status = FC_ERROR;
+        return nullptr;
+    }
+    char* address = nullptr;
+    if(st.st_size != 0 && st.st_size < m_map_limit)
+    {
+        address = (char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        metrics::add(SYSCALLS);
+        if(address == MAP_FAILED)
+        {
+            close(fd);
+            *status = FC_ERROR;
+            return nullptr;
+        }
+    }
+
+    file_entry* entry = new file_entry;
+    entry->path = path;
+    entry->fd = fd;
+    entry->st = st;
+    entry->address = address;
+    snprintf(entry->etag, sizeof(entry->etag), "\"%lx-%lx\"", (unsigned long)st.st_mtime, (unsigned long)st.st_size);
+    struct tm tm;
+    gmtime_r(&st.st_mtime, &tm);
+    strftime(entry->last_modified, sizeof(entry->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    /*只为文本类资源查找预压缩文件 其余文件不付出额外的stat*/
+    entry->has_gzip = false;
+    entry->has_brotli = false;
+    if(compress_cache::compressible(path) && !is_sidecar(path))
+    {
+        entry->has_gzip = has_sidecar(path, ".gz", st);
+        entry->has_brotli = has_sidecar(path, ".br", st);
+    }
+    entry->refcount = 0;
+    entry->shard = -1;
+    entry->cached = false;
+    entry->prev = nullptr;
+    entry->next = nullptr;
+    *status = FC_OK;
+    return entry;
+}
+
+void file_cache::destroy_entry(file_entry* entry)
+{
+    if(entry->address)
+    {
+        munmap(entry->address, entry->st.st_size);
+        metrics::add(SYSCALLS);
+    }
+    close(entry->fd);
+    metrics::add(SYSCALLS);
+    delete entry;
+}
+
+void file_cache::lru_unlink(shard& s, file_entry* entry)
+{
+    if(entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        s.head = entry->next;
+    }
+    if(entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        s.tail = entry->prev;
+    }
+    entry->prev = nullptr;
+    entry->next = nullptr;
+}
+
+void file_cache::lru_push_front(shard& s, file_entry* entry)
+{
+    entry->prev = nullptr;
+    entry->next = s.head;
+    if(s.head)
+    {
+        s.head->prev = entry;
+    }
+    s.head = entry;
+    if(!s.tail)
+    {
+        s.tail = entry;
+    }
+}
+
+bool file_cache::detach(shard& s, file_entry* entry)
+{
+    s.table.erase(cache_key(entry->path));
+    lru_unlink(s, entry);
+    entry->cached = false;
+    s.entries--;
+    if(entry->address)
+    {
+        s.bytes -= entry->st.st_size;
+    }
+    /*释放缓存表持有的引用*/
+    return --entry->refcount == 0;
+}
+
+file_cache::FC_STATUS file_cache::acquire(const char* path, file_entry** entry)
+{
+    return acquire(path, strlen(path), entry);
+}
+
+file_cache::FC_STATUS file_cache::acquire(const char* path, size_t len, file_entry** entry)
+{
+    FC_STATUS status = FC_OK;
+    if(!m_enabled || !canonical(path))
+    {
+        metrics::add(FILE_CACHE_MISSES);
+        *entry = open_entry(path, &status);
+        if(*entry)
+        {
+            (*entry)->refcount = 1;
+        }
+        return status;
+    }
+
+    cache_key key(path, len);
+    int idx = cache_key_hash()(key) % SHARD_NUMBER;
+    shard& s = m_shards[idx];
+    s.mutex.lock();
+    std::unordered_map<cache_key, file_entry*, cache_key_hash, cache_key_equal>::iterator it = s.table.find(key);
+    if(it != s.table.end())
+    {
+        /*命中 不涉及任何系统调用*/
+        file_entry* hit = it->second;
+        lru_unlink(s, hit);
+        lru_push_front(s, hit);
+        hit->refcount++;
+        s.mutex.unlock();
+        metrics::add(FILE_CACHE_HITS);
+        *entry = hit;
+        return FC_OK;
+    }
+    s.mutex.unlock();
+    metrics::add(FILE_CACHE_MISSES);
+
+    /*未命中 在锁外完成文件系统操作 打开之前记下失效代数*/
+    uint64_t generation = m_generation.load(std::memory_order_acquire);
+    file_entry* fresh = open_entry(path, &status);
+    if(!fresh)
+    {
+        *entry = nullptr;
+        return status;
+    }
+    const char* slash = strrchr(path, '/');
+    /*目录刚开始监视时 打开文件和添加监视之间的变化没有通知*/
+    bool watched = watch_dir(std::string(path, slash - path + 1));
+    long mapped = fresh->address ? fresh->st.st_size : 0;
+
+    std::vector<file_entry*> victims;
+    s.mutex.lock();
+    it = s.table.find(key);
+    if(it != s.table.end())
+    {
+        /*其他线程已经插入了同一个文件*/
+        *entry = it->second;
+        it->second->refcount++;
+        s.mutex.unlock();
+        destroy_entry(fresh);
+        return FC_OK;
+    }
+    /*
+    单个文件超过分片容量时不缓存
+    打开之后处理过失效(主线程可能正好处理了这个文件的IN_MODIFY/IN_MOVED_TO)或目录刚开始监视时 打开的可能是旧文件
+    只交给本次请求使用 不放入缓存 下一次请求重新打开
+    */
+    if(mapped > m_shard_bytes || !watched || generation != m_generation.load(std::memory_order_acquire))
+    {
+        s.mutex.unlock();
+        fresh->refcount = 1;
+        *entry = fresh;
+        return FC_OK;
+    }
+    fresh->shard = idx;
+    fresh->cached = true;
+    fresh->refcount = 2;    /*缓存表和调用者各持有一个引用*/
+    s.table[cache_key(fresh->path)] = fresh;
+    lru_push_front(s, fresh);
+    s.entries++;
+    s.bytes += mapped;
+    while((s.entries > m_shard_entries || s.bytes > m_shard_bytes) && s.tail != fresh)
+    {
+        file_entry* victim = s.tail;
+        if(detach(s, victim))
+        {
+            victims.push_back(victim);
+        }
+    }
+    s.mutex.unlock();
+
+    for(size_t i = 0; i < victims.size(); ++i)
+    {
+        destroy_entry(victims[i]);
+    }
+    *entry = fresh;
+    return FC_OK;
+}
+
+void file_cache::release(file_entry* entry)
+{
+    if(!entry)
+    {
+        return;
+    }
+    if(entry->shard < 0)
+    {
+        destroy_entry(entry);
+        return;
+    }
+    shard& s = m_shards[entry->shard];
+    s.mutex.lock();
+    bool dead = (--entry->refcount == 0);
+    s.mutex.unlock();
+    if(dead)
+    {
+        destroy_entry(entry);
+    }
+}
+
+void file_cache::invalidate(const std::string& path)
+{
+    if(!m_enabled)
+    {
+        return;
+    }
+    /*先推进代数再查找 查找之后才插入的缓存项一定能看到新的代数*/
+    m_generation.fetch_add(1, std::memory_order_acq_rel);
+    cache_key key(path);
+    shard& s = m_shards[cache_key_hash()(key) % SHARD_NUMBER];
+    file_entry* victim = nullptr;
+    s.mutex.lock();
+    std::unordered_map<cache_key, file_entry*, cache_key_hash, cache_key_equal>::iterator it = s.table.find(key);
+    if(it != s.table.end())
+    {
+        file_entry* entry = it->second;
+        if(detach(s, entry))
+        {
+            victim = entry;
+        }
+    }
+    s.mutex.unlock();
+    if(victim)
+    {
+        destroy_entry(victim);
+    }
+    if(m_hook)
+    {
+        m_hook(path, m_hook_arg);
+    }
+}
+
+void file_cache::clear()
+{
+    m_generation.fetch_add(1, std::memory_order_acq_rel);
+    for(int i = 0; i < SHARD_NUMBER; ++i)
+    {
+        shard& s = m_shards[i];
+        std::vector<file_entry*> victims;
+        s.mutex.lock();
+        while(s.head)
+        {
+            file_entry* victim = s.head;
+            if(detach(s, victim))
+            {
+                victims.push_back(victim);
+            }
+        }
+        s.mutex.unlock();
+        for(size_t j = 0; j < victims.size(); ++j)
+        {
+            destroy_entry(victims[j]);
+        }
+    }
+    if(m_hook)
+    {
+        m_hook(std::string(), m_hook_arg);
+    }
+}
+
+bool file_cache::resize(int max_entries, long max_bytes)
+{
+    if(!m_enabled || max_entries <= 0 || max_bytes <= 0)
+    {
+        return false;
+    }
+    m_shard_entries = (max_entries + SHARD_NUMBER - 1) / SHARD_NUMBER;
+    m_shard_bytes = (max_bytes + SHARD_NUMBER - 1) / SHARD_NUMBER;
+    for(int i = 0; i < SHARD_NUMBER; ++i)
+    {
+        shard& s = m_shards[i];
+        std::vector<file_entry*> victims;
+        s.mutex.lock();
+        while((s.entries > m_shard_entries || s.bytes > m_shard_bytes) && s.tail)
+        {
+            file_entry* victim = s.tail;
+            if(detach(s, victim))
+            {
+                victims.push_back(victim);
+            }
+        }
+        s.mutex.unlock();
+        for(size_t j = 0; j < victims.size(); ++j)
+        {
+            destroy_entry(victims[j]);
+        }
+    }
+    return true;
+}
+
+std::vector<std::string> file_cache::paths()
+{
+    std::vector<std::string> result;
+    for(int i = 0; i < SHARD_NUMBER; ++i)
+    {
+        shard& s = m_shards[i];
+        s.mutex.lock();
+        for(file_entry* entry = s.head; entry; entry = entry->next)
+        {
+            result.push_back(entry->path);
+        }
+        s.mutex.unlock();
+    }
+    return result;
+}
+
+int file_cache::warm(const std::vector<std::string>& paths)
+{
+    int opened = 0;
+    if(!m_enabled)
+    {
+        return opened;
+    }
+    /*倒序打开 每个分片的LRU链表恢复成原来的顺序*/
+    for(size_t i = paths.size(); i-- > 0; )
+    {
+        file_entry* entry = nullptr;
+        if(acquire(paths[i].c_str(), &entry) == FC_OK)
+        {
+            release(entry);
+            ++opened;
+        }
+    }
+    return opened;
+}
+
+void file_cache::set_invalidate_hook(invalidate_hook hook, void* arg)
+{
+    m_hook = hook;
+    m_hook_arg = arg;
+}
+
+/*监视目录dir(以'/'结尾) 已监视的目录不再产生系统调用*/
+bool file_cache::watch_dir(const std::string& dir)
+{
+    m_watch_mutex.lock();
+    if(m_dir_watches.count(dir))
+    {
+        m_watch_mutex.unlock();
+        return true;
+    }
+    int wd = inotify_add_watch(m_inotify_fd, dir.c_str(), WATCH_MASK);
+    if(wd >= 0)
+    {
+        /*同一目录经由不同路径(符号链接)监视时内核返回相同的wd 以最后一次为准*/
+        m_dir_watches[dir] = wd;
+        m_watch_dirs[wd] = dir;
+    }
+    m_watch_mutex.unlock();
+    return false;
+}
+
+void file_cache::process_events()
+{
+    if(m_inotify_fd < 0)
+    {
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(true)
+    {
+        ssize_t len = read(m_inotify_fd, buf, sizeof(buf));
+        if(len <= 0)
+        {
+            /*EAGAIN 事件已读完*/
+            break;
+        }
+        for(char* ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+        {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+            /*事件队列溢出或被监视的目录本身消失 无法确定哪些缓存项受影响 全部失效*/
+            if(event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+            {
+                if(event->mask & IN_IGNORED)
+                {
+                    m_watch_mutex.lock();
+                    std::unordered_map<int, std::string>::iterator it = m_watch_dirs.find(event->wd);
+                    if(it != m_watch_dirs.end())
+                    {
+                        m_dir_watches.erase(it->second);
+                        m_watch_dirs.erase(it);
+                    }
+                    m_watch_mutex.unlock();
+                }
+                clear();
+                continue;
+            }
+            if(event->len == 0)
+            {
+                continue;
+            }
+            /*子目录被删除或改名 其下所有缓存项的键都已失效*/
+            if((event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+            {
+                clear();
+                continue;
+            }
+            std::string path;
+            m_watch_mutex.lock();
+            std::unordered_map<int, std::string>::iterator it = m_watch_dirs.find(event->wd);
+            if(it != m_watch_dirs.end())
+            {
+                path = it->second + event->name;
+            }
+            m_watch_mutex.unlock();
+            if(!path.empty())
+            {
+                invalidate(path);
+                /*预压缩文件变化 原文件缓存项中记录的has_gzip/has_brotli随之失效*/
+                if(is_sidecar(event->name))
+                {
+                    invalidate(path.substr(0, path.size() - 3));
+                }
+            }
+        }
+    }
+}
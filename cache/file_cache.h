@@ -0,0 +1,125 @@
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<string>
+#include<unordered_map>
+#include<vector>
+#include<atomic>
+
+#include"../lock/myLock.h"
+#include"cache_key.h"
+
+/*
+缓存项：一个已打开的静态文件
+    fd在缓存项生命周期内保持打开 sendfile使用显式偏移 多个连接可以共享同一个fd
+    小文件额外建立一份共享的只读映射 所有连接直接writev该映射 不再逐请求mmap/munmap
+    引用计数归零且已不在缓存中时才真正close/munmap
+*/
+struct file_entry{
+    std::string path;       /*缓存键 doc_root + url*/
+    int fd;
+    struct stat st;
+    char* address;          /*共享映射的起始地址 大文件或空文件为nullptr*/
+    char etag[48];          /*预先生成的ETag响应头取值*/
+    char last_modified[48]; /*预先生成的Last-Modified响应头取值*/
+    bool has_gzip;          /*存在不旧于本文件的.gz预压缩文件*/
+    bool has_brotli;        /*存在不旧于本文件的.br预压缩文件*/
+    int refcount;           /*由所属分片的互斥锁保护*/
+    int shard;              /*所属分片 缓存被禁用时为-1*/
+    bool cached;            /*是否仍在缓存表中*/
+    file_entry* prev;       /*分片内LRU链表 表头最近使用*/
+    file_entry* next;
+};
+
+/*
+按路径分片的已打开文件缓存：
+    命中时不执行任何文件系统系统调用(stat/open/mmap/munmap/close)
+    按缓存项数量和映射字节数限制容量 超出时按LRU淘汰
+    通过inotify监视doc_root及缓存文件所在目录 文件变化时使对应缓存项失效
+    .gz/.br预压缩文件是否存在在打开原文件时一并确定 预压缩文件变化时原文件的缓存项同样失效
+*/
+class file_cache{
+public:
+    enum FC_STATUS{
+        FC_OK = 0,
+        FC_NO_FILE,     /*文件不存在*/
+        FC_FORBIDDEN,   /*文件对其他用户不可读*/
+        FC_IS_DIR,      /*目标是目录*/
+        FC_ERROR        /*打开或映射失败*/
+    };
+
+    /*缓存项失效时的通知 path为空表示全部失效*/
+    typedef void (*invalidate_hook)(const std::string& path, void* arg);
+
+public:
+    /*max_entries和max_bytes为0时禁用缓存 每次请求都重新打开文件; 小于map_limit字节的文件会建立共享映射*/
+    file_cache(const char* root, int max_entries, long max_bytes, long map_limit);
+    ~file_cache();
+
+    /*获取path对应的缓存项并增加引用计数 成功时必须配对调用release*/
+    FC_STATUS acquire(const char* path, file_entry** entry);
+    FC_STATUS acquire(const char* path, size_t len, file_entry** entry);
+    void release(file_entry* entry);
+
+    /*inotify描述符 由主线程注册到epoll中*/
+    int inotify_fd() const { return m_inotify_fd; }
+    /*读取并处理所有待处理的inotify事件 由主线程调用*/
+    void process_events();
+    /*使path对应的缓存项失效*/
+    void invalidate(const std::string& path);
+    /*清空所有缓存项*/
+    void clear();
+    /*运行中调整容量 超出的缓存项立即按LRU淘汰 启动时禁用的缓存不能再启用 返回false*/
+    bool resize(int max_entries, long max_bytes);
+    /*缓存中各文件的路径 每个分片内按最近使用在前 升级时交给新进程预热*/
+    std::vector<std::string> paths();
+    /*按paths()的结果打开文件 每个分片内最近使用的最后打开 返回成功打开的文件数*/
+    int warm(const std::vector<std::string>& paths);
+    /*设置失效通知 依赖本缓存失效机制的上层缓存(如content_cache)借此同步失效*/
+    void set_invalidate_hook(invalidate_hook hook, void* arg);
+    /*inotify是否可用 不可用时上层缓存也无法得知文件变化*/
+    bool watching() const { return m_inotify_fd != -1; }
+
+private:
+    static const int SHARD_NUMBER = 16;
+
+    struct shard{
+        myMutex mutex;
+        std::unordered_map<cache_key, file_entry*, cache_key_hash, cache_key_equal> table;   /*键指向缓存项的path*/
+        file_entry* head;   /*LRU链表头 最近使用*/
+        file_entry* tail;   /*LRU链表尾 最先淘汰*/
+        int entries;
+        long bytes;
+    };
+
+    file_entry* open_entry(const char* path, FC_STATUS* status);
+    void destroy_entry(file_entry* entry);
+    /*以下函数需持有分片的互斥锁*/
+    void lru_unlink(shard& s, file_entry* entry);
+    void lru_push_front(shard& s, file_entry* entry);
+    /*将entry移出缓存表 返回true表示调用者需要销毁它*/
+    bool detach(shard& s, file_entry* entry);
+    /*监视path所在目录 调用之前已在监视时返回true*/
+    bool watch_dir(const std::string& path);
+
+private:
+    shard m_shards[SHARD_NUMBER];
+    /*每个分片允许的最大缓存项数量和映射字节数 重新加载配置时由主线程修改*/
+    std::atomic<int> m_shard_entries;
+    std::atomic<long> m_shard_bytes;
+    long m_map_limit;
+    bool m_enabled;
+    /*每次失效都推进 未命中时打开文件期间发生过失效则不插入缓存*/
+    std::atomic<uint64_t> m_generation;
+    invalidate_hook m_hook;
+    void* m_hook_arg;
+
+    int m_inotify_fd;
+    myMutex m_watch_mutex;
+    std::unordered_map<int, std::string> m_watch_dirs;   /*watch描述符 -> 目录*/
+    std::unordered_map<std::string, int> m_dir_watches;  /*目录 -> watch描述符*/
+};
+
+#endif
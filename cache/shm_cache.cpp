@@ -0,0 +1,374 @@
+#include"shm_cache.h"
+#include"../metrics/metrics.h"
+
+#include<unistd.h>
+#include<time.h>
+#include<cstring>
+#include<sys/mman.h>
+#include<new>
+
+/*毫秒级的单调时钟 只用于比较缓存项的新旧 粗粒度时钟不进入内核*/
+static uint64_t coarse_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+shm_cache::shm_cache(long max_bytes, long max_body)
+: m_max_body(max_body), m_header(nullptr), m_map_bytes(0), m_enabled(false)
+{
+    memset(m_classes, 0, sizeof(m_classes));
+    if(max_bytes <= 0)
+    {
+        return;
+    }
+    /*每个类别分得同样多的数据区 缓存项数取WAYS的整数倍*/
+    size_t total = sizeof(header);
+    for(int i = 0; i < CLASS_NUMBER; ++i)
+    {
+        size_class& c = m_classes[i];
+        c.slot_size = (size_t)1 << (MIN_CLASS_SHIFT + CLASS_SHIFT_STEP * i);
+        c.sets = (size_t)max_bytes / CLASS_NUMBER / c.slot_size / WAYS;
+        total += c.sets * WAYS * (sizeof(shm_entry) + c.slot_size);
+    }
+    char* base = (char*)mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+    {
+        memset(m_classes, 0, sizeof(m_classes));
+        return;
+    }
+    m_map_bytes = total;
+    m_header = new(base) header();
+    char* p = base + sizeof(header);
+    for(int i = 0; i < CLASS_NUMBER; ++i)
+    {
+        size_class& c = m_classes[i];
+        c.entries = (shm_entry*)p;
+        p += c.sets * WAYS * sizeof(shm_entry);
+    }
+    for(int i = 0; i < CLASS_NUMBER; ++i)
+    {
+        size_class& c = m_classes[i];
+        c.data = p;
+        for(size_t j = 0; j < c.sets * WAYS; ++j)
+        {
+            shm_entry* e = new(&c.entries[j]) shm_entry();
+            e->data = p + j * c.slot_size;
+        }
+        p += c.sets * WAYS * c.slot_size;
+    }
+    m_enabled = true;
+}
+
+/*fork出的worker各自析构 只解除本进程的映射*/
+shm_cache::~shm_cache()
+{
+    if(m_header)
+    {
+        munmap(m_header, m_map_bytes);
+    }
+}
+
+int shm_cache::class_of(size_t len) const
+{
+    for(int i = 0; i < CLASS_NUMBER; ++i)
+    {
+        if(len <= m_classes[i].slot_size && m_classes[i].sets)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+shm_entry* shm_cache::set_of(int cls, uint64_t hash) const
+{
+    const size_class& c = m_classes[cls];
+    return &c.entries[(hash % c.sets) * WAYS];
+}
+
+/*引用计数已增加之后核对 此时缓存项不会被改写*/
+bool shm_cache::matches(const shm_entry* e, uint64_t hash, const char* path, size_t path_len, int variant) const
+{
+    return e->hash.load(std::memory_order_relaxed) == hash && e->variant == variant && e->path_len == path_len
+            && e->epoch == m_header->epoch.load(std::memory_order_relaxed) && memcmp(e->data, path, path_len) == 0;
+}
+
+static inline uint32_t sketch_index(uint64_t hash, int row, int width)
+{
+    uint64_t x = hash + (uint64_t)(row + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x & (width - 1);
+}
+
+int shm_cache::frequency(uint64_t hash) const
+{
+    int freq = 255;
+    for(int i = 0; i < SKETCH_DEPTH; ++i)
+    {
+        int count = m_header->sketch[i * SKETCH_WIDTH + sketch_index(hash, i, SKETCH_WIDTH)].load(std::memory_order_relaxed);
+        if(count < freq)
+        {
+            freq = count;
+        }
+    }
+    return freq;
+}
+
+/*与content_cache相同: 计数器饱和于15 每记录10倍宽度次访问后全部减半 恰好数到该次的进程负责减半*/
+void shm_cache::record(uint64_t hash)
+{
+    for(int i = 0; i < SKETCH_DEPTH; ++i)
+    {
+        std::atomic<uint8_t>& count = m_header->sketch[i * SKETCH_WIDTH + sketch_index(hash, i, SKETCH_WIDTH)];
+        uint8_t c = count.load(std::memory_order_relaxed);
+        if(c < 15)
+        {
+            count.store(c + 1, std::memory_order_relaxed);
+        }
+    }
+    if(m_header->samples.fetch_add(1, std::memory_order_relaxed) + 1 == (uint32_t)SKETCH_WIDTH * 10)
+    {
+        m_header->samples.store(0, std::memory_order_relaxed);
+        for(int i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; ++i)
+        {
+            std::atomic<uint8_t>& count = m_header->sketch[i];
+            count.store(count.load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+        }
+    }
+}
+
+shm_entry* shm_cache::lookup(const char* path, size_t path_len, int variant, uint64_t* generation)
+{
+    if(!m_enabled.load(std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+    uint64_t hash = cache_key_hash()(cache_key(path, path_len, variant));
+    record(hash);
+    *generation = m_header->generation.load(std::memory_order_acquire);
+    shm_entry* hit = nullptr;
+    /*响应的长度未知 依次检查各类别中对应的组*/
+    for(int cls = 0; cls < CLASS_NUMBER && !hit; ++cls)
+    {
+        if(!m_classes[cls].sets)
+        {
+            continue;
+        }
+        shm_entry* set = set_of(cls, hash);
+        for(int way = 0; way < WAYS; ++way)
+        {
+            shm_entry* e = &set[way];
+            if(e->hash.load(std::memory_order_relaxed) != hash)
+            {
+                continue;
+            }
+            uint64_t s = e->state.load(std::memory_order_acquire);
+            while(state_of(s) == READY && !e->state.compare_exchange_weak(s, s + 1, std::memory_order_acquire))
+            {
+            }
+            if(state_of(s) != READY)
+            {
+                continue;
+            }
+            /*增加引用之前缓存项可能已被替换为其他内容*/
+            if(!matches(e, hash, path, path_len, variant))
+            {
+                release(e);
+                continue;
+            }
+            uint64_t now = coarse_ms();
+            if(e->last_used.load(std::memory_order_relaxed) != now)
+            {
+                e->last_used.store(now, std::memory_order_relaxed);
+            }
+            hit = e;
+            break;
+        }
+    }
+    metrics::add(hit ? CONTENT_CACHE_HITS : CONTENT_CACHE_MISSES);
+    return hit;
+}
+
+void shm_cache::admit(const char* path, size_t path_len, int variant, uint64_t generation, const char* head, int head_len,
+        const char* body, int fd, size_t body_len)
+{
+    if(!m_enabled.load(std::memory_order_relaxed) || (long)body_len > m_max_body)
+    {
+        return;
+    }
+    size_t len = head_len + 2 + body_len;
+    int cls = class_of(path_len + len);
+    if(cls < 0)
+    {
+        return;
+    }
+    uint64_t hash = cache_key_hash()(cache_key(path, path_len, variant));
+    int freq = frequency(hash);
+    uint32_t epoch = m_header->epoch.load(std::memory_order_relaxed);
+    if(generation != m_header->generation.load(std::memory_order_acquire) || freq < ADMIT_MIN)
+    {
+        return;
+    }
+
+    /*
+    选择替换对象: 空闲或已失效且没有引用的缓存项优先 否则为组内没有引用的最久未使用者
+    TinyLFU: 替换有效的缓存项需要候选者比它更热
+    */
+    shm_entry* set = set_of(cls, hash);
+    shm_entry* victim = nullptr;
+    uint64_t victim_state = 0;
+    bool victim_live = false;
+    for(int way = 0; way < WAYS; ++way)
+    {
+        shm_entry* e = &set[way];
+        uint64_t s = e->state.load(std::memory_order_acquire);
+        uint32_t state = state_of(s);
+        bool live = state == READY && e->epoch == epoch;
+        /*其他worker已准入同一内容*/
+        if(live && e->hash.load(std::memory_order_relaxed) == hash)
+        {
+            return;
+        }
+        if(state == WRITING || low_of(s) != 0)
+        {
+            continue;
+        }
+        if(!live)
+        {
+            victim = e;
+            victim_state = s;
+            victim_live = false;
+            break;
+        }
+        if(!victim || e->last_used.load(std::memory_order_relaxed) < victim->last_used.load(std::memory_order_relaxed))
+        {
+            victim = e;
+            victim_state = s;
+            victim_live = true;
+        }
+    }
+    if(!victim || (victim_live && frequency(victim->hash.load(std::memory_order_relaxed)) >= freq))
+    {
+        return;
+    }
+    /*抢占失败说明它刚被命中或被其他worker抢占 放弃这次准入*/
+    if(!victim->state.compare_exchange_strong(victim_state, make_state(WRITING, (uint32_t)getpid()), std::memory_order_acquire))
+    {
+        return;
+    }
+
+    char* dst = victim->data;
+    memcpy(dst, path, path_len);
+    dst += path_len;
+    memcpy(dst, head, head_len);
+    memcpy(dst + head_len, "\r\n", 2);
+    dst += head_len + 2;
+    if(body)
+    {
+        memcpy(dst, body, body_len);
+    }
+    else
+    {
+        size_t done = 0;
+        while(done < body_len)
+        {
+            ssize_t n = pread(fd, dst + done, body_len - done, done);
+            if(n <= 0)
+            {
+                victim->hash.store(0, std::memory_order_relaxed);
+                victim->state.store(make_state(FREE, 0), std::memory_order_release);
+                return;
+            }
+            done += n;
+        }
+    }
+    victim->hash.store(hash, std::memory_order_relaxed);
+    victim->epoch = epoch;
+    victim->variant = variant;
+    victim->path_len = path_len;
+    victim->head_len = head_len;
+    victim->len = len;
+    victim->last_used.store(coarse_ms(), std::memory_order_relaxed);
+    victim->state.store(make_state(READY, 0), std::memory_order_release);
+
+    /*
+    invalidate先推进generation再扫描 发布之后再检查一次:
+    扫描已经过了这个缓存项时这里一定能看到新的generation 自己把它标记为DEAD
+    */
+    if(generation != m_header->generation.load(std::memory_order_seq_cst))
+    {
+        uint64_t s = make_state(READY, 0);
+        while(state_of(s) == READY && !victim->state.compare_exchange_weak(s, make_state(DEAD, low_of(s))))
+        {
+        }
+    }
+}
+
+void shm_cache::release(shm_entry* entry)
+{
+    if(entry)
+    {
+        entry->state.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void shm_cache::invalidate(const std::string& path)
+{
+    if(!m_header)
+    {
+        return;
+    }
+    m_header->generation.fetch_add(1, std::memory_order_seq_cst);
+    if(path.empty())
+    {
+        m_header->epoch.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    for(int variant = 0; variant < VARIANT_NUMBER; ++variant)
+    {
+        uint64_t hash = cache_key_hash()(cache_key(path, variant));
+        for(int cls = 0; cls < CLASS_NUMBER; ++cls)
+        {
+            if(!m_classes[cls].sets)
+            {
+                continue;
+            }
+            shm_entry* set = set_of(cls, hash);
+            for(int way = 0; way < WAYS; ++way)
+            {
+                shm_entry* e = &set[way];
+                if(e->hash.load(std::memory_order_relaxed) != hash)
+                {
+                    continue;
+                }
+                /*哈希相同的其他路径也一并失效 只是少一次命中*/
+                uint64_t s = e->state.load(std::memory_order_acquire);
+                while(state_of(s) == READY && !e->state.compare_exchange_weak(s, make_state(DEAD, low_of(s))))
+                {
+                }
+            }
+        }
+    }
+}
+
+void shm_cache::invalidate_hook(const std::string& path, void* arg)
+{
+    static_cast<shm_cache*>(arg)->invalidate(path);
+}
+
+void shm_cache::recover(pid_t pid)
+{
+    for(int cls = 0; cls < CLASS_NUMBER; ++cls)
+    {
+        size_class& c = m_classes[cls];
+        for(size_t i = 0; i < c.sets * WAYS; ++i)
+        {
+            uint64_t s = make_state(WRITING, (uint32_t)pid);
+            c.entries[i].state.compare_exchange_strong(s, make_state(FREE, 0));
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef _SHMCACHE_H_
+#define _SHMCACHE_H_
+
+#include<sys/types.h>
+#include<stdint.h>
+#include<atomic>
+
+#include"cache_key.h"
+
+/*
+共享内存中的一个缓存项 与content_entry一样保存小文件的完整响应
+    data = 路径 + 响应头(状态行...Content-Length) + 空行 + 消息体
+    state的高32位为状态 低32位为引用计数 写入中的缓存项低32位为写入者的pid 一次CAS同时检查状态和引用
+*/
+struct shm_entry{
+    std::atomic<uint64_t> state;
+    std::atomic<uint64_t> hash;         /*(path, variant)的哈希 查找时先比较它*/
+    std::atomic<uint64_t> last_used;    /*最近一次命中的毫秒时间 淘汰时选最小者*/
+    uint32_t epoch;                     /*写入时的全部失效代数 与当前代数不同即已失效*/
+    int variant;
+    uint32_t path_len;
+    int head_len;                       /*响应中空行之前的部分*/
+    size_t len;                         /*响应的总长度 不含路径*/
+    char* data;                         /*指向所属大小类别的数据区 各进程映射在同一地址*/
+
+    char* response() const { return data + path_len; }
+};
+
+/*
+prefork模式下所有worker共享的小文件完整响应缓存 代替各进程自己的content_cache:
+    master在fork之前用MAP_SHARED|MAP_ANONYMOUS映射 各worker在同一地址看到它 缓存项中可以直接保存指针
+    容量在启动时按content_cache_bytes平均分给2KB/8KB/32KB/128KB四个大小类别 每个类别是8路组相联的固定表
+    没有锁: 缓存项的状态机FREE->WRITING->READY->DEAD->FREE全部用CAS推进
+        查找在READY状态下CAS增加引用计数 之后再核对路径和代数 引用不为0的缓存项不会被改写
+        准入CAS抢占组内空闲、已失效或没有引用的最久未使用缓存项 写完后发布为READY
+    准入采用与content_cache相同的TinyLFU 共享的Count-Min Sketch计数器不加锁 并发的自增偶尔丢失一次不影响判断
+    文件变化时每个worker的inotify都会通知 把匹配的缓存项CAS为DEAD 正在发送它的连接发送完才释放
+    worker异常退出时: 它写入中的缓存项由master回收 它持有的引用无法得知 对应的缓存项不再能被替换 只损失容量
+*/
+class shm_cache{
+public:
+    /*max_bytes为0时不映射 消息体超过max_body字节的文件不缓存*/
+    shm_cache(long max_bytes, long max_body);
+    ~shm_cache();
+
+    /*查找(path, variant)对应的完整响应 命中时增加引用计数 同时记录一次访问*/
+    shm_entry* lookup(const char* path, size_t path_len, int variant, uint64_t* generation);
+    /*尝试准入 参数与content_cache::admit相同*/
+    void admit(const char* path, size_t path_len, int variant, uint64_t generation, const char* head, int head_len,
+            const char* body, int fd, size_t body_len);
+    void release(shm_entry* entry);
+
+    /*使path的所有编码版本失效 path为空时全部失效*/
+    void invalidate(const std::string& path);
+    static void invalidate_hook(const std::string& path, void* arg);
+    /*master: pid号worker退出后回收它写入中的缓存项*/
+    void recover(pid_t pid);
+
+    long max_body() const { return m_max_body; }
+    /*容量只在启动时确定 重新加载配置时只能停用(max_bytes为0)或重新启用 只影响本进程*/
+    void resize(long max_bytes) { m_enabled.store(m_header && max_bytes > 0, std::memory_order_relaxed); }
+
+private:
+    static const int MIN_CLASS_SHIFT = 11;
+    static const int CLASS_SHIFT_STEP = 2;
+    static const int CLASS_NUMBER = 4;
+    static const int WAYS = 8;
+    static const int SKETCH_DEPTH = 4;
+    static const int SKETCH_WIDTH = 1 << 14;
+    static const int ADMIT_MIN = 2;
+    static const int VARIANT_NUMBER = 4;
+
+    enum STATE{
+        FREE = 0,
+        WRITING,
+        READY,
+        DEAD
+    };
+
+    /*共享内存开头的全局状态*/
+    struct header{
+        std::atomic<uint64_t> generation;   /*每次失效都推进 拒绝失效前读取的内容准入*/
+        std::atomic<uint32_t> epoch;        /*全部失效时推进*/
+        std::atomic<uint32_t> samples;
+        std::atomic<uint8_t> sketch[SKETCH_DEPTH * SKETCH_WIDTH];
+    };
+
+    struct size_class{
+        size_t slot_size;
+        size_t sets;
+        shm_entry* entries;     /*sets * WAYS个缓存项*/
+        char* data;             /*每个缓存项slot_size字节*/
+    };
+
+    static uint64_t make_state(uint32_t state, uint32_t low) { return ((uint64_t)state << 32) | low; }
+    static uint32_t state_of(uint64_t s) { return (uint32_t)(s >> 32); }
+    static uint32_t low_of(uint64_t s) { return (uint32_t)s; }
+
+    int class_of(size_t len) const;
+    shm_entry* set_of(int cls, uint64_t hash) const;
+    bool matches(const shm_entry* e, uint64_t hash, const char* path, size_t path_len, int variant) const;
+    int frequency(uint64_t hash) const;
+    void record(uint64_t hash);
+
+private:
+    long m_max_body;
+    header* m_header;
+    size_t m_map_bytes;
+    size_class m_classes[CLASS_NUMBER];
+    std::atomic<bool> m_enabled;
+};
+
+#endif
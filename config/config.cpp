@@ -0,0 +1,303 @@
+#include"config.h"
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<ctype.h>
+#include<climits>
+#include<fstream>
+
+/*
+每一项的名字、是否可重新加载和取值下限 四个成员指针中只有与类型对应的一个不为空
+整数和字符串项共用一张表 解析、比较和打印都按表进行
+*/
+struct config_key{
+    const char* name;
+    bool reloadable;
+    long min;
+    int server_config::* i;
+    long server_config::* l;
+    double server_config::* d;
+    std::string server_config::* s;
+};
+
+#define INT_KEY(name, reload, min) {#name, reload, min, &server_config::name, nullptr, nullptr, nullptr}
+#define LONG_KEY(name, reload, min) {#name, reload, min, nullptr, &server_config::name, nullptr, nullptr}
+#define DOUBLE_KEY(name, reload) {#name, reload, 0, nullptr, nullptr, &server_config::name, nullptr}
+#define STRING_KEY(name, reload) {#name, reload, 0, nullptr, nullptr, nullptr, &server_config::name}
+
+static const config_key keys[] = {
+    STRING_KEY(listen, false),
+    INT_KEY(port, false, 0),
+    INT_KEY(admin_port, false, 0),
+    STRING_KEY(metrics_path, false),
+    STRING_KEY(doc_root, false),
+    INT_KEY(max_fd, false, 64),
+    INT_KEY(max_events, false, 1),
+    INT_KEY(read_buffer, false, 512),
+    INT_KEY(write_buffer, false, 512),
+    LONG_KEY(sendfile_threshold, false, LONG_MIN),
+    STRING_KEY(proxy_routes, false),
+    STRING_KEY(fastcgi_routes, false),
+    STRING_KEY(upgrade_socket, false),
+    INT_KEY(workers, false, 0),
+    INT_KEY(threads, true, 1),
+    INT_KEY(queue, true, 1),
+    INT_KEY(backlog, true, 1),
+    INT_KEY(send_timeout, true, 1),
+    INT_KEY(idle_timeout, true, 0),
+    LONG_KEY(high_water, true, 0),
+    DOUBLE_KEY(slow_ms, true),
+    LONG_KEY(busy_poll_us, true, 0),
+    INT_KEY(file_cache_entries, true, 0),
+    LONG_KEY(file_cache_bytes, true, 0),
+    LONG_KEY(compress_cache_bytes, true, 0),
+    LONG_KEY(content_cache_bytes, true, 0),
+    STRING_KEY(rate_limit, true),
+    STRING_KEY(admission, true),
+    INT_KEY(drain_timeout, true, 1),
+};
+
+static const int KEY_NUMBER = sizeof(keys) / sizeof(keys[0]);
+
+/*原有的位置参数依次对应的项*/
+static const char* positional[] = {"listen", "port", "sendfile_threshold", "admin_port", "metrics_path", "slow_ms", "busy_poll_us"};
+
+/*对应同名小写键的环境变量*/
+static const char* environment[] = {"DOC_ROOT", "PROXY_ROUTES", "FASTCGI_ROUTES", "RATE_LIMIT", "ADMISSION"};
+
+static const config_key* find_key(const std::string& name)
+{
+    for(int i = 0; i < KEY_NUMBER; ++i)
+    {
+        if(name == keys[i].name)
+        {
+            return &keys[i];
+        }
+    }
+    return nullptr;
+}
+
+static std::string trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r");
+    if(begin == std::string::npos)
+    {
+        return std::string();
+    }
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+server_config::server_config()
+: port(0), admin_port(0), metrics_path("/metrics"), doc_root("/var/www/html"), max_fd(65536), max_events(10000),
+read_buffer(2048), write_buffer(1024), sendfile_threshold(16 * 1024), workers(0),
+threads(8), queue(10000), backlog(5), send_timeout(10), idle_timeout(60), high_water(64 * 1024), slow_ms(0), busy_poll_us(0),
+file_cache_entries(256), file_cache_bytes(64 << 20), compress_cache_bytes(32 << 20), content_cache_bytes(64 << 20),
+drain_timeout(30)
+{
+}
+
+bool server_config::set(const std::string& key, const std::string& value)
+{
+    const config_key* k = find_key(key);
+    if(!k)
+    {
+        printf("unknown config key: %s\n", key.c_str());
+        return false;
+    }
+    if(k->s)
+    {
+        this->*(k->s) = value;
+        return true;
+    }
+    char* end = nullptr;
+    if(k->d)
+    {
+        double v = strtod(value.c_str(), &end);
+        if(value.empty() || *end || v < 0)
+        {
+            printf("bad value for %s: %s\n", key.c_str(), value.c_str());
+            return false;
+        }
+        this->*(k->d) = v;
+        return true;
+    }
+    long v = strtol(value.c_str(), &end, 10);
+    if(value.empty() || *end || v < k->min)
+    {
+        printf("bad value for %s: %s\n", key.c_str(), value.c_str());
+        return false;
+    }
+    if(k->i)
+    {
+        this->*(k->i) = (int)v;
+    }
+    else
+    {
+        this->*(k->l) = v;
+    }
+    return true;
+}
+
+std::string server_config::get(const std::string& key) const
+{
+    const config_key* k = find_key(key);
+    if(!k)
+    {
+        return std::string();
+    }
+    if(k->s)
+    {
+        return this->*(k->s);
+    }
+    char text[32];
+    if(k->d)
+    {
+        snprintf(text, sizeof(text), "%g", this->*(k->d));
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "%ld", k->i ? (long)(this->*(k->i)) : this->*(k->l));
+    }
+    return text;
+}
+
+std::vector<std::string> server_config::changed(const server_config& other, bool reloadable) const
+{
+    std::vector<std::string> names;
+    for(int i = 0; i < KEY_NUMBER; ++i)
+    {
+        if(keys[i].reloadable == reloadable && get(keys[i].name) != other.get(keys[i].name))
+        {
+            names.push_back(keys[i].name);
+        }
+    }
+    return names;
+}
+
+bool server_config::load_file(const char* path)
+{
+    std::ifstream in(path);
+    if(!in)
+    {
+        printf("cannot open config file %s\n", path);
+        return false;
+    }
+    std::string line;
+    for(int lineno = 1; std::getline(in, line); ++lineno)
+    {
+        size_t hash = line.find('#');
+        if(hash != std::string::npos)
+        {
+            line.erase(hash);
+        }
+        line = trim(line);
+        if(line.empty())
+        {
+            continue;
+        }
+        size_t eq = line.find('=');
+        if(eq == std::string::npos)
+        {
+            printf("%s:%d: expected key = value\n", path, lineno);
+            return false;
+        }
+        if(!set(trim(line.substr(0, eq)), trim(line.substr(eq + 1))))
+        {
+            printf("%s:%d: invalid setting\n", path, lineno);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool server_config::load(int argc, char* argv[])
+{
+    /*先找出配置文件 命令行中的其他项在它之后应用*/
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-c") == 0)
+        {
+            if(i + 1 == argc)
+            {
+                printf("-c needs a config file\n");
+                return false;
+            }
+            if(!load_file(argv[++i]))
+            {
+                return false;
+            }
+        }
+    }
+    for(size_t i = 0; i < sizeof(environment) / sizeof(environment[0]); ++i)
+    {
+        const char* value = getenv(environment[i]);
+        if(value)
+        {
+            std::string key = environment[i];
+            for(size_t j = 0; j < key.size(); ++j)
+            {
+                key[j] = tolower(key[j]);
+            }
+            if(!set(key, value))
+            {
+                return false;
+            }
+        }
+    }
+    size_t next = 0;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "-c")
+        {
+            ++i;
+        }
+        else if(arg.compare(0, 2, "--") == 0)
+        {
+            size_t eq = arg.find('=');
+            if(eq == std::string::npos || !set(arg.substr(2, eq - 2), arg.substr(eq + 1)))
+            {
+                printf("bad option: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if(next < sizeof(positional) / sizeof(positional[0]))
+        {
+            if(!set(positional[next++], arg))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            printf("unexpected argument: %s\n", argv[i]);
+            return false;
+        }
+    }
+    if(listen.empty() || port <= 0)
+    {
+        printf("listen address and port are required\n");
+        return false;
+    }
+    /*worker之间没有交接监听socket的协议*/
+    if(workers > 0 && !upgrade_socket.empty())
+    {
+        printf("upgrade_socket cannot be used with workers\n");
+        return false;
+    }
+    return true;
+}
+
+void server_config::usage(const char* prog)
+{
+    printf("usage: %s [-c config_file] [--key=value ...] address[,address...] port_number [sendfile_threshold] [admin_port] [metrics_path] [slow_ms] [busy_poll_us]\n", prog);
+    printf("address: ipv4[:port] | [ipv6][:port] | unix:/path | unix:@abstract\n");
+    printf("keys:");
+    for(int i = 0; i < KEY_NUMBER; ++i)
+    {
+        printf(" %s%s", keys[i].name, keys[i].reloadable ? "*" : "");
+    }
+    printf("\n(* reloaded on SIGHUP)\n");
+}
@@ -0,0 +1,69 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include<string>
+#include<vector>
+
+/*
+服务器配置 优先级从低到高: 默认值 配置文件 环境变量 命令行
+    配置文件每行一项"key = value" '#'之后为注释 未知的键和格式错误都会使加载失败
+    命令行: -c file指定配置文件 --key=value覆盖单项 其余位置参数依次为
+        listen port sendfile_threshold admin_port metrics_path slow_ms busy_poll_us (与原来的用法相同)
+    环境变量DOC_ROOT、PROXY_ROUTES、FASTCGI_ROUTES、RATE_LIMIT、ADMISSION对应同名的小写键
+收到SIGHUP时主线程重新加载: 重新读取配置文件 环境变量和命令行仍然覆盖文件中的值
+    只有标记为可重新加载的项在运行中生效 其余项的变化打印提示 重启后生效 已有的连接不受影响
+*/
+struct server_config{
+    /*只在启动时生效*/
+    std::string listen;         /*逗号分隔的监听地址*/
+    int port;
+    int admin_port;             /*0表示不开管理端口*/
+    std::string metrics_path;
+    std::string doc_root;
+    int max_fd;                 /*连接对象表的大小 描述符不小于它的连接回复503*/
+    int max_events;             /*一次epoll_wait最多取回的事件数*/
+    int read_buffer;
+    int write_buffer;
+    long sendfile_threshold;    /*文件缓存按它决定为哪些文件建立共享映射*/
+    std::string proxy_routes;
+    std::string fastcgi_routes;
+    std::string upgrade_socket; /*不停机升级时交接监听socket的Unix域地址 空表示不支持*/
+    int workers;                /*prefork模式的worker进程数 0表示单进程*/
+
+    /*可重新加载*/
+    int threads;                /*线程池的线程数*/
+    int queue;                  /*线程池请求队列的容量*/
+    int backlog;                /*监听队列的长度 重新调用listen生效*/
+    int send_timeout;           /*慢速客户端: 没有进展的秒数*/
+    int idle_timeout;           /*等待下一个请求的最长秒数 0表示不限制*/
+    long high_water;            /*慢速客户端: 未发送数据的高水位*/
+    double slow_ms;             /*慢请求阈值 0表示不记录*/
+    long busy_poll_us;          /*主循环空转的微秒数*/
+    int file_cache_entries;
+    long file_cache_bytes;
+    long compress_cache_bytes;
+    long content_cache_bytes;
+    std::string rate_limit;
+    std::string admission;
+    int drain_timeout;          /*升级后旧进程等待已接受的请求处理完的最长秒数*/
+
+public:
+    /*各项的默认值*/
+    server_config();
+
+    /*按优先级依次读取配置文件、环境变量和命令行 出错时打印原因并返回false*/
+    bool load(int argc, char* argv[]);
+    /*设置名为key的项 key不存在或value格式错误时返回false*/
+    bool set(const std::string& key, const std::string& value);
+    /*与other取值不同的项 reloadable选择可重新加载的项或只在启动时生效的项*/
+    std::vector<std::string> changed(const server_config& other, bool reloadable) const;
+    /*名为key的项的取值 用于打印*/
+    std::string get(const std::string& key) const;
+
+    static void usage(const char* prog);
+
+private:
+    bool load_file(const char* path);
+};
+
+#endif
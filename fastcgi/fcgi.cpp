@@ -0,0 +1,1536 @@
+#include"fcgi.h"
+
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<sys/uio.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<strings.h>
+#include<cstring>
+
+#include"../metrics/metrics.h"
+
+/*FastCGI 1.0的记录类型和常量*/
+enum FCGI_TYPE{
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+    FCGI_DATA = 8,
+    FCGI_GET_VALUES = 9,
+    FCGI_GET_VALUES_RESULT = 10
+};
+static const int FCGI_HEADER_LEN = 8;
+static const int FCGI_RESPONDER = 1;
+static const int FCGI_KEEP_CONN = 1;
+/*发送缓冲区末尾为空的STDIN和ABORT_REQUEST两条记录保留的空间*/
+static const int SEND_RESERVE = 2 * FCGI_HEADER_LEN;
+/*输出缓冲区末尾为chunked的结束块保留的空间*/
+static const int OUT_RESERVE = 8;
+
+/*记录头: 版本 类型 request id(2字节) 内容长度(2字节) 填充长度 保留*/
+static void put_header(char* p, int type, int id, int len)
+{
+    p[0] = 1;
+    p[1] = (char)type;
+    p[2] = (char)(id >> 8);
+    p[3] = (char)id;
+    p[4] = (char)(len >> 8);
+    p[5] = (char)len;
+    p[6] = 0;
+    p[7] = 0;
+}
+
+/*读取名值对的一个长度 返回读取的字节数 数据不足时返回0*/
+static int get_length(const unsigned char* p, int n, int* len)
+{
+    if(n < 1)
+    {
+        return 0;
+    }
+    if(p[0] < 128)
+    {
+        *len = p[0];
+        return 1;
+    }
+    if(n < 4)
+    {
+        return 0;
+    }
+    *len = ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    return 4;
+}
+
+static const char* status_reason(int status)
+{
+    switch(status)
+    {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+fcgi_request::fcgi_request()
+: m_pool(nullptr), m_route(nullptr), m_conn(nullptr), m_client(nullptr), m_next(nullptr), m_send_next(nullptr),
+  m_send(nullptr), m_head(nullptr), m_out(nullptr)
+{
+}
+
+fcgi_request::~fcgi_request()
+{
+    delete [] m_send;
+}
+
+void fcgi_request::append_record(int type, const char* data, int len)
+{
+    put_header(m_send + m_send_len, type, m_id, len);
+    if(len)
+    {
+        memcpy(m_send + m_send_len + FCGI_HEADER_LEN, data, len);
+    }
+    m_send_len += FCGI_HEADER_LEN + len;
+}
+
+http_conn::WRITE_RESULT fcgi_request::start(http_conn* client, fcgi_route* route)
+{
+    if(!m_send)
+    {
+        m_send = new char[SEND_BUFFER_SIZE + HEAD_BUFFER_SIZE + OUT_BUFFER_SIZE];
+        m_head = m_send + SEND_BUFFER_SIZE;
+        m_out = m_head + HEAD_BUFFER_SIZE;
+    }
+    m_route = route;
+    m_conn = nullptr;
+    m_client = client;
+    m_next = nullptr;
+    m_send_next = nullptr;
+    m_id = 0;
+    m_queued = false;
+    m_want_body = false;
+    m_reading = false;
+    m_stdin_done = false;
+    m_client_blocked = false;
+    m_armed = 0;
+    m_headers_done = false;
+    m_chunked = false;
+    m_ended = false;
+    m_relayed = false;
+    m_client_keep = client->keep_alive();
+    m_status = 0;
+    m_length = -1;
+    m_since = time(NULL);
+    m_send_len = 0;
+    m_send_off = 0;
+    m_head_len = 0;
+    m_out_len = 0;
+    m_out_off = 0;
+    client->enable_nodelay();
+
+    /*request id在主线程分配到连接后写入 见set_id*/
+    const char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    append_record(FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+    int room = SEND_BUFFER_SIZE - m_send_len - 2 * FCGI_HEADER_LEN - SEND_RESERVE;
+    int params = client->fastcgi_params(m_send + m_send_len + FCGI_HEADER_LEN, room < 65535 ? room : 65535);
+    const char* body = 0;
+    int body_len = client->buffered_body(&body);
+    m_body_left = client->content_length() - body_len;
+    if(params < 0 || m_send_len + 3 * FCGI_HEADER_LEN + params + body_len + FCGI_HEADER_LEN > SEND_BUFFER_SIZE - SEND_RESERVE)
+    {
+        printf("fastcgi %s: request headers too large\n", route->addr.spec.c_str());
+        metrics::add(FASTCGI_ERRORS);
+        m_client = nullptr;
+        m_pool->release(this);
+        return client->backend_failed();
+    }
+    put_header(m_send + m_send_len, FCGI_PARAMS, 0, params);
+    m_send_len += FCGI_HEADER_LEN + params;
+    append_record(FCGI_PARAMS, 0, 0);
+    if(body_len)
+    {
+        append_record(FCGI_STDIN, body, body_len);
+    }
+    if(m_body_left == 0)
+    {
+        append_record(FCGI_STDIN, 0, 0);
+        m_stdin_done = true;
+    }
+    metrics::add(FASTCGI_REQUESTS);
+    m_pool->submit(this);
+    return http_conn::WRITE_AGAIN;
+}
+
+void fcgi_request::set_id(int id)
+{
+    m_id = id;
+    for(int off = 0; off < m_send_len; )
+    {
+        unsigned char* p = (unsigned char*)m_send + off;
+        p[2] = (unsigned char)(id >> 8);
+        p[3] = (unsigned char)id;
+        off += FCGI_HEADER_LEN + ((p[4] << 8) | p[5]) + p[6];
+    }
+}
+
+/*
+丢弃还没有发出的记录 正在发送的记录必须完整发出 否则连接上的记录边界会错位
+返回后m_send[m_send_off, m_send_len)只剩正在发送的那条记录的剩余部分
+*/
+void fcgi_request::trim_send()
+{
+    for(int off = 0; off < m_send_len; )
+    {
+        const unsigned char* p = (const unsigned char*)m_send + off;
+        int end = off + FCGI_HEADER_LEN + ((p[4] << 8) | p[5]) + p[6];
+        if(m_send_off < end)
+        {
+            m_send_len = (m_send_off == off) ? off : end;
+            return;
+        }
+        off = end;
+    }
+}
+
+void fcgi_request::on_sent()
+{
+    m_queued = false;
+    m_send_len = 0;
+    m_send_off = 0;
+    if(m_ended)
+    {
+        m_conn = nullptr;
+        maybe_release();
+        return;
+    }
+    if(m_client && m_body_left > 0)
+    {
+        m_want_body = true;
+        if(!m_reading)
+        {
+            update_client();
+        }
+    }
+}
+
+void fcgi_request::maybe_release()
+{
+    if(m_ended && !m_queued && !m_client)
+    {
+        m_conn = nullptr;
+        m_pool->release(this);
+    }
+}
+
+/*客户socket的EPOLLONESHOT事件到达后需要重新注册 只有需要的事件变化时才调用epoll_ctl*/
+void fcgi_request::update_client()
+{
+    if(!m_client)
+    {
+        return;
+    }
+    int ev = 0;
+    if(m_want_body && !m_queued)
+    {
+        ev |= EPOLLIN;
+    }
+    if(m_client_blocked)
+    {
+        ev |= EPOLLOUT;
+    }
+    if(ev && ev != m_armed)
+    {
+        m_client->wait_client(ev);
+        m_armed = ev;
+    }
+}
+
+/*
+每次读出的请求体作为一条STDIN记录 发出后再读下一段 应用读得慢时客户的请求体留在socket中
+一次最多读READ_BUDGET字节 之后由update_client重新注册客户的EPOLLIN 还有数据时下一轮立即返回该事件
+*/
+void fcgi_request::read_body()
+{
+    m_reading = true;
+    long budget = http_conn::READ_BUDGET;
+    while(m_client && m_want_body && !m_queued && budget > 0)
+    {
+        int room = SEND_BUFFER_SIZE - FCGI_HEADER_LEN - SEND_RESERVE;
+        int want = m_body_left < room ? (int)m_body_left : room;
+        ssize_t n = recv(m_client->sockfd(), m_send + FCGI_HEADER_LEN, want, 0);
+        metrics::add(SYSCALLS);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if(n <= 0)
+        {
+            /*请求体没有发完客户就关闭了连接*/
+            m_reading = false;
+            drop_client();
+            return;
+        }
+        metrics::add(BYTES_IN, n);
+        budget -= n;
+        put_header(m_send, FCGI_STDIN, m_id, n);
+        m_send_len = FCGI_HEADER_LEN + n;
+        m_send_off = 0;
+        m_body_left -= n;
+        if(m_body_left == 0)
+        {
+            append_record(FCGI_STDIN, 0, 0);
+            m_stdin_done = true;
+            m_want_body = false;
+        }
+        m_conn->enqueue(this);
+        m_conn->flush();
+    }
+    m_reading = false;
+}
+
+http_conn::WRITE_RESULT fcgi_request::on_client_event()
+{
+    m_armed = 0;
+    if(m_want_body)
+    {
+        read_body();
+        if(!m_client)
+        {
+            return http_conn::WRITE_AGAIN;
+        }
+    }
+    if(m_out_off < m_out_len)
+    {
+        /*relay之后请求可能已经结束并被回收 先取出连接*/
+        fcgi_conn* conn = m_conn;
+        bool paused = conn && conn->m_paused == this;
+        int ret = relay();
+        if(ret == 0)
+        {
+            return http_conn::WRITE_AGAIN;
+        }
+        if(ret > 0)
+        {
+            update_client();
+        }
+        if(paused)
+        {
+            conn->resume();
+        }
+        return http_conn::WRITE_AGAIN;
+    }
+    update_client();
+    return http_conn::WRITE_AGAIN;
+}
+
+int fcgi_request::deliver(const char* p, int n)
+{
+    if(!m_client)
+    {
+        return n;
+    }
+    int used = 0;
+    if(!m_headers_done)
+    {
+        int take = n < HEAD_BUFFER_SIZE - m_head_len ? n : HEAD_BUFFER_SIZE - m_head_len;
+        memcpy(m_head + m_head_len, p, take);
+        m_head_len += take;
+        used = take;
+        int body = parse_head();
+        if(body < 0)
+        {
+            fail();
+            return n;
+        }
+        if(body == 0)
+        {
+            return n;
+        }
+        /*与响应头一起读入的消息体 输出缓冲区此时只有响应头 一定放得下*/
+        put_body(m_head + body, m_head_len - body);
+    }
+    while(true)
+    {
+        used += put_body(p + used, n - used);
+        int ret = relay();
+        if(ret < 0)
+        {
+            return n;
+        }
+        if(ret == 0 || used == n)
+        {
+            return used;
+        }
+    }
+}
+
+/*把消息体写入输出缓冲区 返回写入的字节数 缓冲区满时返回值小于n*/
+int fcgi_request::put_body(const char* p, int n)
+{
+    int space = OUT_BUFFER_SIZE - OUT_RESERVE - m_out_len;
+    if(m_length >= 0)
+    {
+        /*超出Content-Length的部分丢弃*/
+        int take = n;
+        if(take > m_length)
+        {
+            take = (int)m_length;
+        }
+        if(take > space)
+        {
+            take = space;
+        }
+        memcpy(m_out + m_out_len, p, take);
+        m_out_len += take;
+        m_length -= take;
+        return m_length == 0 ? n : take;
+    }
+    if(!m_chunked)
+    {
+        return n;
+    }
+    /*块大小行最长为6位十六进制数加CRLF 块数据之后再加CRLF*/
+    int take = n < space - 10 ? n : space - 10;
+    if(take <= 0 || n == 0)
+    {
+        return 0;
+    }
+    m_out_len += sprintf(m_out + m_out_len, "%x\r\n", take);
+    memcpy(m_out + m_out_len, p, take);
+    m_out_len += take;
+    m_out[m_out_len++] = '\r';
+    m_out[m_out_len++] = '\n';
+    return take;
+}
+
+/*
+CGI响应头以空行结束(CRLF或LF) 返回消息体在m_head中的起始位置 0表示需要更多数据 -1出错
+Status给出状态码 只有Location时为302 Content-Length原样保留 没有时改用chunked编码
+*/
+int fcgi_request::parse_head()
+{
+    int end = -1;
+    for(int i = 0; i + 1 < m_head_len; ++i)
+    {
+        if(m_head[i] != '\n')
+        {
+            continue;
+        }
+        if(m_head[i + 1] == '\n')
+        {
+            end = i + 2;
+            break;
+        }
+        if(m_head[i + 1] == '\r' && i + 2 < m_head_len && m_head[i + 2] == '\n')
+        {
+            end = i + 3;
+            break;
+        }
+    }
+    if(end < 0)
+    {
+        return m_head_len == HEAD_BUFFER_SIZE ? -1 : 0;
+    }
+
+    int status = 0;
+    const char* reason = 0;
+    int reason_len = 0;
+    bool location = false;
+    /*状态行在头部行之后才能确定 先把头部行写到状态行预留空间之后*/
+    const int line_room = 64;
+    int out = line_room;
+    for(int pos = 0; pos < end; )
+    {
+        char* eol = (char*)memchr(m_head + pos, '\n', end - pos);
+        int len = eol - (m_head + pos);
+        const char* line = m_head + pos;
+        pos += len + 1;
+        if(len > 0 && line[len - 1] == '\r')
+        {
+            --len;
+        }
+        if(len == 0)
+        {
+            break;
+        }
+        if(len > 7 && strncasecmp(line, "Status:", 7) == 0)
+        {
+            const char* v = line + 7 + strspn(line + 7, " \t");
+            status = atoi(v);
+            const char* sp = (const char*)memchr(v, ' ', line + len - v);
+            if(sp)
+            {
+                reason = sp + 1;
+                reason_len = line + len - reason;
+            }
+            continue;
+        }
+        if(len > 15 && strncasecmp(line, "Content-Length:", 15) == 0)
+        {
+            m_length = strtoll(line + 15, NULL, 10);
+        }
+        else if((len > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0) ||
+                (len > 11 && strncasecmp(line, "Connection:", 11) == 0) ||
+                (len > 11 && strncasecmp(line, "Keep-Alive:", 11) == 0))
+        {
+            continue;
+        }
+        else if(len > 9 && strncasecmp(line, "Location:", 9) == 0)
+        {
+            location = true;
+        }
+        if(out + len + 2 > OUT_BUFFER_SIZE - 128)
+        {
+            return -1;
+        }
+        memcpy(m_out + out, line, len);
+        out += len;
+        m_out[out++] = '\r';
+        m_out[out++] = '\n';
+    }
+    if(status == 0)
+    {
+        status = location ? 302 : 200;
+    }
+    if(status < 200 || status > 999)
+    {
+        return -1;
+    }
+    if(!reason || reason_len <= 0 || reason_len > 32)
+    {
+        reason = status_reason(status);
+        reason_len = strlen(reason);
+    }
+    if(status == 204 || status == 304)
+    {
+        m_length = 0;
+    }
+    else if(m_length < 0)
+    {
+        m_chunked = true;
+        out += sprintf(m_out + out, "Transfer-Encoding: chunked\r\n");
+    }
+    out += sprintf(m_out + out, m_client_keep ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+
+    char line[line_room + 32];
+    int line_len = snprintf(line, sizeof(line), "HTTP/1.1 %d %.*s\r\n", status, reason_len, reason);
+    m_out_off = line_room - line_len;
+    memcpy(m_out + m_out_off, line, line_len);
+    m_out_len = out;
+    m_status = status;
+    m_headers_done = true;
+    return end;
+}
+
+int fcgi_request::relay()
+{
+    while(m_out_off < m_out_len)
+    {
+        ssize_t n = send(m_client->sockfd(), m_out + m_out_off, m_out_len - m_out_off, MSG_NOSIGNAL);
+        metrics::add(SYSCALLS);
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                m_client_blocked = true;
+                update_client();
+                return 0;
+            }
+            drop_client();
+            return -1;
+        }
+        m_relayed = true;
+        metrics::add(BYTES_OUT, n);
+        m_out_off += n;
+    }
+    m_out_off = 0;
+    m_out_len = 0;
+    m_client_blocked = false;
+    if(m_ended)
+    {
+        finish();
+        return -1;
+    }
+    return 1;
+}
+
+void fcgi_request::on_end()
+{
+    m_ended = true;
+    m_want_body = false;
+    if(m_queued)
+    {
+        /*应用已结束请求 还没有发出的请求体不再需要*/
+        trim_send();
+        if(m_send_off == m_send_len)
+        {
+            m_conn->unlink(this);
+        }
+    }
+    if(!m_queued)
+    {
+        m_conn = nullptr;
+    }
+    if(!m_client)
+    {
+        maybe_release();
+        return;
+    }
+    if(!m_headers_done)
+    {
+        fail();
+        return;
+    }
+    if(m_chunked)
+    {
+        memcpy(m_out + m_out_len, "0\r\n\r\n", 5);
+        m_out_len += 5;
+    }
+    relay();
+}
+
+void fcgi_request::finish()
+{
+    http_conn* client = m_client;
+    int status = m_status;
+    /*消息体比Content-Length短或请求体没有读完时 客户端只能通过关闭连接得知响应结束*/
+    bool keep = m_client_keep && m_length <= 0 && m_body_left == 0;
+    m_client = nullptr;
+    maybe_release();
+    m_pool->done(client, client->backend_done(status, keep));
+}
+
+void fcgi_request::fail()
+{
+    http_conn* client = m_client;
+    bool relayed = m_relayed;
+    metrics::add(FASTCGI_ERRORS);
+    m_client = nullptr;
+    if(!m_ended)
+    {
+        abort_app();
+    }
+    maybe_release();
+    if(relayed)
+    {
+        client->backend_abort();
+        m_pool->done(client, http_conn::WRITE_CLOSE);
+        return;
+    }
+    m_pool->done(client, client->backend_failed());
+}
+
+/*客户连接出错 通知应用放弃请求后关闭客户连接*/
+void fcgi_request::drop_client()
+{
+    http_conn* client = m_client;
+    client->backend_abort();
+    abort();
+    m_pool->done(client, http_conn::WRITE_CLOSE);
+}
+
+void fcgi_request::abort()
+{
+    m_client = nullptr;
+    m_client_blocked = false;
+    if(!m_ended)
+    {
+        if(m_conn)
+        {
+            abort_app();
+        }
+        else
+        {
+            /*还在路由的等待队列中 应用还不知道这个请求*/
+            m_pool->unwait(this);
+            m_ended = true;
+        }
+    }
+    maybe_release();
+}
+
+/*请求体没有发完时先以空的STDIN结束输入流 再发ABORT_REQUEST 应用随后以END_REQUEST确认*/
+void fcgi_request::abort_app()
+{
+    m_want_body = false;
+    if(m_conn->m_paused == this)
+    {
+        /*之后这个请求的输出直接丢弃 连接可以继续处理记录*/
+        m_conn->m_paused = nullptr;
+        m_conn->kick();
+    }
+    if(m_queued)
+    {
+        trim_send();
+    }
+    else
+    {
+        m_send_len = 0;
+        m_send_off = 0;
+    }
+    if(!m_stdin_done)
+    {
+        append_record(FCGI_STDIN, 0, 0);
+        m_stdin_done = true;
+    }
+    append_record(FCGI_ABORT_REQUEST, 0, 0);
+    if(!m_queued)
+    {
+        m_conn->enqueue(this);
+    }
+    m_conn->flush();
+}
+
+fcgi_conn::fcgi_conn()
+: m_fd(-1), m_state(CLOSED), m_broken(false), m_pool(nullptr), m_route(nullptr), m_next(nullptr), m_active(0),
+  m_queue_head(nullptr), m_queue_tail(nullptr), m_paused(nullptr), m_in(nullptr)
+{
+    memset(m_slots, 0, sizeof(m_slots));
+}
+
+fcgi_conn::~fcgi_conn()
+{
+    close_socket();
+    delete [] m_in;
+}
+
+void fcgi_conn::close_socket()
+{
+    if(m_fd != -1)
+    {
+        close(m_fd);
+        metrics::add(SYSCALLS);
+        m_fd = -1;
+    }
+    m_state = CLOSED;
+}
+
+bool fcgi_conn::open(fcgi_route* route)
+{
+    const listen_addr& addr = route->addr;
+    m_fd = socket(addr.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    metrics::add(SYSCALLS);
+    if(m_fd < 0)
+    {
+        return false;
+    }
+    if(addr.is_inet())
+    {
+        int one = 1;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    /*Unix域socket的connect通常立即完成 监听队列满时返回EAGAIN 视为失败*/
+    int ret = connect(m_fd, (const struct sockaddr*)&addr.addr, addr.len);
+    metrics::add(SYSCALLS);
+    if(ret == 0)
+    {
+        m_state = READY;
+    }
+    else if(errno == EINPROGRESS)
+    {
+        m_state = CONNECTING;
+    }
+    else
+    {
+        printf("fastcgi %s: connect failed: %s\n", addr.spec.c_str(), strerror(errno));
+        close_socket();
+        return false;
+    }
+    if(!m_in)
+    {
+        m_in = new char[IN_BUFFER_SIZE];
+    }
+    m_route = route;
+    m_broken = false;
+    m_active = 0;
+    m_max_requests = 1;
+    memset(m_slots, 0, sizeof(m_slots));
+    m_queue_head = nullptr;
+    m_queue_tail = nullptr;
+    m_paused = nullptr;
+    m_in_len = 0;
+    m_in_off = 0;
+    m_header_got = 0;
+    m_record_len = 0;
+    m_last_progress = time(NULL);
+    m_idle_since = m_last_progress;
+
+    /*询问应用能否在一条连接上同时处理多个请求 值为空*/
+    static const char query[] = "\x0e\x00" "FCGI_MAX_REQS" "\x0f\x00" "FCGI_MPXS_CONNS";
+    int query_len = sizeof(query) - 1;
+    put_header(m_mgmt, FCGI_GET_VALUES, 0, query_len);
+    memcpy(m_mgmt + FCGI_HEADER_LEN, query, query_len);
+    m_mgmt_len = FCGI_HEADER_LEN + query_len;
+    m_mgmt_off = 0;
+
+    /*不使用EPOLLONESHOT 只有主线程处理应用连接 ET模式下读写事件各自在状态变化时到达*/
+    struct epoll_event event;
+    event.data.ptr = this;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_ADD, m_fd, &event);
+    metrics::add(SYSCALLS);
+    metrics::add(FASTCGI_CONNECTS);
+    return true;
+}
+
+/*重新注册相同的事件 EPOLL_CTL_MOD会立即检查就绪状态 socket可写或出错时马上产生一次事件*/
+void fcgi_conn::kick()
+{
+    struct epoll_event event;
+    event.data.ptr = this;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_MOD, m_fd, &event);
+    metrics::add(SYSCALLS);
+}
+
+void fcgi_conn::defer_failure()
+{
+    if(!m_broken)
+    {
+        m_broken = true;
+        kick();
+    }
+}
+
+void fcgi_conn::assign(fcgi_request* req)
+{
+    int id = 1;
+    while(m_slots[id])
+    {
+        ++id;
+    }
+    m_slots[id] = req;
+    if(m_active++ == 0)
+    {
+        m_last_progress = time(NULL);
+    }
+    req->m_conn = this;
+    req->set_id(id);
+    enqueue(req);
+    flush();
+}
+
+void fcgi_conn::enqueue(fcgi_request* req)
+{
+    req->m_queued = true;
+    req->m_send_next = nullptr;
+    if(m_queue_tail)
+    {
+        m_queue_tail->m_send_next = req;
+    }
+    else
+    {
+        m_queue_head = req;
+    }
+    m_queue_tail = req;
+}
+
+void fcgi_conn::unlink(fcgi_request* req)
+{
+    fcgi_request** link = &m_queue_head;
+    fcgi_request* prev = nullptr;
+    while(*link && *link != req)
+    {
+        prev = *link;
+        link = &prev->m_send_next;
+    }
+    if(*link)
+    {
+        *link = req->m_send_next;
+        if(m_queue_tail == req)
+        {
+            m_queue_tail = prev;
+        }
+    }
+    req->m_queued = false;
+    req->m_send_next = nullptr;
+}
+
+/*
+管理记录和队列中各请求的记录合并为一次sendmsg 写满时等待EPOLLOUT
+发送完的请求在on_sent中可能开始读客户的请求体 或者被回收
+*/
+void fcgi_conn::flush()
+{
+    if(m_state != READY || m_broken)
+    {
+        return;
+    }
+    while(m_mgmt_off < m_mgmt_len || m_queue_head)
+    {
+        struct iovec iv[16];
+        int count = 0;
+        if(m_mgmt_off < m_mgmt_len)
+        {
+            iv[count].iov_base = m_mgmt + m_mgmt_off;
+            iv[count].iov_len = m_mgmt_len - m_mgmt_off;
+            ++count;
+        }
+        for(fcgi_request* r = m_queue_head; r && count < 16; r = r->m_send_next)
+        {
+            iv[count].iov_base = r->m_send + r->m_send_off;
+            iv[count].iov_len = r->m_send_len - r->m_send_off;
+            ++count;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iv;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+        metrics::add(SYSCALLS);
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                defer_failure();
+            }
+            return;
+        }
+        m_last_progress = time(NULL);
+        int mgmt = m_mgmt_len - m_mgmt_off;
+        if(n < mgmt)
+        {
+            m_mgmt_off += n;
+            continue;
+        }
+        m_mgmt_off = m_mgmt_len;
+        n -= mgmt;
+        while(m_queue_head)
+        {
+            fcgi_request* r = m_queue_head;
+            int left = r->m_send_len - r->m_send_off;
+            if(n < left)
+            {
+                r->m_send_off += n;
+                break;
+            }
+            n -= left;
+            r->m_send_off = r->m_send_len;
+            m_queue_head = r->m_send_next;
+            if(!m_queue_head)
+            {
+                m_queue_tail = nullptr;
+            }
+            r->m_send_next = nullptr;
+            r->on_sent();
+        }
+    }
+}
+
+void fcgi_conn::on_event(uint32_t events)
+{
+    if(m_state == CLOSED)
+    {
+        return;
+    }
+    if(m_broken)
+    {
+        fail("write failed");
+        return;
+    }
+    if(m_state == CONNECTING)
+    {
+        if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            return;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        metrics::add(SYSCALLS);
+        if(err != 0)
+        {
+            fail(strerror(err));
+            return;
+        }
+        m_state = READY;
+    }
+    if(events & EPOLLOUT)
+    {
+        flush();
+        if(m_broken)
+        {
+            fail("write failed");
+            return;
+        }
+    }
+    if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        read_input();
+    }
+}
+
+void fcgi_conn::resume()
+{
+    m_paused = nullptr;
+    read_input();
+}
+
+/*一次最多读入READ_BUDGET字节 之后重新注册事件 没有读完的记录在下一轮epoll_wait中继续*/
+void fcgi_conn::read_input()
+{
+    long budget = http_conn::READ_BUDGET;
+    while(m_state == READY)
+    {
+        int ret = process_input();
+        if(ret < 0)
+        {
+            fail("malformed record");
+            return;
+        }
+        if(ret == 0)
+        {
+            return;
+        }
+        if(budget <= 0)
+        {
+            kick();
+            return;
+        }
+        ssize_t n = recv(m_fd, m_in, IN_BUFFER_SIZE, 0);
+        metrics::add(SYSCALLS);
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                fail(strerror(errno));
+            }
+            return;
+        }
+        if(n == 0)
+        {
+            /*没有进行中的请求时应用关闭空闲连接是正常的*/
+            fail(m_active ? "connection closed by application" : nullptr);
+            return;
+        }
+        m_in_len = n;
+        m_in_off = 0;
+        m_last_progress = time(NULL);
+        budget -= n;
+    }
+}
+
+/*
+逐条解析记录: 记录头、内容、填充 内容可以分多次到达 STDOUT的内容直接交给对应的请求
+返回1已处理完m_in中的数据 0客户写满而暂停 -1记录格式错误
+*/
+int fcgi_conn::process_input()
+{
+    while(true)
+    {
+        if(m_header_got == FCGI_HEADER_LEN && m_content_left == 0)
+        {
+            if(!m_record_done)
+            {
+                m_record_done = true;
+                on_record_end();
+                if(m_state != READY)
+                {
+                    return 1;
+                }
+            }
+            if(m_padding_left == 0)
+            {
+                m_header_got = 0;
+            }
+        }
+        if(m_in_off == m_in_len)
+        {
+            m_in_off = 0;
+            m_in_len = 0;
+            return 1;
+        }
+        int avail = m_in_len - m_in_off;
+        if(m_header_got < FCGI_HEADER_LEN)
+        {
+            int take = FCGI_HEADER_LEN - m_header_got < avail ? FCGI_HEADER_LEN - m_header_got : avail;
+            memcpy(m_header + m_header_got, m_in + m_in_off, take);
+            m_header_got += take;
+            m_in_off += take;
+            if(m_header_got == FCGI_HEADER_LEN)
+            {
+                if(m_header[0] != 1)
+                {
+                    return -1;
+                }
+                m_type = m_header[1];
+                m_id = (m_header[2] << 8) | m_header[3];
+                m_content_left = (m_header[4] << 8) | m_header[5];
+                m_padding_left = m_header[6];
+                m_record_len = 0;
+                m_record_done = false;
+            }
+            continue;
+        }
+        if(m_content_left > 0)
+        {
+            int n = m_content_left < avail ? m_content_left : avail;
+            const char* p = m_in + m_in_off;
+            int used = n;
+            fcgi_request* req = (m_id >= 1 && m_id <= MAX_REQUESTS) ? m_slots[m_id] : nullptr;
+            if(m_type == FCGI_STDOUT)
+            {
+                if(req)
+                {
+                    used = req->deliver(p, n);
+                }
+            }
+            else if(m_type == FCGI_STDERR)
+            {
+                printf("fastcgi %s: %.*s\n", m_route->addr.spec.c_str(), n, p);
+            }
+            else if(m_type == FCGI_END_REQUEST || m_type == FCGI_GET_VALUES_RESULT)
+            {
+                int take = n < (int)sizeof(m_record) - m_record_len ? n : (int)sizeof(m_record) - m_record_len;
+                memcpy(m_record + m_record_len, p, take);
+                m_record_len += take;
+            }
+            m_in_off += used;
+            m_content_left -= used;
+            if(used < n)
+            {
+                m_paused = req;
+                return 0;
+            }
+            continue;
+        }
+        int skip = m_padding_left < avail ? m_padding_left : avail;
+        m_in_off += skip;
+        m_padding_left -= skip;
+    }
+}
+
+void fcgi_conn::on_record_end()
+{
+    if(m_type == FCGI_END_REQUEST)
+    {
+        fcgi_request* req = (m_id >= 1 && m_id <= MAX_REQUESTS) ? m_slots[m_id] : nullptr;
+        if(!req)
+        {
+            return;
+        }
+        /*END_REQUEST的内容: appStatus(4字节) protocolStatus(1字节) 非0表示应用拒绝了请求(如不支持多路复用)*/
+        if(m_record_len >= 5 && m_record[4] != 0)
+        {
+            printf("fastcgi %s: request rejected, protocol status %d\n", m_route->addr.spec.c_str(), m_record[4]);
+        }
+        release_slot(m_id);
+        req->on_end();
+        m_pool->pump(m_route);
+    }
+    else if(m_type == FCGI_GET_VALUES_RESULT)
+    {
+        int max_reqs = MAX_REQUESTS;
+        bool mpxs = false;
+        const unsigned char* p = (const unsigned char*)m_record;
+        int left = m_record_len;
+        while(left > 0)
+        {
+            int name_len, value_len;
+            int a = get_length(p, left, &name_len);
+            int b = a ? get_length(p + a, left - a, &value_len) : 0;
+            if(!b || a + b + name_len + value_len > left)
+            {
+                break;
+            }
+            std::string name((const char*)p + a + b, name_len);
+            std::string value((const char*)p + a + b + name_len, value_len);
+            if(name == "FCGI_MPXS_CONNS")
+            {
+                mpxs = atoi(value.c_str()) != 0;
+            }
+            else if(name == "FCGI_MAX_REQS" && atoi(value.c_str()) > 0)
+            {
+                max_reqs = atoi(value.c_str());
+            }
+            p += a + b + name_len + value_len;
+            left -= a + b + name_len + value_len;
+        }
+        m_max_requests = mpxs ? (max_reqs < MAX_REQUESTS ? max_reqs : MAX_REQUESTS) : 1;
+        m_pool->pump(m_route);
+    }
+}
+
+void fcgi_conn::release_slot(int id)
+{
+    m_slots[id] = nullptr;
+    if(--m_active == 0)
+    {
+        m_idle_since = time(NULL);
+    }
+}
+
+/*
+关闭连接 其上的请求都已失败: 还没有向客户发出数据的返回502 否则关闭客户连接
+等待队列中的请求随后改用其他连接或新建的连接
+*/
+void fcgi_conn::fail(const char* reason)
+{
+    if(reason)
+    {
+        printf("fastcgi %s: %s\n", m_route->addr.spec.c_str(), reason);
+        metrics::add(FASTCGI_ERRORS);
+    }
+    close_socket();
+    m_paused = nullptr;
+    fcgi_request* queued = m_queue_head;
+    m_queue_head = nullptr;
+    m_queue_tail = nullptr;
+    while(queued)
+    {
+        fcgi_request* r = queued;
+        queued = r->m_send_next;
+        r->m_send_next = nullptr;
+        r->m_queued = false;
+        if(r->m_ended)
+        {
+            r->maybe_release();
+        }
+    }
+    for(int id = 1; id <= MAX_REQUESTS; ++id)
+    {
+        fcgi_request* req = m_slots[id];
+        if(!req)
+        {
+            continue;
+        }
+        m_slots[id] = nullptr;
+        req->m_ended = true;
+        req->m_conn = nullptr;
+        if(req->m_client)
+        {
+            req->fail();
+        }
+        else
+        {
+            req->maybe_release();
+        }
+    }
+    m_active = 0;
+    fcgi_route* route = m_route;
+    m_pool->free_conn(this);
+    m_pool->pump(route);
+}
+
+fcgi_pool::fcgi_pool()
+: m_conns(new fcgi_conn[MAX_CONNS]), m_free_conns(nullptr), m_free_tail(nullptr),
+  m_requests(new fcgi_request[MAX_REQUESTS]), m_free_requests(nullptr), m_incoming(nullptr), m_hook(nullptr), m_hook_arg(nullptr)
+{
+    for(int i = 0; i < MAX_CONNS; ++i)
+    {
+        m_conns[i].m_pool = this;
+        free_conn(&m_conns[i]);
+    }
+    for(int i = MAX_REQUESTS - 1; i >= 0; --i)
+    {
+        m_requests[i].m_pool = this;
+        m_requests[i].m_next = m_free_requests;
+        m_free_requests = &m_requests[i];
+    }
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+fcgi_pool::~fcgi_pool()
+{
+    delete [] m_conns;
+    delete [] m_requests;
+    if(m_eventfd != -1)
+    {
+        close(m_eventfd);
+    }
+}
+
+bool fcgi_pool::configure(const char* spec)
+{
+    if(m_eventfd == -1)
+    {
+        printf("fastcgi: eventfd: %s\n", strerror(errno));
+        return false;
+    }
+    std::string list = spec;
+    for(size_t pos = 0; pos <= list.size(); )
+    {
+        size_t comma = list.find(',', pos);
+        if(comma == std::string::npos)
+        {
+            comma = list.size();
+        }
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if(item.empty())
+        {
+            continue;
+        }
+        size_t eq = item.find('=');
+        fcgi_route route;
+        route.wait_head = nullptr;
+        route.wait_tail = nullptr;
+        /*FastCGI没有标准端口 沿用php-fpm的9000*/
+        if(eq == std::string::npos || item[0] != '/' || !route.addr.parse(item.c_str() + eq + 1, 9000))
+        {
+            printf("bad fastcgi route: %s\n", item.c_str());
+            return false;
+        }
+        route.prefix = item.substr(0, eq);
+        m_routes.push_back(route);
+    }
+    /*路由中保存了连接的指针 之后不再增删路由*/
+    m_routes.shrink_to_fit();
+    return true;
+}
+
+fcgi_route* fcgi_pool::match(const char* url)
+{
+    fcgi_route* best = nullptr;
+    for(size_t i = 0; i < m_routes.size(); ++i)
+    {
+        const std::string& prefix = m_routes[i].prefix;
+        if(strncmp(url, prefix.c_str(), prefix.size()) == 0 && (!best || prefix.size() > best->prefix.size()))
+        {
+            best = &m_routes[i];
+        }
+    }
+    return best;
+}
+
+fcgi_request* fcgi_pool::acquire()
+{
+    m_mutex.lock();
+    fcgi_request* req = m_free_requests;
+    if(req)
+    {
+        m_free_requests = req->m_next;
+        req->m_next = nullptr;
+    }
+    m_mutex.unlock();
+    return req;
+}
+
+void fcgi_pool::release(fcgi_request* req)
+{
+    m_mutex.lock();
+    req->m_next = m_free_requests;
+    m_free_requests = req;
+    m_mutex.unlock();
+}
+
+/*交接链表由空变为非空时才写eventfd 主线程取走整个链表前的其他请求不再重复唤醒*/
+void fcgi_pool::submit(fcgi_request* req)
+{
+    m_mutex.lock();
+    req->m_next = m_incoming;
+    m_incoming = req;
+    bool wake = (req->m_next == nullptr);
+    m_mutex.unlock();
+    if(wake)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(m_eventfd, &one, sizeof(one));
+        (void)ret;
+        metrics::add(SYSCALLS);
+    }
+}
+
+void fcgi_pool::on_event(void* ptr, uint32_t events)
+{
+    if(ptr != this)
+    {
+        static_cast<fcgi_conn*>(ptr)->on_event(events);
+        return;
+    }
+    uint64_t count;
+    ssize_t ret = read(m_eventfd, &count, sizeof(count));
+    (void)ret;
+    metrics::add(SYSCALLS);
+    m_mutex.lock();
+    fcgi_request* list = m_incoming;
+    m_incoming = nullptr;
+    m_mutex.unlock();
+    /*链表是后进先出的 反转后按到达顺序发出*/
+    fcgi_request* ordered = nullptr;
+    while(list)
+    {
+        fcgi_request* next = list->m_next;
+        list->m_next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while(ordered)
+    {
+        fcgi_request* req = ordered;
+        ordered = req->m_next;
+        req->m_next = nullptr;
+        dispatch(req);
+    }
+}
+
+void fcgi_pool::dispatch(fcgi_request* req)
+{
+    fcgi_route* route = req->m_route;
+    req->m_next = nullptr;
+    if(route->wait_tail)
+    {
+        route->wait_tail->m_next = req;
+    }
+    else
+    {
+        route->wait_head = req;
+    }
+    route->wait_tail = req;
+    pump(route);
+}
+
+void fcgi_pool::unwait(fcgi_request* req)
+{
+    fcgi_route* route = req->m_route;
+    fcgi_request** link = &route->wait_head;
+    fcgi_request* prev = nullptr;
+    while(*link && *link != req)
+    {
+        prev = *link;
+        link = &prev->m_next;
+    }
+    if(*link)
+    {
+        *link = req->m_next;
+        if(route->wait_tail == req)
+        {
+            route->wait_tail = prev;
+        }
+    }
+    req->m_next = nullptr;
+}
+
+/*已有连接还有空位时优先复用 都满时新建连接 新建失败且没有任何连接时排队的请求全部返回502*/
+fcgi_conn* fcgi_pool::pick(fcgi_route* route)
+{
+    for(size_t i = 0; i < route->conns.size(); ++i)
+    {
+        if(route->conns[i]->has_room())
+        {
+            return route->conns[i];
+        }
+    }
+    if((int)route->conns.size() >= MAX_CONNS_PER_ROUTE || !m_free_conns)
+    {
+        return nullptr;
+    }
+    fcgi_conn* conn = m_free_conns;
+    m_free_conns = conn->m_next;
+    if(!m_free_conns)
+    {
+        m_free_tail = nullptr;
+    }
+    conn->m_next = nullptr;
+    if(!conn->open(route))
+    {
+        free_conn(conn);
+        return nullptr;
+    }
+    route->conns.push_back(conn);
+    return conn;
+}
+
+void fcgi_pool::pump(fcgi_route* route)
+{
+    while(route->wait_head)
+    {
+        fcgi_conn* conn = pick(route);
+        if(!conn)
+        {
+            if(route->conns.empty())
+            {
+                while(route->wait_head)
+                {
+                    fcgi_request* req = route->wait_head;
+                    unwait(req);
+                    req->m_ended = true;
+                    req->fail();
+                }
+            }
+            return;
+        }
+        fcgi_request* req = route->wait_head;
+        unwait(req);
+        conn->assign(req);
+    }
+}
+
+/*空闲槽位按先进先出复用 刚关闭的连接在同一轮epoll事件中不会马上被新连接占用*/
+void fcgi_pool::free_conn(fcgi_conn* conn)
+{
+    fcgi_route* route = conn->m_route;
+    if(route)
+    {
+        for(size_t i = 0; i < route->conns.size(); ++i)
+        {
+            if(route->conns[i] == conn)
+            {
+                route->conns.erase(route->conns.begin() + i);
+                break;
+            }
+        }
+    }
+    conn->m_route = nullptr;
+    conn->m_next = nullptr;
+    if(m_free_tail)
+    {
+        m_free_tail->m_next = conn;
+    }
+    else
+    {
+        m_free_conns = conn;
+    }
+    m_free_tail = conn;
+}
+
+void fcgi_pool::sweep(time_t now)
+{
+    for(size_t i = 0; i < m_routes.size(); ++i)
+    {
+        fcgi_route* route = &m_routes[i];
+        std::vector<fcgi_conn*> conns = route->conns;
+        for(size_t j = 0; j < conns.size(); ++j)
+        {
+            fcgi_conn* conn = conns[j];
+            if(conn->m_active > 0 || conn->m_queue_head)
+            {
+                if(now - conn->m_last_progress >= RESPONSE_TIMEOUT)
+                {
+                    conn->fail("timed out");
+                }
+            }
+            else if(now - conn->m_idle_since >= IDLE_TIMEOUT)
+            {
+                conn->fail(nullptr);
+            }
+        }
+        while(route->wait_head && now - route->wait_head->m_since >= RESPONSE_TIMEOUT)
+        {
+            fcgi_request* req = route->wait_head;
+            printf("fastcgi %s: request queued too long\n", route->addr.spec.c_str());
+            unwait(req);
+            req->m_ended = true;
+            req->fail();
+        }
+    }
+}
@@ -0,0 +1,286 @@
+#ifndef _FCGI_H_
+#define _FCGI_H_
+
+#include<stdint.h>
+#include<time.h>
+#include<string>
+#include<vector>
+
+#include"../lock/myLock.h"
+#include"../net/listener.h"
+#include"../http/http_conn.h"
+#include"../http/backend.h"
+
+class fcgi_request;
+class fcgi_conn;
+class fcgi_pool;
+
+/*主线程中完成的FastCGI请求 对客户连接的处理结果交给主循环(关闭连接或继续处理流水线)*/
+typedef void (*fcgi_done_hook)(http_conn* conn, http_conn::WRITE_RESULT ret, void* arg);
+
+/*路径前缀与应用地址 以及该路由已打开的连接和排队等待连接的请求 只由主线程访问*/
+struct fcgi_route{
+    std::string prefix;
+    listen_addr addr;
+    std::vector<fcgi_conn*> conns;
+    fcgi_request* wait_head;
+    fcgi_request* wait_tail;
+};
+
+/*
+一个交给FastCGI应用的HTTP请求(FastCGI的一个request id):
+    工作线程调用start 把BEGIN_REQUEST、PARAMS和读缓冲区中已有的请求体编码为记录 交给主线程后返回
+    主线程为它选择一条连接、分配request id并发送 请求体剩余的部分从客户socket读出后以STDIN记录继续发送
+    应用的STDOUT记录先解析CGI响应头(Status、Content-Length等)改写为HTTP响应头 消息体写入输出缓冲区转发给客户
+    应用没有给出Content-Length时按chunked编码转发 客户连接仍可保持
+    客户socket写满时停止处理这条连接上的记录 客户可写后继续 同一连接上的其他请求也随之等待
+*/
+class fcgi_request : public backend_request{
+public:
+    /*发往应用的记录(请求头参数、一段请求体)*/
+    static const int SEND_BUFFER_SIZE = 8192;
+    /*应用返回的CGI响应头*/
+    static const int HEAD_BUFFER_SIZE = 4096;
+    /*改写后的响应头和待转发给客户的消息体*/
+    static const int OUT_BUFFER_SIZE = 16384;
+
+public:
+    fcgi_request();
+    ~fcgi_request();
+
+    /*
+    工作线程调用 返回值是对客户连接的处理结果
+    正常时为WRITE_AGAIN 请求已交给主线程 调用者不能再访问该请求和客户连接
+    失败时请求已被释放 客户已在发送502响应 结果与http_conn::write()相同
+    */
+    http_conn::WRITE_RESULT start(http_conn* client, fcgi_route* route);
+    /*主线程在客户socket可读(请求体)或可写时调用 完成时的结果经fcgi_done_hook交给主循环*/
+    http_conn::WRITE_RESULT on_client_event();
+    /*客户连接被关闭 通知应用放弃该请求*/
+    void abort();
+
+private:
+    /*分配到连接后把request id写入各记录头*/
+    void set_id(int id);
+    /*记录全部发出 请求体还有剩余时开始读客户socket*/
+    void on_sent();
+    /*从客户socket读请求体 编码为STDIN记录*/
+    void read_body();
+    /*应用的STDOUT数据 返回接收的字节数 少于n表示客户写满 连接暂停处理记录*/
+    int deliver(const char* p, int n);
+    int parse_head();
+    /*把输出缓冲区发给客户 返回1全部发出 0客户写满 -1出错(请求已结束)*/
+    int relay();
+    /*应用发来END_REQUEST*/
+    void on_end();
+    void finish();
+    /*还没有向客户发出数据时返回502 否则关闭客户连接*/
+    void fail();
+    /*客户socket出错 放弃请求并关闭客户连接*/
+    void drop_client();
+    /*向应用发送ABORT_REQUEST*/
+    void abort_app();
+    /*请求已结束、不在发送队列中且客户已离开时放回空闲链表*/
+    void maybe_release();
+    void trim_send();
+    int put_body(const char* p, int n);
+    /*按需要的事件重新注册客户socket*/
+    void update_client();
+    void append_record(int type, const char* data, int len);
+
+private:
+    friend class fcgi_conn;
+    friend class fcgi_pool;
+
+    fcgi_pool* m_pool;
+    fcgi_route* m_route;
+    fcgi_conn* m_conn;          /*分配到的连接 排队等待时为空*/
+    http_conn* m_client;        /*客户连接被关闭后为空 此后应用的输出被丢弃*/
+    fcgi_request* m_next;       /*空闲链表、交接链表或路由的等待队列*/
+    fcgi_request* m_send_next;  /*连接的发送队列*/
+    int m_id;
+    bool m_queued;              /*在连接的发送队列中*/
+    bool m_want_body;           /*等待客户socket可读*/
+    bool m_reading;             /*正在read_body中 避免重入*/
+    bool m_stdin_done;          /*已编码空的STDIN记录*/
+    bool m_client_blocked;      /*等待客户socket可写*/
+    int m_armed;                /*客户socket已注册的事件 事件到达后清零*/
+    bool m_headers_done;
+    bool m_chunked;             /*按chunked编码转发消息体*/
+    bool m_ended;               /*已收到END_REQUEST*/
+    bool m_relayed;
+    bool m_client_keep;
+    int m_status;
+    int64_t m_length;           /*应用声明的Content-Length中还没有转发的字节数 -1表示没有声明*/
+    long m_body_left;           /*请求体中还没有从客户socket读出的字节数*/
+    time_t m_since;             /*开始排队的时间*/
+
+    /*m_send[m_send_off, m_send_len)是待发往应用的记录*/
+    char* m_send;
+    int m_send_len;
+    int m_send_off;
+    char* m_head;
+    int m_head_len;
+    /*m_out[m_out_off, m_out_len)是待发给客户的数据*/
+    char* m_out;
+    int m_out_len;
+    int m_out_off;
+};
+
+/*
+到FastCGI应用的一条持久连接 由主线程的epoll事件驱动:
+    BEGIN_REQUEST带FCGI_KEEP_CONN 一个请求结束后连接保留 多个请求以request id区分 记录交错收发
+    连接建立后先发FCGI_GET_VALUES询问应用是否支持多路复用(FCGI_MPXS_CONNS)和并发请求数(FCGI_MAX_REQS)
+    收到回答之前只发一个请求 应用不支持多路复用时每条连接同时只有一个请求
+    各请求待发送的记录排成队列 一次sendmsg发出多个请求的记录 socket以ET模式同时注册EPOLLIN和EPOLLOUT
+    发送出错不在当前调用中处理 重新注册事件后由该连接自己的事件统一处理 避免在遍历请求时释放连接
+*/
+class fcgi_conn{
+public:
+    static const int IN_BUFFER_SIZE = 16384;
+    /*一条连接上同时进行的请求数上限 request id为1~MAX_REQUESTS*/
+    static const int MAX_REQUESTS = 32;
+
+    enum STATE{
+        CLOSED = 0,
+        CONNECTING,
+        READY
+    };
+
+public:
+    fcgi_conn();
+    ~fcgi_conn();
+
+private:
+    friend class fcgi_request;
+    friend class fcgi_pool;
+
+    bool open(fcgi_route* route);
+    void on_event(uint32_t events);
+    bool has_room() const { return m_state != CLOSED && m_active < m_max_requests; }
+    void assign(fcgi_request* req);
+    void enqueue(fcgi_request* req);
+    /*从发送队列中移除*/
+    void unlink(fcgi_request* req);
+    void flush();
+    /*客户可写后继续处理暂停的记录*/
+    void resume();
+    /*读取并分发应用的记录 直到EAGAIN或暂停*/
+    void read_input();
+    /*分发m_in中已读入的记录 返回1处理完 0暂停 -1格式错误*/
+    int process_input();
+    void on_record_end();
+    void release_slot(int id);
+    /*连接出错或超时 结束其上的所有请求*/
+    void fail(const char* reason);
+    void close_socket();
+    /*重新注册事件 立即产生一次事件*/
+    void kick();
+    /*发送出错后重新注册事件 由该连接的下一个事件调用fail*/
+    void defer_failure();
+
+private:
+    int m_fd;
+    STATE m_state;
+    bool m_broken;
+    fcgi_pool* m_pool;
+    fcgi_route* m_route;
+    fcgi_conn* m_next;          /*空闲槽位链表*/
+    fcgi_request* m_slots[MAX_REQUESTS + 1];
+    int m_active;
+    int m_max_requests;
+    fcgi_request* m_queue_head;
+    fcgi_request* m_queue_tail;
+    fcgi_request* m_paused;     /*客户写满而暂停处理记录的请求*/
+    time_t m_last_progress;
+    time_t m_idle_since;
+
+    /*连接级的管理记录(FCGI_GET_VALUES)*/
+    char m_mgmt[64];
+    int m_mgmt_len;
+    int m_mgmt_off;
+
+    /*m_in[m_in_off, m_in_len)是已读入未分发的数据*/
+    char* m_in;
+    int m_in_len;
+    int m_in_off;
+    /*当前记录的解析状态*/
+    unsigned char m_header[8];
+    int m_header_got;
+    int m_type;
+    int m_id;
+    int m_content_left;
+    int m_padding_left;
+    bool m_record_done;
+    /*END_REQUEST、GET_VALUES_RESULT的内容较短 收齐后再处理*/
+    char m_record[256];
+    int m_record_len;
+};
+
+/*
+FastCGI的路由表、连接和请求对象 整个事件循环共用一个:
+    连接和请求对象都预先分配 主线程以地址范围区分应用连接的事件
+    工作线程取请求对象、把构造好的请求交给主线程在m_mutex内完成 交接后写eventfd唤醒主线程
+    其余操作(选择连接、收发记录、转发响应、超时)都在主线程中 不需要加锁
+    每个路由最多MAX_CONNS_PER_ROUTE条连接 都满时请求按到达顺序排队 有请求结束时依次发出
+*/
+class fcgi_pool{
+public:
+    static const int MAX_CONNS = 256;
+    static const int MAX_CONNS_PER_ROUTE = 8;
+    static const int MAX_REQUESTS = 1024;
+    static const int IDLE_TIMEOUT = 30;
+    static const int RESPONSE_TIMEOUT = 30;
+
+    fcgi_pool();
+    ~fcgi_pool();
+
+    /*解析"前缀=地址,前缀=地址..." 地址的写法同监听地址 格式错误时返回false*/
+    bool configure(const char* spec);
+    /*最长前缀匹配 没有匹配的路由时返回nullptr*/
+    fcgi_route* match(const char* url);
+    /*工作线程调用 请求对象用完时返回nullptr*/
+    fcgi_request* acquire();
+    /*主线程中完成的请求通过hook交给主循环*/
+    void set_done_hook(fcgi_done_hook hook, void* arg) { m_hook = hook; m_hook_arg = arg; }
+    /*工作线程唤醒主线程的eventfd 事件的data.ptr为fcgi_pool本身*/
+    int event_fd() const { return m_eventfd; }
+    bool owns(void* ptr) const { return ptr == this || (ptr >= (void*)m_conns && ptr < (void*)(m_conns + MAX_CONNS)); }
+    /*主线程调用 eventfd或应用连接的事件*/
+    void on_event(void* ptr, uint32_t events);
+    /*关闭空闲太久的连接 结束没有进展的连接和排队太久的请求 由主线程每秒调用*/
+    void sweep(time_t now);
+
+private:
+    friend class fcgi_request;
+    friend class fcgi_conn;
+
+    void submit(fcgi_request* req);
+    void release(fcgi_request* req);
+    void done(http_conn* client, http_conn::WRITE_RESULT ret) { m_hook(client, ret, m_hook_arg); }
+    /*为请求选择连接 没有可用连接时新建 连接数已满时排队*/
+    void dispatch(fcgi_request* req);
+    /*从路由的等待队列中移除*/
+    void unwait(fcgi_request* req);
+    /*有空位的连接 需要时新建*/
+    fcgi_conn* pick(fcgi_route* route);
+    /*连接有了空位或被关闭后 发出路由中排队的请求*/
+    void pump(fcgi_route* route);
+    void free_conn(fcgi_conn* conn);
+
+private:
+    std::vector<fcgi_route> m_routes;
+    fcgi_conn* m_conns;
+    fcgi_conn* m_free_conns;
+    fcgi_conn* m_free_tail;
+    fcgi_request* m_requests;
+    fcgi_request* m_free_requests;
+    /*工作线程交给主线程的请求*/
+    fcgi_request* m_incoming;
+    int m_eventfd;
+    fcgi_done_hook m_hook;
+    void* m_hook_arg;
+    myMutex m_mutex;
+};
+
+#endif
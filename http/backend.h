@@ -0,0 +1,20 @@
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include"http_conn.h"
+
+/*
+交给后端(反向代理的上游、FastCGI应用)处理的请求:
+    请求进行中时http_conn::m_backend指向它 主线程把客户socket的事件交给on_client_event
+    后端把响应直接写到客户socket 结束时调用http_conn的backend_done/backend_failed/backend_abort
+*/
+class backend_request{
+public:
+    virtual ~backend_request() {}
+    /*客户socket可写 或者可读(请求体还没有读完)*/
+    virtual http_conn::WRITE_RESULT on_client_event() = 0;
+    /*客户连接被关闭 丢弃进行中的响应*/
+    virtual void abort() = 0;
+};
+
+#endif
@@ -1,7 +1,18 @@
 #include"http_conn.h"
+#include"../proxy/upstream.h"
+#include"../fastcgi/fcgi.h"
+#include"../net/rate_limit.h"
+#include"../net/admission.h"
+
+#include<vector>
+#include<algorithm>
+#include<limits>
+#include<sys/ioctl.h>
+#include<linux/sockios.h>
 
 //定义http响应的一些状态信息
 const char *ok_200_title = "OK";
+const char *not_modified_304_title = "Not Modified";
 const char *error_400_title = "Bad Request";
 const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char *error_403_title = "Forbidden";
@@ -10,6 +21,8 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the request file.\n";
+const char *error_502_title = "Bad Gateway";
+const char *error_502_form = "The upstream server could not be reached or sent an invalid response.\n";
 /*网站根目录*/
 const char* doc_root = "/var/www/html";
 
@@ -21,10 +34,11 @@ int setnonblocking(int fd)
     return old_option;
 }
 
-void addfd(int epollfd, int fd, bool one_shot)
+/*注册非连接的描述符(监听socket、inotify) ptr用于在事件中区分它们*/
+void addfd(int epollfd, int fd, void* ptr, bool one_shot)
 {
     struct epoll_event event;
-    event.data.fd = fd;
+    event.data.ptr = ptr;
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
     if(one_shot)
     {
@@ -34,50 +48,117 @@ void addfd(int epollfd, int fd, bool one_shot)
     setnonblocking(fd);
 }
 
-//从内核事件表删除描述符
-void removefd(int epollfd, int fd)
-{
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
-    close(fd);
-}
-
-//将事件重置为EPOLLONESHOT
-void modfd(int epollfd, int fd, int ev)
-{
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
-}
-
-int http_conn::m_user_count = 0;
+std::atomic<int> http_conn::m_user_count(0);
 int http_conn::m_epollfd = -1;
+long http_conn::m_sendfile_threshold = 16 * 1024;
+int http_conn::m_read_buffer_size = 2048;
+int http_conn::m_write_buffer_size = 1024;
+file_cache* http_conn::m_file_cache = nullptr;
+compress_cache* http_conn::m_compress_cache = nullptr;
+content_cache* http_conn::m_content_cache = nullptr;
+shm_cache* http_conn::m_shm_cache = nullptr;
+upstream_pool* http_conn::m_proxy = nullptr;
+fcgi_pool* http_conn::m_fastcgi = nullptr;
+rate_limiter* http_conn::m_rate_limiter = nullptr;
+admission* http_conn::m_admission = nullptr;
+lingering_close* http_conn::m_lingering = nullptr;
+long http_conn::m_high_water = 64 * 1024;
+int http_conn::m_send_timeout = 10;
+int http_conn::m_idle_timeout = 60;
+http_conn* http_conn::m_waiting_head = nullptr;
+myMutex http_conn::m_waiting_mutex;
+time_heap http_conn::m_idle_timers(1024);
+myMutex http_conn::m_idle_mutex;
+std::atomic<unsigned long> http_conn::m_request_count(0);
+std::atomic<unsigned long> http_conn::m_request_allocs(0);
+
+/*统计作用域内当前线程发生的堆分配 计入m_request_allocs*/
+struct alloc_scope{
+    unsigned long start;
+    alloc_scope() : start(request_arena::heap_allocs()) {}
+    ~alloc_scope()
+    {
+        unsigned long n = request_arena::heap_allocs() - start;
+        if(n)
+        {
+            http_conn::m_request_allocs.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+};
 
 //关闭连接，关闭一个连接，客户总量-1
 void http_conn::close_conn(bool real_close)
 {
     if(real_close && (m_sockfd != -1))
     {
-        removefd(m_epollfd, m_sockfd);
-        m_sockfd = -1;
-        m_user_count--;
+        /*没有其他引用该socket的描述符 关闭时内核自动将其移出epoll 不需要EPOLL_CTL_DEL*/
+        close(detach());
+        metrics::add(SYSCALLS);
+    }
+}
+
+int http_conn::detach()
+{
+    stop_waiting();
+    stop_idle_timer();
+    /*后端的响应不完整 上游连接不能再复用 FastCGI请求需要通知应用放弃*/
+    if(m_backend)
+    {
+        m_backend->abort();
+        m_backend = 0;
+    }
+    m_yielded = false;
+    m_idle_since.store(0, std::memory_order_relaxed);
+    /*
+    连接对象的清理都在close之前完成 close之后该描述符可能马上被主线程accept的新连接复用
+    工作线程中关闭时若在close之后再修改m_sockfd等成员 会覆盖新连接刚由init设置的状态
+    */
+    if(m_rate_slot)
+    {
+        rate_limiter::release(m_rate_slot);
+        m_rate_slot = 0;
     }
+    int sockfd = m_sockfd;
+    m_sockfd = -1;
+    unmap();
+    m_arena.release();
+    m_user_count--;
+    metrics::add(CONNECTIONS_CLOSED);
+    metrics::add(CONNECTIONS_OPEN, -1);
+    return sockfd;
 }
 
 //初始化连接，外部调用初始化套接字地址
-void http_conn::init(int sockfd, const struct sockaddr_in& addr)
+void http_conn::init(int sockfd, const struct sockaddr* addr, socklen_t addrlen, rate_slot* slot)
 {
     m_sockfd = sockfd;
-    m_address = addr;
-    
-    /*避免TIME_WAIT状态 调试用*/
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    m_rate_slot = slot;
+    m_yielded = false;
+    /*Unix域socket的对方地址比m_address长 截断后只用到地址族*/
+    memcpy(&m_address, addr, addrlen < sizeof(m_address) ? addrlen : sizeof(m_address));
+    m_nodelay = false;
+    /*缓冲区在对象外 由复用该描述符的连接继续使用*/
+    if(!m_read_buf)
+    {
+        m_read_buf = new char[m_read_buffer_size + m_write_buffer_size + FILENAME_LEN];
+        m_write_buf = m_read_buf + m_read_buffer_size;
+        m_real_file = m_write_buf + m_write_buffer_size;
+    }
 
-    addfd(m_epollfd, sockfd, true);
+    /*socket由accept4设置为非阻塞 事件中的data.ptr直接指向连接对象*/
+    struct epoll_event event;
+    event.data.ptr = this;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, sockfd, &event);
+    metrics::add(SYSCALLS);
     m_user_count++;
+    metrics::add(CONNECTIONS_ACCEPTED);
+    metrics::add(CONNECTIONS_OPEN);
 
     init();
+    m_trace[TRACE_ACCEPT] = request_trace::now();
+    m_idle_since.store(m_trace[TRACE_ACCEPT], std::memory_order_relaxed);
+    start_idle_timer();
 }
 
 //初始化新接受的连接
@@ -89,17 +170,71 @@ void http_conn::init()
 
     m_method = GET;
     m_url = 0;
+    m_real_len = 0;
     m_version = 0;
     m_content_length = 0;
+    m_request_end = 0;
+    m_header_start = 0;
+    m_route = 0;
+    m_fcgi_route = 0;
     m_host = 0;
+    m_if_none_match = 0;
+    m_accept_encoding = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
+    m_file_address = 0;
+    m_file_fd = -1;
+    m_file_entry = 0;
+    m_compress_entry = 0;
+    m_content_entry = 0;
+    m_shm_entry = 0;
+    m_content_generation = 0;
+    m_body_len = 0;
+    m_etag = 0;
+    m_content_encoding = 0;
+    m_vary = false;
+    m_use_sendfile = false;
+    m_file_offset = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+
+    m_status = 0;
+    /*accept的时间戳由init(sockfd, addr)设置 只对连接上的第一个请求有效*/
+    for(int i = TRACE_FIRST_BYTE; i < TRACE_POINT_NUMBER; ++i)
+    {
+        m_trace[i] = 0;
+    }
+    m_arena.reset();
+}
+
+void http_conn::next_request()
+{
+    int end = m_request_end;
+    int pipelined = end > 0 ? m_read_idx - end : 0;
+    init();
+    if(pipelined > 0)
+    {
+        memmove(m_read_buf, m_read_buf + end, pipelined);
+        m_read_idx = pipelined;
+        trace(TRACE_FIRST_BYTE);
+    }
+}
 
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-    memset(m_real_file, '\0', FILENAME_LEN);
+/*
+每个事件之后都需要重新注册 EPOLLONESHOT保证同一时刻只有一个线程处理该连接
+EPOLL_CTL_MOD会立即检查就绪状态 注册时已有数据可读或可写的事件不会丢失
+*/
+void http_conn::arm(int ev)
+{
+    struct epoll_event event;
+    event.data.ptr = this;
+    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, m_sockfd, &event);
+    metrics::add(SYSCALLS);
 }
 
 /*从状态机*/
@@ -146,20 +281,33 @@ http_conn::LINE_STATUS http_conn::parse_line()
     return LINE_OPEN;
 }
 
-//循环读取客户数据，直到无数据可读或对方关闭连接
+/*
+循环读取客户数据，直到无数据可读或对方关闭连接
+读到的数据少于缓冲区剩余空间时说明socket接收缓冲区已读空 不再用一次返回EAGAIN的recv确认
+之后的arm(EPOLLIN)会重新检查是否可读 期间到达的数据不会丢失
+一次最多读入READ_BUDGET字节(read_buffer配置得很大时才起作用) 没有读完的数据同样由arm(EPOLLIN)在下一轮epoll_wait中重新报告
+*/
 bool http_conn::read_once()
 {
-    if(m_read_idx >= READ_BUFFER_SIZE)
+    m_idle_since.store(0, std::memory_order_relaxed);
+    if(m_read_idx >= m_read_buffer_size)
     {
         return false;
     }
 
     int bytes_read = 0;
+    int total = 0;
     while(true)
     {
         //不论是客户还是服务器应用程序都用recv函数从TCP连接的另一端接收数据
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
-        if(bytes_read == -1)\
+        int space = m_read_buffer_size - m_read_idx;
+        if(space > READ_BUDGET - total)
+        {
+            space = READ_BUDGET - total;
+        }
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, space, 0);
+        metrics::add(SYSCALLS);
+        if(bytes_read == -1)
         {
             //非阻塞ET工作模式下，需要一次性将数据读完  (EAGAIN和EWOULDBLOCK等价)
             if(errno == EAGAIN || errno == EWOULDBLOCK)
@@ -172,11 +320,43 @@ bool http_conn::read_once()
         {
             return false;
         }
+        if(!m_trace[TRACE_FIRST_BYTE])
+        {
+            trace(TRACE_FIRST_BYTE);
+        }
         m_read_idx += bytes_read;
+        total += bytes_read;
+        metrics::add(BYTES_IN, bytes_read);
+        /*缓冲区已满时不能再recv(长度为0的recv返回0 会被当成对端关闭) 请求体的其余部分留在socket中*/
+        if(bytes_read < space || m_read_idx == m_read_buffer_size || total >= READ_BUDGET)
+        {
+            break;
+        }
     }
+    TWS_PROBE3(read, m_sockfd, total, m_read_idx);
     return true;
 }
 
+/*一次读入的请求(流水线中的多个请求在同一次交给线程池)取一个令牌*/
+bool http_conn::admit_request()
+{
+    return !m_rate_limiter || m_rate_limiter->take(m_rate_slot);
+}
+
+/*只由主线程调用 socket交给m_lingering之后仍注册在epoll中 由它改为自己的事件*/
+void http_conn::refuse(int status)
+{
+    int sockfd = detach();
+    if(status == 429)
+    {
+        rate_limiter::refuse(sockfd, m_lingering);
+    }
+    else
+    {
+        admission::refuse(sockfd, m_lingering);
+    }
+}
+
 /*分析请求行*/
 http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
 {
@@ -199,9 +379,13 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
     {
         m_method = GET;
     }
+    else if(strcasecmp(method, "POST") == 0)
+    {
+        /*POST只用于转发给后端的请求 静态文件仍只支持GET 见do_request*/
+        m_method = POST;
+    }
     else
     {
-        /*仅支持GET方法*/
         return BAD_REQUEST;
     }
     /*从字符串1的第一个元素开始往后数，看字符串1中是不是连续往后每个字符都在字符串2中可以找到*/
@@ -243,7 +427,8 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
     {
         /*如果HTTP请求有消息体 则还需要读取m_content_length字节的消息体*/
         /*状态机转移到CHECK_STATE_CONTENT状态*/
-        if(m_content_length != 0)
+        /*反向代理和FastCGI的请求体边读边转发 读缓冲区放不下的部分由后端直接从socket读取 不必等消息体读完*/
+        if(m_content_length != 0 && !match_proxy() && !match_fastcgi())
         {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
@@ -274,6 +459,23 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
         text += 15;
         text += strspn(text, " \t");\
         m_content_length = atol(text);
+        if(m_content_length < 0)
+        {
+            return BAD_REQUEST;
+        }
+    }
+    /*处理If-None-Match头部字段*/
+    else if(strncasecmp(text, "If-None-Match:", 14) == 0)
+    {
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
+    }
+    /*处理Accept-Encoding头部字段*/
+    else if(strncasecmp(text, "Accept-Encoding:", 16) == 0)
+    {
+        text += 16;
+        parse_accept_encoding(text);
     }
     /*其他头部字段不处理*/
     else
@@ -283,12 +485,51 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
     return NO_REQUEST;
 }
 
+/*
+Accept-Encoding格式: 编码[;q=权重], 编码[;q=权重]...
+只关心gzip和br是否可接受 q=0表示明确拒绝 *表示接受任意编码
+*/
+void http_conn::parse_accept_encoding(char* text)
+{
+    while(*text)
+    {
+        text += strspn(text, " \t,");
+        char* coding = text;
+        size_t coding_len = strcspn(text, " \t;,");
+        text += strcspn(text, ",");
+        /*q=0 q=0.0 q=0.00...都表示不可接受*/
+        char* q = strstr(coding, "q=");
+        bool refused = (q && q < text && atof(q + 2) == 0);
+        int mask = 0;
+        if(coding_len == 4 && strncasecmp(coding, "gzip", 4) == 0)
+        {
+            mask = ENCODING_GZIP;
+        }
+        else if(coding_len == 2 && strncasecmp(coding, "br", 2) == 0)
+        {
+            mask = ENCODING_BR;
+        }
+        else if(coding_len == 1 && coding[0] == '*')
+        {
+            mask = ENCODING_GZIP | ENCODING_BR;
+        }
+        if(refused)
+        {
+            m_accept_encoding &= ~mask;
+        }
+        else
+        {
+            m_accept_encoding |= mask;
+        }
+    }
+}
+
 /*没有真正解析HTTP请求消息体 只是判断它是否被完整的读入了*/
-http_conn::HTTP_CODE http_conn::parse_content(char* text)
+http_conn::HTTP_CODE http_conn::parse_content()
 {
+    /*消息体没有被使用 不写入结束符 以免覆盖流水线中下一个请求的第一个字节*/
     if(m_read_idx >= (m_content_length + m_checked_idx))
     {
-        text[m_content_length] = '\0';
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -301,12 +542,11 @@ http_conn::HTTP_CODE http_conn::process_read()
     HTTP_CODE ret = NO_REQUEST;     /*记录HTTP请求的处理结果*/
     char* text = 0;
     while(((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK))
-            || ((line_status == parse_line()) == LINE_OK))
+            || ((line_status = parse_line()) == LINE_OK))
     {
         //get_line用于将指针向后偏移，指向未处理的字符
         text = get_line();
         m_start_line = m_checked_idx;     /*记录下一行的起始位置*/
-        printf("got 1 http line: %s\n", text);
         /*m_check_state记录主状态机当前状态*/
         switch(m_check_state)
         {
@@ -317,6 +557,7 @@ http_conn::HTTP_CODE http_conn::process_read()
                 {
                     return BAD_REQUEST; /*请求语法有误*/
                 }
+                m_header_start = m_start_line;
                 break;
             }
             case CHECK_STATE_HEADER:
@@ -328,16 +569,18 @@ http_conn::HTTP_CODE http_conn::process_read()
                 }
                 else if(ret == GET_REQUEST)
                 {
-                    return do_request();    /*生成响应报文*/
+                    m_request_end = m_checked_idx;
+                    return traced_request();    /*生成响应报文*/
                 }
                 break;
             }
             case CHECK_STATE_CONTENT:
             {   /*分析消息体*/
-                ret = parse_content(text);
+                ret = parse_content();
                 if(ret == GET_REQUEST)
                 {
-                    return do_request();
+                    m_request_end = m_checked_idx + m_content_length;
+                    return traced_request();
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -351,239 +594,1329 @@ http_conn::HTTP_CODE http_conn::process_read()
     return NO_REQUEST;
 }
 
+/*反向代理按原始URL匹配前缀 查询串原样转发 路径由上游解释*/
+bool http_conn::match_proxy()
+{
+    if(!m_route && m_proxy)
+    {
+        m_route = m_proxy->match(m_url);
+    }
+    return m_route != 0;
+}
+
+/*按原始URL匹配FastCGI的路由 与反向代理的路由重叠时反向代理优先*/
+bool http_conn::match_fastcgi()
+{
+    if(!m_fastcgi || (m_proxy && m_proxy->match(m_url)))
+    {
+        return false;
+    }
+    m_fcgi_route = m_fastcgi->match(m_url);
+    return m_fcgi_route != 0;
+}
+
 /*
-当得到一个完整、正确的HTTP请求时 就分析目标文件的属性
-如果目标文件存在 对所有用户可读 且不是目录 则使用mmap将其映射到内存地址m_file_address处
+当得到一个完整、正确的HTTP请求时 就从file_cache获取目标文件
+如果目标文件存在 对所有用户可读 且不是目录 则根据缓存项选择发送方式:
+    小文件由缓存项共享一份mmap映射m_file_address 与响应头一起writev
+    大文件和空文件使用缓存项中保持打开的描述符 由write()用sendfile零拷贝发送
+缓存命中时不执行stat/open/mmap/munmap/close等任何文件系统调用
 并告诉调用者获取文件成功
 */
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    if(stat(m_real_file, &m_file_stat) < 0)
+    if(match_proxy())
+    {
+        return PROXY_REQUEST;
+    }
+    if(m_fcgi_route || match_fastcgi())
+    {
+        return FASTCGI_REQUEST;
+    }
+    if(m_method != GET)
     {
-        return NO_RESOURCE;
+        return BAD_REQUEST;
     }
-    if(!(m_file_stat.st_mode & S_IROTH))
+    if(!decode_url())
     {
-        return FORBIDDEN_REQUEST;
+        return BAD_REQUEST;
     }
-    if(S_ISDIR(m_file_stat.st_mode))
+    size_t root_len = strlen(doc_root);
+    size_t url_len = strlen(m_url);
+    if(root_len + url_len >= FILENAME_LEN)
     {
         return BAD_REQUEST;
     }
+    memcpy(m_real_file, doc_root, root_len);
+    memcpy(m_real_file + root_len, m_url, url_len + 1);
+    m_real_len = root_len + url_len;
+
+    /*小文件的完整响应已在内存中 无需再查找文件和协商编码*/
+    if(m_shm_cache && !m_if_none_match)
+    {
+        m_shm_entry = m_shm_cache->lookup(m_real_file, m_real_len, m_accept_encoding, &m_content_generation);
+        if(m_shm_entry)
+        {
+            return CACHED_REQUEST;
+        }
+    }
+    else if(m_content_cache && !m_if_none_match)
+    {
+        m_content_entry = m_content_cache->lookup(m_real_file, m_real_len, m_accept_encoding, &m_content_generation);
+        if(m_content_entry)
+        {
+            return CACHED_REQUEST;
+        }
+    }
 
-    int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    close(fd);
+    file_entry* entry = 0;
+    switch(m_file_cache->acquire(m_real_file, m_real_len, &entry))
+    {
+        case file_cache::FC_NO_FILE:
+            return NO_RESOURCE;
+        case file_cache::FC_FORBIDDEN:
+            return FORBIDDEN_REQUEST;
+        case file_cache::FC_IS_DIR:
+            return BAD_REQUEST;
+        case file_cache::FC_ERROR:
+            return INTERNAL_ERROR;
+        default:
+            break;
+    }
+    use_file_entry(entry);
+    negotiate_encoding();
+    if(m_if_none_match && strcmp(m_if_none_match, m_etag) == 0)
+    {
+        /*304响应没有消息体*/
+        m_use_sendfile = false;
+        return NOT_MODIFIED;
+    }
     return FILE_REQUEST;
 }
 
-/*对内存映射取执行munmap操作*/
-void http_conn::unmap()
+static int hex_value(char c)
 {
-    if(m_file_address)
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
     {
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = 0;
+        return c - 'A' + 10;
     }
+    return -1;
 }
 
-/*写HTTP响应*/
-bool http_conn::write()
+/*
+去掉查询串和片段 对路径做百分号解码 解码结果写入请求arena 并让m_url指向它
+解码后含有'\0'或".."路径段的请求不合法 避免访问网站根目录之外的文件
+*/
+bool http_conn::decode_url()
 {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if(bytes_to_send == 0)
+    size_t len = strcspn(m_url, "?#");
+    char* path = static_cast<char*>(m_arena.alloc(len + 1, 1));
+    if(!path)
     {
-        /*事件重置EPOLLONESHOT*/
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
-        return true;
+        return false;
     }
-
-    while(1)
+    size_t n = 0;
+    for(size_t i = 0; i < len; ++i)
     {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
-        if(temp <= -1)
-        {
-            /*如果TCP写缓冲没有空间 则等待下一轮EPOLLOUT事件*/
-            /*虽然无法接受同一客户的下一个请求 但能保证连接的完整性*/
-            if(errno == EAGAIN)
-            {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
-                return true;
-            }
-            unmap();
-            return false;
-        }
-
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if(bytes_to_send <= bytes_have_send)
+        char c = m_url[i];
+        if(c == '%')
         {
-            /*发送HTTP响应成功 根据Connection字段决定是否关闭连接*/
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-            if(m_linger)
+            if(i + 2 >= len)
             {
-                init();
-                return true;
+                return false;
             }
-            else
+            int hi = hex_value(m_url[i + 1]);
+            int lo = hex_value(m_url[i + 2]);
+            if(hi < 0 || lo < 0 || (hi == 0 && lo == 0))
             {
                 return false;
             }
+            c = (char)(hi << 4 | lo);
+            i += 2;
         }
+        path[n++] = c;
     }
-}
-
-/*往写缓冲中写入待发送的数据*/
-bool http_conn::add_response(const char* format, ...)
-{
-    if(m_write_idx >= WRITE_BUFFER_SIZE)
-    {
-        return false;
-    }
-    va_list arg_list;
-    va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if(len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx))
+    path[n] = '\0';
+    /*m_url以'/'开头 因此p[-1]总是有效的*/
+    for(const char* p = path; (p = strstr(p, "..")) != 0; p += 2)
     {
-        return false;
+        if(p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+        {
+            return false;
+        }
     }
-    m_write_idx += len;
-    va_end(arg_list);
+    m_url = path;
     return true;
 }
 
-bool http_conn::add_status_line(int status, const char* title)
+http_conn::HTTP_CODE http_conn::traced_request()
 {
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+    trace(TRACE_PARSED);
+    HTTP_CODE ret = do_request();
+    trace(TRACE_HANDLED);
+    TWS_PROBE4(request, m_sockfd, (int)ret, m_url, m_trace[TRACE_HANDLED] - m_trace[TRACE_PARSED]);
+    return ret;
 }
 
-bool http_conn::add_headers(int content_len)
+void http_conn::use_file_entry(file_entry* entry)
 {
-    add_content_length(content_len);
-    add_linger();
-    add_blank_line();
+    m_file_entry = entry;
+    m_file_fd = entry->fd;
+    m_file_address = entry->address;
+    m_body_len = entry->st.st_size;
+    m_etag = entry->etag;
+    m_use_sendfile = (m_file_address == 0);
 }
 
-bool http_conn::add_content_length(int content_len)
+/*
+内容协商 依次尝试:
+    客户端接受br且存在.br预压缩文件
+    客户端接受gzip且存在.gz预压缩文件
+    客户端接受gzip且为文本类资源 使用compress_cache中的在线压缩结果(每个版本的文件只压缩一次)
+都不满足时发送原文件
+*/
+void http_conn::negotiate_encoding()
 {
-    return add_response("Content-Length: %d\r\n", content_len);
+    bool compressible = compress_cache::compressible(m_real_file);
+    m_vary = compressible || m_file_entry->has_gzip || m_file_entry->has_brotli;
+    if(!m_accept_encoding || !m_vary)
+    {
+        return;
+    }
+    const char* suffix = 0;
+    if((m_accept_encoding & ENCODING_BR) && m_file_entry->has_brotli)
+    {
+        suffix = ".br";
+        m_content_encoding = "br";
+    }
+    else if((m_accept_encoding & ENCODING_GZIP) && m_file_entry->has_gzip)
+    {
+        suffix = ".gz";
+        m_content_encoding = "gzip";
+    }
+    if(suffix)
+    {
+        /*后缀连同结尾的'\0'共4字节*/
+        char* sidecar_path = m_arena.alloc_array<char>(m_real_len + 4);
+        file_entry* sidecar = 0;
+        if(sidecar_path)
+        {
+            memcpy(sidecar_path, m_real_file, m_real_len);
+            memcpy(sidecar_path + m_real_len, suffix, 4);
+        }
+        if(sidecar_path && m_file_cache->acquire(sidecar_path, m_real_len + 3, &sidecar) == file_cache::FC_OK)
+        {
+            m_file_cache->release(m_file_entry);
+            use_file_entry(sidecar);
+            return;
+        }
+        /*预压缩文件在此期间被删除 继续尝试在线压缩*/
+        m_content_encoding = 0;
+    }
+    if((m_accept_encoding & ENCODING_GZIP) && compressible && m_compress_cache)
+    {
+        compress_entry* compressed = m_compress_cache->acquire(m_file_entry);
+        if(compressed)
+        {
+            m_compress_entry = compressed;
+            m_file_address = compressed->data;
+            m_body_len = compressed->len;
+            m_etag = compressed->etag;
+            m_content_encoding = "gzip";
+            m_use_sendfile = false;
+        }
+    }
 }
 
-bool http_conn::add_linger()
-{
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
-}
-bool http_conn::add_blank_line()
+/*释放目标文件的缓存项引用 映射和描述符由缓存统一管理*/
+void http_conn::unmap()
 {
-    return add_response("%s", "\r\n");
+    if(m_content_entry)
+    {
+        m_content_cache->release(m_content_entry);
+        m_content_entry = 0;
+    }
+    if(m_shm_entry)
+    {
+        m_shm_cache->release(m_shm_entry);
+        m_shm_entry = 0;
+    }
+    if(m_compress_entry)
+    {
+        m_compress_cache->release(m_compress_entry);
+        m_compress_entry = 0;
+    }
+    if(m_file_entry)
+    {
+        m_file_cache->release(m_file_entry);
+        m_file_entry = 0;
+    }
+    m_file_address = 0;
+    m_file_fd = -1;
 }
 
-bool http_conn::add_content(const char* content)
+/*
+输出引擎:
+    待发送的数据由内存段m_iv[m_iv_idx..m_iv_count)和可选的文件段(sendfile)依次组成
+    每次sendmsg后推进iovec游标 部分写入时调整当前段的起始位置和长度; sendfile由m_file_offset记录进度
+    后面还有文件段时内存段带MSG_MORE发送 让内核把响应头和文件内容合并成完整的TCP报文段
+    EAGAIN时注册EPOLLOUT并登记到等待可写链表 下一次write()从游标处继续
+    重新注册事件之后其他线程可能立即开始处理该连接 因此注册总是最后一步
+*/
+http_conn::WRITE_RESULT http_conn::write(long budget)
 {
-    return add_response("%s", content);
+    alloc_scope scope;
+    m_yielded = false;
+    if(m_backend)
+    {
+        return m_backend->on_client_event();
+    }
+    return send_response(budget);
 }
 
-/*根据服务器处理HTTP请求的结果 决定返回给客户端的内容*/
-bool http_conn::process_write(HTTP_CODE ret)
+/*有预算时sendfile的长度不超过剩余预算 sendmsg一次最多写满socket的发送缓冲区 预算在两次系统调用之间检查*/
+http_conn::WRITE_RESULT http_conn::send_response(long budget)
 {
-    switch(ret)
+    off_t start = m_bytes_have_send;
+    if(m_bytes_to_send == 0)
     {
-        case INTERNAL_ERROR:
+        init();
+        arm(EPOLLIN);
+        return WRITE_DONE;
+    }
+
+    while(m_bytes_have_send < m_bytes_to_send)
+    {
+        ssize_t temp = 0;
+        bool memory = (m_iv_idx < m_iv_count);
+        if(memory)
         {
-            add_status_line(500, error_500_title);
-            add_headers(strlen(error_500_form));
-            if(!add_content(error_500_form))
-            {
-                return false;
-            }
-            break;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = m_iv + m_iv_idx;
+            msg.msg_iovlen = m_iv_count - m_iv_idx;
+            temp = sendmsg(m_sockfd, &msg, m_use_sendfile ? MSG_MORE : 0);
+            metrics::add(SYSCALLS);
         }
-        case BAD_REQUEST:
+        else
         {
-            add_status_line(400, error_400_title);
-            add_headers(strlen(error_400_form));
-            if(!add_content(error_400_form))
+            off_t count = m_body_len - m_file_offset;
+            if(budget && count > budget - (m_bytes_have_send - start))
             {
-                return false;
+                count = budget - (m_bytes_have_send - start);
             }
-            break;
-        }
-        case NO_RESOURCE:
-        {
-            add_status_line(404, error_404_title);
-            add_headers(strlen(error_404_form));
-            if(!add_content(error_404_form))
+            temp = sendfile(m_sockfd, m_file_fd, &m_file_offset, count);
+            metrics::add(SYSCALLS);
+            /*文件在发送过程中被截断 无法再发送声明的Content-Length*/
+            if(temp == 0)
             {
-                return false;
+                stop_waiting();
+                unmap();
+                return WRITE_CLOSE;
             }
-            break;
         }
-        case FORBIDDEN_REQUEST:
+        if(temp <= -1)
         {
-            add_status_line(403, error_403_title);
-            add_headers(strlen(error_403_form));
-            if(!add_content(error_403_form))
+            /*如果TCP写缓冲没有空间 则等待下一轮EPOLLOUT事件*/
+            /*虽然无法接受同一客户的下一个请求 但能保证连接的完整性*/
+            if(errno == EAGAIN)
             {
-                return false;
+                wait_writable();
+                arm(EPOLLOUT);
+                return WRITE_AGAIN;
             }
-            break;
+            stop_waiting();
+            unmap();
+            return WRITE_CLOSE;
         }
-        case FILE_REQUEST:
+        m_bytes_have_send += temp;
+        metrics::add(BYTES_OUT, temp);
+        m_last_progress = time(NULL);
+        if(memory)
         {
-            add_status_line(200, ok_200_title);
-            if(m_file_stat.st_size != 0)
-            {
-                add_headers(m_file_stat.st_size);
-                m_iv[0].iov_base = m_write_buf;
-                m_iv[0].iov_len = m_write_idx;
-                m_iv[1].iov_base = m_file_address;
-                m_iv[1].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
-                return true;
-            }
-            else
-            {
-                const char* ok_string = "<html><body></body></html>";
-                add_headers(strlen(ok_string));
-                if(!add_content(ok_string))
-                {
-                    return false;
-                }
-            }
+            advance_iv(temp);
         }
-        default:
+        if(budget && m_bytes_have_send - start >= budget && m_bytes_have_send < m_bytes_to_send)
         {
-            return false;
+            m_yielded = true;
+            return WRITE_YIELD;
         }
     }
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
-    return true;
+
+    return finish_response(m_linger);
 }
 
-/*由线程池中的工作线程调用 处理HTTP请求的入口函数*/
-void http_conn::process()
+/*发送HTTP响应成功 根据Connection字段决定是否关闭连接*/
+http_conn::WRITE_RESULT http_conn::finish_response(bool keep)
 {
-    HTTP_CODE read_ret = process_read();
-    //NO_REQUEST 表示请求不完整，需要继续接受请求数据
-    if(read_ret == NO_REQUEST)
+    trace(TRACE_LAST_BYTE);
+    TWS_PROBE4(write_done, m_sockfd, (long)m_bytes_to_send, m_status, (int)m_linger);
+    request_trace::record(m_trace, m_url, m_status);
+    m_trace[TRACE_ACCEPT] = 0;
+    stop_waiting();
+    unmap();
+    if(!keep)
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        return;
+        return WRITE_CLOSE;
+    }
+    next_request();
+    if(m_read_idx > 0)
+    {
+        return WRITE_PIPELINED;
+    }
+    /*注册之后主线程可能立即读到下一个请求 必须先标记空闲*/
+    m_idle_since.store(request_trace::now(), std::memory_order_release);
+    arm(EPOLLIN);
+    return WRITE_DONE;
+}
+
+/*逐跳头部只对客户到本服务器的这一段连接有效 不转发给上游*/
+static bool hop_by_hop(const char* line)
+{
+    static const char* fields[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Trailer:", "Upgrade:"};
+    for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+    {
+        if(strncasecmp(line, fields[i], strlen(fields[i])) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+请求头仍在读缓冲区中 每行结尾的CRLF已被parse_line替换为两个'\0'
+从m_header_start开始逐行复制 遇到空行(头部结束)为止 请求体由上游连接经buffered_body和客户socket转发
+客户已带X-Forwarded-For时把客户地址追加到最后一个该字段之后 否则新增该字段
+*/
+int http_conn::proxy_request(char* buf, int size) const
+{
+    int len = snprintf(buf, size, "%s %s HTTP/1.1\r\n", m_method == POST ? "POST" : "GET", m_url);
+    if(len >= size)
+    {
+        return -1;
     }
-    //调用process_write完成报文响应
-    bool write_ret = process_write(read_ret);
-    if(!write_ret)
+    /*最后一个X-Forwarded-For行在buf中的结尾(CRLF之前)*/
+    int forwarded_end = -1;
+    for(const char* line = m_read_buf + m_header_start; *line; )
     {
-        close_conn();
+        int n = strlen(line);
+        if(!hop_by_hop(line))
+        {
+            if(len + n + 2 > size)
+            {
+                return -1;
+            }
+            memcpy(buf + len, line, n);
+            len += n;
+            if(strncasecmp(line, "X-Forwarded-For:", 16) == 0)
+            {
+                forwarded_end = len;
+            }
+            buf[len++] = '\r';
+            buf[len++] = '\n';
+        }
+        line += n + 2;
+    }
+    char peer[INET6_ADDRSTRLEN];
+    const void* ip = 0;
+    if(m_address.sa.sa_family == AF_INET)
+    {
+        ip = &m_address.v4.sin_addr;
+    }
+    else if(m_address.sa.sa_family == AF_INET6)
+    {
+        ip = &m_address.v6.sin6_addr;
+    }
+    if(ip && inet_ntop(m_address.sa.sa_family, ip, peer, sizeof(peer)))
+    {
+        if(forwarded_end >= 0)
+        {
+            int n = strlen(peer);
+            if(len + n + 2 > size)
+            {
+                return -1;
+            }
+            memmove(buf + forwarded_end + n + 2, buf + forwarded_end, len - forwarded_end);
+            memcpy(buf + forwarded_end, ", ", 2);
+            memcpy(buf + forwarded_end + 2, peer, n);
+            len += n + 2;
+        }
+        else if(len < size)
+        {
+            len += snprintf(buf + len, size - len, "X-Forwarded-For: %s\r\n", peer);
+        }
+    }
+    if(len < size)
+    {
+        len += snprintf(buf + len, size - len, "Connection: keep-alive\r\n\r\n");
+    }
+    return len < size ? len : -1;
+}
+
+/*FastCGI名值对: 名字和值的长度小于128时用1字节 否则用4字节(最高位置1) 之后是名字和值本身*/
+static int put_param(char* buf, int size, int len, const char* name, int name_len, const char* value, int value_len)
+{
+    if(len < 0 || len + 8 + name_len + value_len > size)
+    {
+        return -1;
+    }
+    char* p = buf + len;
+    const int lens[2] = {name_len, value_len};
+    for(int i = 0; i < 2; ++i)
+    {
+        if(lens[i] < 128)
+        {
+            *p++ = (char)lens[i];
+        }
+        else
+        {
+            *p++ = (char)(((lens[i] >> 24) & 0x7f) | 0x80);
+            *p++ = (char)(lens[i] >> 16);
+            *p++ = (char)(lens[i] >> 8);
+            *p++ = (char)lens[i];
+        }
+    }
+    memcpy(p, name, name_len);
+    memcpy(p + name_len, value, value_len);
+    return p + name_len + value_len - buf;
+}
+
+static int put_param(char* buf, int size, int len, const char* name, const char* value)
+{
+    return put_param(buf, size, len, name, strlen(name), value, strlen(value));
+}
+
+/*
+CGI/1.1的环境变量 URL不解码 路径和查询串在第一个'?'处分开
+SCRIPT_FILENAME为网站根目录加路径 应用按它找到脚本(如php-fpm) 其余请求头以HTTP_前缀传递
+*/
+int http_conn::fastcgi_params(char* buf, int size) const
+{
+    const char* query = strchr(m_url, '?');
+    int path_len = query ? query - m_url : strlen(m_url);
+    query = query ? query + 1 : "";
+    char script[FILENAME_LEN * 2];
+    snprintf(script, sizeof(script), "%s%.*s", doc_root, path_len, m_url);
+    char number[32];
+    snprintf(number, sizeof(number), "%d", m_content_length);
+
+    int len = 0;
+    len = put_param(buf, size, len, "GATEWAY_INTERFACE", "CGI/1.1");
+    len = put_param(buf, size, len, "SERVER_SOFTWARE", "TinyWebServer");
+    len = put_param(buf, size, len, "SERVER_PROTOCOL", "HTTP/1.1");
+    len = put_param(buf, size, len, "REQUEST_METHOD", m_method == POST ? "POST" : "GET");
+    len = put_param(buf, size, len, "REQUEST_URI", m_url);
+    len = put_param(buf, size, len, "SCRIPT_NAME", 11, m_url, path_len);
+    len = put_param(buf, size, len, "DOCUMENT_URI", 12, m_url, path_len);
+    len = put_param(buf, size, len, "QUERY_STRING", query);
+    len = put_param(buf, size, len, "DOCUMENT_ROOT", doc_root);
+    len = put_param(buf, size, len, "SCRIPT_FILENAME", script);
+    len = put_param(buf, size, len, "CONTENT_LENGTH", number);
+
+    char peer[INET6_ADDRSTRLEN];
+    const void* ip = 0;
+    int port = 0;
+    if(m_address.sa.sa_family == AF_INET)
+    {
+        ip = &m_address.v4.sin_addr;
+        port = ntohs(m_address.v4.sin_port);
+    }
+    else if(m_address.sa.sa_family == AF_INET6)
+    {
+        ip = &m_address.v6.sin6_addr;
+        port = ntohs(m_address.v6.sin6_port);
+    }
+    if(ip && inet_ntop(m_address.sa.sa_family, ip, peer, sizeof(peer)))
+    {
+        snprintf(number, sizeof(number), "%d", port);
+        len = put_param(buf, size, len, "REMOTE_ADDR", peer);
+        len = put_param(buf, size, len, "REMOTE_PORT", number);
+    }
+
+    /*请求头仍在读缓冲区中 格式同proxy_request*/
+    for(const char* line = m_read_buf + m_header_start; *line; )
+    {
+        int n = strlen(line);
+        const char* colon = strchr(line, ':');
+        int name_len = colon ? colon - line : 0;
+        if(name_len > 0 && name_len < 64 && !hop_by_hop(line) && strncasecmp(line, "Content-Length:", 15) != 0)
+        {
+            const char* value = colon + 1 + strspn(colon + 1, " \t");
+            int value_len = line + n - value;
+            if(strncasecmp(line, "Content-Type:", 13) == 0)
+            {
+                len = put_param(buf, size, len, "CONTENT_TYPE", 12, value, value_len);
+            }
+            else
+            {
+                char name[72] = "HTTP_";
+                for(int i = 0; i < name_len; ++i)
+                {
+                    char c = line[i];
+                    name[5 + i] = (c == '-') ? '_' : toupper((unsigned char)c);
+                }
+                len = put_param(buf, size, len, name, 5 + name_len, value, value_len);
+            }
+        }
+        line += n + 2;
+    }
+    return len;
+}
+
+/*请求体从头部之后开始 读缓冲区中超出请求体的数据是流水线中的下一个请求*/
+int http_conn::buffered_body(const char** data)
+{
+    int n = m_read_idx - m_request_end;
+    if(n > m_content_length)
+    {
+        n = m_content_length;
+    }
+    *data = m_read_buf + m_request_end;
+    m_request_end += n;
+    return n;
+}
+
+/*
+静态文件的响应一次sendmsg发出 转发的响应则随上游的数据分多次写出
+前一次写出的小段还没有被确认时 Nagle算法会让后面的小段等待客户端的延迟确认(约40ms)
+每个连接在第一次转发时设置一次
+*/
+void http_conn::enable_nodelay()
+{
+    if(m_nodelay || (m_address.sa.sa_family != AF_INET && m_address.sa.sa_family != AF_INET6))
+    {
+        return;
+    }
+    int one = 1;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    metrics::add(SYSCALLS);
+    m_nodelay = true;
+}
+
+http_conn::WRITE_RESULT http_conn::backend_done(int status, bool keep)
+{
+    m_backend = 0;
+    m_status = status;
+    METRIC m = metrics::response_metric(status);
+    if(m != METRIC_NUMBER)
+    {
+        metrics::add(m);
+    }
+    return finish_response(keep && m_linger);
+}
+
+http_conn::WRITE_RESULT http_conn::backend_failed()
+{
+    m_backend = 0;
+    m_status = 502;
+    metrics::add(RESPONSES_502);
+    if(!process_write(BAD_GATEWAY))
+    {
+        return WRITE_CLOSE;
+    }
+    return send_response();
+}
+
+/*已发送n字节 跳过发送完的内存段 调整部分发送的内存段*/
+void http_conn::advance_iv(size_t n)
+{
+    while(m_iv_idx < m_iv_count && n >= m_iv[m_iv_idx].iov_len)
+    {
+        n -= m_iv[m_iv_idx].iov_len;
+        m_iv[m_iv_idx].iov_len = 0;
+        ++m_iv_idx;
+    }
+    if(m_iv_idx < m_iv_count)
+    {
+        m_iv[m_iv_idx].iov_base = (char*)m_iv[m_iv_idx].iov_base + n;
+        m_iv[m_iv_idx].iov_len -= n;
+    }
+}
+
+/*设置好m_iv后初始化发送进度*/
+void http_conn::start_send()
+{
+    m_iv_idx = 0;
+    m_bytes_to_send = 0;
+    for(int i = 0; i < m_iv_count; ++i)
+    {
+        m_bytes_to_send += m_iv[i].iov_len;
+    }
+    if(m_use_sendfile)
+    {
+        m_bytes_to_send += m_body_len;
+    }
+    m_bytes_have_send = 0;
+    m_last_progress = time(NULL);
+}
+
+http_conn::send_progress http_conn::progress() const
+{
+    send_progress p;
+    p.total = m_bytes_to_send;
+    p.sent = m_bytes_have_send;
+    p.last_progress = m_last_progress;
+    return p;
+}
+
+/*
+未发送的数据超过高水位 且m_send_timeout秒内客户端没有接收任何数据
+send只是把数据放进发送缓冲区 接收窗口很小的客户端一直在接收 缓冲区却可能很久才腾出EPOLLOUT要求的空间
+所以每次检查都用SIOCOUTQ查询发送缓冲区中对方还没有确认的字节数 已确认的字节数比上一次检查时多也算有进展
+Unix域socket的SIOCOUTQ是发送缓冲区占用的内存 同样随对方读取而减少
+*/
+bool http_conn::slow(time_t now)
+{
+    if(m_bytes_to_send - m_bytes_have_send <= m_high_water)
+    {
+        return false;
+    }
+    int unacked;
+    if(ioctl(m_sockfd, SIOCOUTQ, &unacked) == 0)
+    {
+        off_t acked = m_bytes_have_send - unacked;
+        if(acked > m_bytes_acked)
+        {
+            m_last_progress = now;
+        }
+        m_bytes_acked = acked;
+    }
+    metrics::add(SYSCALLS);
+    return now - m_last_progress >= m_send_timeout;
+}
+
+/*
+m_waiting只由当前处理该连接的线程和持有m_waiting_mutex的清理过程修改
+不在链表中的连接(绝大多数响应一次发完)不需要加锁
+*/
+void http_conn::wait_writable()
+{
+    if(m_waiting)
+    {
+        return;
+    }
+    m_waiting_mutex.lock();
+    m_waiting = true;
+    /*第一次检查只记下已确认的字节数*/
+    m_bytes_acked = std::numeric_limits<off_t>::max();
+    m_wait_prev = nullptr;
+    m_wait_next = m_waiting_head;
+    if(m_waiting_head)
+    {
+        m_waiting_head->m_wait_prev = this;
+    }
+    m_waiting_head = this;
+    m_waiting_mutex.unlock();
+}
+
+void http_conn::stop_waiting()
+{
+    if(!m_waiting)
+    {
+        return;
+    }
+    m_waiting_mutex.lock();
+    unlink_waiting();
+    m_waiting_mutex.unlock();
+}
+
+/*调用者持有m_waiting_mutex*/
+void http_conn::unlink_waiting()
+{
+    if(m_wait_prev)
+    {
+        m_wait_prev->m_wait_next = m_wait_next;
+    }
+    else
+    {
+        m_waiting_head = m_wait_next;
+    }
+    if(m_wait_next)
+    {
+        m_wait_next->m_wait_prev = m_wait_prev;
+    }
+    m_wait_prev = nullptr;
+    m_wait_next = nullptr;
+    m_waiting = false;
+}
+
+/*关闭所有等待可写且长时间没有进展的连接 返回关闭的数量 在锁内摘下慢速连接 在锁外关闭*/
+int http_conn::sweep_slow_clients(time_t now)
+{
+    http_conn* slow_list = nullptr;
+    m_waiting_mutex.lock();
+    http_conn* conn = m_waiting_head;
+    while(conn)
+    {
+        http_conn* next = conn->m_wait_next;
+        if(conn->slow(now))
+        {
+            conn->unlink_waiting();
+            conn->m_wait_next = slow_list;
+            slow_list = conn;
+        }
+        conn = next;
+    }
+    m_waiting_mutex.unlock();
+
+    int closed = 0;
+    while(slow_list)
+    {
+        conn = slow_list;
+        slow_list = conn->m_wait_next;
+        conn->m_wait_next = nullptr;
+        conn->close_conn();
+        ++closed;
+    }
+    if(closed)
+    {
+        metrics::add(SLOW_CLIENT_CLOSES, closed);
+    }
+    return closed;
+}
+
+/*
+空闲定时器只在accept和关闭时进出定时器堆 处理请求时不调整(工作线程不必加锁)
+到期时再按m_idle_since判断: 正在处理请求或空闲还不够久的连接按剩余时间重新加入
+*/
+void http_conn::start_idle_timer()
+{
+    if(m_idle_timeout <= 0)
+    {
+        return;
+    }
+    m_idle_mutex.lock();
+    m_idle_timers.del_timer(&m_idle_timer);
+    m_idle_timer.expire = time(NULL) + m_idle_timeout;
+    m_idle_timers.add_timer(&m_idle_timer);
+    m_idle_mutex.unlock();
+}
+
+/*关闭m_idle_timeout为0时启动的连接也会调用 不在堆中的定时器删除时什么也不做*/
+void http_conn::stop_idle_timer()
+{
+    m_idle_mutex.lock();
+    m_idle_timers.del_timer(&m_idle_timer);
+    m_idle_mutex.unlock();
+}
+
+/*
+与evict_idle相同 空闲连接只shutdown并清除空闲标记 随后的EPOLLRDHUP事件按通常的路径关闭连接
+持有m_idle_mutex时工作线程中的关闭停在detach的开头 描述符还不会被关闭和复用
+*/
+int http_conn::expire_idle(time_t now)
+{
+    int closed = 0;
+    uint64_t now_ns = request_trace::now();
+    m_idle_mutex.lock();
+    heap_timer* timer = m_idle_timers.top();
+    while(timer && timer->expire <= now)
+    {
+        m_idle_timers.pop_timer();
+        http_conn* conn = static_cast<idle_timer*>(timer)->conn;
+        uint64_t since = conn->m_idle_since.load(std::memory_order_acquire);
+        long idle = since && since < now_ns ? (long)((now_ns - since) / 1000000000ULL) : 0;
+        if(since && idle >= m_idle_timeout)
+        {
+            conn->m_idle_since.store(0, std::memory_order_relaxed);
+            shutdown(conn->m_sockfd, SHUT_RDWR);
+            metrics::add(SYSCALLS);
+            ++closed;
+            idle = 0;
+        }
+        /*运行中把m_idle_timeout改为0后 到期的定时器不再加入*/
+        if(m_idle_timeout > 0)
+        {
+            timer->expire = now + m_idle_timeout - idle;
+            m_idle_timers.add_timer(timer);
+        }
+        timer = m_idle_timers.top();
+    }
+    m_idle_mutex.unlock();
+    if(closed)
+    {
+        metrics::add(IDLE_TIMEOUTS, closed);
+    }
+    return closed;
+}
+
+/*
+关闭的顺序是最近最少使用: 空闲开始得最早的先关闭 用nth_element选出 不需要维护LRU链表
+空闲连接只注册了EPOLLIN 没有其他线程持有它 这里只shutdown并清除空闲标记
+    随后的EPOLLRDHUP事件由主线程按通常的路径关闭连接 不与正在注册事件的工作线程竞争
+    客户在keep-alive连接上收到FIN后重新连接 与服务器关闭空闲连接时的行为相同
+*/
+int http_conn::evict_idle(http_conn* users, int count, int n, uint64_t before)
+{
+    std::vector<std::pair<uint64_t, http_conn*> > idle;
+    for(int i = 0; i < count; ++i)
+    {
+        uint64_t since = users[i].m_idle_since.load(std::memory_order_acquire);
+        if(since && (!before || since < before))
+        {
+            idle.push_back(std::make_pair(since, &users[i]));
+        }
+    }
+    if(n < (int)idle.size())
+    {
+        std::nth_element(idle.begin(), idle.begin() + n, idle.end());
+    }
+    else
+    {
+        n = (int)idle.size();
+    }
+    for(int i = 0; i < n; ++i)
+    {
+        http_conn* conn = idle[i].second;
+        conn->m_idle_since.store(0, std::memory_order_relaxed);
+        shutdown(conn->m_sockfd, SHUT_RDWR);
+        metrics::add(SYSCALLS);
+        metrics::add(IDLE_EVICTIONS);
+    }
+    return n;
+}
+
+/*
+预先生成的响应头片段 构造响应头时只需若干次memcpy:
+    状态行在启动时生成
+    Date头部每个线程每秒最多格式化一次
+    Content-Length使用定长的整数转字符串
+    错误响应(状态行之后的全部内容)在启动时按是否保持连接各生成一份 与Date头部拼接即可
+*/
+struct status_line{
+    int status;
+    const char *title;
+    char text[48];
+    int len;
+};
+
+static status_line status_lines[] = {
+    {200, ok_200_title, {0}, 0},
+    {304, not_modified_304_title, {0}, 0},
+    {400, error_400_title, {0}, 0},
+    {403, error_403_title, {0}, 0},
+    {404, error_404_title, {0}, 0},
+    {500, error_500_title, {0}, 0},
+    {502, error_502_title, {0}, 0}
+};
+static const int STATUS_LINE_NUMBER = sizeof(status_lines) / sizeof(status_lines[0]);
+
+struct error_response{
+    http_conn::HTTP_CODE code;
+    int status;
+    const char *form;
+    const status_line *line;
+    /*Content-Length、Connection、空行和消息体 下标为是否保持连接*/
+    char tail[2][256];
+    int tail_len[2];
+};
+
+static error_response error_responses[] = {
+    {http_conn::BAD_REQUEST, 400, error_400_form, nullptr, {{0}, {0}}, {0, 0}},
+    {http_conn::FORBIDDEN_REQUEST, 403, error_403_form, nullptr, {{0}, {0}}, {0, 0}},
+    {http_conn::NO_RESOURCE, 404, error_404_form, nullptr, {{0}, {0}}, {0, 0}},
+    {http_conn::INTERNAL_ERROR, 500, error_500_form, nullptr, {{0}, {0}}, {0, 0}},
+    {http_conn::BAD_GATEWAY, 502, error_502_form, nullptr, {{0}, {0}}, {0, 0}}
+};
+static const int ERROR_RESPONSE_NUMBER = sizeof(error_responses) / sizeof(error_responses[0]);
+
+static const status_line* find_status_line(int status)
+{
+    for(int i = 0; i < STATUS_LINE_NUMBER; ++i)
+    {
+        if(status_lines[i].status == status)
+        {
+            return &status_lines[i];
+        }
+    }
+    return nullptr;
+}
+
+/*无符号整数转十进制字符串 返回写入的字节数*/
+static int format_uint(char *buf, unsigned long long value)
+{
+    char tmp[20];
+    int n = 0;
+    do
+    {
+        tmp[n++] = '0' + value % 10;
+        value /= 10;
+    }while(value);
+    for(int i = 0; i < n; ++i)
+    {
+        buf[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+/*当前线程缓存的Date头部 time()走vDSO 秒数不变时不重新格式化*/
+static const char* date_line(int *len)
+{
+    static __thread time_t cached = -1;
+    static __thread char line[64];
+    static __thread int line_len = 0;
+    time_t now = time(NULL);
+    if(now != cached)
+    {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        line_len = strftime(line, sizeof(line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        cached = now;
+    }
+    *len = line_len;
+    return line;
+}
+
+static const char connection_close[] = "Connection: close\r\n";
+static const char connection_keep_alive[] = "Connection: keep-alive\r\n";
+
+void http_conn::init_responses()
+{
+    for(int i = 0; i < STATUS_LINE_NUMBER; ++i)
+    {
+        status_line& line = status_lines[i];
+        line.len = snprintf(line.text, sizeof(line.text), "HTTP/1.1 %d %s\r\n", line.status, line.title);
+    }
+    for(int i = 0; i < ERROR_RESPONSE_NUMBER; ++i)
+    {
+        error_response& response = error_responses[i];
+        response.line = find_status_line(response.status);
+        for(int linger = 0; linger < 2; ++linger)
+        {
+            response.tail_len[linger] = snprintf(response.tail[linger], sizeof(response.tail[linger]),
+                    "Content-Length: %d\r\n%s\r\n%s", (int)strlen(response.form),
+                    linger ? connection_keep_alive : connection_close, response.form);
+        }
+    }
+}
+
+/*往写缓冲中写入待发送的数据*/
+bool http_conn::add_bytes(const char* data, int len)
+{
+    if(m_write_idx + len > m_write_buffer_size)
+    {
+        return false;
+    }
+    memcpy(m_write_buf + m_write_idx, data, len);
+    m_write_idx += len;
+    return true;
+}
+
+/*写入一行"name: value\r\n" name包含冒号和空格*/
+bool http_conn::add_field(const char* name, int name_len, const char* value)
+{
+    int value_len = strlen(value);
+    if(m_write_idx + name_len + value_len + 2 > m_write_buffer_size)
+    {
+        return false;
+    }
+    char* p = m_write_buf + m_write_idx;
+    memcpy(p, name, name_len);
+    memcpy(p + name_len, value, value_len);
+    memcpy(p + name_len + value_len, "\r\n", 2);
+    m_write_idx += name_len + value_len + 2;
+    return true;
+}
+
+bool http_conn::add_status_line(int status)
+{
+    const status_line* line = find_status_line(status);
+    if(!line)
+    {
+        return false;
+    }
+    return add_bytes(line->text, line->len);
+}
+
+bool http_conn::add_date()
+{
+    int len = 0;
+    const char* line = date_line(&len);
+    return add_bytes(line, len);
+}
+
+bool http_conn::add_headers(off_t content_len)
+{
+    return add_content_length(content_len) && add_linger() && add_blank_line();
+}
+
+bool http_conn::add_content_length(off_t content_len)
+{
+    static const char name[] = "Content-Length: ";
+    if(m_write_idx + (int)sizeof(name) - 1 + 20 + 2 > m_write_buffer_size)
+    {
+        return false;
+    }
+    char* p = m_write_buf + m_write_idx;
+    memcpy(p, name, sizeof(name) - 1);
+    p += sizeof(name) - 1;
+    p += format_uint(p, content_len);
+    memcpy(p, "\r\n", 2);
+    m_write_idx = p + 2 - m_write_buf;
+    return true;
+}
+
+bool http_conn::add_linger()
+{
+    if(m_linger)
+    {
+        return add_bytes(connection_keep_alive, sizeof(connection_keep_alive) - 1);
+    }
+    return add_bytes(connection_close, sizeof(connection_close) - 1);
+}
+
+bool http_conn::add_blank_line()
+{
+    return add_bytes("\r\n", 2);
+}
+
+/*缓存项中预先生成的验证器 供客户端条件请求使用*/
+bool http_conn::add_validators()
+{
+    return add_field("ETag: ", 6, m_etag) && add_field("Last-Modified: ", 15, m_file_entry->last_modified);
+}
+
+bool http_conn::add_encoding()
+{
+    if(m_content_encoding && !add_field("Content-Encoding: ", 18, m_content_encoding))
+    {
+        return false;
+    }
+    return !m_vary || add_field("Vary: ", 6, "Accept-Encoding");
+}
+
+/*启动时生成的错误响应: 状态行 + Date + 其余部分*/
+bool http_conn::add_error(HTTP_CODE code)
+{
+    for(int i = 0; i < ERROR_RESPONSE_NUMBER; ++i)
+    {
+        const error_response& response = error_responses[i];
+        if(response.code == code)
+        {
+            int linger = m_linger ? 1 : 0;
+            return add_bytes(response.line->text, response.line->len) && add_date()
+                    && add_bytes(response.tail[linger], response.tail_len[linger]);
+        }
+    }
+    return false;
+}
+
+/*根据服务器处理HTTP请求的结果 决定返回给客户端的内容*/
+bool http_conn::process_write(HTTP_CODE ret)
+{
+    switch(ret)
+    {
+        case INTERNAL_ERROR:
+        case BAD_REQUEST:
+        case NO_RESOURCE:
+        case FORBIDDEN_REQUEST:
+        case BAD_GATEWAY:
+        {
+            if(!add_error(ret))
+            {
+                return false;
+            }
+            break;
+        }
+        case FILE_REQUEST:
+        {
+            /*Date和Connection放在最后 之前的部分与连接无关 可以整体放入content_cache*/
+            if(!(add_status_line(200) && add_validators() && add_encoding() && add_content_length(m_body_len)))
+            {
+                return false;
+            }
+            int head_len = m_write_idx;
+            if(!(add_date() && add_linger() && add_blank_line()))
+            {
+                return false;
+            }
+            if(m_shm_cache && !m_if_none_match && m_body_len <= m_shm_cache->max_body())
+            {
+                m_shm_cache->admit(m_real_file, m_real_len, m_accept_encoding, m_content_generation, m_write_buf, head_len,
+                        m_file_address, m_file_fd, m_body_len);
+            }
+            else if(!m_shm_cache && m_content_cache && !m_if_none_match && m_body_len <= m_content_cache->max_body())
+            {
+                m_content_cache->admit(m_real_file, m_real_len, m_accept_encoding, m_content_generation, m_write_buf, head_len,
+                        m_file_address, m_file_fd, m_body_len, m_etag);
+            }
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv_count = 1;
+            if(!m_use_sendfile)
+            {
+                m_iv[1].iov_base = m_file_address;
+                m_iv[1].iov_len = m_body_len;
+                m_iv_count = 2;
+            }
+            start_send();
+            return true;
+        }
+        case CACHED_REQUEST:
+        {
+            if(!(add_date() && add_linger()))
+            {
+                return false;
+            }
+            /*两种缓存的响应布局相同*/
+            char* data = m_shm_entry ? m_shm_entry->response() : m_content_entry->data;
+            int head_len = m_shm_entry ? m_shm_entry->head_len : m_content_entry->head_len;
+            size_t len = m_shm_entry ? m_shm_entry->len : m_content_entry->len;
+            m_iv[0].iov_base = data;
+            m_iv[0].iov_len = head_len;
+            m_iv[1].iov_base = m_write_buf;
+            m_iv[1].iov_len = m_write_idx;
+            m_iv[2].iov_base = data + head_len;
+            m_iv[2].iov_len = len - head_len;
+            m_iv_count = 3;
+            start_send();
+            return true;
+        }
+        case NOT_MODIFIED:
+        {
+            if(!(add_status_line(304) && add_date() && add_validators() && add_encoding() && add_linger() && add_blank_line()))
+            {
+                return false;
+            }
+            break;
+        }
+        default:
+        {
+            return false;
+        }
+    }
+    m_iv[0].iov_base = m_write_buf;
+    m_iv[0].iov_len = m_write_idx;
+    m_iv_count = 1;
+    start_send();
+    return true;
+}
+
+/*process_read的结果对应的响应状态码*/
+static int response_status(http_conn::HTTP_CODE code)
+{
+    switch(code)
+    {
+        case http_conn::FILE_REQUEST:
+        case http_conn::CACHED_REQUEST:
+            return 200;
+        case http_conn::NOT_MODIFIED:
+            return 304;
+        case http_conn::BAD_REQUEST:
+            return 400;
+        case http_conn::FORBIDDEN_REQUEST:
+            return 403;
+        case http_conn::NO_RESOURCE:
+            return 404;
+        case http_conn::BAD_GATEWAY:
+            return 502;
+        default:
+            return 500;
+    }
+}
+
+/*
+由线程池中的工作线程调用 处理HTTP请求的入口函数
+生成响应后直接发送 多数响应一次就能发完 不必先注册EPOLLOUT再由主线程发送
+发送完毕后读缓冲区中还有流水线的下一个请求时继续处理
+*/
+void http_conn::process()
+{
+    alloc_scope scope;
+    while(true)
+    {
+        HTTP_CODE read_ret = process_read();
+        TWS_PROBE4(parsed, m_sockfd, (int)read_ret, (int)m_check_state, (int)m_method);
+        //NO_REQUEST 表示请求不完整，需要继续接受请求数据
+        if(read_ret == NO_REQUEST)
+        {
+            arm(EPOLLIN);
+            return;
+        }
+        m_request_count.fetch_add(1, std::memory_order_relaxed);
+        /*压力下响应带Connection: close 客户的下一个请求重新连接 经过accept时的准入控制*/
+        if(m_linger && m_admission && !m_admission->keep_alive())
+        {
+            m_linger = false;
+        }
+        /*取到上游连接后由upstream_conn发送请求 之后的转发在主线程中完成*/
+        if(read_ret == PROXY_REQUEST)
+        {
+            upstream_conn* upstream = m_proxy->acquire(m_route);
+            if(upstream)
+            {
+                m_backend = upstream;
+                WRITE_RESULT ret = upstream->start(this);
+                if(ret == WRITE_CLOSE)
+                {
+                    close_conn();
+                    return;
+                }
+                if(ret != WRITE_PIPELINED)
+                {
+                    return;
+                }
+                continue;
+            }
+            read_ret = BAD_GATEWAY;
+        }
+        /*FastCGI请求交给主线程中的应用连接发送 响应同样在主线程中转发*/
+        if(read_ret == FASTCGI_REQUEST)
+        {
+            fcgi_request* request = m_fastcgi->acquire();
+            if(request)
+            {
+                m_backend = request;
+                WRITE_RESULT ret = request->start(this, m_fcgi_route);
+                if(ret == WRITE_CLOSE)
+                {
+                    close_conn();
+                    return;
+                }
+                if(ret != WRITE_PIPELINED)
+                {
+                    return;
+                }
+                continue;
+            }
+            read_ret = BAD_GATEWAY;
+        }
+        /*请求有误时没有执行do_request 解析和处理阶段都记在解析结束的时刻*/
+        if(!m_trace[TRACE_HANDLED])
+        {
+            trace(TRACE_PARSED);
+            m_trace[TRACE_HANDLED] = m_trace[TRACE_PARSED];
+        }
+        m_status = response_status(read_ret);
+        //调用process_write完成报文响应
+        if(!process_write(read_ret))
+        {
+            close_conn();
+            return;
+        }
+        METRIC m = metrics::response_metric(m_status);
+        if(m != METRIC_NUMBER)
+        {
+            metrics::add(m);
+        }
+        WRITE_RESULT ret = send_response();
+        if(ret == WRITE_CLOSE)
+        {
+            close_conn();
+            return;
+        }
+        if(ret != WRITE_PIPELINED)
+        {
+            return;
+        }
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include<fcntl.h>
 #include<sys/socket.h>
 #include<netinet/in.h>
+#include<netinet/tcp.h>
 #include<arpa/inet.h>
 #include<assert.h>
 #include<sys/stat.h>
@@ -20,18 +21,38 @@
 #include<errno.h>
 #include<sys/wait.h>
 #include<sys/uio.h>
+#include<sys/sendfile.h>
 #include<map>
+#include<atomic>
 
 #include"../lock/myLock.h"
+#include"../cache/file_cache.h"
+#include"../cache/compress_cache.h"
+#include"../cache/content_cache.h"
+#include"../cache/shm_cache.h"
+#include"request_arena.h"
+#include"../metrics/metrics.h"
+#include"../metrics/request_trace.h"
+#include"../metrics/probes.h"
+#include"../timer/time_heap_timer.h"
+
+class backend_request;
+class upstream_pool;
+struct proxy_route;
+class fcgi_pool;
+struct fcgi_route;
+class rate_limiter;
+struct rate_slot;
+class admission;
+class lingering_close;
 
 class http_conn {
 public:
     //设置读取文件的名称m_real_file的大小
     static const int FILENAME_LEN = 200;
-    //设置读读缓冲区m_read_buf的大小
-    static const int READ_BUFFER_SIZE = 2048;
-    //设置写缓冲区m_write_buf的大小
-    static const int WRITE_BUFFER_SIZE = 1024;
+    /*主线程处理一个事件时最多读入、发出的字节数 用完后让出事件循环 反向代理和FastCGI的转发也按这两个预算*/
+    static const long READ_BUDGET = 64 << 10;
+    static const long WRITE_BUDGET = 256 << 10;
     //报文的请求方法，本项目只用到GET和POST
     enum METHOD{
         GET = 0,
@@ -61,9 +82,19 @@ public:
         NO_RESOURCE,
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
+        NOT_MODIFIED,   /*If-None-Match与文件的ETag一致*/
+        CACHED_REQUEST, /*content_cache中有完整的响应*/
+        PROXY_REQUEST,  /*URL匹配反向代理的路由 转发给上游*/
+        FASTCGI_REQUEST,/*URL匹配FastCGI的路由 交给FastCGI应用*/
+        BAD_GATEWAY,    /*上游连接失败或响应有误*/
         INTERNAL_ERROR,
         CLOSED_CONNECTION
     };
+    //客户端可接受的内容编码 Accept-Encoding解析结果的位掩码
+    enum ENCODING{
+        ENCODING_GZIP = 1,
+        ENCODING_BR = 2
+    };
     //从状态机的状态
     enum LINE_STATUS{
         //完整读取一行
@@ -73,26 +104,107 @@ public:
         //读取的行不完整
         LINE_OPEN
     };
+    /*发送响应的结果*/
+    enum WRITE_RESULT{
+        /*出错或不保持连接 调用者关闭连接*/
+        WRITE_CLOSE = 0,
+        /*socket发送缓冲区已满 已注册EPOLLOUT等待继续发送*/
+        WRITE_AGAIN,
+        /*发送完毕 已重新注册EPOLLIN等待下一个请求*/
+        WRITE_DONE,
+        /*发送完毕 读缓冲区中已有流水线的下一个请求 需要继续处理 此时没有注册任何事件*/
+        WRITE_PIPELINED,
+        /*本次发送的字节数达到预算 socket仍可写 没有注册任何事件 由主线程稍后再调用write*/
+        WRITE_YIELD
+    };
 
 public:
-    http_conn() {}
-    ~http_conn() {}
+    http_conn() : m_sockfd(-1), m_waiting(false), m_read_buf(0), m_write_buf(0), m_real_file(0), m_file_fd(-1),
+        m_idle_since(0), m_wait_prev(0), m_wait_next(0), m_file_entry(0), m_file_address(0), m_compress_entry(0), m_content_entry(0), m_shm_entry(0),
+        m_backend(0) { m_idle_timer.conn = this; }
+    ~http_conn() { stop_idle_timer(); delete [] m_read_buf; }
 
 public:
-    //初始化套接字地址，函数内部会调用私有方法init
-    void init(int sockfd, const struct sockaddr_in& addr);
+    //初始化套接字地址，函数内部会调用私有方法init slot为accept时限流表中对方地址的槽位
+    void init(int sockfd, const struct sockaddr* addr, socklen_t addrlen, rate_slot* slot = nullptr);
     //关闭http连接
     void close_conn(bool real_close = true);
     /*处理客户请求*/
     void process();
     /*非阻塞读操作*/
     bool read_once();
-    /*非阻塞写操作*/
-    bool write();
+    /*主线程把读到的请求交给线程池之前调用 从对方地址的令牌桶取一个令牌*/
+    bool admit_request();
+    /*超过限流时发送429、过载或请求队列已满时发送503 并关闭连接 不经过线程池*/
+    void refuse(int status);
+    /*
+    非阻塞写操作 工作线程生成响应后直接调用一次 发送不完时由主线程在EPOLLOUT事件中继续调用
+    budget为本次最多发送的字节数(0不限制) 主线程传入WRITE_BUDGET 一个大响应不会独占事件循环
+    */
+    WRITE_RESULT write(long budget = 0);
+    /*上次write因预算用完而返回WRITE_YIELD 之后还没有继续发送或关闭*/
+    bool yielded() const { return m_yielded; }
+    /*记录请求处理到达p的时间*/
+    void trace(TRACE_POINT p) { m_trace[p] = request_trace::now(); }
+    /*连接的描述符 供线程池的探针使用*/
+    int sockfd() const { return m_sockfd; }
+    /*启动时生成状态行和完整的错误响应*/
+    static void init_responses();
+
+    /*
+    后端(反向代理的上游、FastCGI应用)处理的请求: 由backend_request调用
+        proxy_request   把当前请求的请求头改写为发往上游的请求头(去掉逐跳头部 在X-Forwarded-For中加入客户地址) 放不下时返回-1
+        fastcgi_params  当前请求的FastCGI环境变量(名值对编码) 放不下时返回-1
+        buffered_body   已在读缓冲区中的那部分请求体 其余部分由后端从客户socket读取
+        backend_done    响应转发完毕 与write()完成时的处理相同 keep为false时关闭连接
+        backend_failed  还没有向客户发出数据时后端出错 改为发送502
+        backend_abort   已向客户发出部分响应后出错 调用者随后关闭连接
+    */
+    int proxy_request(char* buf, int size) const;
+    int fastcgi_params(char* buf, int size) const;
+    int buffered_body(const char** data);
+    long content_length() const { return m_content_length; }
+    /*只有GET可以在上游连接断开后重发*/
+    bool idempotent() const { return m_method == GET; }
+    WRITE_RESULT backend_done(int status, bool keep);
+    WRITE_RESULT backend_failed();
+    void backend_abort() { m_backend = 0; }
+    /*转发时客户socket写满(EPOLLOUT)或等待请求体(EPOLLIN) 事件由主线程交给后端*/
+    void wait_client(int ev) { arm(ev); }
+    /*后端请求进行中 客户socket的事件不再按新请求处理*/
+    bool relaying() const { return m_backend != 0; }
+    /*转发的响应分多次写出 关闭Nagle算法*/
+    void enable_nodelay();
+    bool keep_alive() const { return m_linger; }
+
+    /*响应的发送进度*/
+    struct send_progress{
+        off_t total;            /*响应的总字节数*/
+        off_t sent;             /*已发送的字节数*/
+        time_t last_progress;   /*最近一次发送出数据、或对方确认了数据的时间*/
+    };
+    send_progress progress() const;
+    /*是否为需要断开的慢速客户端 由清理过程在持有m_waiting_mutex时调用*/
+    bool slow(time_t now);
+    /*检查等待可写的连接 关闭慢速客户端 由主线程定期调用*/
+    static int sweep_slow_clients(time_t now);
+    /*
+    在users的前count个连接中按空闲开始的时间关闭最早的至多n个空闲连接 由主线程在连接数的压力下调用
+    before不为0时只关闭在它之前开始空闲的连接 升级后排空时给刚建立的连接留出发来请求的时间
+    */
+    static int evict_idle(http_conn* users, int count, int n, uint64_t before = 0);
+    /*关闭空闲超过m_idle_timeout秒的连接 由主线程每秒调用 返回关闭的数量*/
+    static int expire_idle(time_t now);
 
 private:
     /*初始化连接*/
     void init();
+    /*关闭连接时除close之外的清理 返回交出的socket*/
+    int detach();
+    /*保持连接时为下一个请求初始化 保留读缓冲区中已读入的流水线请求*/
+    void next_request();
+    /*以EPOLLONESHOT重新注册事件ev*/
+    void arm(int ev);
     /*解析HTTP请求*/
     HTTP_CODE process_read();
     /*填充HTTP应答*/
@@ -102,9 +214,15 @@ private:
     //主状态机解析报文中的请求头数据
     HTTP_CODE parse_headers(char *text);
     //主状态机解析报文中的请求内容
-    HTTP_CODE parse_content(char *text);
+    HTTP_CODE parse_content();
     //生成响应报文
     HTTP_CODE do_request();
+    bool match_proxy();
+    bool match_fastcgi();
+    //记录解析完成和do_request完成的时间 并调用do_request
+    HTTP_CODE traced_request();
+    //对URL路径做百分号解码并检查 结果放在请求arena中
+    bool decode_url();
 
     //m_start_line是已经解析的字符
     //get_line用于将指针向后偏移，指向未处理的字符
@@ -117,46 +235,140 @@ private:
     
     /*被process_write调用用以填充HTTP应答*/
     void unmap();
-    bool add_response(const char *format, ...);
-    bool add_content(const char *content);
-    bool add_status_line(int status, const char *title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_bytes(const char *data, int len);
+    bool add_field(const char *name, int name_len, const char *value);
+    bool add_status_line(int status);
+    bool add_date();
+    bool add_headers(off_t content_length);
+    bool add_content_length(off_t content_length);
     bool add_linger();
     bool add_blank_line();
+    bool add_error(HTTP_CODE code);
+    bool add_validators();
+    bool add_encoding();
+    //解析Accept-Encoding头部字段
+    void parse_accept_encoding(char *text);
+    //选择目标文件的预压缩版本或在线压缩版本
+    void negotiate_encoding();
+    //用file_cache中的缓存项作为响应消息体
+    void use_file_entry(file_entry *entry);
+    /*输出引擎: 发送响应 推进iovec游标 设置发送进度*/
+    WRITE_RESULT send_response(long budget = 0);
+    /*响应的最后一个字节已发出 记录耗时 决定关闭连接、继续处理流水线请求或等待下一个请求*/
+    WRITE_RESULT finish_response(bool keep);
+    void advance_iv(size_t n);
+    void start_send();
+    /*维护等待可写的连接链表*/
+    void wait_writable();
+    void stop_waiting();
+    void unlink_waiting();
+    /*accept时加入空闲定时器 关闭连接时删除*/
+    void start_idle_timer();
+    void stop_idle_timer();
 
 public:
     /*所有socket事件注册到同一个epoll内核事件中*/
     static int m_epollfd;
     /*统计用户数量*/
-    static int m_user_count;
+    static std::atomic<int> m_user_count;
+    /*文件大小不小于该阈值时用sendfile零拷贝发送 否则用mmap+writev 为负数时禁用sendfile*/
+    static long m_sendfile_threshold;
+    /*读缓冲区(默认2048)和写缓冲区(默认1024)的大小 缓冲区由复用同一描述符的连接继续使用 只能在启动时设置*/
+    static int m_read_buffer_size;
+    static int m_write_buffer_size;
+    /*所有连接共享的已打开文件缓存*/
+    static file_cache* m_file_cache;
+    /*所有连接共享的在线压缩结果缓存*/
+    static compress_cache* m_compress_cache;
+    /*所有连接共享的小文件完整响应缓存*/
+    static content_cache* m_content_cache;
+    /*prefork模式下所有worker共享的完整响应缓存 设置时代替m_content_cache*/
+    static shm_cache* m_shm_cache;
+    /*反向代理的路由和上游连接池 没有配置路由时为空*/
+    static upstream_pool* m_proxy;
+    /*FastCGI的路由和应用连接 没有配置路由时为空*/
+    static fcgi_pool* m_fastcgi;
+    /*按客户地址的限流 没有配置时为空*/
+    static rate_limiter* m_rate_limiter;
+    /*过载时的准入控制 压力以上时响应不再保持连接*/
+    static admission* m_admission;
+    /*回复429/503之后延迟关闭连接 只由主线程使用*/
+    static lingering_close* m_lingering;
+    /*未发送数据的高水位 超过它且m_send_timeout秒内没有发送出数据、对方也没有确认数据的连接视为慢速客户端*/
+    static long m_high_water;
+    static int m_send_timeout;
+    /*keep-alive连接等待下一个请求(或新连接等待第一个请求)的最长秒数 0表示不限制*/
+    static int m_idle_timeout;
+    /*已完成解析的请求数 以及处理请求时发生的堆分配次数(含工作线程的解析和主线程的发送)*/
+    static std::atomic<unsigned long> m_request_count;
+    static std::atomic<unsigned long> m_request_allocs;
 
 private:
-    /*该HTTP连接的socket和对方的socket地址*/
-    int m_sockfd;
-    struct sockaddr_in m_address;
-    /*读缓冲区*/
-    char m_read_buf[READ_BUFFER_SIZE];
+    /*
+    成员按访问频率排列：
+        第一个缓存行是每次读写事件和解析都要访问的状态 第二、三个缓存行是输出引擎的发送进度
+        之后是每个请求访问一次的解析结果和缓存项 最后是只在建立和关闭连接时访问的冷数据
+    读写缓冲区和目标文件路径(共约3.2KB)不在对象内 由m_read_buf指向的一块内存统一存放
+        该内存在描述符第一次被使用时申请 之后由复用同一描述符的连接继续使用 直到对象析构
+        keep-alive的请求之间不清零缓冲区 解析只访问[0, m_read_idx)中已读入的数据
+    */
+    /*该HTTP连接的socket*/
+    alignas(64) int m_sockfd;
+    //主状态机的状态
+    CHECK_STATE m_check_state;
     /*标识读缓冲中已经读入的客户数据的最后一个字节的下一个位置*/
     int m_read_idx;
     /*当前正在分析的字符在读缓冲区中的位置*/
     int m_checked_idx;
     /*当前正在解析的行的位置*/
     int m_start_line;
-    /*写缓冲区*/
-    char m_write_buf[WRITE_BUFFER_SIZE];
     /*写缓冲区中待发送的字节数*/
     int m_write_idx;
-    
-    
-    //主状态机的状态
-    CHECK_STATE m_check_state;
     //请求方法
     METHOD m_method;
-    
-    /*客户请求的目标文件的完整路径  doc_root + m_url(doc_root是网站根目录)*/
-    char m_real_file[FILENAME_LEN];
-    /*客户请求的目标文件的文件名*/
+    /*HTTP请求是否要保持连接*/
+    bool m_linger;
+    /*是否使用sendfile发送目标文件*/
+    bool m_use_sendfile;
+    /*是否在等待EPOLLOUT的连接链表中*/
+    bool m_waiting;
+    /*write返回了WRITE_YIELD 在主线程的待发送列表中*/
+    bool m_yielded;
+    /*目标文件存在多个编码版本 响应需带Vary头部*/
+    bool m_vary;
+    /*读缓冲区、写缓冲区 以及客户请求的目标文件的完整路径doc_root + m_url(doc_root是网站根目录)*/
+    char *m_read_buf;
+    char *m_write_buf;
+    char *m_real_file;
+    /*iovec游标 m_iv_idx之前的内存段已发送完毕*/
+    int m_iv_idx;
+    int m_iv_count;
+
+    /*整个响应(内存段加文件段)的字节数和已发送的字节数*/
+    off_t m_bytes_to_send;
+    off_t m_bytes_have_send;
+    /*sendfile模式下下一次发送的文件偏移*/
+    off_t m_file_offset;
+    /*目标文件的描述符 由缓存项持有 sendfile模式下使用*/
+    int m_file_fd;
+    /*最近一次发送出数据、或检查时发现对方确认了数据的时间*/
+    time_t m_last_progress;
+    /*上一次检查时对方已确认的字节数(已发送的字节数减去SIOCOUTQ) 与m_bytes_have_send同一起点*/
+    off_t m_bytes_acked;
+    /*
+    等待下一个请求(刚accept或keep-alive的响应已发完)的开始时间 0表示连接正在处理请求
+    主线程读到数据或关闭连接时清零 工作线程在重新注册EPOLLIN之前设置 主线程据此选出最近最少使用的空闲连接
+    */
+    std::atomic<uint64_t> m_idle_since;
+    /*等待EPOLLOUT的连接组成的双向链表 由m_waiting_mutex保护*/
+    http_conn *m_wait_prev;
+    http_conn *m_wait_next;
+    /*使用writev来执行写操作 命中content_cache时为 缓存的响应头/Date和Connection/空行和消息体 三段*/
+    struct iovec m_iv[3];
+
+    /*m_real_file的长度 作为缓存查找的键长度*/
+    size_t m_real_len;
+    /*客户请求的目标文件的文件名 do_request之后指向arena中解码后的路径*/
     char *m_url;
     /*HTTP协议版本号 仅支持HTTP/1.1*/
     char *m_version;
@@ -164,16 +376,68 @@ private:
     char *m_host;
     /*请求的消息体长度*/
     int m_content_length;
-    /*HTTP请求是否要保持连接*/
-    bool m_linger;
-
-    /*客户请求的目标文件被mmap到内存的起始位置*/
+    /*请求(含消息体)在读缓冲区中的结束位置 解析出完整请求之前为0 之后的数据属于流水线中的下一个请求*/
+    int m_request_end;
+    /*第一个头部字段在读缓冲区中的位置 转发请求时从这里复制头部*/
+    int m_header_start;
+    /*客户端可接受的内容编码*/
+    int m_accept_encoding;
+    /*If-None-Match头部字段的取值*/
+    char *m_if_none_match;
+    /*目标文件在file_cache中的缓存项 发送完成后释放引用*/
+    file_entry *m_file_entry;
+    /*客户请求的目标文件被mmap到内存的起始位置 由缓存项共享*/
     char *m_file_address;
-    /*目标文件的状态 判断文件是否存在、是否为目录、是否可读 获取文件大小*/
-    struct stat m_file_stat;
-    /*使用writev来执行写操作*/
-    struct iovec m_iv[2];
-    int m_iv_count;
+    /*在线压缩的结果 发送完成后释放引用*/
+    compress_entry *m_compress_entry;
+    /*content_cache命中的完整响应 发送完成后释放引用*/
+    content_entry *m_content_entry;
+    /*shm_cache命中的完整响应 与m_content_entry至多有一个*/
+    shm_entry *m_shm_entry;
+    /*未命中时content_cache的失效代数 准入时用于排除期间发生变化的文件*/
+    uint64_t m_content_generation;
+    /*响应消息体的长度*/
+    off_t m_body_len;
+    /*响应的ETag和Content-Encoding 随所选的编码版本而不同*/
+    const char *m_etag;
+    const char *m_content_encoding;
+    /*响应的状态码*/
+    int m_status;
+    /*各处理阶段的时间戳*/
+    uint64_t m_trace[TRACE_POINT_NUMBER];
+    /*匹配的反向代理或FastCGI路由 以及正在处理该请求的后端*/
+    proxy_route *m_route;
+    fcgi_route *m_fcgi_route;
+    backend_request *m_backend;
+
+    /*
+    对方的socket地址 监听地址可以是IPv4、IPv6或Unix域socket
+    只用到IP地址、端口和地址族 不保存128字节的sockaddr_storage
+    */
+    union{
+        struct sockaddr sa;
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    } m_address;
+    /*对方地址在限流表中的槽位 关闭连接时减少其连接数*/
+    rate_slot *m_rate_slot;
+    /*已对socket设置TCP_NODELAY*/
+    bool m_nodelay;
+    /*请求级arena 解码后的URL、预压缩文件路径等临时内存从这里分配*/
+    request_arena m_arena;
+    /*嵌入连接对象的空闲定时器 到期时由conn找回连接 加入和删除都不分配内存*/
+    struct idle_timer : heap_timer{
+        http_conn* conn;
+    } m_idle_timer;
+    static http_conn *m_waiting_head;
+    /*主线程和直接发送响应的工作线程都会登记等待可写的连接*/
+    static myMutex m_waiting_mutex;
+    /*
+    所有连接的空闲定时器 accept时加入、关闭时删除、到期时由主线程检查
+    关闭连接可能发生在工作线程中 由m_idle_mutex保护
+    */
+    static time_heap m_idle_timers;
+    static myMutex m_idle_mutex;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include"request_arena.h"
+
+#include<cstdlib>
+#include<new>
+
+/*每个线程的堆分配计数 只由本线程修改 不需要原子操作*/
+static __thread unsigned long heap_alloc_count = 0;
+
+unsigned long request_arena::heap_allocs()
+{
+    return heap_alloc_count;
+}
+
+void request_arena::count_heap_alloc()
+{
+    heap_alloc_count++;
+}
+
+request_arena::block* request_arena::new_block(size_t size)
+{
+    count_heap_alloc();
+    block* b = static_cast<block*>(malloc(sizeof(block) + size));
+    if(b)
+    {
+        b->next = nullptr;
+        b->size = size;
+    }
+    return b;
+}
+
+void* request_arena::alloc_slow(size_t size, size_t align)
+{
+    /*第一块还没有申请*/
+    if(!m_first)
+    {
+        m_first = new_block(BLOCK_SIZE);
+        if(!m_first)
+        {
+            return nullptr;
+        }
+        m_current = m_first;
+        m_ptr = (char*)(m_first + 1);
+        m_end = m_ptr + BLOCK_SIZE;
+        return alloc(size, align);
+    }
+    /*当前块不够 申请一块至少能容纳本次分配的新块 挂在当前块之后*/
+    size_t need = size + align;
+    block* b = new_block(need > BLOCK_SIZE ? need : BLOCK_SIZE);
+    if(!b)
+    {
+        return nullptr;
+    }
+    m_current->next = b;
+    m_current = b;
+    m_ptr = (char*)(b + 1);
+    m_end = m_ptr + b->size;
+    return alloc(size, align);
+}
+
+void request_arena::reset()
+{
+    if(!m_first)
+    {
+        return;
+    }
+    block* b = m_first->next;
+    while(b)
+    {
+        block* next = b->next;
+        free(b);
+        b = next;
+    }
+    m_first->next = nullptr;
+    m_current = m_first;
+    m_ptr = (char*)(m_first + 1);
+    m_end = m_ptr + BLOCK_SIZE;
+}
+
+void request_arena::release()
+{
+    block* b = m_first;
+    while(b)
+    {
+        block* next = b->next;
+        free(b);
+        b = next;
+    }
+    m_first = nullptr;
+    m_current = nullptr;
+    m_ptr = nullptr;
+    m_end = nullptr;
+}
+
+size_t request_arena::used() const
+{
+    size_t total = 0;
+    for(block* b = m_first; b; b = b->next)
+    {
+        if(b == m_current)
+        {
+            total += m_ptr - (char*)(b + 1);
+            break;
+        }
+        total += b->size;
+    }
+    return total;
+}
+
+/*替换全局operator new 统计所有经由new的堆分配(std::string、容器节点等)*/
+void* operator new(size_t size)
+{
+    heap_alloc_count++;
+    void* p = malloc(size ? size : 1);
+    if(!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
@@ -0,0 +1,83 @@
+#ifndef _REQUESTARENA_H_
+#define _REQUESTARENA_H_
+
+#include<stddef.h>
+#include<stdint.h>
+#include<cstring>
+
+/*
+请求级arena(每个http_conn一个)：
+    解析请求和构造响应期间需要的临时内存(解码后的URL、预压缩文件路径等)都从这里分配 不使用new/malloc
+    alloc只移动指针 不支持单独释放; init()在两个keep-alive请求之间调用reset() 一次性回收本次请求的全部内存
+    第一块内存在连接第一次使用时申请并保留到连接关闭 之后稳态下每个请求零次堆分配
+    单次请求用量超过第一块时申请额外的块 reset时归还
+    分配得到的内存只在本次请求内有效 不能保存到init()之后
+*/
+class request_arena{
+public:
+    static const size_t BLOCK_SIZE = 4096;
+
+public:
+    request_arena() : m_first(nullptr), m_current(nullptr), m_ptr(nullptr), m_end(nullptr) {}
+    ~request_arena() { release(); }
+
+    /*分配size字节 按align对齐(align须为2的幂) 失败返回nullptr*/
+    void* alloc(size_t size, size_t align = sizeof(void*))
+    {
+        uintptr_t p = ((uintptr_t)m_ptr + align - 1) & ~(uintptr_t)(align - 1);
+        if(!m_ptr || p + size > (uintptr_t)m_end)
+        {
+            return alloc_slow(size, align);
+        }
+        m_ptr = (char*)(p + size);
+        return (void*)p;
+    }
+
+    /*分配n个T的数组 不调用构造函数 T须为平凡类型*/
+    template<typename T>
+    T* alloc_array(size_t n)
+    {
+        return static_cast<T*>(alloc(sizeof(T) * n, alignof(T)));
+    }
+
+    /*复制s的前n个字节并追加'\0'*/
+    char* strndup(const char* s, size_t n)
+    {
+        char* p = static_cast<char*>(alloc(n + 1, 1));
+        if(p)
+        {
+            memcpy(p, s, n);
+            p[n] = '\0';
+        }
+        return p;
+    }
+
+    /*回收本次请求分配的全部内存 保留第一块供下一个请求使用*/
+    void reset();
+    /*归还所有内存 连接关闭时调用*/
+    void release();
+    /*本次请求已分配的字节数(含对齐填充)*/
+    size_t used() const;
+
+    /*当前线程累计的堆分配次数(operator new与arena申请的块) 用于验证稳态请求零分配*/
+    static unsigned long heap_allocs();
+    static void count_heap_alloc();
+
+private:
+    /*每块的头部 块之间组成单向链表*/
+    struct block{
+        block* next;
+        size_t size;
+    };
+
+    void* alloc_slow(size_t size, size_t align);
+    block* new_block(size_t size);
+
+private:
+    block* m_first;     /*保留的第一块*/
+    block* m_current;   /*当前分配所在的块*/
+    char* m_ptr;        /*当前块中下一个可分配的位置*/
+    char* m_end;        /*当前块的结尾*/
+};
+
+#endif
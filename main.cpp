@@ -10,18 +10,41 @@
 #include<cassert>
 #include<sys/epoll.h>
 #include<iostream>
+#include<climits>
+#include<vector>
+#include<new>
+#include<sys/resource.h>
 
 #include"lock/myLock.h"
 #include"threadpool/threadpool.h"
 #include"http/http_conn.h"
+#include"metrics/admin_server.h"
+#include"net/listener.h"
+#include"net/rate_limit.h"
+#include"net/admission.h"
+#include"net/lingering.h"
+#include"net/handoff.h"
+#include"proxy/upstream.h"
+#include"fastcgi/fcgi.h"
+#include"config/config.h"
+#include"prefork/master.h"
 
 using namespace std;
 
-#define MAX_FD 65536
-#define MAX_EVENT_NUMBER 10000
+/*同时监听的地址数*/
+#define MAX_LISTENERS 8
+/*监听socket、epoll、inotify、eventfd和日志等其他描述符的余量 准入控制计算可容纳的连接数时扣除*/
+#define FD_RESERVE 64
+/*暂停accept或升级后排空连接期间epoll_wait最多阻塞的毫秒数 没有事件时也能及时恢复accept、关闭空闲连接*/
+#define PAUSED_TIMEOUT 10
+/*排空时空闲不到该时间(纳秒)的连接暂不关闭 对方可能正在发来请求*/
+#define DRAIN_GRACE (100 * 1000000ULL)
+/*允许在线压缩的最大文件 以及完整响应缓存可缓存的最大消息体 各缓存的容量见配置*/
+#define COMPRESS_MAX_FILE_SIZE (4 << 20)
+#define CONTENT_MAX_BODY (64 << 10)
 
-extern int addfd(int epollfd, int fd, bool one_shot);
-extern int removefd(int epollfd, int fd);
+extern void addfd(int epollfd, int fd, void* ptr, bool one_shot);
+extern const char* doc_root;
 
 void addsig(int sig, void(handler)(int), bool restart = true)
 {
@@ -36,129 +59,850 @@ void addsig(int sig, void(handler)(int), bool restart = true)
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-void show_error(int connfd, const char* info)
+/*收到SIGUSR1时在主循环中打印请求和堆分配的统计*/
+static volatile sig_atomic_t dump_stats = 0;
+
+void stats_handler(int /*sig*/)
+{
+    dump_stats = 1;
+}
+
+/*收到SIGHUP时在主循环中重新加载配置*/
+static volatile sig_atomic_t reload_config = 0;
+
+void reload_handler(int /*sig*/)
+{
+    reload_config = 1;
+}
+
+/*准入控制的默认连接数阈值: 打开文件数限制扣除文件缓存、后端连接池、延迟关闭的连接和其他描述符的余量 不超过连接对象表的大小*/
+static int connection_capacity(const server_config& cfg, bool proxy, bool fastcgi)
+{
+    struct rlimit nofile;
+    long fds = cfg.max_fd;
+    if(getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY && (long)nofile.rlim_cur < fds)
+    {
+        fds = (long)nofile.rlim_cur;
+    }
+    fds -= cfg.file_cache_entries + FD_RESERVE + lingering_close::MAX_SOCKETS + (proxy ? upstream_pool::MAX_CONNS : 0) + (fastcgi ? fcgi_pool::MAX_CONNS : 0);
+    return fds > FD_RESERVE ? (int)fds : FD_RESERVE;
+}
+
+/*
+把读到的请求交给线程池 以下情况在主线程中直接回复并关闭连接 不占用请求队列:
+    超过对方地址的限流时回复429 准入控制处于过载或请求队列已满时回复503
+*/
+static void dispatch(http_conn* conn, threadpool<http_conn>* pool)
+{
+    if(!conn->admit_request())
+    {
+        conn->refuse(429);
+    }
+    else if(http_conn::m_admission->shed_requests() || !pool->append(conn))
+    {
+        metrics::add(SHED_REQUESTS);
+        conn->refuse(503);
+    }
+}
+
+/*
+发送预算用完的连接 本轮的事件都处理完后再各发送一份预算 仍没有发完的留到下一轮
+列表不为空时epoll_wait不阻塞 只由主线程访问
+*/
+static std::vector<http_conn*> yielded_conns;
+
+/*发送响应或转发的结果: 关闭客户连接 把流水线中的下一个请求交给线程池 或稍后继续发送*/
+static void after_write(http_conn* conn, http_conn::WRITE_RESULT ret, threadpool<http_conn>* pool)
+{
+    if(ret == http_conn::WRITE_CLOSE)
+    {
+        conn->close_conn();
+    }
+    else if(ret == http_conn::WRITE_PIPELINED)
+    {
+        dispatch(conn, pool);
+    }
+    else if(ret == http_conn::WRITE_YIELD)
+    {
+        yielded_conns.push_back(conn);
+    }
+}
+
+/*
+重新加载配置 在主线程中执行 已有的连接和排队的请求不受影响:
+    可重新加载的项逐项应用 某一项的取值无效时保留该项原来的设置 其余项照常应用
+    只在启动时生效的项发生变化时打印提示
+*/
+static void reload(server_config& cfg, int argc, char* argv[], threadpool<http_conn>* pool, file_cache* cache,
+        compress_cache* zcache, content_cache* ccache, rate_limiter*& limiter, admission* overload,
+        const int* listenfds, int listener_count, uint64_t& busy_poll_ns)
 {
-    printf("%s\n", info);
-    send(connfd, info, strlen(info), 0);
-    close(connfd);
+    server_config next;
+    if(!next.load(argc, argv))
+    {
+        printf("config reload failed, running configuration unchanged\n");
+        return;
+    }
+    std::vector<std::string> restart = cfg.changed(next, false);
+    for(size_t i = 0; i < restart.size(); ++i)
+    {
+        printf("config: %s changed, takes effect after restart\n", restart[i].c_str());
+    }
+
+    pool->resize(next.threads, next.queue);
+    /*只修改监听队列的长度 已在队列中的连接不受影响 已交给新进程的监听socket为-1*/
+    for(int i = 0; i < listener_count; ++i)
+    {
+        if(listenfds[i] >= 0)
+        {
+            listen(listenfds[i], next.backlog);
+        }
+    }
+    http_conn::m_send_timeout = next.send_timeout;
+    http_conn::m_idle_timeout = next.idle_timeout;
+    http_conn::m_high_water = next.high_water;
+    request_trace::set_slow_threshold((uint64_t)(next.slow_ms * 1e6));
+    busy_poll_ns = (uint64_t)next.busy_poll_us * 1000;
+    if(!cache->resize(next.file_cache_entries, next.file_cache_bytes))
+    {
+        next.file_cache_entries = cfg.file_cache_entries;
+        next.file_cache_bytes = cfg.file_cache_bytes;
+    }
+    zcache->resize(next.compress_cache_bytes);
+    if(http_conn::m_shm_cache)
+    {
+        http_conn::m_shm_cache->resize(cache->watching() ? next.content_cache_bytes : 0);
+    }
+    else
+    {
+        ccache->resize(cache->watching() ? next.content_cache_bytes : 0);
+    }
+    if(!next.rate_limit.empty() && !limiter)
+    {
+        limiter = new rate_limiter;
+        http_conn::m_rate_limiter = limiter;
+    }
+    if(limiter && !limiter->configure(next.rate_limit.c_str()))
+    {
+        next.rate_limit = cfg.rate_limit;
+    }
+    if(!overload->configure(next.admission.c_str(), connection_capacity(next, http_conn::m_proxy, http_conn::m_fastcgi), pool->capacity()))
+    {
+        next.admission = cfg.admission;
+    }
+
+    std::vector<std::string> applied = cfg.changed(next, true);
+    for(size_t i = 0; i < applied.size(); ++i)
+    {
+        printf("config: %s = %s\n", applied[i].c_str(), next.get(applied[i]).c_str());
+    }
+    printf("config reloaded: %d threads, queue %d\n", pool->threads(), pool->capacity());
+    /*只在启动时生效的项保留运行中的值 下次比较时仍会提示*/
+    for(size_t i = 0; i < restart.size(); ++i)
+    {
+        next.set(restart[i], cfg.get(restart[i]));
+    }
+    cfg = next;
+}
+
+/*FastCGI请求在主线程中完成后的回调 arg为线程池*/
+static void fastcgi_done(http_conn* conn, http_conn::WRITE_RESULT ret, void* arg)
+{
+    after_write(conn, ret, static_cast<threadpool<http_conn>*>(arg));
 }
 
 int main(int argc, char* argv[])
 {
-    if(argc <= 2)
+    /*默认值、-c指定的配置文件、环境变量和命令行依次覆盖*/
+    server_config cfg;
+    if(!cfg.load(argc, argv))
+    {
+        server_config::usage(basename(argv[0]));
+        return 1;
+    }
+    /*逗号分隔的监听地址 各地址族可以混合*/
+    listen_addr addrs[MAX_LISTENERS];
+    int listener_count = 0;
+    const std::string& addr_list = cfg.listen;
+    for(size_t pos = 0; pos <= addr_list.size(); )
     {
-        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+        size_t comma = addr_list.find(',', pos);
+        if(comma == std::string::npos)
+        {
+            comma = addr_list.size();
+        }
+        std::string spec = addr_list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if(spec.empty())
+        {
+            continue;
+        }
+        if(listener_count == MAX_LISTENERS || !addrs[listener_count].parse(spec.c_str(), cfg.port))
+        {
+            printf("bad listen address: %s\n", spec.c_str());
+            return 1;
+        }
+        ++listener_count;
+    }
+    if(listener_count == 0)
+    {
+        printf("no listen address\n");
         return 1;
     }
-    const char* ip = argv[1];
-    int port = atoi(argv[2]);
+    /*文件大小达到该值时使用sendfile发送 0表示总是使用 负数表示总是使用mmap*/
+    http_conn::m_sendfile_threshold = cfg.sendfile_threshold;
+    http_conn::m_read_buffer_size = cfg.read_buffer;
+    http_conn::m_write_buffer_size = cfg.write_buffer;
+    http_conn::m_send_timeout = cfg.send_timeout;
+    http_conn::m_idle_timeout = cfg.idle_timeout;
+    http_conn::m_high_water = cfg.high_water;
+    /*网站根目录只在启动时设置 重新加载配置不会改变这份拷贝*/
+    const std::string root = cfg.doc_root;
+    doc_root = root.c_str();
 
     /*忽略SIGPIPE信号*/
     addsig(SIGPIPE, SIG_IGN);
+    /*不设置SA_RESTART 使epoll_wait被EINTR打断后立即打印统计或重新加载配置*/
+    addsig(SIGUSR1, stats_handler, false);
+    addsig(SIGHUP, reload_handler, false);
+
+    /*管理端口绑定在第一个IP地址上 只有Unix域socket时绑定回环地址*/
+    listen_addr admin_addr;
+    admin_addr.parse("127.0.0.1", cfg.admin_port);
+    for(int i = 0; i < listener_count; ++i)
+    {
+        if(addrs[i].is_inet())
+        {
+            admin_addr = addrs[i];
+            admin_addr.set_port(cfg.admin_port);
+            break;
+        }
+    }
+
+    /*
+    workers大于0时为prefork模式: master在这里fork出各worker 之后一直管理它们直到退出 不再向下执行
+    worker从run返回 按单进程的流程继续启动 监听socket由master打开 管理端口由master监听
+    完整响应缓存换成fork之前映射的shm_cache 所有worker共享
+    worker中不析构master 其中的管理线程只在master进程中存在
+    */
+    master* prefork = nullptr;
+    shm_cache* shared = nullptr;
+    int given[MAX_LISTENERS];
+    bool worker = false;
+    if(cfg.workers > 0)
+    {
+        shared = new shm_cache(cfg.content_cache_bytes, CONTENT_MAX_BODY);
+        prefork = new master(cfg, argc, argv, addrs, listener_count, shared);
+        if(prefork->run(cfg.admin_port > 0 ? &admin_addr : nullptr, given) < 0)
+        {
+            int status = prefork->status();
+            delete prefork;
+            delete shared;
+            return status;
+        }
+        worker = true;
+    }
+
+    http_conn::init_responses();
+
+    /*小于sendfile阈值的文件由缓存建立共享映射*/
+    long map_limit = http_conn::m_sendfile_threshold < 0 ? LONG_MAX : http_conn::m_sendfile_threshold;
+    file_cache* cache = new file_cache(doc_root, cfg.file_cache_entries, cfg.file_cache_bytes, map_limit);
+    http_conn::m_file_cache = cache;
+    compress_cache* zcache = new compress_cache(cfg.compress_cache_bytes, COMPRESS_MAX_FILE_SIZE);
+    http_conn::m_compress_cache = zcache;
+    /*内容缓存依赖file_cache的inotify得知文件变化*/
+    content_cache* ccache = new content_cache(cache->watching() && !shared ? cfg.content_cache_bytes : 0, CONTENT_MAX_BODY);
+    http_conn::m_content_cache = ccache;
+    if(shared)
+    {
+        shared->resize(cache->watching() ? cfg.content_cache_bytes : 0);
+        cache->set_invalidate_hook(shm_cache::invalidate_hook, shared);
+        http_conn::m_shm_cache = shared;
+    }
+    else
+    {
+        cache->set_invalidate_hook(content_cache::invalidate_hook, ccache);
+    }
+
+    /*proxy_routes配置反向代理 如"/api/=127.0.0.1:8080,/app/=unix:/run/app.sock"*/
+    upstream_pool* proxy = nullptr;
+    if(!cfg.proxy_routes.empty())
+    {
+        proxy = new upstream_pool;
+        if(!proxy->configure(cfg.proxy_routes.c_str()))
+        {
+            return 1;
+        }
+        http_conn::m_proxy = proxy;
+    }
+
+    /*fastcgi_routes把路径前缀交给FastCGI应用 如"/app/=unix:/run/php-fpm.sock,/cgi/=127.0.0.1:9000"*/
+    fcgi_pool* fastcgi = nullptr;
+    if(!cfg.fastcgi_routes.empty())
+    {
+        fastcgi = new fcgi_pool;
+        if(!fastcgi->configure(cfg.fastcgi_routes.c_str()))
+        {
+            return 1;
+        }
+        http_conn::m_fastcgi = fastcgi;
+    }
+
+    /*
+    rate_limit按客户IP限流 如"rate=100,burst=200,conns=64" 每秒100批请求 最多积攒200个令牌 同时64个连接
+    限流表在第一次配置时创建 之后重新加载配置只修改参数 连接持有的槽位指针始终有效
+    */
+    rate_limiter* limiter = nullptr;
+    if(!cfg.rate_limit.empty())
+    {
+        limiter = new rate_limiter;
+        if(!limiter->configure(cfg.rate_limit.c_str()))
+        {
+            return 1;
+        }
+        http_conn::m_rate_limiter = limiter;
+    }
+
+    /*总耗时超过slow_ms毫秒的请求记入慢请求环形缓冲区*/
+    request_trace::set_slow_threshold((uint64_t)(cfg.slow_ms * 1e6));
+
+    /*忙轮询：主循环在睡眠前先用0超时的epoll_wait空转至多busy_poll_us微秒 0(默认)表示不空转*/
+    uint64_t busy_poll_ns = (uint64_t)cfg.busy_poll_us * 1000;
+
+    /*
+    upgrade_socket支持不停机升级 如"unix:/run/tws.upgrade"
+    有旧进程在该地址监听时从它接过监听socket和文件缓存中的路径 没有时正常启动
+    在其余配置都检查过之后才交接 交接之后启动失败时旧进程照常服务
+    */
+    listen_addr upgrade_addr;
+    handoff inherited;
+    bool upgrading = false;
+    if(!cfg.upgrade_socket.empty())
+    {
+        if(!upgrade_addr.parse(cfg.upgrade_socket.c_str(), 0) || upgrade_addr.family != AF_UNIX)
+        {
+            printf("bad upgrade socket: %s\n", cfg.upgrade_socket.c_str());
+            return 1;
+        }
+        upgrading = inherited.receive(upgrade_addr);
+    }
+
+    /*管理端口 与客户连接分开监听 在独立线程中响应指标抓取*/
+    admin_server* admin = nullptr;
+    if(cfg.admin_port > 0 && !worker)
+    {
+        admin = new admin_server(cfg.metrics_path.c_str());
+        if(!admin->start(admin_addr, inherited.take(admin_addr)))
+        {
+            printf("admin listener on port %d failed\n", cfg.admin_port);
+            return 1;
+        }
+    }
 
     /*创建线程池*/
     threadpool<http_conn>* pool = nullptr;
     try
     {
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(cfg.threads, cfg.queue);
     }
     catch(...)
     {
         return 1;
     }
     
-    /*预先为每个可能的客户连接分配一个http_conn对象*/
-    http_conn* users = new http_conn[MAX_FD];
-    assert(users);
-    int user_count = 0;
-
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
-    struct linger tmp = {1, 0};
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
-
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero(&address, sizeof(address));
-    address.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &address.sin_addr);
-    address.sin_port = htons(port);
-
-    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
-    assert(ret != -1);
-
-    ret = listen(listenfd, 5);
-    assert(ret != -1);
-
-    struct epoll_event events[MAX_EVENT_NUMBER];
+    /*准入控制 admission调整过载阈值 如"conns=10000,queue=2000,delay=50" 排队延迟的单位为毫秒*/
+    admission* overload = new admission;
+    if(!overload->configure(cfg.admission.c_str(), connection_capacity(cfg, proxy, fastcgi), pool->capacity()))
+    {
+        return 1;
+    }
+    http_conn::m_admission = overload;
+
+    /*
+    为每个可能的客户连接预留一个http_conn对象的位置 对象在描述符第一次被使用时才构造
+    max_fd个对象共几十MB 大块分配由mmap得到 没有写过的页不占物理内存 常驻内存只随用过的最大描述符增长
+    */
+    http_conn* users = static_cast<http_conn*>(::operator new(sizeof(http_conn) * cfg.max_fd, std::align_val_t(alignof(http_conn))));
+    /*用过的最大描述符 [0, max_connfd]中的对象都已构造 扫描空闲连接时只需检查到这里*/
+    int max_connfd = -1;
+
+    int listenfds[MAX_LISTENERS];
+    for(int i = 0; i < listener_count; ++i)
+    {
+        /*从旧进程接过或由master打开的监听socket沿用原来的监听队列 只按本进程的配置调整长度*/
+        listenfds[i] = worker ? given[i] : inherited.take(addrs[i]);
+        if(listenfds[i] >= 0)
+        {
+            listen(listenfds[i], cfg.backlog);
+        }
+        else
+        {
+            listenfds[i] = open_listener(addrs[i], cfg.backlog);
+        }
+        if(listenfds[i] < 0)
+        {
+            printf("listen on %s failed: %s\n", addrs[i].spec.c_str(), strerror(errno));
+            return 1;
+        }
+        /*
+        内核在socket上忙轮询网卡队列 accept得到的连接从监听socket继承这两个选项 Unix域socket没有网卡队列
+        超过net.core.busy_poll的值需要CAP_NET_ADMIN 失败时只做提示 用户态的空转不受影响
+        */
+        if(busy_poll_ns && addrs[i].is_inet())
+        {
+#ifdef SO_BUSY_POLL
+            int usec = (int)(busy_poll_ns / 1000);
+            if(setsockopt(listenfds[i], SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+            {
+                printf("SO_BUSY_POLL: %s, spinning in user space only\n", strerror(errno));
+            }
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+            int prefer = 1;
+            setsockopt(listenfds[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+        }
+    }
+
+    std::vector<struct epoll_event> events(cfg.max_events);
     int epollfd = epoll_create(5);
     assert(epollfd != -1);
-    addfd(epollfd, listenfd, false);
+    /*客户连接事件的data.ptr指向http_conn对象 各监听socket和inotify用标记区分 监听socket的标记在listen_tags中的下标即其序号*/
+    static char listen_tags[MAX_LISTENERS], inotify_tag, upgrade_tag, handoff_tag;
+    for(int i = 0; i < listener_count; ++i)
+    {
+        addfd(epollfd, listenfds[i], &listen_tags[i], false);
+    }
     http_conn::m_epollfd = epollfd;
+    /*回复429/503后延迟关闭的连接 事件的data.ptr指向它的槽位*/
+    lingering_close* lingering = new lingering_close(epollfd);
+    http_conn::m_lingering = lingering;
+    /*文件变化通知 使对应的缓存项失效*/
+    int inotifyfd = cache->inotify_fd();
+    if(inotifyfd != -1)
+    {
+        addfd(epollfd, inotifyfd, &inotify_tag, false);
+    }
+    /*工作线程交来的FastCGI请求 eventfd事件的data.ptr为fcgi_pool*/
+    if(fastcgi)
+    {
+        addfd(epollfd, fastcgi->event_fd(), fastcgi, false);
+        fastcgi->set_done_hook(fastcgi_done, pool);
+    }
+
+    /*
+    升级: 按旧进程的访问记录预热文件缓存 只取本进程网站根目录下的路径
+    监听socket都已注册 通知旧进程停止accept 此后两个进程不会同时accept
+    */
+    if(upgrading)
+    {
+        std::vector<std::string> paths;
+        for(size_t i = 0; i < inherited.paths().size(); ++i)
+        {
+            if(inherited.paths()[i].compare(0, root.size(), root) == 0)
+            {
+                paths.push_back(inherited.paths()[i]);
+            }
+        }
+        int warmed = cache->warm(paths);
+        if(inherited.commit())
+        {
+            printf("upgrade: took over listening sockets, %d cached files warmed\n", warmed);
+        }
+        else
+        {
+            printf("upgrade: old process went away before the handoff completed\n");
+        }
+    }
+    /*等待下一次升级的新进程 旧进程在交接开始时已关闭它的upgrade_socket*/
+    int upgradefd = -1;
+    if(!cfg.upgrade_socket.empty())
+    {
+        upgradefd = open_listener(upgrade_addr, 1);
+        if(upgradefd < 0)
+        {
+            printf("listen on %s failed: %s\n", upgrade_addr.spec.c_str(), strerror(errno));
+            return 1;
+        }
+        addfd(epollfd, upgradefd, &upgrade_tag, false);
+    }
 
+    time_t last_sweep = time(NULL);
+    uint64_t spin_start = 0;    /*本轮空转开始的时间 0表示没有在空转*/
+    uint64_t last_admission = 0, last_evict = 0;
+    bool accept_paused = false;
+    /*监听socket已交给新进程 等待已接受的连接处理完 handoff_conn为等待新进程确认的连接*/
+    bool draining = false;
+    time_t drain_deadline = 0;
+    int handoff_conn = -1;
+    std::vector<http_conn*> running;
     while(true)
     {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        /*工作线程也会登记等待可写的连接 每秒醒来一次检查慢速客户端*/
+        int timeout = 1000;
+        if(!yielded_conns.empty())
+        {
+            /*还有连接等着继续发送 只收取已就绪的事件*/
+            timeout = 0;
+            spin_start = 0;
+        }
+        else if(accept_paused || draining)
+        {
+            timeout = PAUSED_TIMEOUT;
+        }
+        else if(busy_poll_ns)
+        {
+            uint64_t now = request_trace::now();
+            if(!spin_start)
+            {
+                spin_start = now;
+            }
+            if(now - spin_start < busy_poll_ns)
+            {
+                timeout = 0;
+            }
+            else
+            {
+                metrics::add(BUSY_POLL_NS, now - spin_start);
+                metrics::add(BUSY_POLL_PARKS);
+                spin_start = 0;
+            }
+        }
+        int number = epoll_wait(epollfd, &events[0], cfg.max_events, timeout);
+        metrics::add(SYSCALLS);
+        if(spin_start && timeout == 0 && number > 0)
+        {
+            metrics::add(BUSY_POLL_NS, request_trace::now() - spin_start);
+            metrics::add(BUSY_POLL_HITS);
+            spin_start = 0;
+        }
         if((number < 0) && (errno != EINTR))
         {
             printf("epoll failure\n");
             break;
         }
+        if(dump_stats)
+        {
+            dump_stats = 0;
+            unsigned long requests = http_conn::m_request_count.load();
+            unsigned long allocs = http_conn::m_request_allocs.load();
+            long syscalls = metrics::value(SYSCALLS);
+            printf("requests: %lu heap allocations: %lu (%.3f per request) syscalls: %ld (%.3f per request)\n",
+                    requests, allocs, requests ? (double)allocs / requests : 0.0,
+                    syscalls, requests ? (double)syscalls / requests : 0.0);
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            printf("cpu: user %.3fs system %.3fs busy poll: spun %.3fs hits %ld parks %ld\n",
+                    ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6, ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+                    metrics::value(BUSY_POLL_NS) / 1e9, (long)metrics::value(BUSY_POLL_HITS), (long)metrics::value(BUSY_POLL_PARKS));
+            fflush(stdout);
+        }
+        if(reload_config)
+        {
+            reload_config = 0;
+            reload(cfg, argc, argv, pool, cache, zcache, ccache, limiter, overload, listenfds, listener_count, busy_poll_ns);
+            fflush(stdout);
+        }
 
         for(int i = 0; i < number; ++i)
         {
-            int sockfd = events[i].data.fd;
-            if(sockfd == listenfd)
+            void* ptr = events[i].data.ptr;
+            if(ptr >= (void*)listen_tags && ptr < (void*)(listen_tags + listener_count))
             {
-                struct sockaddr_in client;
-                socklen_t client_addrlength = sizeof(client);
-                int connfd = accept(listenfd, (struct sockaddr*)&client, &client_addrlength);
-                if(connfd < 0)
+                int listenfd = listenfds[(char*)ptr - listen_tags];
+                /*同一批事件中已交给新进程的监听socket*/
+                if(listenfd < 0)
                 {
-                    printf("errno is: %d\n", errno);
                     continue;
                 }
-                if(http_conn::m_user_count >= MAX_FD)
+                /*监听socket是ET模式 必须一直accept到EAGAIN 否则积压在队列中的连接不会再触发事件*/
+                while(true)
                 {
-                    show_error(connfd, "Internal server bussy");
-                    continue;
+                    struct sockaddr_storage client;
+                    socklen_t client_addrlength = sizeof(client);
+                    /*accept4直接得到非阻塞的socket 省去每个连接的一对fcntl*/
+                    int connfd = accept4(listenfd, (struct sockaddr*)&client, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    metrics::add(SYSCALLS);
+                    if(connfd < 0)
+                    {
+                        /*描述符用尽 连接留在监听队列中 暂停accept直到连接数回落*/
+                        if(errno == EMFILE || errno == ENFILE)
+                        {
+                            overload->exhausted(request_trace::now());
+                        }
+                        else if(errno != EAGAIN && errno != EWOULDBLOCK)
+                        {
+                            printf("errno is: %d\n", errno);
+                        }
+                        break;
+                    }
+                    /*连接对象按描述符下标 超出时回复503后交给lingering关闭 发送不阻塞主线程*/
+                    if(connfd >= cfg.max_fd)
+                    {
+                        admission::refuse(connfd, lingering);
+                        metrics::add(SHED_ACCEPTS);
+                        continue;
+                    }
+                    /*超过限流的连接回复429后交给lingering关闭 不创建连接状态*/
+                    rate_slot* slot = nullptr;
+                    if(limiter && limiter->limiting() && !limiter->admit((struct sockaddr*)&client, &slot))
+                    {
+                        rate_limiter::refuse(connfd, lingering);
+                        continue;
+                    }
+                    /*初始化客户连接*/
+                    for(; max_connfd < connfd; ++max_connfd)
+                    {
+                        new(users + max_connfd + 1) http_conn;
+                    }
+                    users[connfd].init(connfd, (struct sockaddr*)&client, client_addrlength, slot);
+                    TWS_PROBE2(accept, connfd, http_conn::m_user_count.load(std::memory_order_relaxed));
                 }
-                /*初始化客户连接*/
-                users[connfd].init(connfd, client);
             }
-            else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            else if(ptr == &inotify_tag)
             {
-                /*异常 直接关闭客户连接*/
-                users[sockfd].close_conn();
+                cache->process_events();
+            }
+            else if(ptr == &upgrade_tag)
+            {
+                /*新进程来接管 交出客户连接的监听socket和管理端口 关闭upgrade_socket使新进程可以绑定同一地址*/
+                int fds[MAX_LISTENERS + 1];
+                listen_addr offered[MAX_LISTENERS + 1];
+                int n = 0;
+                for(int j = 0; j < listener_count; ++j)
+                {
+                    fds[n] = listenfds[j];
+                    offered[n++] = addrs[j];
+                }
+                if(admin)
+                {
+                    fds[n] = admin->listen_fd();
+                    offered[n++] = admin_addr;
+                }
+                handoff_conn = handoff::offer(upgradefd, fds, offered, n, cache->paths());
+                if(handoff_conn >= 0)
+                {
+                    close(upgradefd);
+                    upgradefd = -1;
+                    addfd(epollfd, handoff_conn, &handoff_tag, false);
+                    printf("upgrade: listening sockets sent to new process\n");
+                    fflush(stdout);
+                }
             }
-            else if(events[i].events & EPOLLIN)
+            else if(ptr == &handoff_tag)
             {
-                /*根据读的结果 决定是将任务添加到线程池 还是关闭连接*/
-                if(users[sockfd].read_once())
+                bool taken = handoff::committed(handoff_conn);
+                close(handoff_conn);
+                handoff_conn = -1;
+                if(taken)
                 {
-                    pool->append(users + sockfd);
+                    /*
+                    新进程已接管: 移出epoll后关闭监听socket 内核中的监听队列由新进程继续accept
+                    同一个socket还被新进程引用 关闭描述符不会自动移出epoll 必须先EPOLL_CTL_DEL
+                    */
+                    for(int j = 0; j < listener_count; ++j)
+                    {
+                        epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfds[j], NULL);
+                        close(listenfds[j]);
+                        listenfds[j] = -1;
+                    }
+                    delete admin;
+                    admin = nullptr;
+                    overload->drain();
+                    draining = true;
+                    drain_deadline = time(NULL) + cfg.drain_timeout;
+                    printf("upgrade: new process took over, draining %d connections\n", http_conn::m_user_count.load());
                 }
                 else
                 {
-                    users[sockfd].close_conn();
+                    /*新进程没有完成启动 继续服务并等待下一次升级*/
+                    upgradefd = open_listener(upgrade_addr, 1);
+                    if(upgradefd >= 0)
+                    {
+                        addfd(epollfd, upgradefd, &upgrade_tag, false);
+                    }
+                    printf("upgrade: new process failed before taking over, still serving\n");
                 }
+                fflush(stdout);
             }
-            else if(events[i].events & EPOLLOUT)
+            else if(proxy && proxy->owns(ptr))
             {
-                /*根据写的结果 决定是否关闭连接*/
-                if(!users[sockfd].write())
+                /*上游socket的事件 转发的结果作用于对应的客户连接 没有客户连接的是已关闭的上游连接的过时事件*/
+                upstream_conn* upstream = static_cast<upstream_conn*>(ptr);
+                http_conn* conn = upstream->client();
+                if(conn)
                 {
-                    users[sockfd].close_conn();
+                    after_write(conn, upstream->on_event(events[i].events), pool);
                 }
             }
+            else if(lingering->owns(ptr))
+            {
+                lingering->on_event(ptr);
+            }
+            else if(fastcgi && fastcgi->owns(ptr))
+            {
+                /*eventfd或应用连接的事件 完成的请求经fastcgi_done交给after_write*/
+                fastcgi->on_event(ptr, events[i].events);
+            }
             else
-            {}
+            {
+                http_conn* conn = static_cast<http_conn*>(ptr);
+                if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                {
+                    /*异常 直接关闭客户连接*/
+                    conn->close_conn();
+                }
+                else if(conn->relaying())
+                {
+                    /*交给FastCGI应用的请求: 客户可读时继续读请求体 可写时继续转发响应*/
+                    after_write(conn, conn->write(), pool);
+                }
+                else if(events[i].events & EPOLLIN)
+                {
+                    /*根据读的结果 决定是将任务添加到线程池 还是关闭连接*/
+                    if(conn->read_once())
+                    {
+                        dispatch(conn, pool);
+                    }
+                    else
+                    {
+                        conn->close_conn();
+                    }
+                }
+                else if(events[i].events & EPOLLOUT)
+                {
+                    /*根据写的结果 决定关闭连接、把流水线中的下一个请求交给线程池 还是预算用完稍后继续*/
+                    after_write(conn, conn->write(http_conn::WRITE_BUDGET), pool);
+                }
+            }
+        }
+        /*轮流给预算用完的连接再发送一份预算 期间被关闭的连接不再发送*/
+        if(!yielded_conns.empty())
+        {
+            running.swap(yielded_conns);
+            for(size_t j = 0; j < running.size(); ++j)
+            {
+                if(running[j]->yielded())
+                {
+                    after_write(running[j], running[j]->write(http_conn::WRITE_BUDGET), pool);
+                }
+            }
+            running.clear();
+        }
+        /*这一批事件处理完 其间关闭的上游连接对象可以分配给新请求*/
+        if(proxy)
+        {
+            proxy->reclaim();
+        }
+        /*
+        准入控制: 每INTERVAL_NS采样一次连接数、请求队列长度和队头请求的等待时间
+        过载时把监听socket移出epoll 新连接留在内核的监听队列中 恢复时重新注册 EPOLL_CTL_ADD会立即报告积压的连接
+        连接数有压力时关闭最近最少使用的空闲连接
+        */
+        uint64_t now_ns = request_trace::now();
+        if(now_ns - last_admission >= admission::INTERVAL_NS)
+        {
+            uint64_t wait = 0;
+            int queued = pool->queued(now_ns, &wait);
+            int conns = http_conn::m_user_count.load(std::memory_order_relaxed);
+            overload->update(now_ns, conns, queued, wait);
+            last_admission = now_ns;
+            int evict = overload->evict_count(conns);
+            if(evict && now_ns - last_evict >= admission::EVICT_INTERVAL_NS)
+            {
+                http_conn::evict_idle(users, max_connfd + 1, evict);
+                last_evict = now_ns;
+            }
+        }
+        /*
+        排空: 已接受的连接都已关闭或超过drain_timeout时退出
+        响应不再保持连接 空闲超过DRAIN_GRACE的连接直接关闭
+        */
+        if(draining)
+        {
+            int conns = http_conn::m_user_count.load(std::memory_order_relaxed);
+            if(conns == 0 || time(NULL) >= drain_deadline)
+            {
+                printf("upgrade: drained, %d connections left, exiting\n", conns);
+                break;
+            }
+            if(now_ns - last_evict >= admission::EVICT_INTERVAL_NS)
+            {
+                http_conn::evict_idle(users, max_connfd + 1, conns, now_ns - DRAIN_GRACE);
+                last_evict = now_ns;
+            }
+        }
+        else if(overload->pause_accept() != accept_paused)
+        {
+            accept_paused = !accept_paused;
+            for(int j = 0; j < listener_count; ++j)
+            {
+                if(accept_paused)
+                {
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfds[j], NULL);
+                }
+                else
+                {
+                    addfd(epollfd, listenfds[j], &listen_tags[j], false);
+                }
+            }
+            if(accept_paused)
+            {
+                metrics::add(ACCEPT_PAUSES);
+            }
+        }
+        time_t now = time(NULL);
+        if(now != last_sweep)
+        {
+            http_conn::sweep_slow_clients(now);
+            http_conn::expire_idle(now);
+            lingering->sweep(now);
+            if(proxy)
+            {
+                std::vector<upstream_conn*> expired = proxy->sweep(now);
+                for(size_t j = 0; j < expired.size(); ++j)
+                {
+                    http_conn* conn = expired[j]->client();
+                    after_write(conn, expired[j]->on_timeout(), pool);
+                }
+            }
+            if(fastcgi)
+            {
+                fastcgi->sweep(now);
+            }
+            last_sweep = now;
         }
     }
     close(epollfd);
-    close(listenfd);
-    delete [] users;
+    /*已交给新进程的监听socket为-1 它的socket文件不能删除 prefork模式下由master删除*/
+    for(int i = 0; i < listener_count; ++i)
+    {
+        if(listenfds[i] < 0)
+        {
+            continue;
+        }
+        close(listenfds[i]);
+        if(addrs[i].unix_path() && !worker)
+        {
+            unlink(addrs[i].unix_path());
+        }
+    }
+    for(int i = 0; i <= max_connfd; ++i)
+    {
+        users[i].~http_conn();
+    }
+    ::operator delete(users, std::align_val_t(alignof(http_conn)));
+    delete lingering;
     delete pool;
+    delete zcache;
+    delete cache;
+    delete proxy;
+    delete fastcgi;
+    delete limiter;
+    delete overload;
+    delete ccache;
+    delete admin;
     return 0;
 }
 
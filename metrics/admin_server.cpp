@@ -0,0 +1,174 @@
+#include"admin_server.h"
+#include"metrics.h"
+#include"request_trace.h"
+
+#include<sys/socket.h>
+#include<sys/time.h>
+#include<poll.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<stdio.h>
+#include<cstring>
+
+static const char SLOW_PATH[] = "/slow";
+static const char not_found[] =
+    "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+admin_server::admin_server(const char* metrics_path)
+: m_metrics_path(metrics_path), m_listenfd(-1), m_thread(0)
+{
+    m_wake[0] = m_wake[1] = -1;
+}
+
+admin_server::~admin_server()
+{
+    if(m_listenfd != -1)
+    {
+        /*
+        经管道唤醒阻塞在poll中的管理线程
+        不对监听socket做shutdown 升级时它已交给新进程 shutdown会使新进程的accept也失败
+        */
+        char stop = 0;
+        ssize_t ret = write(m_wake[1], &stop, 1);
+        (void)ret;
+        pthread_join(m_thread, NULL);
+        close(m_listenfd);
+        close(m_wake[0]);
+        close(m_wake[1]);
+    }
+}
+
+bool admin_server::start(const listen_addr& addr, int fd)
+{
+    if(fd < 0)
+    {
+        fd = open_listener(addr, 16);
+    }
+    if(fd < 0)
+    {
+        return false;
+    }
+    if(pipe2(m_wake, O_CLOEXEC) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    /*监听socket可能与升级中的另一个进程共用 连接被对方取走时accept不能阻塞*/
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    m_listenfd = fd;
+    if(pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        close(fd);
+        close(m_wake[0]);
+        close(m_wake[1]);
+        m_listenfd = -1;
+        return false;
+    }
+    return true;
+}
+
+void* admin_server::worker(void* arg)
+{
+    admin_server* server = static_cast<admin_server*>(arg);
+    server->run();
+    return server;
+}
+
+void admin_server::run()
+{
+    struct pollfd fds[2] = {{m_listenfd, POLLIN, 0}, {m_wake[0], POLLIN, 0}};
+    while(true)
+    {
+        fds[0].revents = fds[1].revents = 0;
+        if(poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        /*析构函数要求退出*/
+        if(fds[1].revents)
+        {
+            break;
+        }
+        if(!(fds[0].revents & POLLIN))
+        {
+            continue;
+        }
+        int connfd = accept(m_listenfd, NULL, NULL);
+        if(connfd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                continue;
+            }
+            break;
+        }
+        handle(connfd);
+        close(connfd);
+    }
+}
+
+/*读取请求头 只检查请求行中的方法和路径*/
+void admin_server::handle(int connfd)
+{
+    struct timeval tv = {RECV_TIMEOUT, 0};
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char buf[2048];
+    size_t len = 0;
+    while(len < sizeof(buf) - 1)
+    {
+        ssize_t n = recv(connfd, buf + len, sizeof(buf) - 1 - len, 0);
+        if(n <= 0)
+        {
+            return;
+        }
+        len += n;
+        buf[len] = '\0';
+        if(strstr(buf, "\r\n\r\n"))
+        {
+            break;
+        }
+    }
+    buf[len] = '\0';
+
+    const char* path = nullptr;
+    size_t path_len = 0;
+    if(strncmp(buf, "GET ", 4) == 0)
+    {
+        path = buf + 4;
+        path_len = strcspn(path, " ?\r\n");
+    }
+    std::string body;
+    if(path && path_len == m_metrics_path.size() && memcmp(path, m_metrics_path.data(), path_len) == 0)
+    {
+        body = metrics::render() + request_trace::render_histograms();
+    }
+    else if(path && path_len == sizeof(SLOW_PATH) - 1 && memcmp(path, SLOW_PATH, path_len) == 0)
+    {
+        body = request_trace::render_slow();
+    }
+    else
+    {
+        send(connfd, not_found, sizeof(not_found) - 1, MSG_NOSIGNAL);
+        return;
+    }
+
+    char head[160];
+    int head_len = snprintf(head, sizeof(head),
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            body.size());
+    std::string response(head, head_len);
+    response += body;
+    size_t sent = 0;
+    while(sent < response.size())
+    {
+        ssize_t n = send(connfd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            return;
+        }
+        sent += n;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _ADMINSERVER_H_
+#define _ADMINSERVER_H_
+
+#include<pthread.h>
+#include<string>
+
+#include"../net/listener.h"
+
+/*
+管理端口：
+    独立的监听socket和独立的线程 阻塞地逐个处理请求 不进入主线程的epoll 也不占用工作线程
+    只响应 GET <metrics_path>(运行指标和各阶段耗时) 和 GET /slow(最近的慢请求) 其余路径返回404 每个请求处理完即关闭连接
+    客户端在RECV_TIMEOUT秒内没有发完请求头则断开 避免一个慢速客户端长期占用管理线程
+*/
+class admin_server{
+public:
+    static const int RECV_TIMEOUT = 2;
+
+    admin_server(const char* metrics_path);
+    ~admin_server();
+
+    /*绑定地址并启动管理线程 fd为升级时从旧进程接过的监听socket 失败时返回false*/
+    bool start(const listen_addr& addr, int fd = -1);
+    /*监听socket 升级时交给新进程*/
+    int listen_fd() const { return m_listenfd; }
+
+private:
+    static void* worker(void* arg);
+    void run();
+    void handle(int connfd);
+
+private:
+    std::string m_metrics_path;
+    int m_listenfd;
+    int m_wake[2];          /*停止管理线程的管道*/
+    pthread_t m_thread;
+};
+
+#endif
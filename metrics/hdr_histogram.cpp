@@ -0,0 +1,68 @@
+#include"hdr_histogram.h"
+
+#include<math.h>
+
+hdr_histogram::hdr_histogram() : m_count(0), m_sum(0)
+{
+    for(int i = 0; i < BUCKET_NUMBER; ++i)
+    {
+        m_counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+/*index_of的逆运算 返回桶中最大的值*/
+uint64_t hdr_histogram::highest_of(int index)
+{
+    if(index < HALF * 2)
+    {
+        return index;
+    }
+    int shift = index / HALF - 1;
+    uint64_t sub = index - shift * HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hdr_histogram::merge(const hdr_histogram& other)
+{
+    for(int i = 0; i < BUCKET_NUMBER; ++i)
+    {
+        uint64_t n = other.m_counts[i].load(std::memory_order_relaxed);
+        if(n)
+        {
+            m_counts[i].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    m_count.fetch_add(other.count(), std::memory_order_relaxed);
+    m_sum.fetch_add(other.sum(), std::memory_order_relaxed);
+}
+
+uint64_t hdr_histogram::percentile(double q) const
+{
+    /*各桶的计数可能在遍历期间增加 以遍历时实际累加到的总数为准*/
+    uint64_t counts[BUCKET_NUMBER];
+    uint64_t total = 0;
+    for(int i = 0; i < BUCKET_NUMBER; ++i)
+    {
+        counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if(total == 0)
+    {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(q * total);
+    if(target == 0)
+    {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKET_NUMBER; ++i)
+    {
+        seen += counts[i];
+        if(seen >= target)
+        {
+            return highest_of(i);
+        }
+    }
+    return highest_of(BUCKET_NUMBER - 1);
+}
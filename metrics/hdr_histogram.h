@@ -0,0 +1,58 @@
+#ifndef _HDRHISTOGRAM_H_
+#define _HDRHISTOGRAM_H_
+
+#include<stdint.h>
+#include<atomic>
+
+/*
+HDR(高动态范围)直方图 记录以纳秒为单位的耗时：
+    小于128的值每个值一个桶 之后每个2的幂区间等分为64个桶 相对误差不超过1/64
+    覆盖0到2^40纳秒(约18分钟) 更大的值计入最后一个桶
+    record只对一个桶做relaxed的fetch_add 多个线程可以同时记录 读取时不加锁
+*/
+class hdr_histogram{
+public:
+    static const int SUB_BITS = 7;
+    static const int HALF = 1 << (SUB_BITS - 1);
+    static const int MAX_BITS = 40;
+    static const int BUCKET_NUMBER = (MAX_BITS - SUB_BITS + 2) * HALF;
+
+    hdr_histogram();
+
+    void record(uint64_t value)
+    {
+        m_counts[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    /*把other的记录累加到本直方图 用于合并各线程各自记录的直方图*/
+    void merge(const hdr_histogram& other);
+    /*第q分位(0 < q <= 1)所在桶的上界*/
+    uint64_t percentile(double q) const;
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+
+private:
+    static int index_of(uint64_t value)
+    {
+        if(value < (uint64_t)HALF * 2)
+        {
+            return (int)value;
+        }
+        if(value >> MAX_BITS)
+        {
+            return BUCKET_NUMBER - 1;
+        }
+        int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+        return shift * HALF + (int)(value >> shift);
+    }
+    static uint64_t highest_of(int index);
+
+private:
+    std::atomic<uint64_t> m_counts[BUCKET_NUMBER];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+};
+
+#endif
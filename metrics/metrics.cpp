@@ -0,0 +1,235 @@
+#include"metrics.h"
+
+#include<stdio.h>
+#include<cstring>
+#include<sys/resource.h>
+#include<sys/mman.h>
+#include<new>
+
+metrics::region metrics::m_default;
+metrics::region* metrics::m_regions = &metrics::m_default;
+int metrics::m_region_count = 1;
+metrics::region* metrics::m_own = &metrics::m_default;
+bool metrics::m_aggregate = false;
+__thread metrics::shard* metrics::m_local = nullptr;
+
+/*每项指标的名字、标签、类型和说明 同名的多组标签只需在第一组给出说明*/
+struct metric_desc{
+    const char* name;
+    const char* labels;
+    const char* type;
+    const char* help;
+};
+
+static const metric_desc descs[METRIC_NUMBER] = {
+    {"tws_connections_accepted_total", nullptr, "counter", "Accepted client connections."},
+    {"tws_connections_closed_total", nullptr, "counter", "Closed client connections."},
+    {"tws_connections_open", nullptr, "gauge", "Currently open client connections."},
+    {"tws_http_responses_total", "code=\"200\"", "counter", "HTTP responses by status code."},
+    {"tws_http_responses_total", "code=\"304\"", "counter", nullptr},
+    {"tws_http_responses_total", "code=\"400\"", "counter", nullptr},
+    {"tws_http_responses_total", "code=\"403\"", "counter", nullptr},
+    {"tws_http_responses_total", "code=\"404\"", "counter", nullptr},
+    {"tws_http_responses_total", "code=\"500\"", "counter", nullptr},
+    {"tws_http_responses_total", "code=\"502\"", "counter", nullptr},
+    {"tws_bytes_received_total", nullptr, "counter", "Bytes read from client sockets."},
+    {"tws_bytes_sent_total", nullptr, "counter", "Bytes written to client sockets, headers and bodies."},
+    {"tws_threadpool_queue_depth", nullptr, "gauge", "Requests waiting in the threadpool work queue."},
+    {"tws_worker_busy_seconds_total", nullptr, "counter", "Time worker threads spent processing requests."},
+    {"tws_cache_hits_total", "cache=\"file\"", "counter", "Cache lookups that hit."},
+    {"tws_cache_misses_total", "cache=\"file\"", "counter", "Cache lookups that missed."},
+    {"tws_cache_hits_total", "cache=\"content\"", "counter", nullptr},
+    {"tws_cache_misses_total", "cache=\"content\"", "counter", nullptr},
+    {"tws_cache_hits_total", "cache=\"compress\"", "counter", nullptr},
+    {"tws_cache_misses_total", "cache=\"compress\"", "counter", nullptr},
+    {"tws_syscalls_total", nullptr, "counter", "System calls on the connection lifecycle: accept, epoll, socket I/O and file cache misses."},
+    {"tws_busy_poll_seconds_total", nullptr, "counter", "Time the event loop spent spinning on empty zero-timeout polls."},
+    {"tws_busy_poll_wakeups_total", "result=\"hit\"", "counter", "Busy-poll rounds that found events before the spin budget ran out (hit) or parked in a blocking wait (park)."},
+    {"tws_busy_poll_wakeups_total", "result=\"park\"", "counter", nullptr},
+    {"tws_upstream_requests_total", "connection=\"new\"", "counter", "Upstream connections opened (new) and pooled connections reused for a proxied request (reused)."},
+    {"tws_upstream_requests_total", "connection=\"reused\"", "counter", nullptr},
+    {"tws_upstream_errors_total", nullptr, "counter", "Upstream connect failures, resets and malformed responses."},
+    {"tws_fastcgi_requests_total", nullptr, "counter", "Requests handed to a FastCGI application."},
+    {"tws_fastcgi_connections_total", nullptr, "counter", "Persistent connections opened to FastCGI applications."},
+    {"tws_fastcgi_errors_total", nullptr, "counter", "FastCGI connection failures, timeouts and failed requests."},
+    {"tws_rate_limited_total", "stage=\"accept\"", "counter", "Connections refused at accept (empty bucket or too many connections) and requests refused before reaching the thread pool."},
+    {"tws_rate_limited_total", "stage=\"request\"", "counter", nullptr},
+    {"tws_rate_limit_table_full_total", nullptr, "counter", "Connections admitted unlimited because the client table had no free slot."},
+    {"tws_admission_level", nullptr, "gauge", "Overload admission level: 0 normal, 1 pressure (keep-alive off, idle eviction), 2 overload (accept paused, requests shed)."},
+    {"tws_overload_shed_total", "stage=\"accept\"", "counter", "Connections refused with 503 because no descriptor was left (accept) and requests answered with 503 instead of queueing (request)."},
+    {"tws_overload_shed_total", "stage=\"request\"", "counter", nullptr},
+    {"tws_idle_evictions_total", nullptr, "counter", "Idle keep-alive connections closed, least recently used first, under connection pressure."},
+    {"tws_slow_client_closes_total", nullptr, "counter", "Connections closed because unsent data stayed above high_water with no progress for send_timeout seconds."},
+    {"tws_idle_timeouts_total", nullptr, "counter", "Connections closed after waiting idle_timeout seconds for a request."},
+    {"tws_accept_pauses_total", nullptr, "counter", "Times the listeners were removed from the event loop because of overload."},
+    {"tws_workers", nullptr, "gauge", "Worker processes running in prefork mode."},
+    {"tws_worker_restarts_total", nullptr, "counter", "Worker processes restarted by the master after they exited."},
+};
+
+metrics::shard* metrics::attach()
+{
+    int idx = m_own->next_shard.fetch_add(1, std::memory_order_relaxed);
+    if(idx < MAX_SHARDS - 1)
+    {
+        m_own->shards[idx].exclusive = true;
+        m_local = &m_own->shards[idx];
+    }
+    else
+    {
+        /*最后一个分片为共用分片 exclusive保持为false*/
+        m_local = &m_own->shards[MAX_SHARDS - 1];
+    }
+    return m_local;
+}
+
+/*重新启动的worker从第0个分片重新领取 之前的worker用过的分片可能比它多 所以对全部分片求和*/
+int64_t metrics::region_value(const region& r, METRIC m)
+{
+    int64_t sum = 0;
+    for(int i = 0; i < MAX_SHARDS; ++i)
+    {
+        sum += r.shards[i].values[m].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+int64_t metrics::value(METRIC m)
+{
+    if(!m_aggregate)
+    {
+        return region_value(*m_own, m);
+    }
+    int64_t sum = 0;
+    for(int i = 0; i < m_region_count; ++i)
+    {
+        int64_t v = region_value(m_regions[i], m);
+        /*各进程的准入控制相互独立 汇总时取最严重的级别*/
+        if(m == ADMISSION_LEVEL)
+        {
+            sum = v > sum ? v : sum;
+        }
+        else
+        {
+            sum += v;
+        }
+    }
+    return sum;
+}
+
+bool metrics::share(int processes)
+{
+    void* p = mmap(NULL, sizeof(region) * processes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        return false;
+    }
+    /*匿名映射已清零 原子变量在Linux上以零初始化即可使用 这里仍按对象构造*/
+    region* regions = static_cast<region*>(p);
+    for(int i = 0; i < processes; ++i)
+    {
+        new(&regions[i]) region();
+    }
+    m_regions = regions;
+    m_region_count = processes;
+    m_own = regions;
+    return true;
+}
+
+void metrics::select(int index, bool aggregate)
+{
+    m_own = &m_regions[index];
+    m_aggregate = aggregate;
+    /*重新启动的worker从第0个分片开始领取 fork继承的线程局部指针属于master*/
+    m_own->next_shard.store(0, std::memory_order_relaxed);
+    m_local = nullptr;
+}
+
+void metrics::reset_gauges(int index)
+{
+    region& r = m_regions[index];
+    for(int m = 0; m < METRIC_NUMBER; ++m)
+    {
+        if(strcmp(descs[m].type, "gauge") != 0)
+        {
+            continue;
+        }
+        for(int i = 0; i < MAX_SHARDS; ++i)
+        {
+            r.shards[i].values[m].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+METRIC metrics::response_metric(int status)
+{
+    switch(status)
+    {
+        case 200: return RESPONSES_200;
+        case 304: return RESPONSES_304;
+        case 400: return RESPONSES_400;
+        case 403: return RESPONSES_403;
+        case 404: return RESPONSES_404;
+        case 500: return RESPONSES_500;
+        case 502: return RESPONSES_502;
+        default: return METRIC_NUMBER;
+    }
+}
+
+/*同一名字的多组标签(如各个状态码)连续输出 只输出一次HELP和TYPE*/
+std::string metrics::render()
+{
+    std::string out;
+    char line[256];
+    int64_t values[METRIC_NUMBER];
+    for(int i = 0; i < METRIC_NUMBER; ++i)
+    {
+        values[i] = value((METRIC)i);
+    }
+    bool printed[METRIC_NUMBER] = {false};
+    for(int i = 0; i < METRIC_NUMBER; ++i)
+    {
+        if(printed[i])
+        {
+            continue;
+        }
+        const metric_desc& d = descs[i];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", d.name, d.help ? d.help : "", d.name, d.type);
+        out += line;
+        for(int j = i; j < METRIC_NUMBER; ++j)
+        {
+            if(printed[j] || strcmp(descs[j].name, d.name) != 0)
+            {
+                continue;
+            }
+            printed[j] = true;
+            if(j == WORKER_BUSY_NS || j == BUSY_POLL_NS)
+            {
+                snprintf(line, sizeof(line), "%s %.6f\n", descs[j].name, values[j] / 1e9);
+            }
+            else if(descs[j].labels)
+            {
+                snprintf(line, sizeof(line), "%s{%s} %lld\n", descs[j].name, descs[j].labels, (long long)values[j]);
+            }
+            else
+            {
+                snprintf(line, sizeof(line), "%s %lld\n", descs[j].name, (long long)values[j]);
+            }
+            out += line;
+        }
+    }
+    /*忙轮询用CPU换延迟 与请求耗时对照时需要知道进程实际消耗的CPU*/
+    struct rusage ru;
+    if(getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+        char cpu[512];
+        snprintf(cpu, sizeof(cpu),
+                "# HELP tws_process_cpu_seconds_total CPU time consumed by the server process.\n"
+                "# TYPE tws_process_cpu_seconds_total counter\n"
+                "tws_process_cpu_seconds_total{mode=\"user\"} %ld.%06ld\n"
+                "tws_process_cpu_seconds_total{mode=\"system\"} %ld.%06ld\n",
+                (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec,
+                (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+        out += cpu;
+    }
+    return out;
+}
@@ -0,0 +1,121 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include<stdint.h>
+#include<atomic>
+#include<string>
+
+/*服务器的各项指标 计数器只增不减 仪表(GAUGE)可增可减*/
+enum METRIC{
+    CONNECTIONS_ACCEPTED = 0,
+    CONNECTIONS_CLOSED,
+    CONNECTIONS_OPEN,           /*仪表*/
+    RESPONSES_200,
+    RESPONSES_304,
+    RESPONSES_400,
+    RESPONSES_403,
+    RESPONSES_404,
+    RESPONSES_500,
+    RESPONSES_502,
+    BYTES_IN,
+    BYTES_OUT,
+    QUEUE_DEPTH,                /*仪表*/
+    WORKER_BUSY_NS,
+    FILE_CACHE_HITS,
+    FILE_CACHE_MISSES,
+    CONTENT_CACHE_HITS,
+    CONTENT_CACHE_MISSES,
+    COMPRESS_CACHE_HITS,
+    COMPRESS_CACHE_MISSES,
+    SYSCALLS,                   /*连接生命周期中的系统调用: accept、epoll、socket读写、文件缓存未命中时的文件操作*/
+    BUSY_POLL_NS,               /*忙轮询模式下主循环空转(0超时epoll_wait没有事件)的时间*/
+    BUSY_POLL_HITS,             /*空转预算内等到事件 没有进入睡眠*/
+    BUSY_POLL_PARKS,            /*空转预算耗尽 转为阻塞的epoll_wait*/
+    UPSTREAM_NEW,               /*反向代理新建的上游连接*/
+    UPSTREAM_REUSED,            /*复用空闲上游连接的请求*/
+    UPSTREAM_ERRORS,            /*上游连接失败、断开或响应有误*/
+    FASTCGI_REQUESTS,           /*交给FastCGI应用的请求*/
+    FASTCGI_CONNECTS,           /*新建的FastCGI应用连接*/
+    FASTCGI_ERRORS,             /*FastCGI连接失败、断开、超时或请求失败*/
+    RATE_LIMITED_ACCEPTS,       /*因令牌桶已空或连接数已满在accept时拒绝的连接*/
+    RATE_LIMITED_REQUESTS,      /*因令牌桶已空没有交给线程池的请求*/
+    RATE_LIMIT_TABLE_FULL,      /*限流表的探测窗口已满 没有限流的连接*/
+    ADMISSION_LEVEL,            /*仪表 准入控制的级别 0正常 1压力 2过载*/
+    SHED_ACCEPTS,               /*描述符用尽时回复503关闭的连接*/
+    SHED_REQUESTS,              /*过载或请求队列已满时回复503的请求*/
+    IDLE_EVICTIONS,             /*压力下关闭的空闲keep-alive连接*/
+    SLOW_CLIENT_CLOSES,         /*未发送数据超过高水位且超时没有进展而关闭的连接*/
+    IDLE_TIMEOUTS,              /*空闲超过idle_timeout而关闭的连接*/
+    ACCEPT_PAUSES,              /*过载时暂停accept的次数*/
+    WORKERS,                    /*仪表 prefork模式下运行中的worker进程数*/
+    WORKER_RESTARTS,            /*退出后由master重新启动的worker进程*/
+    METRIC_NUMBER
+};
+
+/*
+按线程分片的指标：
+    每个线程第一次记录指标时领取一个独占的分片 分片按缓存行对齐 线程之间不会争用同一个缓存行
+    独占分片只有一个写者 记录指标只是一次普通的读改写(relaxed原子读写) 不需要带LOCK前缀的指令
+    线程数超过MAX_SHARDS-1时 多出的线程共用最后一个分片 使用fetch_add
+    读取时把所有分片的值相加 不加锁 仪表在不同线程中的增减也在相加后抵消
+    各分片的值在读取过程中仍可能变化 得到的是近似同一时刻的快照
+prefork模式下每个进程一组分片 都在master于fork之前映射的共享内存中:
+    worker只写自己的一组 master的管理端口读取时把所有进程的分片相加(准入控制级别取各进程的最大值)
+    worker异常退出后只清零它的仪表 计数器保留 重新启动的worker在原来的值上继续累加 汇总的计数器不会回退
+*/
+class metrics{
+public:
+    static const int MAX_SHARDS = 64;
+
+    static void add(METRIC m, int64_t n = 1)
+    {
+        shard* s = m_local ? m_local : attach();
+        if(s->exclusive)
+        {
+            s->values[m].store(s->values[m].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        else
+        {
+            s->values[m].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    /*所有分片之和*/
+    static int64_t value(METRIC m);
+    /*按Prometheus文本格式输出全部指标 以及进程的CPU时间*/
+    static std::string render();
+    /*HTTP状态码对应的响应计数器 没有对应计数器时返回METRIC_NUMBER*/
+    static METRIC response_metric(int status);
+
+    /*prefork模式: master在fork之前调用 为processes个进程各映射一组共享的分片 失败时返回false*/
+    static bool share(int processes);
+    /*在fork之后、记录任何指标之前选择第index组分片 aggregate为true时value()汇总所有进程*/
+    static void select(int index, bool aggregate);
+    /*第index个进程退出后清零它的仪表*/
+    static void reset_gauges(int index);
+
+private:
+    struct shard{
+        alignas(64) std::atomic<int64_t> values[METRIC_NUMBER];
+        bool exclusive;
+    };
+    /*一个进程的全部分片*/
+    struct region{
+        shard shards[MAX_SHARDS];
+        std::atomic<int> next_shard;
+    };
+
+    static shard* attach();
+    static int64_t region_value(const region& r, METRIC m);
+
+private:
+    /*单进程时指向m_default prefork模式下指向共享内存*/
+    static region m_default;
+    static region* m_regions;
+    static int m_region_count;
+    static region* m_own;
+    static bool m_aggregate;
+    static __thread shard* m_local;
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+USDT静态探针：provider为tinyweb
+    探针编译为一条nop指令和ELF中.note.stapsdt段里的描述 没有附加跟踪程序时不产生任何开销
+    附加后可以用bpftrace/perf在不重启、不重新编译的情况下观察每个请求
+        bpftrace -l 'usdt:./server:tinyweb:*'
+        bpftrace -e 'usdt:./server:tinyweb:write_done { @[arg2] = hist(arg1); }'
+    需要sys/sdt.h(systemtap-sdt-dev/systemtap-sdt-devel) 没有该头文件或定义了TWS_NO_USDT时探针只对参数求值 避免只供探针使用的变量产生未使用警告
+
+探针及参数：
+    accept(fd, 当前连接数)
+    read(fd, 本次读到的字节数, 读缓冲区中的总字节数)
+    enqueue(fd, 入队后的队列长度)
+    dequeue(fd, 出队后的队列长度)
+    parsed(fd, process_read的结果HTTP_CODE, 主状态机状态, 请求方法)
+    request(fd, do_request的结果HTTP_CODE, url, 耗时纳秒)
+    write_done(fd, 响应的字节数, 状态码, 是否保持连接)
+*/
+#if !defined(TWS_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include<sys/sdt.h>
+#define TWS_USDT 1
+#endif
+#endif
+
+#ifdef TWS_USDT
+#define TWS_PROBE2(name, a, b) DTRACE_PROBE2(tinyweb, name, a, b)
+#define TWS_PROBE3(name, a, b, c) DTRACE_PROBE3(tinyweb, name, a, b, c)
+#define TWS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(tinyweb, name, a, b, c, d)
+#else
+#define TWS_PROBE2(name, a, b) do { (void)(a); (void)(b); } while(0)
+#define TWS_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while(0)
+#define TWS_PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while(0)
+#endif
+
+#endif
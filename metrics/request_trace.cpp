@@ -0,0 +1,164 @@
+#include"request_trace.h"
+
+#include<stdio.h>
+#include<cstring>
+#include<sys/mman.h>
+#include<new>
+
+hdr_histogram request_trace::m_default[TRACE_PHASE_NUMBER];
+hdr_histogram* request_trace::m_phases = request_trace::m_default;
+hdr_histogram* request_trace::m_shared = nullptr;
+int request_trace::m_processes = 0;
+bool request_trace::m_aggregate = false;
+std::atomic<uint64_t> request_trace::m_slow_threshold(0);
+myMutex request_trace::m_slow_mutex;
+request_trace::slow_request request_trace::m_slow_ring[SLOW_RING_SIZE];
+unsigned long request_trace::m_slow_total = 0;
+
+static const char* phase_names[TRACE_PHASE_NUMBER] = {
+    "connect", "read", "queue", "parse", "handle", "write", "total"
+};
+
+/*每个阶段的起止位置*/
+static const int phase_bounds[TRACE_PHASE_NUMBER][2] = {
+    {TRACE_ACCEPT, TRACE_FIRST_BYTE},
+    {TRACE_FIRST_BYTE, TRACE_ENQUEUE},
+    {TRACE_ENQUEUE, TRACE_DEQUEUE},
+    {TRACE_DEQUEUE, TRACE_PARSED},
+    {TRACE_PARSED, TRACE_HANDLED},
+    {TRACE_HANDLED, TRACE_LAST_BYTE},
+    {TRACE_FIRST_BYTE, TRACE_LAST_BYTE},
+};
+
+/*没有记录的阶段*/
+static const uint64_t NO_PHASE = ~0ULL;
+
+void request_trace::record(const uint64_t* points, const char* url, int status)
+{
+    uint64_t phases[TRACE_PHASE_NUMBER];
+    for(int i = 0; i < TRACE_PHASE_NUMBER; ++i)
+    {
+        uint64_t start = points[phase_bounds[i][0]];
+        uint64_t end = points[phase_bounds[i][1]];
+        if(!start || !end || end < start)
+        {
+            phases[i] = NO_PHASE;
+            continue;
+        }
+        phases[i] = end - start;
+        m_phases[i].record(phases[i]);
+    }
+
+    uint64_t threshold = m_slow_threshold.load(std::memory_order_relaxed);
+    if(!threshold || phases[PHASE_TOTAL] == NO_PHASE || phases[PHASE_TOTAL] < threshold)
+    {
+        return;
+    }
+    m_slow_mutex.lock();
+    slow_request& slot = m_slow_ring[m_slow_total % SLOW_RING_SIZE];
+    slot.when = time(NULL);
+    slot.status = status;
+    snprintf(slot.url, sizeof(slot.url), "%s", url ? url : "-");
+    memcpy(slot.phases, phases, sizeof(phases));
+    m_slow_total++;
+    m_slow_mutex.unlock();
+}
+
+std::string request_trace::render_histograms()
+{
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    /*master合并各worker的直方图 每个直方图约18KB 在堆上合并*/
+    const hdr_histogram* phases = m_phases;
+    hdr_histogram* merged = nullptr;
+    if(m_aggregate)
+    {
+        merged = new hdr_histogram[TRACE_PHASE_NUMBER];
+        for(int p = 0; p < m_processes; ++p)
+        {
+            for(int i = 0; i < TRACE_PHASE_NUMBER; ++i)
+            {
+                merged[i].merge(m_shared[p * TRACE_PHASE_NUMBER + i]);
+            }
+        }
+        phases = merged;
+    }
+    std::string out;
+    char line[160];
+    out += "# HELP tws_request_phase_seconds Request latency by processing phase.\n";
+    out += "# TYPE tws_request_phase_seconds summary\n";
+    for(int i = 0; i < TRACE_PHASE_NUMBER; ++i)
+    {
+        for(size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); ++j)
+        {
+            snprintf(line, sizeof(line), "tws_request_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                    phase_names[i], quantiles[j], phases[i].percentile(quantiles[j]) / 1e9);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "tws_request_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+                phase_names[i], phases[i].sum() / 1e9);
+        out += line;
+        snprintf(line, sizeof(line), "tws_request_phase_seconds_count{phase=\"%s\"} %llu\n",
+                phase_names[i], (unsigned long long)phases[i].count());
+        out += line;
+    }
+    delete [] merged;
+    return out;
+}
+
+bool request_trace::share(int processes)
+{
+    size_t bytes = sizeof(hdr_histogram) * TRACE_PHASE_NUMBER * processes;
+    void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        return false;
+    }
+    m_shared = static_cast<hdr_histogram*>(p);
+    for(int i = 0; i < TRACE_PHASE_NUMBER * processes; ++i)
+    {
+        new(&m_shared[i]) hdr_histogram();
+    }
+    m_processes = processes;
+    return true;
+}
+
+void request_trace::select(int index, bool aggregate)
+{
+    m_phases = &m_shared[index * TRACE_PHASE_NUMBER];
+    m_aggregate = aggregate;
+}
+
+/*每行一个慢请求: 时间 状态码 URL 各阶段耗时(微秒) 没有记录的阶段为'-'*/
+std::string request_trace::render_slow()
+{
+    std::string out;
+    char line[512];
+    m_slow_mutex.lock();
+    snprintf(line, sizeof(line), "# slow requests: %lu total, threshold %.3f ms\n",
+            m_slow_total, m_slow_threshold.load(std::memory_order_relaxed) / 1e6);
+    out += line;
+    unsigned long n = m_slow_total < (unsigned long)SLOW_RING_SIZE ? m_slow_total : SLOW_RING_SIZE;
+    for(unsigned long k = 0; k < n; ++k)
+    {
+        const slow_request& r = m_slow_ring[(m_slow_total - 1 - k) % SLOW_RING_SIZE];
+        struct tm tm;
+        gmtime_r(&r.when, &tm);
+        int len = strftime(line, sizeof(line), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        len += snprintf(line + len, sizeof(line) - len, " %d %s", r.status, r.url);
+        for(int i = 0; i < TRACE_PHASE_NUMBER && len < (int)sizeof(line); ++i)
+        {
+            if(r.phases[i] == NO_PHASE)
+            {
+                len += snprintf(line + len, sizeof(line) - len, " %s=-", phase_names[i]);
+            }
+            else
+            {
+                len += snprintf(line + len, sizeof(line) - len, " %s=%.1f", phase_names[i], r.phases[i] / 1e3);
+            }
+        }
+        out += line;
+        out += '\n';
+    }
+    m_slow_mutex.unlock();
+    return out;
+}
@@ -0,0 +1,96 @@
+#ifndef _REQUESTTRACE_H_
+#define _REQUESTTRACE_H_
+
+#include<stdint.h>
+#include<time.h>
+#include<string>
+#include<atomic>
+
+#include"../lock/myLock.h"
+#include"hdr_histogram.h"
+
+/*请求处理过程中记录时间戳的位置*/
+enum TRACE_POINT{
+    TRACE_ACCEPT = 0,   /*主线程accept 只对连接上的第一个请求有效*/
+    TRACE_FIRST_BYTE,   /*主线程读到请求的第一个字节*/
+    TRACE_ENQUEUE,      /*主线程pool->append 请求分多次读入时为最后一次*/
+    TRACE_DEQUEUE,      /*工作线程从工作队列中取出请求*/
+    TRACE_PARSED,       /*工作线程解析完请求*/
+    TRACE_HANDLED,      /*工作线程do_request完成*/
+    TRACE_LAST_BYTE,    /*主线程发送完响应的最后一个字节*/
+    TRACE_POINT_NUMBER
+};
+
+/*相邻时间戳之间的阶段 以及从第一个字节到最后一个字节的总耗时*/
+enum TRACE_PHASE{
+    PHASE_CONNECT = 0,  /*accept到第一个字节*/
+    PHASE_READ,         /*第一个字节到放入工作队列*/
+    PHASE_QUEUE,        /*在工作队列中等待*/
+    PHASE_PARSE,        /*解析请求*/
+    PHASE_HANDLE,       /*do_request 查找缓存和文件*/
+    PHASE_WRITE,        /*生成和发送响应*/
+    PHASE_TOTAL,
+    TRACE_PHASE_NUMBER
+};
+
+/*
+请求耗时分解：
+    每个阶段一个HDR直方图 在管理端口的/metrics中以summary输出p50/p99/p999
+    总耗时超过阈值的请求记入环形缓冲区(保留最近SLOW_RING_SIZE个) 在管理端口的/slow中查看各阶段耗时
+    时间戳使用CLOCK_MONOTONIC 单位为纳秒 值为0表示该位置没有被记录
+*/
+class request_trace{
+public:
+    static const int SLOW_RING_SIZE = 256;
+    static const int SLOW_URL_LEN = 96;
+
+    static uint64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    /*慢请求阈值 0表示不记录慢请求*/
+    static void set_slow_threshold(uint64_t ns) { m_slow_threshold.store(ns, std::memory_order_relaxed); }
+
+    /*请求完成时由主线程调用 points为各位置的时间戳*/
+    static void record(const uint64_t* points, const char* url, int status);
+
+    /*各阶段的summary 追加在/metrics的输出之后*/
+    static std::string render_histograms();
+    /*环形缓冲区中的慢请求 最新的在前*/
+    static std::string render_slow();
+
+    /*
+    prefork模式: master在fork之前为processes个进程各映射一组共享的直方图 失败时返回false
+    fork之后各进程用select选择自己的一组 aggregate为true时render_histograms合并所有进程
+    慢请求环形缓冲区仍是各进程自己的
+    */
+    static bool share(int processes);
+    static void select(int index, bool aggregate);
+
+private:
+    struct slow_request{
+        time_t when;
+        int status;
+        char url[SLOW_URL_LEN];
+        uint64_t phases[TRACE_PHASE_NUMBER];
+    };
+
+private:
+    static hdr_histogram m_default[TRACE_PHASE_NUMBER];
+    /*本进程记录的一组 单进程时指向m_default*/
+    static hdr_histogram* m_phases;
+    /*共享内存中各进程的直方图 依次每组TRACE_PHASE_NUMBER个*/
+    static hdr_histogram* m_shared;
+    static int m_processes;
+    static bool m_aggregate;
+    /*重新加载配置时由主线程修改 工作线程和主线程记录请求时读取*/
+    static std::atomic<uint64_t> m_slow_threshold;
+    static myMutex m_slow_mutex;
+    static slow_request m_slow_ring[SLOW_RING_SIZE];
+    static unsigned long m_slow_total;
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include"admission.h"
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string>
+#include<climits>
+
+#include"lingering.h"
+#include"../metrics/metrics.h"
+
+/*过载时的响应 Retry-After提示一秒后重试*/
+static const char refuse_503[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+/*默认的排队延迟阈值(纳秒)*/
+static const uint64_t DEFAULT_DELAY = 100 * 1000000ULL;
+
+admission::admission()
+: m_max_conns(INT_MAX), m_max_queue(INT_MAX), m_max_delay(DEFAULT_DELAY),
+m_conn_level(NORMAL), m_work_level(NORMAL), m_conn_since(0), m_work_since(0), m_level(NORMAL), m_draining(false)
+{
+}
+
+bool admission::configure(const char* spec, int max_conns, int max_queue)
+{
+    max_queue /= 2;
+    uint64_t max_delay = DEFAULT_DELAY;
+    std::string list = spec;
+    for(size_t pos = 0; pos <= list.size(); )
+    {
+        size_t comma = list.find(',', pos);
+        if(comma == std::string::npos)
+        {
+            comma = list.size();
+        }
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if(item.empty())
+        {
+            continue;
+        }
+        size_t eq = item.find('=');
+        char* end = nullptr;
+        double value = eq == std::string::npos ? 0 : strtod(item.c_str() + eq + 1, &end);
+        if(eq == std::string::npos || end == item.c_str() + eq + 1 || *end || value <= 0)
+        {
+            printf("bad admission setting: %s\n", item.c_str());
+            return false;
+        }
+        std::string name = item.substr(0, eq);
+        if(name == "conns")
+        {
+            max_conns = (int)value;
+        }
+        else if(name == "queue")
+        {
+            max_queue = (int)value;
+        }
+        else if(name == "delay")
+        {
+            max_delay = (uint64_t)(value * 1e6);
+        }
+        else
+        {
+            printf("bad admission setting: %s\n", item.c_str());
+            return false;
+        }
+    }
+    m_max_conns = max_conns;
+    m_max_queue = max_queue;
+    m_max_delay = max_delay;
+    return true;
+}
+
+/*一个信号按阈值的scale倍划分的级别*/
+static admission::LEVEL band(double value, double limit, double scale)
+{
+    if(value >= limit * scale)
+    {
+        return admission::OVERLOAD;
+    }
+    if(value >= limit * scale * admission::PRESSURE_RATIO)
+    {
+        return admission::PRESSURE;
+    }
+    return admission::NORMAL;
+}
+
+/*up为按进入阈值的级别 down为按回落阈值的级别(不低于up) 升高立即生效 降低需要停留够HOLD_NS*/
+static void step(admission::LEVEL& level, uint64_t& since, uint64_t now, admission::LEVEL up, admission::LEVEL down)
+{
+    if(up > level)
+    {
+        level = up;
+        since = now;
+    }
+    else if(down < level && now - since >= admission::HOLD_NS)
+    {
+        level = down;
+        since = now;
+    }
+}
+
+static admission::LEVEL higher(admission::LEVEL a, admission::LEVEL b)
+{
+    return a > b ? a : b;
+}
+
+bool admission::update(uint64_t now, int conns, int queued, uint64_t queue_wait)
+{
+    step(m_conn_level, m_conn_since, now, band(conns, m_max_conns, 1), band(conns, m_max_conns, HYSTERESIS));
+    step(m_work_level, m_work_since, now,
+            higher(band(queued, m_max_queue, 1), band(queue_wait, m_max_delay, 1)),
+            higher(band(queued, m_max_queue, HYSTERESIS), band(queue_wait, m_max_delay, HYSTERESIS)));
+    int old = m_level.load(std::memory_order_relaxed);
+    int now_level = higher(m_conn_level, m_work_level);
+    if(now_level == old)
+    {
+        return false;
+    }
+    m_level.store(now_level, std::memory_order_relaxed);
+    metrics::add(ADMISSION_LEVEL, now_level - old);
+    return true;
+}
+
+void admission::exhausted(uint64_t now)
+{
+    m_conn_level = OVERLOAD;
+    m_conn_since = now;
+    int old = m_level.load(std::memory_order_relaxed);
+    if(old != OVERLOAD)
+    {
+        m_level.store(OVERLOAD, std::memory_order_relaxed);
+        metrics::add(ADMISSION_LEVEL, OVERLOAD - old);
+    }
+}
+
+int admission::evict_count(int conns) const
+{
+    if(m_conn_level == NORMAL)
+    {
+        return 0;
+    }
+    int target = (int)(m_max_conns * PRESSURE_RATIO * HYSTERESIS);
+    return conns > target ? conns - target : 0;
+}
+
+void admission::refuse(int fd, lingering_close* closer)
+{
+    closer->close(fd, refuse_503, sizeof(refuse_503) - 1);
+}
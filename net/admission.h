@@ -0,0 +1,75 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include<stdint.h>
+#include<atomic>
+
+class lingering_close;
+
+/*
+过载时的准入控制 整个事件循环共用一个 级别只由主线程更新:
+    三个信号: 打开的连接数、线程池请求队列的长度、队头请求已等待的时间(排队延迟)
+    每个信号有一个过载阈值 达到阈值的PRESSURE_RATIO倍为压力
+    连接数决定连接级别 队列长度和排队延迟决定请求级别 两者分开升降
+    级别升高立即生效 降低需要信号都回落到进入阈值的HYSTERESIS倍以下 并且在当前级别至少停留了HOLD_NS
+各级别的措施由主线程和工作线程执行:
+    压力: 响应不再保持连接 连接级别为压力以上时按最近最少使用的顺序关闭空闲的keep-alive连接
+    过载: 另外暂停accept(监听socket移出epoll) 请求级别过载时新读到的请求直接回复503 不进入请求队列
+*/
+class admission{
+public:
+    enum LEVEL{
+        NORMAL = 0,
+        PRESSURE,
+        OVERLOAD
+    };
+    static constexpr double PRESSURE_RATIO = 0.8;
+    static constexpr double HYSTERESIS = 0.8;
+    /*级别降低之前至少停留的时间 避免在阈值附近反复暂停和恢复accept*/
+    static const uint64_t HOLD_NS = 50 * 1000000ULL;
+    /*主线程采样信号的间隔*/
+    static const uint64_t INTERVAL_NS = 1000000ULL;
+    /*两次扫描空闲连接之间的最短间隔 扫描要访问每个连接对象*/
+    static const uint64_t EVICT_INTERVAL_NS = 10 * 1000000ULL;
+
+public:
+    admission();
+
+    /*
+    解析"conns=连接数,queue=队列长度,delay=排队毫秒数" 都是过载阈值 格式错误时返回false且不改变设置
+    省略的项使用默认值: max_conns为描述符能容纳的客户连接数 max_queue为线程池请求队列的容量 队列长度的默认阈值为它的一半
+    重新加载配置时再次调用 当前级别保留 按新阈值在下一次采样时升降
+    */
+    bool configure(const char* spec, int max_conns, int max_queue);
+    /*按当前信号更新级别 返回级别是否变化*/
+    bool update(uint64_t now, int conns, int queued, uint64_t queue_wait);
+    /*accept因描述符用尽而失败 连接级别进入过载 至少保持HOLD_NS*/
+    void exhausted(uint64_t now);
+
+    /*两个级别中较高者 工作线程生成响应时读取*/
+    LEVEL level() const { return (LEVEL)m_level.load(std::memory_order_relaxed); }
+    bool keep_alive() const { return level() == NORMAL && !m_draining.load(std::memory_order_relaxed); }
+    bool pause_accept() const { return level() == OVERLOAD; }
+    bool shed_requests() const { return m_work_level == OVERLOAD; }
+    /*升级后旧进程排空连接: 响应不再保持连接 不影响级别*/
+    void drain() { m_draining.store(true, std::memory_order_relaxed); }
+    /*连接级别为压力以上时需要关闭的空闲连接数 使连接数回落到压力阈值的HYSTERESIS倍*/
+    int evict_count(int conns) const;
+
+    /*发送预先生成的503响应 不等待发送完成 之后由closer关闭连接*/
+    static void refuse(int fd, lingering_close* closer);
+
+private:
+    int m_max_conns;
+    int m_max_queue;
+    uint64_t m_max_delay;
+    LEVEL m_conn_level;
+    LEVEL m_work_level;
+    /*各自进入当前级别的时间*/
+    uint64_t m_conn_since;
+    uint64_t m_work_since;
+    std::atomic<int> m_level;
+    std::atomic<bool> m_draining;
+};
+
+#endif
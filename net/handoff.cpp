@@ -0,0 +1,306 @@
+#include"handoff.h"
+
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/time.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stdio.h>
+#include<stdint.h>
+#include<cstring>
+
+#include"../metrics/metrics.h"
+
+/*
+交接连接上的数据:
+    头部和各监听socket的地址 一次sendmsg发送 SCM_RIGHTS按同样的顺序携带描述符
+    之后每个缓存路径为4字节长度加路径本身
+*/
+static const uint32_t HANDOFF_MAGIC = 0x54575331;   /*"TWS1"*/
+static const uint32_t MAX_PATH_LEN = 4096;
+
+struct handoff_header{
+    uint32_t magic;
+    uint32_t fds;
+    uint32_t paths;
+};
+
+struct handoff_addr{
+    struct sockaddr_storage addr;
+    uint32_t len;
+};
+
+/*阻塞地读满或写完n字节 对方关闭或超时时返回false*/
+static bool read_full(int fd, void* buf, size_t n)
+{
+    char* p = static_cast<char*>(buf);
+    while(n > 0)
+    {
+        ssize_t ret = recv(fd, p, n, 0);
+        if(ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ret <= 0)
+        {
+            return false;
+        }
+        p += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void* buf, size_t n)
+{
+    const char* p = static_cast<const char*>(buf);
+    while(n > 0)
+    {
+        ssize_t ret = send(fd, p, n, MSG_NOSIGNAL);
+        if(ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ret <= 0)
+        {
+            return false;
+        }
+        p += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+static void set_timeout(int fd)
+{
+    struct timeval tv = {handoff::IO_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+handoff::handoff()
+: m_conn(-1)
+{
+}
+
+handoff::~handoff()
+{
+    reset();
+}
+
+bool handoff::receive(const listen_addr& upgrade)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        return false;
+    }
+    /*没有旧进程: socket文件不存在或没有进程在监听*/
+    if(connect(fd, (const struct sockaddr*)&upgrade.addr, upgrade.len) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    set_timeout(fd);
+    m_conn = fd;
+    if(!read_state())
+    {
+        /*关闭连接 旧进程得知交接失败后继续服务*/
+        reset();
+        return false;
+    }
+    return true;
+}
+
+void handoff::reset()
+{
+    for(size_t i = 0; i < m_fds.size(); ++i)
+    {
+        if(m_fds[i].fd != -1)
+        {
+            close(m_fds[i].fd);
+        }
+    }
+    m_fds.clear();
+    if(m_conn != -1)
+    {
+        close(m_conn);
+        m_conn = -1;
+    }
+}
+
+bool handoff::read_state()
+{
+    int fd = m_conn;
+    handoff_header header;
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if(ret <= 0)
+    {
+        printf("handoff: old process closed the connection\n");
+        return false;
+    }
+    /*描述符随头部的第一个字节到达 先收下 出错时由reset关闭*/
+    for(struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    {
+        if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* fds = (const int*)CMSG_DATA(c);
+            for(int i = 0; i < count; ++i)
+            {
+                entry e;
+                memset(&e, 0, sizeof(e));
+                e.fd = fds[i];
+                m_fds.push_back(e);
+            }
+        }
+    }
+    if(ret < (ssize_t)sizeof(header) && !read_full(fd, (char*)&header + ret, sizeof(header) - ret))
+    {
+        printf("handoff: truncated header\n");
+        return false;
+    }
+    if(header.magic != HANDOFF_MAGIC || header.fds != m_fds.size() || (msg.msg_flags & MSG_CTRUNC))
+    {
+        printf("handoff: unexpected data from old process\n");
+        return false;
+    }
+    for(size_t i = 0; i < m_fds.size(); ++i)
+    {
+        handoff_addr a;
+        if(!read_full(fd, &a, sizeof(a)) || a.len > sizeof(a.addr))
+        {
+            printf("handoff: truncated listener list\n");
+            return false;
+        }
+        m_fds[i].addr = a.addr;
+        m_fds[i].len = a.len;
+    }
+    for(uint32_t i = 0; i < header.paths; ++i)
+    {
+        uint32_t len;
+        if(!read_full(fd, &len, sizeof(len)) || len > MAX_PATH_LEN)
+        {
+            printf("handoff: truncated path list\n");
+            return false;
+        }
+        std::string path(len, '\0');
+        if(len && !read_full(fd, &path[0], len))
+        {
+            printf("handoff: truncated path list\n");
+            return false;
+        }
+        m_paths.push_back(path);
+    }
+    return true;
+}
+
+int handoff::take(const listen_addr& a)
+{
+    for(size_t i = 0; i < m_fds.size(); ++i)
+    {
+        if(m_fds[i].fd != -1 && m_fds[i].len == a.len && memcmp(&m_fds[i].addr, &a.addr, a.len) == 0)
+        {
+            int fd = m_fds[i].fd;
+            m_fds[i].fd = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+bool handoff::commit()
+{
+    char ready = 'R';
+    bool ok = m_conn != -1 && write_full(m_conn, &ready, 1);
+    /*新配置中已不再监听的地址随旧进程退出而关闭*/
+    reset();
+    return ok;
+}
+
+int handoff::offer(int upgradefd, const int* fds, const listen_addr* addrs, int n, const std::vector<std::string>& paths)
+{
+    int connfd = accept4(upgradefd, NULL, NULL, SOCK_CLOEXEC);
+    metrics::add(SYSCALLS);
+    if(connfd < 0)
+    {
+        return -1;
+    }
+    /*只把监听socket交给同一用户的进程*/
+    struct ucred cred;
+    memset(&cred, 0, sizeof(cred));
+    socklen_t len = sizeof(cred);
+    if(getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid() || n > MAX_FDS)
+    {
+        printf("handoff: refused peer pid %d\n", (int)cred.pid);
+        close(connfd);
+        return -1;
+    }
+    set_timeout(connfd);
+
+    std::string data;
+    handoff_header header = {HANDOFF_MAGIC, (uint32_t)n, (uint32_t)paths.size()};
+    data.append((const char*)&header, sizeof(header));
+    for(int i = 0; i < n; ++i)
+    {
+        handoff_addr a;
+        memset(&a, 0, sizeof(a));
+        memcpy(&a.addr, &addrs[i].addr, addrs[i].len);
+        a.len = addrs[i].len;
+        data.append((const char*)&a, sizeof(a));
+    }
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&data[0], data.size()};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * n);
+    ssize_t ret = sendmsg(connfd, &msg, MSG_NOSIGNAL);
+    metrics::add(SYSCALLS);
+    /*描述符随第一个字节送出 其余部分按普通数据补发*/
+    bool ok = ret > 0 && write_full(connfd, data.data() + ret, data.size() - ret);
+
+    data.clear();
+    for(size_t i = 0; ok && i < paths.size(); ++i)
+    {
+        uint32_t len = (uint32_t)paths[i].size();
+        data.append((const char*)&len, sizeof(len));
+        data.append(paths[i]);
+    }
+    if(!ok || !write_full(connfd, data.data(), data.size()))
+    {
+        printf("handoff: sending to new process failed\n");
+        close(connfd);
+        return -1;
+    }
+    return connfd;
+}
+
+/*连接可读时才调用 收到确认字节或对方已关闭 recv不会阻塞*/
+bool handoff::committed(int connfd)
+{
+    char ready = 0;
+    ssize_t ret;
+    do
+    {
+        ret = recv(connfd, &ready, 1, 0);
+    }while(ret < 0 && errno == EINTR);
+    metrics::add(SYSCALLS);
+    return ret == 1 && ready == 'R';
+}
@@ -0,0 +1,64 @@
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include<sys/socket.h>
+#include<string>
+#include<vector>
+
+#include"listener.h"
+
+/*
+不停机升级时交接监听socket 新旧两个进程经upgrade_socket(Unix域socket)通信:
+    旧进程一直在upgrade_socket上监听 新进程启动时连接它 连接不上则正常冷启动
+    旧进程确认对方是同一用户后关闭upgrade_socket 用SCM_RIGHTS发送各监听socket(含管理端口)的描述符和地址
+    随后发送文件缓存中的路径 新进程据此预热文件缓存
+    新进程接管监听socket并注册到epoll之后回复一个字节确认 再在upgrade_socket上监听 供下一次升级使用
+    旧进程收到确认后不再accept 响应不再保持连接 处理完已接受的请求后退出
+    没有收到确认就断开(新进程启动失败)时旧进程重新监听upgrade_socket 继续正常服务
+交接期间两个进程共用同一批监听socket 内核的监听队列始终没有关闭 升级过程中不会拒绝连接
+*/
+class handoff{
+public:
+    /*一次交接的监听socket数 客户连接的监听地址加管理端口*/
+    static const int MAX_FDS = 16;
+    /*交接连接上收发的超时(秒) 旧进程发送时阻塞主线程 数据只有几十KB*/
+    static const int IO_TIMEOUT = 2;
+
+    handoff();
+    ~handoff();
+
+    /*新进程: 连接upgrade并接收描述符和缓存路径 没有旧进程在监听时返回false 协议错误时打印原因并返回false*/
+    bool receive(const listen_addr& upgrade);
+    /*新进程: 取走与a地址相同的监听socket 没有时返回-1*/
+    int take(const listen_addr& a);
+    /*新进程: 旧进程文件缓存中的路径 每个分片内按最近使用在前*/
+    const std::vector<std::string>& paths() const { return m_paths; }
+    /*新进程: 接管完成 通知旧进程退出 关闭没有被take取走的描述符*/
+    bool commit();
+
+    /*
+    旧进程: upgrade_socket可读时调用 accept新进程的连接并发送 fds与addrs一一对应
+    成功时返回等待确认的连接 由调用者注册到epoll 失败时返回-1
+    */
+    static int offer(int upgradefd, const int* fds, const listen_addr* addrs, int n, const std::vector<std::string>& paths);
+    /*旧进程: 等待确认的连接可读时调用 返回新进程是否已接管 调用者随后关闭连接*/
+    static bool committed(int connfd);
+
+private:
+    bool read_state();
+    /*关闭没有被take取走的描述符和交接连接*/
+    void reset();
+
+private:
+    struct entry{
+        struct sockaddr_storage addr;
+        socklen_t len;
+        int fd;
+    };
+
+    int m_conn;
+    std::vector<entry> m_fds;
+    std::vector<std::string> m_paths;
+};
+
+#endif
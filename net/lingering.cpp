@@ -0,0 +1,122 @@
+#include"lingering.h"
+
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<unistd.h>
+#include<errno.h>
+
+#include"../metrics/metrics.h"
+
+lingering_close::lingering_close(int epollfd)
+: m_epollfd(epollfd)
+{
+    m_free.reserve(MAX_SOCKETS);
+    for(int i = MAX_SOCKETS - 1; i >= 0; --i)
+    {
+        m_slots[i].fd = -1;
+        m_free.push_back(&m_slots[i]);
+    }
+}
+
+lingering_close::~lingering_close()
+{
+    for(int i = 0; i < MAX_SOCKETS; ++i)
+    {
+        if(m_slots[i].fd >= 0)
+        {
+            ::close(m_slots[i].fd);
+        }
+    }
+}
+
+void lingering_close::close(int fd, const char* response, size_t len)
+{
+    ssize_t ret = send(fd, response, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)ret;
+    shutdown(fd, SHUT_WR);
+    metrics::add(SYSCALLS, 2);
+    slot tmp = {fd, 0, 0};
+    if(drain(&tmp) || m_free.empty())
+    {
+        ::close(fd);
+        metrics::add(SYSCALLS);
+        return;
+    }
+    /*
+    fd可能还以http_conn为data.ptr注册在epoll中(ONESHOT已触发) 此时改为指向槽位
+    accept后直接拒绝的连接还没有注册
+    */
+    slot* s = m_free.back();
+    epoll_event event;
+    event.data.ptr = s;
+    event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    if(epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event) < 0
+        && (errno != EEXIST || epoll_ctl(m_epollfd, EPOLL_CTL_MOD, fd, &event) < 0))
+    {
+        ::close(fd);
+        metrics::add(SYSCALLS);
+        return;
+    }
+    metrics::add(SYSCALLS);
+    m_free.pop_back();
+    s->fd = fd;
+    s->deadline = time(NULL) + TIMEOUT;
+    s->discarded = tmp.discarded;
+}
+
+void lingering_close::on_event(void* ptr)
+{
+    slot* s = static_cast<slot*>(ptr);
+    if(s->fd >= 0 && drain(s))
+    {
+        release(s);
+    }
+}
+
+void lingering_close::sweep(time_t now)
+{
+    if((int)m_free.size() == MAX_SOCKETS)
+    {
+        return;
+    }
+    for(int i = 0; i < MAX_SOCKETS; ++i)
+    {
+        if(m_slots[i].fd >= 0 && now >= m_slots[i].deadline)
+        {
+            release(&m_slots[i]);
+        }
+    }
+}
+
+bool lingering_close::drain(slot* s)
+{
+    char buf[4096];
+    while(true)
+    {
+        ssize_t n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        metrics::add(SYSCALLS);
+        if(n > 0)
+        {
+            s->discarded += n;
+            if(s->discarded > MAX_DISCARD)
+            {
+                return true;
+            }
+            continue;
+        }
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+}
+
+/*没有其他引用该socket的描述符 关闭时内核自动将其移出epoll*/
+void lingering_close::release(slot* s)
+{
+    ::close(s->fd);
+    metrics::add(SYSCALLS);
+    s->fd = -1;
+    m_free.push_back(s);
+}
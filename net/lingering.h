@@ -0,0 +1,51 @@
+#ifndef _LINGERING_H_
+#define _LINGERING_H_
+
+#include<stddef.h>
+#include<time.h>
+#include<vector>
+
+/*
+回复拒绝响应后延迟关闭连接(lingering close) 整个事件循环共用一个 只由主线程使用:
+    直接close时接收缓冲区中还有未读的请求、或之后又有请求体到达 内核都会回复RST
+    客户可能还在发送请求体 还没读到429/503就收到ECONNRESET/EPIPE
+    这里发送响应后shutdown(SHUT_WR) 响应之后紧跟FIN 然后继续读取并丢弃客户发来的数据 直到对方关闭
+    对方TIMEOUT秒内没有关闭、或丢弃的数据超过MAX_DISCARD字节时不再等待 直接关闭
+    同时等待的连接不超过MAX_SOCKETS个 已满时只读掉已到达的数据后关闭
+*/
+class lingering_close{
+public:
+    static const int MAX_SOCKETS = 64;
+    static const int TIMEOUT = 2;
+    static const size_t MAX_DISCARD = 1 << 20;
+
+public:
+    explicit lingering_close(int epollfd);
+    ~lingering_close();
+
+    /*发送预先生成的响应 不等待发送完成 之后fd归它所有 调用者不再关闭*/
+    void close(int fd, const char* response, size_t len);
+    /*epoll事件的data.ptr是否指向它的槽位*/
+    bool owns(const void* ptr) const { return ptr >= m_slots && ptr < m_slots + MAX_SOCKETS; }
+    void on_event(void* ptr);
+    /*主线程每秒调用一次 关闭超时的连接*/
+    void sweep(time_t now);
+
+private:
+    struct slot{
+        int fd;
+        time_t deadline;
+        size_t discarded;
+    };
+
+    /*读掉已到达的数据 对方已关闭、出错或丢弃的数据超过上限时返回true*/
+    bool drain(slot* s);
+    void release(slot* s);
+
+private:
+    int m_epollfd;
+    slot m_slots[MAX_SOCKETS];
+    std::vector<slot*> m_free;
+};
+
+#endif
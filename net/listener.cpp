@@ -0,0 +1,165 @@
+#include"listener.h"
+
+#include<sys/un.h>
+#include<sys/stat.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stddef.h>
+#include<stdlib.h>
+#include<cstring>
+
+/*解析地址后面可选的:port 没有时使用默认端口*/
+static bool parse_port(const char* p, int default_port, int& port)
+{
+    if(*p == '\0')
+    {
+        port = default_port;
+        return port > 0 && port < 65536;
+    }
+    if(*p != ':')
+    {
+        return false;
+    }
+    char* end;
+    long v = strtol(p + 1, &end, 10);
+    if(*end != '\0' || v <= 0 || v >= 65536)
+    {
+        return false;
+    }
+    port = (int)v;
+    return true;
+}
+
+bool listen_addr::parse(const char* text, int default_port)
+{
+    memset(&addr, 0, sizeof(addr));
+    spec = text;
+    if(strncmp(text, "unix:", 5) == 0)
+    {
+        const char* path = text + 5;
+        size_t n = strlen(path);
+        struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+        /*抽象地址以'\0'开头 长度不含结尾的'\0'*/
+        if(n == 0 || n >= sizeof(un->sun_path) || (path[0] == '@' && n == 1))
+        {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path, n);
+        len = offsetof(struct sockaddr_un, sun_path) + n;
+        if(path[0] == '@')
+        {
+            un->sun_path[0] = '\0';
+        }
+        else
+        {
+            len += 1;
+        }
+        family = AF_UNIX;
+        return true;
+    }
+    int port;
+    if(text[0] == '[')
+    {
+        const char* close = strchr(text, ']');
+        if(!close || close - text - 1 >= INET6_ADDRSTRLEN)
+        {
+            return false;
+        }
+        char host[INET6_ADDRSTRLEN];
+        memcpy(host, text + 1, close - text - 1);
+        host[close - text - 1] = '\0';
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+        if(inet_pton(AF_INET6, host, &in6->sin6_addr) != 1 || !parse_port(close + 1, default_port, port))
+        {
+            return false;
+        }
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        len = sizeof(*in6);
+        family = AF_INET6;
+        return true;
+    }
+    const char* colon = strchr(text, ':');
+    size_t n = colon ? (size_t)(colon - text) : strlen(text);
+    if(n >= INET_ADDRSTRLEN)
+    {
+        return false;
+    }
+    char host[INET_ADDRSTRLEN];
+    memcpy(host, text, n);
+    host[n] = '\0';
+    struct sockaddr_in* in = (struct sockaddr_in*)&addr;
+    if(inet_pton(AF_INET, host, &in->sin_addr) != 1 || !parse_port(text + n, default_port, port))
+    {
+        return false;
+    }
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    len = sizeof(*in);
+    family = AF_INET;
+    return true;
+}
+
+void listen_addr::set_port(int port)
+{
+    if(family == AF_INET)
+    {
+        ((struct sockaddr_in*)&addr)->sin_port = htons(port);
+    }
+    else if(family == AF_INET6)
+    {
+        ((struct sockaddr_in6*)&addr)->sin6_port = htons(port);
+    }
+}
+
+const char* listen_addr::unix_path() const
+{
+    const struct sockaddr_un* un = (const struct sockaddr_un*)&addr;
+    if(family != AF_UNIX || un->sun_path[0] == '\0')
+    {
+        return nullptr;
+    }
+    return un->sun_path;
+}
+
+int open_listener(const listen_addr& a, int backlog, bool reuseport)
+{
+    int fd = socket(a.family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(a.is_inet())
+    {
+        /*服务器主动关闭的连接处于TIME_WAIT时 允许重启后立即重新绑定端口*/
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(reuseport)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        }
+    }
+    if(a.family == AF_INET6)
+    {
+        int only = 1;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &only, sizeof(only));
+    }
+    /*上次运行残留的socket文件会使bind失败 只删除确实是socket的文件*/
+    const char* path = a.unix_path();
+    struct stat st;
+    if(path && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+    if(bind(fd, (const struct sockaddr*)&a.addr, a.len) < 0 || listen(fd, backlog) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
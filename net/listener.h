@@ -0,0 +1,37 @@
+#ifndef _LISTENER_H_
+#define _LISTENER_H_
+
+#include<sys/socket.h>
+#include<string>
+
+/*
+监听地址 同一个事件循环中可以有多个不同地址族的监听socket：
+    1.2.3.4 / 1.2.3.4:port          IPv4
+    [::] / [::1]:port               IPv6 设置IPV6_V6ONLY 可以和同端口的IPv4地址同时监听
+    unix:/path/to/sock              文件系统中的Unix域socket 绑定前删除残留的socket文件
+    unix:@name                      抽象命名空间的Unix域socket 不在文件系统中留下文件
+    没有写端口的IP地址使用默认端口
+*/
+struct listen_addr{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int family;
+    std::string spec;               /*原始写法 用于日志*/
+
+    /*解析spec 格式错误时返回false*/
+    bool parse(const char* text, int default_port);
+    /*TCP监听(IPv4/IPv6)才有端口、拥塞控制、忙轮询等选项*/
+    bool is_inet() const { return family == AF_INET || family == AF_INET6; }
+    /*替换IP地址的端口 Unix域socket没有端口*/
+    void set_port(int port);
+    /*文件系统中的Unix域socket路径 其他地址返回nullptr*/
+    const char* unix_path() const;
+};
+
+/*
+创建socket并绑定、监听 失败时返回-1 errno为失败调用的错误码
+reuseport为true时TCP监听设置SO_REUSEPORT 多个socket绑定同一地址 内核按连接的四元组哈希分给各socket
+*/
+int open_listener(const listen_addr& a, int backlog, bool reuseport = false);
+
+#endif
@@ -0,0 +1,213 @@
+#include"rate_limit.h"
+
+#include<netinet/in.h>
+#include<unistd.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<cstring>
+#include<string>
+#include<random>
+
+#include"lingering.h"
+#include"../metrics/metrics.h"
+#include"../metrics/request_trace.h"
+
+/*被限流的客户收到的响应 Retry-After提示一秒后重试*/
+static const char refuse_429[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+rate_limiter::rate_limiter()
+: m_slots(new rate_slot[SHARDS * SHARD_SLOTS]), m_interval(0), m_burst(0), m_max_conns(0)
+{
+    for(int i = 0; i < SHARDS * SHARD_SLOTS; ++i)
+    {
+        m_slots[i].used = false;
+        m_slots[i].conns.store(0, std::memory_order_relaxed);
+        m_slots[i].tat = 0;
+    }
+    std::random_device rd;
+    m_seed = ((uint64_t)rd() << 32) | rd();
+}
+
+rate_limiter::~rate_limiter()
+{
+    delete [] m_slots;
+}
+
+bool rate_limiter::configure(const char* spec)
+{
+    double rate = 0, burst = 0;
+    int max_conns = 0;
+    std::string list = spec;
+    for(size_t pos = 0; pos <= list.size(); )
+    {
+        size_t comma = list.find(',', pos);
+        if(comma == std::string::npos)
+        {
+            comma = list.size();
+        }
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if(item.empty())
+        {
+            continue;
+        }
+        size_t eq = item.find('=');
+        char* end = nullptr;
+        double value = eq == std::string::npos ? 0 : strtod(item.c_str() + eq + 1, &end);
+        if(eq == std::string::npos || end == item.c_str() + eq + 1 || *end || value < 0)
+        {
+            printf("bad rate limit: %s\n", item.c_str());
+            return false;
+        }
+        std::string name = item.substr(0, eq);
+        if(name == "rate")
+        {
+            rate = value;
+        }
+        else if(name == "burst")
+        {
+            burst = value;
+        }
+        else if(name == "conns")
+        {
+            max_conns = (int)value;
+        }
+        else
+        {
+            printf("bad rate limit: %s\n", item.c_str());
+            return false;
+        }
+    }
+    /*全部解析成功后才替换 重新加载时省略的项恢复为不限制*/
+    m_interval = 0;
+    m_burst = 0;
+    m_max_conns = max_conns;
+    if(rate > 0)
+    {
+        if(burst < 1)
+        {
+            burst = rate < 1 ? 1 : rate;
+        }
+        m_interval = (uint64_t)(1e9 / rate);
+        m_burst = (uint64_t)(burst * m_interval);
+    }
+    return true;
+}
+
+/*IPv6按/64前缀 IPv4映射的IPv6地址与IPv4地址使用同一个键*/
+bool rate_limiter::make_key(const struct sockaddr* addr, uint64_t key[2]) const
+{
+    if(addr->sa_family == AF_INET)
+    {
+        key[0] = 0;
+        key[1] = ((const struct sockaddr_in*)addr)->sin_addr.s_addr;
+        return true;
+    }
+    if(addr->sa_family == AF_INET6)
+    {
+        const unsigned char* a = ((const struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+        static const unsigned char v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        if(memcmp(a, v4mapped, 12) == 0)
+        {
+            uint32_t v4;
+            memcpy(&v4, a + 12, 4);
+            key[0] = 0;
+            key[1] = v4;
+            return true;
+        }
+        memcpy(&key[0], a, 8);
+        /*最高位标记IPv6 与IPv4的键区分*/
+        key[1] = 1ULL << 63;
+        return true;
+    }
+    return false;
+}
+
+rate_slot* rate_limiter::find(const uint64_t key[2], uint64_t now)
+{
+    uint64_t h = (key[0] ^ m_seed) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ key[1] ^ (h >> 29)) * 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    rate_slot* shard = m_slots + (h >> 60) * SHARD_SLOTS;
+    uint32_t pos = (uint32_t)h & (SHARD_SLOTS - 1);
+    rate_slot* reuse = nullptr;
+    for(int i = 0; i < MAX_PROBE; ++i)
+    {
+        rate_slot* slot = shard + ((pos + i) & (SHARD_SLOTS - 1));
+        if(!slot->used)
+        {
+            /*槽位不删除 空槽位之后不会再有该地址*/
+            if(!reuse)
+            {
+                reuse = slot;
+            }
+            break;
+        }
+        if(slot->key[0] == key[0] && slot->key[1] == key[1])
+        {
+            return slot;
+        }
+        if(!reuse && slot->tat <= now && slot->conns.load(std::memory_order_relaxed) == 0)
+        {
+            reuse = slot;
+        }
+    }
+    if(reuse)
+    {
+        reuse->key[0] = key[0];
+        reuse->key[1] = key[1];
+        reuse->used = true;
+        reuse->tat = now;
+    }
+    return reuse;
+}
+
+bool rate_limiter::admit(const struct sockaddr* addr, rate_slot** slot)
+{
+    *slot = nullptr;
+    uint64_t key[2];
+    if(!make_key(addr, key))
+    {
+        return true;
+    }
+    uint64_t now = request_trace::now();
+    rate_slot* s = find(key, now);
+    if(!s)
+    {
+        metrics::add(RATE_LIMIT_TABLE_FULL);
+        return true;
+    }
+    /*桶里至少还有一个令牌才接受连接 令牌在交给线程池时才取走*/
+    uint64_t tat = s->tat > now ? s->tat : now;
+    if((m_max_conns && s->conns.load(std::memory_order_relaxed) >= m_max_conns) ||
+            (m_interval && tat + m_interval - now > m_burst))
+    {
+        metrics::add(RATE_LIMITED_ACCEPTS);
+        return false;
+    }
+    s->conns.fetch_add(1, std::memory_order_relaxed);
+    *slot = s;
+    return true;
+}
+
+bool rate_limiter::take(rate_slot* slot)
+{
+    if(!slot || !m_interval)
+    {
+        return true;
+    }
+    uint64_t now = request_trace::now();
+    uint64_t tat = slot->tat > now ? slot->tat : now;
+    if(tat + m_interval - now > m_burst)
+    {
+        metrics::add(RATE_LIMITED_REQUESTS);
+        return false;
+    }
+    slot->tat = tat + m_interval;
+    return true;
+}
+
+void rate_limiter::refuse(int fd, lingering_close* closer)
+{
+    closer->close(fd, refuse_429, sizeof(refuse_429) - 1);
+}
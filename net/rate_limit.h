@@ -0,0 +1,71 @@
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+#include<stdint.h>
+#include<atomic>
+#include<sys/socket.h>
+
+class lingering_close;
+
+/*
+一个客户地址的限流状态:
+    槽位在表中的位置固定不变 连接保存槽位的指针 关闭连接时(可能在工作线程中)原子地减少连接数
+    令牌桶用等价的单个时间戳表示(GCRA): m_tat之前的时间已被取走的令牌占用 m_tat <= now时桶是满的
+*/
+struct rate_slot{
+    uint64_t key[2];
+    std::atomic<int> conns;
+    bool used;
+    uint64_t tat;
+};
+
+/*
+按客户IP地址限流 整个事件循环共用一个:
+    每个地址一个令牌桶 每秒补充rate个令牌 最多积攒burst个 交给线程池的每批请求取一个令牌
+    每个地址同时打开的连接数不超过conns accept时桶已空或连接数已满的连接直接拒绝
+    IPv6地址按/64前缀计 IPv4映射的IPv6地址按IPv4计 Unix域socket的客户不限流
+表按哈希值的高位分为SHARDS个分片 每个分片是一块开放寻址的数组 线性探测不跨越分片 最多探测MAX_PROBE个槽位
+    只有主线程查找和插入(accept和交给线程池都在主线程中) 不需要加锁 其他线程只通过槽位指针修改连接数
+    槽位不删除 探测窗口内连接数为0且令牌桶已满的槽位可被新地址占用 窗口内没有可用槽位时不限流该地址
+*/
+class rate_limiter{
+public:
+    static const int SHARDS = 16;
+    static const int SHARD_SLOTS = 4096;
+    static const int MAX_PROBE = 16;
+
+public:
+    rate_limiter();
+    ~rate_limiter();
+
+    /*
+    解析"rate=每秒请求数,burst=桶容量,conns=每个地址的连接数" 省略的项不限制 burst默认等于rate 格式错误时返回false且不改变设置
+    由主线程调用 重新加载配置时可以再次调用 表中各地址的状态保留
+    */
+    bool configure(const char* spec);
+    /*是否限制了请求速率或连接数 都不限制时accept不再查表*/
+    bool limiting() const { return m_interval || m_max_conns; }
+    /*accept时调用 返回false表示拒绝该连接 否则*slot为该地址的槽位(不限流时为nullptr) 连接数已加1*/
+    bool admit(const struct sockaddr* addr, rate_slot** slot);
+    /*交给线程池之前调用 取一个令牌 返回false表示拒绝*/
+    bool take(rate_slot* slot);
+    /*关闭连接时调用 任意线程*/
+    static void release(rate_slot* slot) { slot->conns.fetch_sub(1, std::memory_order_relaxed); }
+    /*发送预先生成的429响应 不等待发送完成 之后由closer关闭连接*/
+    static void refuse(int fd, lingering_close* closer);
+
+private:
+    bool make_key(const struct sockaddr* addr, uint64_t key[2]) const;
+    rate_slot* find(const uint64_t key[2], uint64_t now);
+
+private:
+    rate_slot* m_slots;
+    /*哈希种子 避免客户构造落在同一探测窗口的地址*/
+    uint64_t m_seed;
+    /*补充一个令牌的时间和桶容量对应的时间(纳秒) 0表示不限制请求速率*/
+    uint64_t m_interval;
+    uint64_t m_burst;
+    int m_max_conns;
+};
+
+#endif
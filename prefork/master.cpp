@@ -0,0 +1,271 @@
+#include"master.h"
+
+#include<sys/prctl.h>
+#include<sys/wait.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stdio.h>
+#include<cstring>
+
+#include"../metrics/metrics.h"
+#include"../metrics/request_trace.h"
+#include"../metrics/admin_server.h"
+
+master::master(server_config& cfg, int argc, char* argv[], const listen_addr* addrs, int listener_count, shm_cache* cache)
+: m_cfg(cfg), m_argc(argc), m_argv(argv), m_addrs(addrs), m_listener_count(listener_count), m_cache(cache),
+m_workers(cfg.workers), m_pids(cfg.workers, 0), m_started(cfg.workers, 0), m_admin(nullptr), m_status(1)
+{
+    sigemptyset(&m_signals);
+    sigaddset(&m_signals, SIGHUP);
+    sigaddset(&m_signals, SIGUSR1);
+    sigaddset(&m_signals, SIGTERM);
+    sigaddset(&m_signals, SIGINT);
+    sigaddset(&m_signals, SIGCHLD);
+    sigemptyset(&m_old_mask);
+}
+
+master::~master()
+{
+    delete m_admin;
+    for(int i = 0; i < (int)m_fds.size(); ++i)
+    {
+        int j = i % m_listener_count;
+        /*Unix域socket只属于第0组*/
+        if(m_fds[i] < 0 || (!m_addrs[j].is_inet() && i >= m_listener_count))
+        {
+            continue;
+        }
+        close(m_fds[i]);
+        if(m_addrs[j].unix_path())
+        {
+            unlink(m_addrs[j].unix_path());
+        }
+    }
+}
+
+bool master::open_listeners()
+{
+    m_fds.assign(m_workers * m_listener_count, -1);
+    for(int i = 0; i < m_workers; ++i)
+    {
+        for(int j = 0; j < m_listener_count; ++j)
+        {
+            int& fd = m_fds[i * m_listener_count + j];
+            if(i > 0 && !m_addrs[j].is_inet())
+            {
+                fd = m_fds[j];
+                continue;
+            }
+            fd = open_listener(m_addrs[j], m_cfg.backlog, true);
+            if(fd < 0)
+            {
+                printf("listen on %s failed: %s\n", m_addrs[j].spec.c_str(), strerror(errno));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool master::spawn(int index, int* fds)
+{
+    m_started[index] = time(NULL);
+    pid_t parent = getpid();
+    /*缓冲区中还没输出的内容不能被子进程再输出一次*/
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        printf("prefork: fork failed: %s\n", strerror(errno));
+        return false;
+    }
+    if(pid > 0)
+    {
+        m_pids[index] = pid;
+        metrics::add(WORKERS);
+        return false;
+    }
+
+    /*worker: master退出时随之退出 fork之后、设置之前master已经退出时直接退出*/
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() != parent)
+    {
+        _exit(0);
+    }
+    /*main在fork之前已安装信号处理函数 阻塞期间到达的SIGHUP/SIGUSR1在这里交给它们*/
+    sigprocmask(SIG_SETMASK, &m_old_mask, NULL);
+    metrics::select(index, false);
+    request_trace::select(index, false);
+    /*只保留自己那一组TCP监听socket和共用的Unix域socket*/
+    for(int i = 0; i < m_workers; ++i)
+    {
+        for(int j = 0; j < m_listener_count; ++j)
+        {
+            int fd = m_fds[i * m_listener_count + j];
+            if(i == index)
+            {
+                fds[j] = fd;
+            }
+            else if(m_addrs[j].is_inet())
+            {
+                close(fd);
+            }
+        }
+    }
+    if(m_admin)
+    {
+        close(m_admin->listen_fd());
+    }
+    return true;
+}
+
+void master::reap()
+{
+    int status;
+    pid_t pid;
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for(int i = 0; i < m_workers; ++i)
+        {
+            if(m_pids[i] != pid)
+            {
+                continue;
+            }
+            m_pids[i] = 0;
+            metrics::add(WORKERS, -1);
+            metrics::reset_gauges(i);
+            m_cache->recover(pid);
+            if(WIFSIGNALED(status))
+            {
+                printf("prefork: worker %d (pid %d) killed by signal %d\n", i, (int)pid, WTERMSIG(status));
+            }
+            else
+            {
+                printf("prefork: worker %d (pid %d) exited with status %d\n", i, (int)pid, WEXITSTATUS(status));
+            }
+        }
+    }
+}
+
+/*worker各自重新加载 master的这份配置只用于之后启动的worker 只在启动时生效的项保留原来的值*/
+void master::reload()
+{
+    server_config next;
+    if(!next.load(m_argc, m_argv))
+    {
+        printf("prefork: config reload failed, new workers use the running configuration\n");
+        return;
+    }
+    std::vector<std::string> restart = m_cfg.changed(next, false);
+    for(size_t i = 0; i < restart.size(); ++i)
+    {
+        next.set(restart[i], m_cfg.get(restart[i]));
+    }
+    m_cfg = next;
+}
+
+void master::signal_workers(int sig)
+{
+    for(int i = 0; i < m_workers; ++i)
+    {
+        if(m_pids[i] > 0)
+        {
+            kill(m_pids[i], sig);
+        }
+    }
+}
+
+void master::shutdown()
+{
+    signal_workers(SIGTERM);
+    for(int i = 0; i < m_workers; ++i)
+    {
+        if(m_pids[i] > 0)
+        {
+            waitpid(m_pids[i], NULL, 0);
+            m_pids[i] = 0;
+        }
+    }
+}
+
+int master::run(const listen_addr* admin_addr, int* fds)
+{
+    if(!open_listeners())
+    {
+        return -1;
+    }
+    /*共享内存必须在fork之前映射 master使用最后一组 读取时汇总所有进程*/
+    if(!metrics::share(m_workers + 1) || !request_trace::share(m_workers + 1))
+    {
+        printf("prefork: mapping shared metrics failed\n");
+        return -1;
+    }
+    metrics::select(m_workers, true);
+    request_trace::select(m_workers, true);
+    /*信号只在sigtimedwait中处理 管理线程继承阻塞的掩码*/
+    sigprocmask(SIG_BLOCK, &m_signals, &m_old_mask);
+
+    for(int i = 0; i < m_workers; ++i)
+    {
+        if(spawn(i, fds))
+        {
+            return i;
+        }
+    }
+    if(admin_addr)
+    {
+        m_admin = new admin_server(m_cfg.metrics_path.c_str());
+        if(!m_admin->start(*admin_addr))
+        {
+            printf("admin listener on port %d failed\n", m_cfg.admin_port);
+            shutdown();
+            return -1;
+        }
+    }
+    printf("prefork: master %d started %d workers\n", (int)getpid(), m_workers);
+    fflush(stdout);
+
+    while(true)
+    {
+        /*每秒醒来一次 重新启动因间隔未到而推迟的worker*/
+        struct timespec timeout = {1, 0};
+        int sig = sigtimedwait(&m_signals, NULL, &timeout);
+        if(sig == SIGTERM || sig == SIGINT)
+        {
+            break;
+        }
+        if(sig == SIGHUP)
+        {
+            reload();
+            signal_workers(SIGHUP);
+        }
+        else if(sig == SIGUSR1)
+        {
+            signal_workers(SIGUSR1);
+        }
+        reap();
+        time_t now = time(NULL);
+        for(int i = 0; i < m_workers; ++i)
+        {
+            if(m_pids[i] || now - m_started[i] < RESPAWN_INTERVAL)
+            {
+                continue;
+            }
+            if(spawn(i, fds))
+            {
+                return i;
+            }
+            if(!m_pids[i])
+            {
+                continue;
+            }
+            metrics::add(WORKER_RESTARTS);
+            printf("prefork: restarted worker %d (pid %d)\n", i, (int)m_pids[i]);
+        }
+        fflush(stdout);
+    }
+    shutdown();
+    printf("prefork: master exiting\n");
+    m_status = 0;
+    return -1;
+}
@@ -0,0 +1,72 @@
+#ifndef _MASTER_H_
+#define _MASTER_H_
+
+#include<sys/types.h>
+#include<signal.h>
+#include<time.h>
+#include<vector>
+
+#include"../config/config.h"
+#include"../net/listener.h"
+#include"../cache/shm_cache.h"
+
+class admin_server;
+
+/*
+prefork模式的master进程 配置workers大于0时使用:
+    master为每个worker打开一组设置了SO_REUSEPORT的TCP监听socket 内核按连接的四元组哈希分给各组 各worker的accept互不竞争
+    Unix域socket不支持按连接分发 只打开一次 所有worker共用 由先被唤醒的worker accept
+    监听socket始终由master持有 worker异常退出后它那一组的监听队列保留 重新启动的worker接着accept 队列中的连接不会被拒绝
+    worker与单进程模式一样运行完整的事件循环和线程池 文件缓存、连接对象等都是各自的
+    所有worker共享master在fork之前映射的shm_cache和指标分片
+master自己不处理请求:
+    收到SIGHUP时重新加载配置(之后启动的worker使用) 并转发给各worker SIGUSR1也转发给各worker
+    收到SIGTERM/SIGINT时结束所有worker后退出
+    worker退出时清零它的仪表 回收它写入中的共享缓存项 至少间隔RESPAWN_INTERVAL秒后在同一位置重新启动
+    配置了管理端口时由master监听 汇总所有进程的计数器和直方图
+*/
+class master{
+public:
+    /*同一个位置两次启动worker之间的最短秒数 避免启动即退出的worker占满CPU*/
+    static const int RESPAWN_INTERVAL = 1;
+
+    /*cfg在master重新加载配置后更新 之后fork的worker继续使用这份配置*/
+    master(server_config& cfg, int argc, char* argv[], const listen_addr* addrs, int listener_count, shm_cache* cache);
+    ~master();
+
+    /*
+    打开监听socket、映射共享的指标并启动各worker 之后master在这里管理worker直到退出
+    在worker中返回它的序号 fds为它使用的各监听socket 与addrs一一对应
+    在master中返回-1 status()为进程的退出码
+    */
+    int run(const listen_addr* admin_addr, int* fds);
+    int status() const { return m_status; }
+
+private:
+    bool open_listeners();
+    /*在第index个位置启动worker 在子进程中返回true*/
+    bool spawn(int index, int* fds);
+    void reap();
+    void reload();
+    void signal_workers(int sig);
+    void shutdown();
+
+private:
+    server_config& m_cfg;
+    int m_argc;
+    char** m_argv;
+    const listen_addr* m_addrs;
+    int m_listener_count;
+    shm_cache* m_cache;
+    int m_workers;
+    /*第i个worker的第j个监听socket为m_fds[i * m_listener_count + j] Unix域socket各worker共用同一个描述符*/
+    std::vector<int> m_fds;
+    std::vector<pid_t> m_pids;      /*0表示该位置没有worker*/
+    std::vector<time_t> m_started;
+    sigset_t m_signals;             /*master在sigtimedwait中等待的信号 平时阻塞*/
+    sigset_t m_old_mask;            /*worker恢复的信号掩码*/
+    admin_server* m_admin;
+    int m_status;
+};
+
+#endif
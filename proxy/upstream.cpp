@@ -0,0 +1,897 @@
+#include"upstream.h"
+
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<strings.h>
+#include<cstring>
+
+#include"../metrics/metrics.h"
+
+/*chunked消息体的解析状态*/
+enum CHUNK_STATE{
+    CHUNK_SIZE = 0,         /*块大小的十六进制数字*/
+    CHUNK_EXT,              /*块扩展 直到行尾*/
+    CHUNK_DATA,
+    CHUNK_DATA_END,         /*块数据之后的CRLF*/
+    CHUNK_TRAILER_START,    /*最后一块之后 尾部字段的行首 空行表示消息结束*/
+    CHUNK_TRAILER_LINE
+};
+
+upstream_conn::upstream_conn()
+: m_fd(-1), m_state(IDLE), m_registered(false), m_pool(nullptr), m_route(nullptr), m_client(nullptr), m_next(nullptr),
+  m_idle_since(0), m_head(nullptr), m_buf(nullptr)
+{
+}
+
+upstream_conn::~upstream_conn()
+{
+    close_socket();
+    delete [] m_head;
+}
+
+void upstream_conn::close_socket()
+{
+    if(m_fd != -1)
+    {
+        close(m_fd);
+        metrics::add(SYSCALLS);
+        m_fd = -1;
+    }
+    m_registered = false;
+    m_state = IDLE;
+}
+
+/*
+与http_conn一样以EPOLLONESHOT注册 同一时刻只有一个线程处理该连接
+工作线程中注册之后主线程可能立即处理事件 直到请求结束、连接被关闭 所以对成员的修改都在epoll_ctl之前
+*/
+void upstream_conn::arm(int ev)
+{
+    struct epoll_event event;
+    event.data.ptr = this;
+    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    int op = m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    m_registered = true;
+    epoll_ctl(http_conn::m_epollfd, op, m_fd, &event);
+    metrics::add(SYSCALLS);
+}
+
+bool upstream_conn::connect_upstream()
+{
+    const listen_addr& addr = m_route->addr;
+    m_fd = socket(addr.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    metrics::add(SYSCALLS);
+    if(m_fd < 0)
+    {
+        return false;
+    }
+    if(addr.is_inet())
+    {
+        int one = 1;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    metrics::add(UPSTREAM_NEW);
+    m_reused = false;
+    /*Unix域socket的connect通常立即完成 TCP返回EINPROGRESS*/
+    int ret = connect(m_fd, (const struct sockaddr*)&addr.addr, addr.len);
+    metrics::add(SYSCALLS);
+    if(ret == 0)
+    {
+        m_state = SENDING;
+    }
+    else if(errno == EINPROGRESS)
+    {
+        m_state = CONNECTING;
+    }
+    else
+    {
+        close_socket();
+        return false;
+    }
+    return true;
+}
+
+http_conn::WRITE_RESULT upstream_conn::start(http_conn* client)
+{
+    if(!m_head)
+    {
+        m_head = new char[HEAD_BUFFER_SIZE + BODY_BUFFER_SIZE];
+        m_buf = m_head + HEAD_BUFFER_SIZE;
+    }
+    m_client = client;
+    client->enable_nodelay();
+    m_reused = (m_fd != -1);
+    m_buf_len = 0;
+    m_buf_off = 0;
+    m_relayed = false;
+    m_sent = false;
+    m_streamed = false;
+    m_idempotent = client->idempotent();
+    m_headers_done = false;
+    m_complete = false;
+    m_reusable = true;
+    m_client_keep = client->keep_alive();
+    m_status = 0;
+    m_body = BODY_NONE;
+    m_chunk_state = CHUNK_SIZE;
+    m_remaining = 0;
+    m_last_progress = time(NULL);
+    m_req_len = client->proxy_request(m_head, HEAD_BUFFER_SIZE);
+    m_head_len = m_req_len < 0 ? 0 : m_req_len;
+    m_head_off = 0;
+    m_req_body_len = client->buffered_body(&m_req_body);
+    m_req_body_off = 0;
+    m_req_body_left = client->content_length() - m_req_body_len;
+    if(m_req_len < 0)
+    {
+        m_reused = false;
+        return fail();
+    }
+    /*
+    不能重发的请求先确认空闲连接没有被上游关闭 否则请求发出后才发现连接已断开只能返回502
+    空闲连接上不应有数据可读 读到EOF、数据或错误都换一条新连接
+    */
+    if(m_reused && !m_idempotent)
+    {
+        char c;
+        ssize_t n = recv(m_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        metrics::add(SYSCALLS);
+        if(n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            close_socket();
+            m_reused = false;
+        }
+    }
+    if(m_reused)
+    {
+        metrics::add(UPSTREAM_REUSED);
+        m_state = SENDING;
+    }
+    else if(!connect_upstream())
+    {
+        return fail();
+    }
+    if(m_state == CONNECTING)
+    {
+        arm(EPOLLOUT);
+        return http_conn::WRITE_AGAIN;
+    }
+    /*已建立的连接直接发送 与工作线程直接发送响应相同 多数请求一次发完*/
+    return send_request();
+}
+
+/*
+依次发出请求头和请求体 请求体发完后注册EPOLLIN等待响应
+一次调用最多从客户socket读入READ_BUDGET字节 之后重新注册客户的EPOLLIN 还有数据时下一轮epoll_wait立即返回该事件
+*/
+http_conn::WRITE_RESULT upstream_conn::send_request()
+{
+    long budget = http_conn::READ_BUDGET;
+    while(true)
+    {
+        if(m_head_off == m_head_len && m_req_body_off == m_req_body_len)
+        {
+            if(m_req_body_left == 0)
+            {
+                break;
+            }
+            if(budget <= 0)
+            {
+                m_client->wait_client(EPOLLIN);
+                return http_conn::WRITE_AGAIN;
+            }
+            int want = m_req_body_left < BODY_BUFFER_SIZE ? (int)m_req_body_left : BODY_BUFFER_SIZE;
+            ssize_t n = recv(m_client->sockfd(), m_buf, want, 0);
+            metrics::add(SYSCALLS);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                m_client->wait_client(EPOLLIN);
+                return http_conn::WRITE_AGAIN;
+            }
+            if(n <= 0)
+            {
+                /*请求体没有发完客户就关闭了连接 上游连接停在请求中间 不能复用*/
+                http_conn* client = m_client;
+                abort();
+                client->backend_abort();
+                return http_conn::WRITE_CLOSE;
+            }
+            metrics::add(BYTES_IN, n);
+            m_last_progress = time(NULL);
+            budget -= n;
+            m_streamed = true;
+            m_req_body = m_buf;
+            m_req_body_len = n;
+            m_req_body_off = 0;
+            m_req_body_left -= n;
+        }
+        struct iovec iv[2];
+        int count = 0;
+        if(m_head_off < m_head_len)
+        {
+            iv[count].iov_base = m_head + m_head_off;
+            iv[count].iov_len = m_head_len - m_head_off;
+            ++count;
+        }
+        if(m_req_body_off < m_req_body_len)
+        {
+            iv[count].iov_base = (void*)(m_req_body + m_req_body_off);
+            iv[count].iov_len = m_req_body_len - m_req_body_off;
+            ++count;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iv;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+        metrics::add(SYSCALLS);
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                arm(EPOLLOUT);
+                return http_conn::WRITE_AGAIN;
+            }
+            return fail();
+        }
+        m_sent = true;
+        int head = m_head_len - m_head_off;
+        if(n < head)
+        {
+            m_head_off += n;
+            continue;
+        }
+        m_head_off = m_head_len;
+        m_req_body_off += n - head;
+    }
+    m_state = RELAYING;
+    m_head_len = 0;
+    m_head_off = 0;
+    arm(EPOLLIN);
+    return http_conn::WRITE_AGAIN;
+}
+
+http_conn::WRITE_RESULT upstream_conn::on_event(uint32_t events)
+{
+    /*
+    同一批事件中客户连接先被关闭时 上游连接随之关闭 它的事件已经过时
+    关闭的连接对象在这一批事件处理完之后才回到空闲槽位链表 不会在这里遇到已交给新请求的对象
+    */
+    if(!m_client)
+    {
+        return http_conn::WRITE_AGAIN;
+    }
+    m_last_progress = time(NULL);
+    if(m_state == CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        metrics::add(SYSCALLS);
+        if(err != 0)
+        {
+            return fail();
+        }
+        m_state = SENDING;
+    }
+    if(m_state == SENDING)
+    {
+        if(events & (EPOLLERR | EPOLLHUP))
+        {
+            return fail();
+        }
+        return send_request();
+    }
+    /*EPOLLRDHUP时仍可能有未读完的响应 由recv返回0判断*/
+    return relay();
+}
+
+http_conn::WRITE_RESULT upstream_conn::on_timeout()
+{
+    printf("upstream %s timed out\n", m_route->addr.spec.c_str());
+    return fail();
+}
+
+void upstream_conn::abort()
+{
+    m_client = nullptr;
+    m_pool->release(this, false);
+}
+
+/*
+主循环: 先把缓冲区中的数据发给客户 客户写满时注册客户的EPOLLOUT返回
+缓冲区清空后再从上游读 读到EAGAIN时注册上游的EPOLLIN返回
+一次调用最多从上游读入READ_BUDGET字节 之后重新注册上游的EPOLLIN 还有数据时下一轮epoll_wait立即返回该事件
+*/
+http_conn::WRITE_RESULT upstream_conn::relay()
+{
+    long budget = http_conn::READ_BUDGET;
+    while(true)
+    {
+        if(m_headers_done)
+        {
+            int ret = flush();
+            if(ret < 0)
+            {
+                /*客户连接出错 响应不完整 上游连接也不能复用*/
+                http_conn* client = m_client;
+                abort();
+                client->backend_abort();
+                return http_conn::WRITE_CLOSE;
+            }
+            if(ret == 0)
+            {
+                m_client->wait_client(EPOLLOUT);
+                return http_conn::WRITE_AGAIN;
+            }
+            if(m_complete)
+            {
+                return finish();
+            }
+            m_buf_off = 0;
+            m_buf_len = 0;
+            if(budget <= 0)
+            {
+                arm(EPOLLIN);
+                return http_conn::WRITE_AGAIN;
+            }
+        }
+        else if(m_buf_len == BODY_BUFFER_SIZE)
+        {
+            /*响应头超过缓冲区*/
+            return fail();
+        }
+        ssize_t n = recv(m_fd, m_buf + m_buf_len, BODY_BUFFER_SIZE - m_buf_len, 0);
+        metrics::add(SYSCALLS);
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                arm(EPOLLIN);
+                return http_conn::WRITE_AGAIN;
+            }
+            return fail();
+        }
+        if(n == 0)
+        {
+            /*没有长度的消息体以上游关闭连接结束*/
+            if(m_headers_done && m_body == BODY_UNTIL_CLOSE)
+            {
+                m_complete = true;
+                m_reusable = false;
+                continue;
+            }
+            return fail();
+        }
+        m_last_progress = time(NULL);
+        budget -= n;
+        int start = m_buf_len;
+        m_buf_len += n;
+        if(!m_headers_done)
+        {
+            int ret = parse_head();
+            if(ret < 0)
+            {
+                return fail();
+            }
+            if(ret == 0)
+            {
+                continue;
+            }
+            start = m_buf_off;
+        }
+        int used = frame(m_buf + start, m_buf_len - start);
+        if(used < 0)
+        {
+            return fail();
+        }
+        if(start + used < m_buf_len)
+        {
+            /*响应之后多出的数据 上游的状态不可信 不再复用*/
+            m_buf_len = start + used;
+            m_reusable = false;
+        }
+    }
+}
+
+/*响应头和消息体一次sendmsg发给客户 返回1全部发出 0客户写满 -1出错*/
+int upstream_conn::flush()
+{
+    while(m_head_off < m_head_len || m_buf_off < m_buf_len)
+    {
+        struct iovec iv[2];
+        int count = 0;
+        if(m_head_off < m_head_len)
+        {
+            iv[count].iov_base = m_head + m_head_off;
+            iv[count].iov_len = m_head_len - m_head_off;
+            ++count;
+        }
+        if(m_buf_off < m_buf_len)
+        {
+            iv[count].iov_base = m_buf + m_buf_off;
+            iv[count].iov_len = m_buf_len - m_buf_off;
+            ++count;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iv;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(m_client->sockfd(), &msg, MSG_NOSIGNAL);
+        metrics::add(SYSCALLS);
+        if(n < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        m_relayed = true;
+        m_last_progress = time(NULL);
+        metrics::add(BYTES_OUT, n);
+        int head = m_head_len - m_head_off;
+        if(n < head)
+        {
+            m_head_off += n;
+            continue;
+        }
+        m_head_off = m_head_len;
+        m_buf_off += n - head;
+    }
+    return 1;
+}
+
+/*头部行是否为name字段 name包含结尾的':'*/
+static bool is_field(const char* line, int len, const char* name)
+{
+    int n = strlen(name);
+    return len > n && strncasecmp(line, name, n) == 0;
+}
+
+/*字段值中是否含有token(不区分大小写)*/
+static bool has_token(const char* p, int len, const char* token)
+{
+    int n = strlen(token);
+    for(int i = 0; i + n <= len; ++i)
+    {
+        if(strncasecmp(p + i, token, n) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int upstream_conn::parse_head()
+{
+    while(true)
+    {
+        char* end = (char*)memmem(m_buf, m_buf_len, "\r\n\r\n", 4);
+        if(!end)
+        {
+            return 0;
+        }
+        int head_end = end - m_buf + 4;
+        if(head_end < 14 || strncmp(m_buf, "HTTP/1.", 7) != 0 || m_buf[8] != ' ')
+        {
+            return -1;
+        }
+        int status = atoi(m_buf + 9);
+        if(status < 100 || status > 999)
+        {
+            return -1;
+        }
+        /*1xx中间响应 丢弃后继续解析最终的响应*/
+        if(status < 200)
+        {
+            memmove(m_buf, m_buf + head_end, m_buf_len - head_end);
+            m_buf_len -= head_end;
+            continue;
+        }
+        m_status = status;
+        if(m_buf[7] == '0')
+        {
+            m_reusable = false;
+        }
+
+        /*状态行原样保留 去掉逐跳头部 最后按客户连接补上Connection*/
+        int64_t content_length = -1;
+        bool chunked = false;
+        int out = 0;
+        char* p = m_buf;
+        char* limit = end + 2;
+        while(p < limit)
+        {
+            char* eol = (char*)memchr(p, '\n', limit - p);
+            int len = eol + 1 - p;
+            bool copy = true;
+            if(p != m_buf)
+            {
+                if(is_field(p, len, "Connection:"))
+                {
+                    copy = false;
+                    if(has_token(p + 11, len - 11, "close"))
+                    {
+                        m_reusable = false;
+                    }
+                }
+                else if(is_field(p, len, "Keep-Alive:") || is_field(p, len, "Proxy-Connection:"))
+                {
+                    copy = false;
+                }
+                else if(is_field(p, len, "Transfer-Encoding:"))
+                {
+                    chunked = has_token(p + 18, len - 18, "chunked");
+                }
+                else if(is_field(p, len, "Content-Length:"))
+                {
+                    content_length = strtoll(p + 15, NULL, 10);
+                }
+            }
+            if(copy)
+            {
+                if(out + len > HEAD_BUFFER_SIZE)
+                {
+                    return -1;
+                }
+                memcpy(m_head + out, p, len);
+                out += len;
+            }
+            p = eol + 1;
+        }
+
+        if(status == 204 || status == 304)
+        {
+            m_body = BODY_NONE;
+        }
+        else if(chunked)
+        {
+            m_body = BODY_CHUNKED;
+        }
+        else if(content_length > 0)
+        {
+            m_body = BODY_LENGTH;
+            m_remaining = content_length;
+        }
+        else if(content_length == 0)
+        {
+            m_body = BODY_NONE;
+        }
+        else
+        {
+            /*消息体以上游关闭连接结束 客户端只能同样以关闭连接得知响应结束*/
+            m_body = BODY_UNTIL_CLOSE;
+            m_reusable = false;
+            m_client_keep = false;
+        }
+        const char* connection = m_client_keep ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        int connection_len = strlen(connection);
+        if(out + connection_len > HEAD_BUFFER_SIZE)
+        {
+            return -1;
+        }
+        memcpy(m_head + out, connection, connection_len);
+        m_head_len = out + connection_len;
+        m_head_off = 0;
+        m_buf_off = head_end;
+        m_headers_done = true;
+        m_complete = (m_body == BODY_NONE);
+        return 1;
+    }
+}
+
+static int hex_digit(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int upstream_conn::frame(const char* p, int n)
+{
+    switch(m_body)
+    {
+        case BODY_NONE:
+            return 0;
+        case BODY_UNTIL_CLOSE:
+            return n;
+        case BODY_LENGTH:
+        {
+            int used = m_remaining < n ? (int)m_remaining : n;
+            m_remaining -= used;
+            m_complete = (m_remaining == 0);
+            return used;
+        }
+        default:
+            break;
+    }
+    /*chunked: 块数据整段跳过 只逐字节检查块大小行和尾部字段*/
+    int i = 0;
+    while(i < n && !m_complete)
+    {
+        char c = p[i];
+        switch(m_chunk_state)
+        {
+            case CHUNK_SIZE:
+            {
+                int v = hex_digit(c);
+                if(v < 0)
+                {
+                    m_chunk_state = CHUNK_EXT;
+                    break;
+                }
+                if(m_remaining >> 56)
+                {
+                    return -1;
+                }
+                m_remaining = m_remaining * 16 + v;
+                ++i;
+                break;
+            }
+            case CHUNK_EXT:
+                ++i;
+                if(c == '\n')
+                {
+                    m_chunk_state = m_remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+                }
+                break;
+            case CHUNK_DATA:
+            {
+                int take = m_remaining < n - i ? (int)m_remaining : n - i;
+                i += take;
+                m_remaining -= take;
+                if(m_remaining == 0)
+                {
+                    m_chunk_state = CHUNK_DATA_END;
+                }
+                break;
+            }
+            case CHUNK_DATA_END:
+                ++i;
+                if(c == '\n')
+                {
+                    m_chunk_state = CHUNK_SIZE;
+                }
+                break;
+            case CHUNK_TRAILER_START:
+                ++i;
+                if(c == '\n')
+                {
+                    m_complete = true;
+                }
+                else if(c != '\r')
+                {
+                    m_chunk_state = CHUNK_TRAILER_LINE;
+                }
+                break;
+            case CHUNK_TRAILER_LINE:
+                ++i;
+                if(c == '\n')
+                {
+                    m_chunk_state = CHUNK_TRAILER_START;
+                }
+                break;
+        }
+    }
+    return i;
+}
+
+http_conn::WRITE_RESULT upstream_conn::finish()
+{
+    http_conn* client = m_client;
+    int status = m_status;
+    bool keep = m_client_keep;
+    m_client = nullptr;
+    m_pool->release(this, m_reusable);
+    return client->backend_done(status, keep);
+}
+
+/*
+上游出错:
+    复用的空闲连接可能已被上游关闭 还没有读到任何响应时换一条新连接重发一次
+        只重发还没有任何字节发出的请求 或者请求体都还在内存中的GET 上游可能已经执行了其他请求
+    还没有向客户发出数据时返回502 否则只能关闭客户连接
+*/
+http_conn::WRITE_RESULT upstream_conn::fail()
+{
+    metrics::add(UPSTREAM_ERRORS);
+    if(m_reused && !m_headers_done && m_buf_len == 0 && !m_streamed && (!m_sent || m_idempotent))
+    {
+        close_socket();
+        if(connect_upstream())
+        {
+            m_sent = false;
+            m_head_off = 0;
+            m_head_len = m_req_len;
+            m_req_body_off = 0;
+            if(m_state == CONNECTING)
+            {
+                arm(EPOLLOUT);
+                return http_conn::WRITE_AGAIN;
+            }
+            return send_request();
+        }
+    }
+    http_conn* client = m_client;
+    bool relayed = m_relayed;
+    abort();
+    if(relayed)
+    {
+        client->backend_abort();
+        return http_conn::WRITE_CLOSE;
+    }
+    return client->backend_failed();
+}
+
+upstream_pool::upstream_pool()
+: m_conns(new upstream_conn[MAX_CONNS]), m_free(nullptr), m_retired(nullptr)
+{
+    for(int i = MAX_CONNS - 1; i >= 0; --i)
+    {
+        m_conns[i].m_pool = this;
+        m_conns[i].m_next = m_free;
+        m_free = &m_conns[i];
+    }
+}
+
+upstream_pool::~upstream_pool()
+{
+    delete [] m_conns;
+}
+
+bool upstream_pool::configure(const char* spec)
+{
+    std::string list = spec;
+    for(size_t pos = 0; pos <= list.size(); )
+    {
+        size_t comma = list.find(',', pos);
+        if(comma == std::string::npos)
+        {
+            comma = list.size();
+        }
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        if(item.empty())
+        {
+            continue;
+        }
+        size_t eq = item.find('=');
+        proxy_route route;
+        route.idle = nullptr;
+        route.idle_count = 0;
+        if(eq == std::string::npos || item[0] != '/' || !route.addr.parse(item.c_str() + eq + 1, 80))
+        {
+            printf("bad proxy route: %s\n", item.c_str());
+            return false;
+        }
+        route.prefix = item.substr(0, eq);
+        m_routes.push_back(route);
+    }
+    return true;
+}
+
+proxy_route* upstream_pool::match(const char* url)
+{
+    proxy_route* best = nullptr;
+    for(size_t i = 0; i < m_routes.size(); ++i)
+    {
+        const std::string& prefix = m_routes[i].prefix;
+        if(strncmp(url, prefix.c_str(), prefix.size()) == 0 && (!best || prefix.size() > best->prefix.size()))
+        {
+            best = &m_routes[i];
+        }
+    }
+    return best;
+}
+
+upstream_conn* upstream_pool::acquire(proxy_route* route)
+{
+    m_mutex.lock();
+    upstream_conn* conn = route->idle;
+    if(conn)
+    {
+        route->idle = conn->m_next;
+        --route->idle_count;
+    }
+    else if(m_free)
+    {
+        conn = m_free;
+        m_free = conn->m_next;
+        conn->m_route = route;
+    }
+    if(conn)
+    {
+        conn->m_next = nullptr;
+        /*超时检查在锁内读取 工作线程随后在start中设置m_client*/
+        conn->m_last_progress = time(NULL);
+    }
+    m_mutex.unlock();
+    return conn;
+}
+
+void upstream_pool::release(upstream_conn* conn, bool reusable)
+{
+    proxy_route* route = conn->m_route;
+    if(!reusable || conn->m_fd == -1 || route->idle_count >= MAX_IDLE_PER_ROUTE)
+    {
+        conn->close_socket();
+    }
+    m_mutex.lock();
+    if(conn->m_fd != -1)
+    {
+        /*空闲连接留在epoll中但没有注册任何事件 被上游关闭时在下一次复用时发现*/
+        conn->m_state = upstream_conn::IDLE;
+        conn->m_idle_since = time(NULL);
+        conn->m_next = route->idle;
+        route->idle = conn;
+        ++route->idle_count;
+    }
+    else
+    {
+        conn->m_route = nullptr;
+        conn->m_next = m_retired;
+        m_retired = conn;
+    }
+    m_mutex.unlock();
+}
+
+void upstream_pool::reclaim()
+{
+    m_mutex.lock();
+    while(m_retired)
+    {
+        upstream_conn* conn = m_retired;
+        m_retired = conn->m_next;
+        conn->m_next = m_free;
+        m_free = conn;
+    }
+    m_mutex.unlock();
+}
+
+std::vector<upstream_conn*> upstream_pool::sweep(time_t now)
+{
+    std::vector<upstream_conn*> expired;
+    m_mutex.lock();
+    for(size_t i = 0; i < m_routes.size(); ++i)
+    {
+        upstream_conn** link = &m_routes[i].idle;
+        while(*link)
+        {
+            upstream_conn* conn = *link;
+            if(now - conn->m_idle_since < IDLE_TIMEOUT)
+            {
+                link = &conn->m_next;
+                continue;
+            }
+            *link = conn->m_next;
+            --m_routes[i].idle_count;
+            conn->close_socket();
+            conn->m_route = nullptr;
+            conn->m_next = m_free;
+            m_free = conn;
+        }
+    }
+    for(int i = 0; i < MAX_CONNS; ++i)
+    {
+        upstream_conn* conn = &m_conns[i];
+        if(conn->m_client && now - conn->m_last_progress >= RESPONSE_TIMEOUT)
+        {
+            expired.push_back(conn);
+        }
+    }
+    m_mutex.unlock();
+    return expired;
+}
@@ -0,0 +1,183 @@
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include<stdint.h>
+#include<time.h>
+#include<string>
+#include<vector>
+
+#include"../lock/myLock.h"
+#include"../net/listener.h"
+#include"../http/http_conn.h"
+#include"../http/backend.h"
+
+class upstream_conn;
+class upstream_pool;
+
+/*路径前缀与上游地址 空闲连接链表由upstream_pool的互斥锁保护*/
+struct proxy_route{
+    std::string prefix;
+    listen_addr addr;
+    upstream_conn* idle;
+    int idle_count;
+};
+
+/*
+到上游服务器的一条持久连接：
+    工作线程解析出请求后调用start 构造转发的请求并直接发送 最后一步把上游socket注册到主线程的epoll
+    之后的连接建立、发送请求剩余部分、读取响应、转发给客户都在主线程的epoll事件中完成 不再经过工作线程
+    请求体先发读缓冲区中已有的部分 其余部分每次从客户socket读入一段(m_buf)发给上游 上游写满时等上游的EPOLLOUT
+        客户socket暂时没有数据时等客户的EPOLLIN 请求体发完之后才读响应
+    客户socket写满时停止读上游 注册客户的EPOLLOUT 客户可写后继续转发 两个socket同一时刻只有一个注册了事件
+    响应头被改写(去掉逐跳头部 按客户连接补上Connection) 消息体原样转发 按Content-Length或chunked判断响应结束
+    响应完整结束且上游没有要求关闭时 连接放回所属路由的空闲链表 下一个请求直接复用
+    复用的空闲连接可能已被上游关闭 还没有读到任何响应时换一条新连接重发一次:
+        请求还没有任何字节发出 或者是GET且请求体没有从客户socket读出过(读出的部分已不在内存中)
+        其他请求可能已被上游执行 不重发 所以发出之前先用MSG_PEEK确认复用的连接还没有被上游关闭
+*/
+class upstream_conn : public backend_request{
+public:
+    /*发往上游的请求 以及改写后发给客户的响应头*/
+    static const int HEAD_BUFFER_SIZE = 8192;
+    /*从上游读入、尚未转发给客户的数据*/
+    static const int BODY_BUFFER_SIZE = 16384;
+
+    enum STATE{
+        IDLE = 0,
+        CONNECTING,     /*非阻塞connect进行中*/
+        SENDING,        /*请求头或请求体还没有发完*/
+        RELAYING        /*读取响应并转发给客户*/
+    };
+    /*响应消息体的定界方式*/
+    enum BODY{
+        BODY_NONE = 0,
+        BODY_LENGTH,
+        BODY_CHUNKED,
+        BODY_UNTIL_CLOSE
+    };
+
+public:
+    upstream_conn();
+    ~upstream_conn();
+
+    /*
+    工作线程调用 向上游发出client的请求 返回值是对客户连接的处理结果
+    正常时为WRITE_AGAIN 此时上游socket已注册到epoll 调用者不能再访问该连接和客户连接
+    失败时连接已被释放 客户已在发送502响应 结果与http_conn::write()相同
+    */
+    http_conn::WRITE_RESULT start(http_conn* client);
+    /*主线程在上游socket的事件中调用 返回值是对客户连接的处理结果*/
+    http_conn::WRITE_RESULT on_event(uint32_t events);
+    /*主线程在客户socket可读(请求体)或可写时调用*/
+    http_conn::WRITE_RESULT on_client_event() { return m_state == RELAYING ? relay() : send_request(); }
+    /*上游长时间没有响应*/
+    http_conn::WRITE_RESULT on_timeout();
+    /*客户连接被关闭 丢弃进行中的响应*/
+    void abort();
+    http_conn* client() const { return m_client; }
+
+private:
+    bool connect_upstream();
+    http_conn::WRITE_RESULT send_request();
+    http_conn::WRITE_RESULT relay();
+    int flush();
+    /*解析响应头并改写到m_head 返回-1出错 0需要更多数据 1完成*/
+    int parse_head();
+    /*按定界方式检查新读入的n字节消息体 返回属于本响应的字节数*/
+    int frame(const char* p, int n);
+    http_conn::WRITE_RESULT finish();
+    http_conn::WRITE_RESULT fail();
+    void arm(int ev);
+    void close_socket();
+
+private:
+    friend class upstream_pool;
+
+    int m_fd;
+    STATE m_state;
+    bool m_registered;          /*m_fd已加入epoll*/
+    bool m_reused;              /*本次请求使用的是空闲链表中的连接*/
+    bool m_relayed;             /*已经向客户发出数据 此后出错只能关闭客户连接*/
+    bool m_sent;                /*请求已有字节发给上游*/
+    bool m_streamed;            /*请求体已有部分从客户socket读出 不能再重发*/
+    bool m_idempotent;
+    bool m_headers_done;
+    bool m_complete;            /*响应的最后一个字节已读入*/
+    bool m_reusable;            /*响应结束后可以放回空闲链表*/
+    bool m_client_keep;         /*转发完成后客户连接是否保持*/
+    int m_status;
+    BODY m_body;
+    int m_chunk_state;
+    int64_t m_remaining;        /*定长消息体或当前chunk剩余的字节数*/
+    time_t m_last_progress;
+
+    upstream_pool* m_pool;
+    proxy_route* m_route;
+    http_conn* m_client;
+    upstream_conn* m_next;      /*空闲链表或空闲槽位链表*/
+    time_t m_idle_since;
+
+    /*m_head[m_head_off, m_head_len)是待发送的请求或响应头 m_req_len为请求头的长度 重发时使用*/
+    char* m_head;
+    int m_head_len;
+    int m_head_off;
+    int m_req_len;
+    /*
+    m_req_body[m_req_body_off, m_req_body_len)是待发送的一段请求体 先指向客户读缓冲区中已有的部分 之后指向m_buf
+    m_req_body_left为还没有从客户socket读出的字节数
+    */
+    const char* m_req_body;
+    int m_req_body_len;
+    int m_req_body_off;
+    long m_req_body_left;
+    /*m_buf[m_buf_off, m_buf_len)是已读入未转发的数据*/
+    char* m_buf;
+    int m_buf_len;
+    int m_buf_off;
+};
+
+/*
+反向代理的路由表和上游连接池 整个事件循环共用一个：
+    连接对象预先分配在一个数组中 主线程以地址范围区分上游socket和客户socket的事件
+    关闭的连接对象在主线程处理完当前一批事件后才重新分配 过时的事件只会遇到已关闭的对象
+    工作线程取空闲连接、主线程放回连接都在m_mutex内 只是几次链表操作
+    空闲超过IDLE_TIMEOUT秒的连接、RESPONSE_TIMEOUT秒没有进展的请求由主线程每秒检查一次
+*/
+class upstream_pool{
+public:
+    static const int MAX_CONNS = 1024;
+    static const int MAX_IDLE_PER_ROUTE = 64;
+    static const int IDLE_TIMEOUT = 30;
+    static const int RESPONSE_TIMEOUT = 30;
+
+    upstream_pool();
+    ~upstream_pool();
+
+    /*解析"前缀=地址,前缀=地址..." 地址的写法同监听地址 格式错误时返回false*/
+    bool configure(const char* spec);
+    bool empty() const { return m_routes.empty(); }
+    /*最长前缀匹配 没有匹配的路由时返回nullptr*/
+    proxy_route* match(const char* url);
+    /*取一条空闲连接 没有时分配一个新槽位 槽位用完时返回nullptr*/
+    upstream_conn* acquire(proxy_route* route);
+    /*请求结束后放回连接 不可复用或空闲链表已满时关闭 关闭的连接先记入m_retired*/
+    void release(upstream_conn* conn, bool reusable);
+    /*主线程处理完一批epoll事件后调用 关闭的连接此后才能分配给新请求*/
+    void reclaim();
+    bool owns(void* ptr) const { return ptr >= (void*)m_conns && ptr < (void*)(m_conns + MAX_CONNS); }
+    /*关闭空闲太久的连接 返回等待响应超时的连接 由主线程调用*/
+    std::vector<upstream_conn*> sweep(time_t now);
+
+private:
+    std::vector<proxy_route> m_routes;
+    upstream_conn* m_conns;
+    upstream_conn* m_free;
+    /*
+    已关闭、还不能重新分配的连接 同一批epoll事件中可能还有它关闭之前的事件
+    若在这期间分配给新请求 过时的事件会与工作线程中的start同时处理同一个对象
+    */
+    upstream_conn* m_retired;
+    myMutex m_mutex;
+};
+
+#endif
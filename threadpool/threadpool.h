@@ -2,12 +2,15 @@
 #define _THREADPOOL_H_
 
 #include <iostream>
-#include <list>
 #include <exception>
 #include <pthread.h>
+#include <time.h>
 #include "../lock/myLock.h"
+#include "../metrics/metrics.h"
+#include "../metrics/request_trace.h"
+#include "../metrics/probes.h"
 
-/*线程池类 定义为模板为了方便复用 T是任务类*/
+/*线程池类 定义为模板为了方便复用 T是任务类 需提供process()、记录入队出队时间的trace()和供探针使用的sockfd()*/
 template<typename T>
 class threadpool {
 public:
@@ -16,75 +19,183 @@ public:
     ~threadpool();
     //向请求队列中插入任务请求
     bool append(T* request);
+    /*请求队列的容量*/
+    int capacity() const { return m_max_requests; }
+    /*当前的线程数 不含等待退出的线程*/
+    int threads()
+    {
+        m_queuemutex.lock();
+        int n = m_thread_number - m_retiring;
+        m_queuemutex.unlock();
+        return n;
+    }
+    /*
+    运行中调整线程数和请求队列的容量 由主线程在重新加载配置时调用
+    增加的线程立即创建 减少时通知多余的线程处理完手上的请求后退出 队列容量不小于已在排队的请求数
+    */
+    void resize(int thread_number, int max_requests);
+    /*队列中的请求数 *wait为队头请求已等待的纳秒数 供主线程的准入控制采样*/
+    int queued(uint64_t now, uint64_t* wait);
 
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行*/
     static void* worker(void* arg);
     void run();
+    /*创建一个脱离的工作线程*/
+    bool spawn();
 
 private:
-    int m_thread_number;    /*线程池中线程数*/
+    int m_thread_number;    /*线程池中线程数 由m_queuemutex保护*/
+    int m_retiring;         /*等待退出的线程数 由m_queuemutex保护*/
     int m_max_requests;     /*请求队列中允许的最大请求数*/
-    pthread_t *m_threads;   /*描述线程池的数组，其大小为m_thread_number*/
-    std::list<T*>m_workqueue;       /*请求队列*/
+    T **m_workqueue;        /*请求队列 容量为m_max_requests的环形数组 入队出队不分配内存*/
+    uint64_t *m_enqueued;   /*与m_workqueue对应的入队时间*/
+    int m_queue_head;       /*队头下标*/
+    int m_queue_size;       /*队列中的请求数*/
     myMutex m_queuemutex;   /*保护请求队列的互斥锁*/
     mySem m_queuestat;      /*是否有任务需要处理*/
     bool m_stop;            /*是否结束线程*/
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_threads(nullptr)
+threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number(0), m_retiring(0), m_max_requests(max_requests),
+m_workqueue(nullptr), m_enqueued(nullptr), m_queue_head(0), m_queue_size(0), m_stop(false)
 {
     if(thread_number <= 0 || max_requests <= 0)
     {
         throw std::exception();
     }
-    m_threads = new pthread_t[m_thread_number];
-    if(!m_threads)
-    {
-        throw std::exception();
-    }
+    m_workqueue = new T*[m_max_requests];
+    m_enqueued = new uint64_t[m_max_requests];
     /*创建thread_number个线程 并将它们都设置为脱离线程*/
     for(int i = 0; i < thread_number; ++i)
     {
         printf("create the %dth thread\n", i);
-        if(pthread_create(m_threads + i, NULL, worker, this) != 0)
+        if(!spawn())
         {
-            //新创建的线程从第三个参数的函数的地址开始运行  该函数要求为静态函数/静态成员函数
-            delete[] m_threads;
-            throw std::exception();
-        }
-        if(pthread_detach(m_threads[i]) != 0)
-        {
-            //可分离的线程 不能被其他线程回收或杀死，其内存空间在它终止时由系统自动释放 不用单独对工作线程进行回收
-            delete[] m_threads;
             throw std::exception();
         }
+        m_thread_number++;
     }
 }
 
+template<typename T>
+bool threadpool<T>::spawn()
+{
+    pthread_t tid;
+    //新创建的线程从第三个参数的函数的地址开始运行  该函数要求为静态函数/静态成员函数
+    if(pthread_create(&tid, NULL, worker, this) != 0)
+    {
+        return false;
+    }
+    //可分离的线程 不能被其他线程回收或杀死，其内存空间在它终止时由系统自动释放 不用单独对工作线程进行回收
+    return pthread_detach(tid) == 0;
+}
+
 template<typename T>
 threadpool<T>::~threadpool()
 {
-    delete[] m_threads;
+    delete[] m_workqueue;
+    delete[] m_enqueued;
     m_stop = true;
 }
 
 template<typename T>
 bool threadpool<T>::append(T *request)
 {
+    /*在放入队列之前记录 放入后工作线程可能立即开始处理*/
+    request->trace(TRACE_ENQUEUE);
+    uint64_t now = request_trace::now();
     m_queuemutex.lock();
-    if(m_workqueue.size() >= m_max_requests)
+    if(m_queue_size >= m_max_requests)
     {
         m_queuemutex.unlock();
         return false;
     }
-    m_workqueue.push_back(request);
+    int tail = (m_queue_head + m_queue_size) % m_max_requests;
+    m_workqueue[tail] = request;
+    m_enqueued[tail] = now;
+    m_queue_size++;
+    int depth = m_queue_size;
     m_queuemutex.unlock();
+    TWS_PROBE2(enqueue, request->sockfd(), depth);
+    metrics::add(QUEUE_DEPTH);
     m_queuestat.post();     //m_queuestat信号量 是否有任务处理
     return true;
 }
 
+/*
+缩容不直接结束线程: 记下要退出的线程数 每个多出的线程对应一次信号量post
+醒来的线程先检查m_retiring 于是信号量的计数不少于排队的请求数加待退出的线程数 请求不会因线程退出而滞留
+随后又扩容时先取消尚未执行的退出 多出的post只会让一个线程醒来发现队列为空
+*/
+template<typename T>
+void threadpool<T>::resize(int thread_number, int max_requests)
+{
+    if(thread_number <= 0 || max_requests <= 0)
+    {
+        return;
+    }
+    int retire = 0;
+    m_queuemutex.lock();
+    if(max_requests < m_queue_size)
+    {
+        max_requests = m_queue_size;
+    }
+    if(max_requests != m_max_requests)
+    {
+        /*按出队顺序搬到新数组的开头*/
+        T** queue = new T*[max_requests];
+        uint64_t* enqueued = new uint64_t[max_requests];
+        for(int i = 0; i < m_queue_size; ++i)
+        {
+            int idx = (m_queue_head + i) % m_max_requests;
+            queue[i] = m_workqueue[idx];
+            enqueued[i] = m_enqueued[idx];
+        }
+        delete[] m_workqueue;
+        delete[] m_enqueued;
+        m_workqueue = queue;
+        m_enqueued = enqueued;
+        m_queue_head = 0;
+        m_max_requests = max_requests;
+    }
+    int live = m_thread_number - m_retiring;
+    if(thread_number < live)
+    {
+        retire = live - thread_number;
+        m_retiring += retire;
+    }
+    else
+    {
+        /*先抵消还没有退出的线程*/
+        int keep = thread_number - live < m_retiring ? thread_number - live : m_retiring;
+        m_retiring -= keep;
+        live += keep;
+        while(live < thread_number && spawn())
+        {
+            m_thread_number++;
+            live++;
+        }
+    }
+    m_queuemutex.unlock();
+    for(int i = 0; i < retire; ++i)
+    {
+        m_queuestat.post();
+    }
+}
+
+template<typename T>
+int threadpool<T>::queued(uint64_t now, uint64_t* wait)
+{
+    m_queuemutex.lock();
+    int depth = m_queue_size;
+    uint64_t head = depth ? m_enqueued[m_queue_head] : now;
+    m_queuemutex.unlock();
+    *wait = now > head ? now - head : 0;
+    return depth;
+}
+
 template<typename T>
 void* threadpool<T>::worker(void *arg)
 {
@@ -102,19 +213,35 @@ void threadpool<T>::run()
     {
         m_queuestat.wait();
         m_queuemutex.lock();
-        if(m_workqueue.empty())
+        if(m_retiring > 0)
+        {
+            m_retiring--;
+            m_thread_number--;
+            m_queuemutex.unlock();
+            return;
+        }
+        if(m_queue_size == 0)
         {
             m_queuemutex.unlock();
             continue;
         }
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
+        T *request = m_workqueue[m_queue_head];
+        m_queue_head = (m_queue_head + 1) % m_max_requests;
+        m_queue_size--;
+        int depth = m_queue_size;
         m_queuemutex.unlock();
+        metrics::add(QUEUE_DEPTH, -1);
         if(!request)
         {
             continue;
         }
+        TWS_PROBE2(dequeue, request->sockfd(), depth);
+        request->trace(TRACE_DEQUEUE);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
         request->process();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        metrics::add(WORKER_BUSY_NS, (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
     }
 }
 
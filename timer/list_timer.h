@@ -2,6 +2,11 @@
 #define _LISTTIMER_H_
 
 #include<time.h>
+#include<netinet/in.h>
+#include<stdio.h>
+
+#include"timer_slab.h"
+
 #define BUFFER_SIZE 64
 class util_timer;
 
@@ -19,10 +24,23 @@ struct client_data{
     util_timer* timer;
 };
 
-/*定时器类*/
+/*
+定时器类：
+    由create()从timer_slab分配的定时器 在被删除或到期后由链表回收
+    直接嵌入在连接对象中的定时器(pooled为false) 链表只把它摘下 不回收内存 摘下后可以再次add_timer
+*/
 class util_timer{
 public:
-    util_timer() : prev(nullptr), next(nullptr) {}
+    util_timer() : prev(nullptr), next(nullptr), pooled(false) {}
+    static util_timer* create()
+    {
+        util_timer* timer = timer_slab<util_timer>::alloc();
+        if(timer)
+        {
+            timer->pooled = true;
+        }
+        return timer;
+    }
 public:
     time_t expire;  /*任务超时时间(绝对时间)*/
     void (*cb_func)(client_data*);  /*任务回调函数*/
@@ -30,6 +48,7 @@ public:
     client_data* user_data;
     util_timer* prev;
     util_timer* next;
+    bool pooled;    /*是否由timer_slab分配*/
 };
 
 /*定时器链表 升序双向链表 有头节点和尾节点*/
@@ -43,7 +62,7 @@ public:
         while(tmp)
         {
             head = tmp->next;
-            delete tmp;
+            destroy(tmp);
             tmp = head;
         }
     }
@@ -105,7 +124,7 @@ public:
         /*链表中只有一个定时器即timer*/
         if(timer == head && timer == tail)
         {
-            delete timer;
+            destroy(timer);
             head = nullptr;
             tail = nullptr;
             return;
@@ -114,19 +133,19 @@ public:
         {
             head = head->next;
             head->prev = nullptr;
-            delete timer;
+            destroy(timer);
             return;
         }
         if(timer == tail)
         {
             tail = tail->prev;
             tail->next = nullptr;
-            delete timer;
+            destroy(timer);
             return;
         }
         timer->prev->next = timer->next;
         timer->next->prev = timer->prev;
-        delete timer;
+        destroy(timer);
     }
     /*SIGALRM信号每次被触发就执行一次tick函数 以处理链表上的到期任务*/
     void tick()
@@ -152,7 +171,7 @@ public:
             {
                 head->prev = nullptr;
             }
-            delete tmp;
+            destroy(tmp);
             tmp = head;
         }
     }
@@ -171,6 +190,7 @@ private:
                 timer->prev = prev;
                 tmp->prev = timer;
                 timer->next = tmp;
+                break;
             }
             prev = tmp;
             tmp = prev->next;
@@ -183,6 +203,16 @@ private:
             tail = timer;
         }
     }
+    /*从链表摘下的定时器 slab分配的放回空闲链表 嵌入的只重置指针*/
+    static void destroy(util_timer* timer)
+    {
+        timer->prev = nullptr;
+        timer->next = nullptr;
+        if(timer->pooled)
+        {
+            timer_slab<util_timer>::free(timer);
+        }
+    }
 private:
     util_timer* head;
     util_timer* tail;
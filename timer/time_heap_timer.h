@@ -1,224 +1,290 @@
-#ifndef _TIMEHEAPTIMER_H_
-#define _TIMEHEAPTIMER_H_
-
-#include<iostream>
-#include<netinet/in.h>
-#include<time.h>
-using std::exception;
-
-#define BUFFER_SIZE 64
-
-class heap_timer;
-
-/*绑定socket和定时器*/
-struct client_data{
-    struct sockaddr_in address;
-    int sockfd;
-    char buf[BUFFER_SIZE];
-    heap_timer* timer;
-};
-
-/*定时器类*/
-class heap_timer{
-public:
-    heap_timer(int delay)
-    {
-        expire = time(NULL) + delay;
-    }
-
-public:
-    time_t expire;  /*定时器生效的绝对时间*/
-    void (*cb_func)(client_data*);  /*定时器的回调函数*/
-    client_data* user_data; /*用户数据*/
-};
-
-/*时间堆类*/
-class time_heap{
-public:
-    time_heap(int cap) throw(std::exception) : capacity(cap), cur_size(0)
-    {
-        array = new heap_timer*[capacity];
-        if(!array)
-        {
-            throw std::exception;
-        }
-        for(int i = 0; i < capacity; ++i)
-        {
-            array[i] = nullptr;
-        }
-    }
-    time_heap(heap_timer** init_array, int size, int cap) throw(std::exception)
-    : cur_size(size), capacity(cap)
-    {
-        if(capacity < size)
-        {
-            throw std::exception;
-        }
-        array = new heap_timer*[capacity];
-        if(!array)
-        {
-            throw std::exception;
-        }
-        for(int i = 0; i < capacity; ++i)
-        {
-            array[i] = nullptr;
-        }
-        if(size != 0)
-        {
-            /*初始化堆数组*/
-            for(int i = 0; i < size; ++i)
-            {
-                array[i] = init_array[i];
-            }
-            for(int i = (cur_size - 1) / 2; i >= 0; --i)
-            {
-                /*对非叶子节点执行下滤操作*/
-                percolate_down(i);
-            }
-        }
-    }
-
-    ~time_heap()
-    {
-        for(int i = 0; i < cur_size; ++i)
-        {
-            delete array[i];
-        }
-        delete [] array;
-    }
-public:
-    /*添加目标定时器timer*/
-    void add_timer(heap_timer* timer) throw(std::exception)
-    {
-        if(!timer)
-        {
-            return;
-        }
-        if(cur_size >= capacity)
-        {
-            resize();   /*扩容1倍*/
-        }
-        int hole = cur_size++;
-        int parent = 0;
-        for(; hole > 0; hole = parent)
-        {
-            parent = (hole - 1) / 2;
-            if(array[parent]->expire <= timer->expire)
-            {
-                break;
-            }
-            array[hole] = array[parent];
-        }
-        array[hole] = timer;
-    }
-    /*删除目标定时器timer*/
-    void del_timer(heap_timer* timer)
-    {
-        if(!timer)
-        {
-            return;
-        }
-        /*仅仅将目标定时器的回调函数设置为空 即所谓的延迟销毁*/
-        /*节省真正删除该定时器造成的开销 但可能是堆数组膨胀*/
-        timer->cb_func = nullptr;
-    }
-    /*获得堆顶的定时器*/
-    heap_timer* top() const
-    {
-        if(empty())
-        {
-            return nullptr;
-        }
-        return array[0];
-    }
-    /*删除堆顶部定时器*/
-    void pop_timer()
-    {
-        if(empty())
-        {
-            return;
-        }
-        if(array[0])
-        {
-            delete array[0];
-            array[0] = array[--cur_size];
-            percolate_down(0);
-        }
-    }
-    /*心搏函数*/
-    void tick()
-    {
-        heap_timer* tmp = array[0];
-        time_t cur = time(NULL);
-        /*循环处理堆中到期的定时器*/
-        while(!empty())
-        {
-            if(!tmp)
-            {
-                break;
-            }
-            /*如果堆顶定时器没到期 则退出循环*/
-            if(tmp->expire > cur)
-            {
-                break;
-            }
-            if(array[0]->cb_func)
-            {
-                array[0]->cb_func(array[0]->user_data);
-            }
-            pop_timer();
-            tmp = array[0];
-        }
-    }
-    bool empty() const {return cur_size == 0;}
-private:
-    /*最小堆的下滤操作*/
-    void percolate_down(int hole)
-    {
-        heap_timer* tmp = array[hole];
-        int child = 0;
-        for(; ((hole * 2 + 1) <= (cur_size - 1)); hole = child)
-        {
-            child = hole * 2 + 1;
-            if(child < cur_size - 1 && array[child + 1]->expire < array[child]->expire)
-            {
-                ++child;
-            }
-            if(array[child]->expire < tmp->expire)
-            {
-                array[hole] = array[child];
-            }
-            else
-            {
-                break;
-            }
-        }
-        array[hole] = tmp;
-    }
-    /*堆数组容量扩大1倍*/
-    void resize() throw(std::exception)
-    {
-        heap_timer** tmp = new heap_timer*[2 * capacity];
-        for(int i = 0; i < 2 * capacity; ++i)
-        {
-            tmp[i] = nullptr;
-        }
-        if(!tmp)
-        {
-            throw std::exception;
-        }
-        capacity = 2 * capacity;
-        for(int i = 0; i < cur_size; ++i)
-        {
-            tmp[i] = array[i];
-        }
-        delete [] array;
-        array = tmp;
-    }
-private:
-    heap_timer** array; /*堆数组*/
-    int capacity;   /*堆数组容量*/
-    int cur_size;   /*堆数组当前包含元素个数*/
-};
-
+#ifndef _TIMEHEAPTIMER_H_
+#define _TIMEHEAPTIMER_H_
+
+#include<iostream>
+#include<netinet/in.h>
+#include<time.h>
+
+#include"timer_slab.h"
+using std::exception;
+
+#define BUFFER_SIZE 64
+
+class heap_timer;
+
+/*绑定socket和定时器*/
+struct client_data{
+    struct sockaddr_in address;
+    int sockfd;
+    char buf[BUFFER_SIZE];
+    heap_timer* timer;
+};
+
+/*
+定时器类：
+    create()从timer_slab分配 删除时延迟销毁 到达堆顶后回收
+    也可以直接嵌入在连接对象中(pooled为false) 删除时立即从堆中取出 之后可以再次add_timer
+*/
+class heap_timer{
+public:
+    heap_timer() : expire(0), cb_func(nullptr), user_data(nullptr), index(-1), pooled(false) {}
+    heap_timer(int delay) : cb_func(nullptr), user_data(nullptr), index(-1), pooled(false)
+    {
+        expire = time(NULL) + delay;
+    }
+    static heap_timer* create(int delay)
+    {
+        heap_timer* timer = timer_slab<heap_timer>::alloc(delay);
+        if(timer)
+        {
+            timer->pooled = true;
+        }
+        return timer;
+    }
+
+public:
+    time_t expire;  /*定时器生效的绝对时间*/
+    void (*cb_func)(client_data*);  /*定时器的回调函数*/
+    client_data* user_data; /*用户数据*/
+    int index;      /*在堆数组中的下标 不在堆中时为-1*/
+    bool pooled;    /*是否由timer_slab分配*/
+};
+
+/*时间堆类*/
+class time_heap{
+public:
+    time_heap(int cap) : capacity(cap), cur_size(0)
+    {
+        array = new heap_timer*[capacity];
+        if(!array)
+        {
+            throw std::exception();
+        }
+        for(int i = 0; i < capacity; ++i)
+        {
+            array[i] = nullptr;
+        }
+    }
+    time_heap(heap_timer** init_array, int size, int cap)
+    : capacity(cap), cur_size(size)
+    {
+        if(capacity < size)
+        {
+            throw std::exception();
+        }
+        array = new heap_timer*[capacity];
+        if(!array)
+        {
+            throw std::exception();
+        }
+        for(int i = 0; i < capacity; ++i)
+        {
+            array[i] = nullptr;
+        }
+        if(size != 0)
+        {
+            /*初始化堆数组*/
+            for(int i = 0; i < size; ++i)
+            {
+                array[i] = init_array[i];
+                array[i]->index = i;
+            }
+            for(int i = (cur_size - 1) / 2; i >= 0; --i)
+            {
+                /*对非叶子节点执行下滤操作*/
+                percolate_down(i);
+            }
+        }
+    }
+
+    ~time_heap()
+    {
+        for(int i = 0; i < cur_size; ++i)
+        {
+            destroy(array[i]);
+        }
+        delete [] array;
+    }
+public:
+    /*添加目标定时器timer*/
+    void add_timer(heap_timer* timer)
+    {
+        if(!timer)
+        {
+            return;
+        }
+        if(cur_size >= capacity)
+        {
+            resize();   /*扩容1倍*/
+        }
+        int hole = cur_size++;
+        array[hole] = timer;
+        percolate_up(hole);
+    }
+    /*删除目标定时器timer*/
+    void del_timer(heap_timer* timer)
+    {
+        if(!timer)
+        {
+            return;
+        }
+        /*仅仅将目标定时器的回调函数设置为空 即所谓的延迟销毁*/
+        /*节省真正删除该定时器造成的开销 但可能是堆数组膨胀*/
+        timer->cb_func = nullptr;
+        /*嵌入的定时器由调用者持有 必须立即取出 以便调用者重新使用*/
+        if(!timer->pooled && timer->index >= 0)
+        {
+            remove_at(timer->index);
+        }
+    }
+    /*获得堆顶的定时器*/
+    heap_timer* top() const
+    {
+        if(empty())
+        {
+            return nullptr;
+        }
+        return array[0];
+    }
+    /*删除堆顶部定时器*/
+    void pop_timer()
+    {
+        if(empty())
+        {
+            return;
+        }
+        if(array[0])
+        {
+            remove_at(0);
+        }
+    }
+    /*心搏函数*/
+    void tick()
+    {
+        heap_timer* tmp = array[0];
+        time_t cur = time(NULL);
+        /*循环处理堆中到期的定时器*/
+        while(!empty())
+        {
+            if(!tmp)
+            {
+                break;
+            }
+            /*如果堆顶定时器没到期 则退出循环*/
+            if(tmp->expire > cur)
+            {
+                break;
+            }
+            /*先从堆中取出再执行回调 回调中可以安全地重新添加嵌入的定时器*/
+            void (*cb_func)(client_data*) = tmp->cb_func;
+            client_data* user_data = tmp->user_data;
+            pop_timer();
+            if(cb_func)
+            {
+                cb_func(user_data);
+            }
+            tmp = array[0];
+        }
+    }
+    bool empty() const {return cur_size == 0;}
+private:
+    /*最小堆的下滤操作*/
+    void percolate_down(int hole)
+    {
+        heap_timer* tmp = array[hole];
+        int child = 0;
+        for(; ((hole * 2 + 1) <= (cur_size - 1)); hole = child)
+        {
+            child = hole * 2 + 1;
+            if(child < cur_size - 1 && array[child + 1]->expire < array[child]->expire)
+            {
+                ++child;
+            }
+            if(array[child]->expire < tmp->expire)
+            {
+                array[hole] = array[child];
+                array[hole]->index = hole;
+            }
+            else
+            {
+                break;
+            }
+        }
+        array[hole] = tmp;
+        tmp->index = hole;
+    }
+    /*最小堆的上滤操作*/
+    void percolate_up(int hole)
+    {
+        heap_timer* tmp = array[hole];
+        int parent = 0;
+        for(; hole > 0; hole = parent)
+        {
+            parent = (hole - 1) / 2;
+            if(array[parent]->expire <= tmp->expire)
+            {
+                break;
+            }
+            array[hole] = array[parent];
+            array[hole]->index = hole;
+        }
+        array[hole] = tmp;
+        tmp->index = hole;
+    }
+    /*取出下标为hole的定时器 用堆尾元素填补空位*/
+    void remove_at(int hole)
+    {
+        heap_timer* timer = array[hole];
+        heap_timer* last = array[--cur_size];
+        array[cur_size] = nullptr;
+        if(hole < cur_size)
+        {
+            array[hole] = last;
+            last->index = hole;
+            if(hole > 0 && last->expire < array[(hole - 1) / 2]->expire)
+            {
+                percolate_up(hole);
+            }
+            else
+            {
+                percolate_down(hole);
+            }
+        }
+        destroy(timer);
+    }
+    /*离开堆的定时器 slab分配的放回空闲链表 嵌入的只重置下标*/
+    static void destroy(heap_timer* timer)
+    {
+        timer->index = -1;
+        if(timer->pooled)
+        {
+            timer_slab<heap_timer>::free(timer);
+        }
+    }
+    /*堆数组容量扩大1倍*/
+    void resize()
+    {
+        heap_timer** tmp = new heap_timer*[2 * capacity];
+        for(int i = 0; i < 2 * capacity; ++i)
+        {
+            tmp[i] = nullptr;
+        }
+        if(!tmp)
+        {
+            throw std::exception();
+        }
+        capacity = 2 * capacity;
+        for(int i = 0; i < cur_size; ++i)
+        {
+            tmp[i] = array[i];
+        }
+        delete [] array;
+        array = tmp;
+    }
+private:
+    heap_timer** array; /*堆数组*/
+    int capacity;   /*堆数组容量*/
+    int cur_size;   /*堆数组当前包含元素个数*/
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef _TIMERSLAB_H_
+#define _TIMERSLAB_H_
+
+#include<cstdlib>
+#include<new>
+
+/*
+定时器节点的分配器 三种定时器共用：
+    每个线程一条空闲链表 空闲节点的内存本身用作链表指针(侵入式) 分配和回收只是链表头的出入 不加锁
+    空闲链表为空时一次申请一整块(SLAB_NODES个节点) 块不归还给系统 由该线程后续的定时器重复使用
+    由哪个线程回收就进入哪个线程的空闲链表 定时器通常只在主线程中使用
+不想有任何分配的场合 可以把定时器节点直接嵌入连接对象中 见各定时器的add_timer
+*/
+template<typename T>
+class timer_slab{
+public:
+    static const int SLAB_NODES = 64;
+
+    /*从当前线程的空闲链表取出一个节点并构造 失败时返回nullptr*/
+    template<typename... Args>
+    static T* alloc(Args... args)
+    {
+        free_node*& head = free_list();
+        if(!head && !refill())
+        {
+            return nullptr;
+        }
+        free_node* node = head;
+        head = node->next;
+        return new(node) T(args...);
+    }
+
+    /*析构节点并放回当前线程的空闲链表*/
+    static void free(T* timer)
+    {
+        if(!timer)
+        {
+            return;
+        }
+        timer->~T();
+        free_node* node = reinterpret_cast<free_node*>(timer);
+        free_node*& head = free_list();
+        node->next = head;
+        head = node;
+    }
+
+private:
+    union free_node{
+        free_node* next;
+        alignas(T) char storage[sizeof(T)];
+    };
+
+    static free_node*& free_list()
+    {
+        static __thread free_node* head = nullptr;
+        return head;
+    }
+
+    /*申请一块新的slab 把其中的节点全部串入空闲链表*/
+    static bool refill()
+    {
+        free_node* slab = static_cast<free_node*>(malloc(sizeof(free_node) * SLAB_NODES));
+        if(!slab)
+        {
+            return false;
+        }
+        for(int i = 0; i < SLAB_NODES - 1; ++i)
+        {
+            slab[i].next = &slab[i + 1];
+        }
+        slab[SLAB_NODES - 1].next = free_list();
+        free_list() = slab;
+        return true;
+    }
+};
+
+#endif